@@ -4,22 +4,72 @@
 #include "fat_32.h"
 #include "hdd.h"
 #include "idt.h"
+#include "cpu.h"
+#include "memory.h"
+#include "multiboot2.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "kmalloc.h"
+#include "apic.h"
+#include "tlb.h"
+#include "ramdisk.h"
+#include "bcache.h"
+#include "pcache.h"
+#include "mmap.h"
+#include "tmpfs.h"
+#include "ata.h"
+#include "ahci.h"
+#include "keyboard.h"
+#include "fd.h"
 
 
 
-void kernel_main() {
+#define ZERO_POOL_IDLE_BATCH 16     /* Pages zeroed between two looks at pending work */
+
+void kernel_main(uint32_t multiboot_info) {
+    // Pick the memory kernels before anything copies sectors around
+    cpu_detect_features();
+    memory_init();
+
     print_clear();
     print_set_color(MAGENTA, BLACK);
     print_str("Welcome to JDOS operating system\n");
     print_newline();
 
+    // Find out how much RAM there is and hand it to the page allocator
+    multiboot_init(multiboot_info);
+    pmm_init();
+    vmm_init();
+    pmm_print_stats();
+    kmalloc_init();
+    lapic_init();
+    tlb_init();
+    mmap_init();
+
+    // The disk image comes in as a multiboot2 module
+    ramdisk_init();
+    // A disk on the AHCI or the IDE controller is preferred over the module
+    ahci_init();
+    ata_init();
+    bcache_init();
+    pcache_init();
+
     char buffer[SECTOR_SIZE];
-    FatFileSystem fs;
-    initialize_fat_file_system(&fs, "hdd.img");
+    FatFileSystem* fs = kzalloc(sizeof(FatFileSystem));
+    char* disk = blockdev_find("ahci0") != NULL ? "ahci0" : blockdev_find("ata0") != NULL ? "ata0" : "hdd.img";
+    initialize_fat_file_system(fs, disk);
+    // Scratch files live in memory beside the disk
+    tmpfs_mount("/tmp");
     print_newline();
 
     char* filename = "test.txt";
-    create_file("test.txt", &fs);
+    if (fs->device != NULL) {
+        // Through the VFS, which serves FAT and exFAT volumes alike
+        int32_t fd = sys_open(filename, O_WRONLY | O_CREAT);
+        if (fd >= 0) {
+            sys_close(fd);
+        }
+    }
 
     print_set_color(MAGENTA, BLACK);
     print_str("\nJDOS> ");
@@ -27,7 +77,24 @@ void kernel_main() {
     reset_key_buffer();
   
     idt_init();
+    // Disk commands issued with interrupts on complete by interrupt from here on
+    ata_enable_irq();
+    ahci_enable_irq();
 
-
-    while (1);
+    // Idle: run the shell commands the keyboard queued, keep the pre-zeroed
+    // page pool topped up and sleep until the next interrupt once there is
+    // nothing left to do
+    while (1) {
+        keyboard_run_command();
+        if (pmm_zero_pool_fill(ZERO_POOL_IDLE_BATCH) == 0) {
+            // sti takes effect after the next instruction, a line queued after the check still wakes the hlt
+            asm volatile("cli");
+            if (keyboard_command_pending()) {
+                asm volatile("sti");
+            }
+            else {
+                asm volatile("sti\n\thlt");
+            }
+        }
+    }
 }
\ No newline at end of file
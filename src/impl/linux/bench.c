@@ -0,0 +1,847 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "host.h"
+#include "imagedisk.h"
+#include "cpu.h"
+#include "memory.h"
+#include "strings.h"
+#include "constants.h"
+#include "bcache.h"
+#include "fat_32.h"
+#include "fat_alloc.h"
+#include "fat_cache.h"
+#include "fat_dir.h"
+#include "fat_geometry.h"
+#include "fat_journal.h"
+#include "fd.h"
+#include "exfat.h"
+#include "pcache.h"
+#include "tmpfs.h"
+
+// Filesystem benchmarks for the hosted build. Every image is mounted with the
+// kernel's own mount code, then each workload is timed and reported as one
+// line: a table for people, JSON lines (--json) for scripts. --baseline reads
+// an earlier --json run and fails when an operation got slower than allowed.
+
+#define BENCH_SIZES_MAX 8
+#define BENCH_IMAGES_MAX 8
+#define BENCH_RESULTS_MAX 256
+
+#define CREATE_FILES 2000
+#define LOOKUPS 20000
+#define BATCH_FILE_SIZE 1024
+#define SEQ_FILE_MAX (32u << 20)
+#define SEQ_CHUNK (64u << 10)
+#define RANDOM_READS 20000
+#define RANDOM_SIZE 4096
+#define ALLOC_EXTENTS 4096
+#define ALLOC_CLUSTERS 16
+#define TRUNCATE_FILES 24                   /* open at once, below FD_MAX */
+#define TRUNCATE_CLUSTERS 4                 /* written per file, all but one and a bit are cut off */
+#define CRASH_SIZE_MIB 64
+#define CRASH_FILES_MAX 4000                /* more commits than the smallest log holds */
+#define EXFAT_SIZE_MIB 64
+#define EXFAT_FILES 300                     /* the directory outgrows its first cluster */
+#define EXFAT_FILE_SIZE 20000
+
+typedef struct {
+    char image[64];
+    uint32_t size_mib;
+    uint32_t frag;              // percent of the data region cut into one cluster holes
+    char op[16];
+    uint64_t ops;
+    uint64_t bytes;
+    double seconds;
+} Result;
+
+static Result results[BENCH_RESULTS_MAX];
+static uint32_t result_count;
+static uint8_t json;
+static uint32_t image_count;
+static uint32_t failures;           // workloads whose results did not check out
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double per_second(double amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0;
+}
+
+// Keep the fastest of the repeated runs, short runs are at the mercy of the scheduler
+static void report(char* image, uint32_t size_mib, uint32_t frag, char* op, uint64_t ops, uint64_t bytes, double seconds) {
+    Result* r = NULL;
+    for (uint32_t i = 0; i < result_count && r == NULL; i++) {
+        Result* old = &results[i];
+        if (strEqual(old->image, image) && old->size_mib == size_mib && old->frag == frag && strEqual(old->op, op)) {
+            r = old;
+        }
+    }
+    if (r == NULL) {
+        if (result_count == BENCH_RESULTS_MAX) {
+            return;
+        }
+        r = &results[result_count++];
+        snprintf(r->image, sizeof(r->image), "%s", image);
+        snprintf(r->op, sizeof(r->op), "%s", op);
+        r->size_mib = size_mib;
+        r->frag = frag;
+    }
+    else if (per_second(ops, seconds) <= per_second(r->ops, r->seconds)) {
+        return;
+    }
+    r->ops = ops;
+    r->bytes = bytes;
+    r->seconds = seconds;
+}
+
+static void print_results(void) {
+    if (!json) {
+        printf("%-12s %6s %6s  %-12s %18s %16s\n", "image", "MiB", "frag", "op", "rate", "throughput");
+    }
+    for (uint32_t i = 0; i < result_count; i++) {
+        Result* r = &results[i];
+        double rate = per_second(r->ops, r->seconds);
+        double throughput = per_second(r->bytes, r->seconds);
+        if (json) {
+            printf("{\"image\":\"%s\",\"size_mib\":%u,\"frag\":%u,\"op\":\"%s\",\"ops\":%llu,\"bytes\":%llu,"
+                   "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f}\n",
+                   r->image, r->size_mib, r->frag, r->op, (unsigned long long)r->ops, (unsigned long long)r->bytes,
+                   r->seconds, rate, throughput);
+        }
+        else {
+            printf("%-12s %6u %5u%%  %-12s %12.1f ops/s %10.1f MiB/s\n", r->image, r->size_mib, r->frag, r->op,
+                   rate, throughput / (1 << 20));
+        }
+    }
+}
+
+// Images
+
+// Lay out an empty FAT32 volume: boot sector, FSInfo, two FATs and a root directory cluster
+static void format(BlockDev* dev) {
+    uint8_t* base = imagedisk_base(dev);
+    uint32_t total = dev->sector_count;
+    uint32_t reserved = 32;
+    uint32_t per_cluster = 8;
+    uint32_t fat_sectors = (total - reserved + (256 * per_cluster + 2) / 2 - 1) / ((256 * per_cluster + 2) / 2);
+
+    BootSector* bs = (BootSector*)base;
+    memCpy(bs->jump, "\xEB\x58\x90", 3);
+    memCpy(bs->oem_name, "PROJOS  ", 8);
+    bs->bytes_per_sector = IMAGEDISK_SECTOR_SIZE;
+    bs->sectors_per_cluster = per_cluster;
+    bs->reserved_sector_count = reserved;
+    bs->fat_count = 2;
+    bs->media_descriptor_type = 0xF8;
+    bs->total_sectors_32 = total;
+    bs->sectors_per_fat_32 = fat_sectors;
+    bs->root_cluster_count = 2;
+    bs->fs_info_sector = 1;
+    bs->backup_boot_sector = 6;
+    bs->signature = 0x29;
+    memCpy(bs->volume_label, "BENCH      ", 11);
+    memCpy(bs->file_system_type, "FAT32   ", 8);
+    base[510] = 0x55;
+    base[511] = 0xAA;
+
+    uint32_t clusters = (total - reserved - 2 * fat_sectors) / per_cluster;
+    FsInfo* info = (FsInfo*)(base + IMAGEDISK_SECTOR_SIZE);
+    info->lead_signature = 0x41615252;
+    info->struct_signature = 0x61417272;
+    info->free_cluster_count = clusters - 1;
+    info->next_free_cluster = 3;
+    info->trail_signature = 0xAA550000;
+
+    for (uint32_t copy = 0; copy < 2; copy++) {
+        uint32_t* fat = (uint32_t*)(base + (uint64_t)(reserved + copy * fat_sectors) * IMAGEDISK_SECTOR_SIZE);
+        fat[0] = 0x0FFFFFF8;
+        fat[1] = 0x0FFFFFFF;
+        fat[2] = 0x0FFFFFFF;
+    }
+}
+
+// exFAT checksum step, the boot region and the up-case table both use it
+static uint32_t exfat_sum(uint32_t sum, uint8_t byte) {
+    return ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + byte;
+}
+
+// Lay out an empty exFAT volume: boot region, one FAT, the allocation bitmap,
+// a compressed up-case table and a root directory cluster
+static void format_exfat(BlockDev* dev) {
+    uint8_t* base = imagedisk_base(dev);
+    uint32_t total = dev->sector_count;
+    uint32_t shift = 3;
+    uint32_t cluster_bytes = IMAGEDISK_SECTOR_SIZE << shift;
+    uint32_t fat_offset = 128;
+    uint32_t fat_length = (((total >> shift) + 2) * 4 + IMAGEDISK_SECTOR_SIZE - 1) / IMAGEDISK_SECTOR_SIZE;
+    uint32_t heap = (fat_offset + fat_length + (1u << shift) - 1) & ~((1u << shift) - 1);
+    uint32_t count = (total - heap) >> shift;
+
+    // Identity except a to z, runs of unchanged code units are compressed
+    uint16_t upcase[2 + 26 + 2];
+    uint32_t units = 0;
+    upcase[units++] = 0xFFFF;
+    upcase[units++] = 'a';
+    for (uint16_t c = 'a'; c <= 'z'; c++) {
+        upcase[units++] = c - 32;
+    }
+    upcase[units++] = 0xFFFF;
+    upcase[units++] = EXFAT_UPCASE_ENTRIES - ('z' + 1);
+    uint32_t upcase_sum = 0;
+    for (uint32_t i = 0; i < sizeof(upcase); i++) {
+        upcase_sum = exfat_sum(upcase_sum, ((uint8_t*)upcase)[i]);
+    }
+
+    uint32_t bitmap_bytes = (count + 7) / 8;
+    uint32_t bitmap = EXFAT_FIRST_CLUSTER;
+    uint32_t table = bitmap + (bitmap_bytes + cluster_bytes - 1) / cluster_bytes;
+    uint32_t root = table + 1;
+    uint32_t* fat = (uint32_t*)(base + (uint64_t)fat_offset * IMAGEDISK_SECTOR_SIZE);
+    uint8_t* bits = base + ((uint64_t)heap + ((bitmap - EXFAT_FIRST_CLUSTER) << shift)) * IMAGEDISK_SECTOR_SIZE;
+    fat[0] = 0xFFFFFFF8;
+    fat[1] = EXFAT_FAT_EOC;
+    for (uint32_t c = bitmap; c <= root; c++) {
+        fat[c] = c == table - 1 || c >= table ? EXFAT_FAT_EOC : c + 1;
+        bits[(c - EXFAT_FIRST_CLUSTER) / 8] |= 1 << ((c - EXFAT_FIRST_CLUSTER) % 8);
+    }
+    memCpy(base + ((uint64_t)heap + ((table - EXFAT_FIRST_CLUSTER) << shift)) * IMAGEDISK_SECTOR_SIZE, upcase, sizeof(upcase));
+
+    // An empty volume label, then the bitmap and the up-case table
+    ExfatTableEntry* entries = (ExfatTableEntry*)(base + ((uint64_t)heap + ((root - EXFAT_FIRST_CLUSTER) << shift)) * IMAGEDISK_SECTOR_SIZE);
+    entries[0].type = EXFAT_TYPE_LABEL;
+    entries[1].type = EXFAT_TYPE_BITMAP;
+    entries[1].first_cluster = bitmap;
+    entries[1].data_length = bitmap_bytes;
+    entries[2].type = EXFAT_TYPE_UPCASE;
+    entries[2].table_checksum = upcase_sum;
+    entries[2].first_cluster = table;
+    entries[2].data_length = sizeof(upcase);
+
+    ExfatBootSector* bs = (ExfatBootSector*)base;
+    memCpy(bs->jump, "\xEB\x76\x90", 3);
+    memCpy(bs->file_system_name, EXFAT_SIGNATURE, 8);
+    bs->volume_length = total;
+    bs->fat_offset = fat_offset;
+    bs->fat_length = fat_length;
+    bs->cluster_heap_offset = heap;
+    bs->cluster_count = count;
+    bs->root_cluster = root;
+    bs->volume_serial = 0x1234;
+    bs->revision = 0x100;
+    bs->bytes_per_sector_shift = 9;
+    bs->sectors_per_cluster_shift = shift;
+    bs->fat_count = 1;
+    bs->drive_select = 0x80;
+    for (uint32_t sector = 0; sector < 9; sector++) {
+        base[sector * IMAGEDISK_SECTOR_SIZE + 510] = 0x55;
+        base[sector * IMAGEDISK_SECTOR_SIZE + 511] = 0xAA;
+    }
+
+    // Sector 11 repeats the checksum of sectors 0 to 10, VolumeFlags and PercentInUse left out
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < 11 * IMAGEDISK_SECTOR_SIZE; i++) {
+        if (i != 106 && i != 107 && i != 112) {
+            sum = exfat_sum(sum, base[i]);
+        }
+    }
+    uint32_t* checksums = (uint32_t*)(base + 11 * IMAGEDISK_SECTOR_SIZE);
+    for (uint32_t i = 0; i < IMAGEDISK_SECTOR_SIZE / 4; i++) {
+        checksums[i] = sum;
+    }
+}
+
+static FatFileSystem fs;
+
+static uint8_t mount(char* name) {
+    host_console(0);
+    initialize_fat_file_system(&fs, name);
+    host_console(1);
+    return fs.device != NULL && journal_active();
+}
+
+// Everything home and nothing cached, the next mount starts cold
+static void unmount(void) {
+    journal_checkpoint();
+    bcache_invalidate(fs.device);
+    dir_index_drop_all();
+}
+
+// Fill the first 'frag' percent of the free clusters with one cluster
+// allocations and free every second one, later allocations there get holes
+static void fragment(uint32_t frag) {
+    uint32_t count = (uint64_t)fat_free_clusters() * frag / 100;
+    uint32_t* firsts = malloc((count + 1) * sizeof(uint32_t));
+    uint32_t made = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length;
+        uint32_t first = fat_alloc_extent(1, &length);
+        if (first == 0) {
+            break;
+        }
+        firsts[made++] = first;
+    }
+    for (uint32_t i = 0; i < made; i += 2) {
+        fat_free_chain(firsts[i]);
+    }
+    free(firsts);
+    fat_sync();
+}
+
+// Workloads
+
+static uint64_t random_state = 88172645463325252ull;
+
+static uint64_t random_next(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// Clusters in the FAT chain of a root directory file
+static uint32_t chain_length(char* name) {
+    DirectoryEntry entry;
+    if (!dir_lookup(root_directory_cluster(), name, &entry, NULL)) {
+        return 0;
+    }
+    uint32_t cluster = ((uint32_t)entry.cluster_high << 16) | entry.cluster_low;
+    uint32_t length = 0;
+    while (cluster >= 2 && cluster < 0x0FFFFFF8 && length <= fat_cluster_count()) {
+        cluster = fat_cache_get(cluster);
+        length++;
+    }
+    return length;
+}
+
+// truncate: files of a few clusters cut to one cluster and a bit. The chains
+// must end after the kept clusters and the kept bytes read back unchanged.
+static void run_truncate(char* image, uint32_t size_mib, uint32_t frag) {
+    char name[16];
+    uint32_t cluster_bytes = fat_geometry.cluster_size;
+    uint32_t file_size = TRUNCATE_CLUSTERS * cluster_bytes;
+    uint32_t kept = cluster_bytes + 100;
+    char* contents = malloc(file_size);
+    char* back = malloc(file_size);
+    for (uint32_t i = 0; i < file_size; i++) {
+        contents[i] = (char)random_next();
+    }
+
+    int32_t fds[TRUNCATE_FILES];
+    for (uint32_t i = 0; i < TRUNCATE_FILES; i++) {
+        snprintf(name, sizeof(name), "r%05u.dat", i);
+        fds[i] = sys_open(name, O_RDWR | O_CREAT | O_TRUNC);
+        if (fds[i] >= 0 && sys_write(fds[i], contents, file_size) != file_size) {
+            sys_close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+    fat_sync();
+
+    uint32_t free_before = fat_free_clusters();
+    uint32_t cut = 0;
+    double start = now();
+    for (uint32_t i = 0; i < TRUNCATE_FILES; i++) {
+        cut += fds[i] >= 0 && sys_ftruncate(fds[i], kept) == 0;
+    }
+    for (uint32_t i = 0; i < TRUNCATE_FILES; i++) {
+        if (fds[i] >= 0) {
+            sys_fsync(fds[i]);
+            sys_close(fds[i]);
+        }
+    }
+    report(image, size_mib, frag, "truncate", cut, 0, now() - start);
+
+    uint32_t freed = fat_free_clusters() - free_before;
+    if (cut != TRUNCATE_FILES || freed != cut * (TRUNCATE_CLUSTERS - 2)) {
+        fprintf(stderr, "truncate: %u of %u files cut, %u clusters freed\n", cut, TRUNCATE_FILES, freed);
+        failures++;
+    }
+
+    // Read back from the device, not from what the writes left cached
+    journal_checkpoint();
+    bcache_invalidate(fs.device);
+    for (uint32_t i = 0; i < TRUNCATE_FILES; i++) {
+        snprintf(name, sizeof(name), "r%05u.dat", i);
+        int32_t fd = sys_open(name, O_RDONLY);
+        int64_t got = fd >= 0 ? sys_read(fd, back, file_size) : -1;
+        uint32_t chain = chain_length(name);
+        if (got != kept || memCmp(back, contents, kept) != 0 || chain != 2) {
+            fprintf(stderr, "truncate: %s reads %lld bytes, chain of %u clusters\n", name, (long long)got, chain);
+            failures++;
+        }
+        sys_close(fd);
+        sys_unlink(name);
+    }
+    fat_sync();
+    free(contents);
+    free(back);
+}
+
+static void run(char* image, uint32_t size_mib, uint32_t frag) {
+    char name[16];
+    uint32_t cluster_bytes = fat_geometry.cluster_size;
+
+    // create: empty files in the root directory, committed at the end
+    double start = now();
+    for (uint32_t i = 0; i < CREATE_FILES; i++) {
+        snprintf(name, sizeof(name), "b%05u.dat", i);
+        int32_t fd = sys_open(name, O_WRONLY | O_CREAT);
+        if (fd < 0) {
+            break;
+        }
+        sys_close(fd);
+    }
+    fat_sync();
+    report(image, size_mib, frag, "create", CREATE_FILES, 0, now() - start);
+
+    DirectoryEntry entry;
+    uint32_t dir = root_directory_cluster();
+    start = now();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        snprintf(name, sizeof(name), "b%05u.dat", (uint32_t)(random_next() % CREATE_FILES));
+        dir_lookup(dir, name, &entry, NULL);
+    }
+    report(image, size_mib, frag, "lookup", LOOKUPS, 0, now() - start);
+
+    start = now();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        snprintf(name, sizeof(name), "m%05u.dat", (uint32_t)(random_next() % CREATE_FILES));
+        dir_lookup(dir, name, &entry, NULL);
+    }
+    report(image, size_mib, frag, "lookup_miss", LOOKUPS, 0, now() - start);
+
+    // tmp_churn: short lived files in /tmp, nothing of them reaches the disk
+    char* scratch = malloc(BATCH_FILE_SIZE);
+    memSet(scratch, 0x5A, BATCH_FILE_SIZE);
+    uint64_t requests = fs.device->requests;
+    uint32_t churned = 0;
+    start = now();
+    for (uint32_t i = 0; i < CREATE_FILES; i++) {
+        snprintf(name, sizeof(name), "/tmp/t%05u", i);
+        int32_t fd = sys_open(name, O_RDWR | O_CREAT);
+        if (fd < 0) {
+            break;
+        }
+        sys_write(fd, scratch, BATCH_FILE_SIZE);
+        sys_close(fd);
+        churned += sys_unlink(name) == 0;
+    }
+    report(image, size_mib, frag, "tmp_churn", churned, (uint64_t)churned * BATCH_FILE_SIZE, now() - start);
+    if (fs.device->requests != requests) {
+        fprintf(stderr, "tmp_churn: %llu device requests\n", (unsigned long long)(fs.device->requests - requests));
+    }
+    free(scratch);
+
+    // create_batch: the same number of small files with contents, in one call
+    FatBatchCreate* creates = malloc(CREATE_FILES * sizeof(FatBatchCreate));
+    FatBatchStat* stats = malloc(CREATE_FILES * sizeof(FatBatchStat));
+    char* names = malloc(CREATE_FILES * 16);
+    char* contents = malloc(BATCH_FILE_SIZE);
+    for (uint32_t i = 0; i < BATCH_FILE_SIZE; i++) {
+        contents[i] = (char)random_next();
+    }
+    for (uint32_t i = 0; i < CREATE_FILES; i++) {
+        snprintf(names + i * 16, 16, "k%05u.dat", i);
+        creates[i].name = names + i * 16;
+        creates[i].data = contents;
+        creates[i].size = BATCH_FILE_SIZE;
+        stats[i].name = names + i * 16;
+    }
+    start = now();
+    uint32_t created = create_files_batch(creates, CREATE_FILES);
+    fat_sync();
+    report(image, size_mib, frag, "create_batch", created, (uint64_t)created * BATCH_FILE_SIZE, now() - start);
+
+    start = now();
+    uint32_t found = stat_dir_batch(stats, CREATE_FILES);
+    report(image, size_mib, frag, "stat_batch", found, 0, now() - start);
+
+    // Every file of the batch, read back from the device
+    if (created != CREATE_FILES || found != CREATE_FILES) {
+        fprintf(stderr, "create_batch: %u of %u files created, %u found\n", created, CREATE_FILES, found);
+        failures++;
+    }
+    char* back = malloc(BATCH_FILE_SIZE + 1);
+    journal_checkpoint();
+    bcache_invalidate(fs.device);
+    for (uint32_t i = 0; i < CREATE_FILES; i++) {
+        int32_t fd = sys_open(creates[i].name, O_RDONLY);
+        int64_t got = fd >= 0 ? sys_read(fd, back, BATCH_FILE_SIZE + 1) : -1;
+        if (got != BATCH_FILE_SIZE || memCmp(back, contents, BATCH_FILE_SIZE) != 0) {
+            fprintf(stderr, "create_batch: %s reads %lld bytes\n", creates[i].name, (long long)got);
+            failures++;
+        }
+        sys_close(fd);
+    }
+    free(back);
+    free(creates);
+    free(stats);
+    free(names);
+    free(contents);
+
+    run_truncate(image, size_mib, frag);
+
+    // The sequential file takes at most a quarter of what is free
+    uint64_t room = (uint64_t)fat_free_clusters() * cluster_bytes / 4;
+    uint32_t file_size = room < SEQ_FILE_MAX ? (uint32_t)(room / SEQ_CHUNK * SEQ_CHUNK) : SEQ_FILE_MAX;
+    char* chunk = malloc(SEQ_CHUNK);
+    for (uint32_t i = 0; i < SEQ_CHUNK; i++) {
+        chunk[i] = (char)random_next();
+    }
+
+    if (file_size >= SEQ_CHUNK) {
+        int32_t fd = sys_open("seq.dat", O_RDWR | O_CREAT | O_TRUNC);
+        start = now();
+        for (uint32_t done = 0; done < file_size; done += SEQ_CHUNK) {
+            sys_write(fd, chunk, SEQ_CHUNK);
+        }
+        sys_fsync(fd);
+        report(image, size_mib, frag, "seq_write", file_size / SEQ_CHUNK, file_size, now() - start);
+        sys_close(fd);
+
+        // Reads start from the device, not from what the writes left cached
+        journal_checkpoint();
+        bcache_invalidate(fs.device);
+        fd = sys_open("seq.dat", O_RDONLY);
+        start = now();
+        uint64_t got = 0;
+        int64_t n;
+        while ((n = sys_read(fd, chunk, SEQ_CHUNK)) > 0) {
+            got += n;
+        }
+        report(image, size_mib, frag, "seq_read", got / SEQ_CHUNK, got, now() - start);
+
+        start = now();
+        for (uint32_t i = 0; i < RANDOM_READS; i++) {
+            sys_lseek(fd, (random_next() % (file_size / RANDOM_SIZE)) * RANDOM_SIZE, SEEK_SET);
+            sys_read(fd, chunk, RANDOM_SIZE);
+        }
+        report(image, size_mib, frag, "rand_read", RANDOM_READS, (uint64_t)RANDOM_READS * RANDOM_SIZE, now() - start);
+        sys_close(fd);
+    }
+    free(chunk);
+
+    // alloc: extents straight from the allocator, fragmentation shows up as short ones
+    uint32_t* firsts = malloc(ALLOC_EXTENTS * sizeof(uint32_t));
+    uint32_t made = 0;
+    uint64_t clusters = 0;
+    start = now();
+    while (made < ALLOC_EXTENTS && fat_free_clusters() > ALLOC_CLUSTERS) {
+        uint32_t length;
+        uint32_t first = fat_alloc_extent(ALLOC_CLUSTERS, &length);
+        if (first == 0) {
+            break;
+        }
+        firsts[made++] = first;
+        clusters += length;
+    }
+    report(image, size_mib, frag, "alloc", made, clusters * cluster_bytes, now() - start);
+    for (uint32_t i = 0; i < made; i++) {
+        fat_free_chain(firsts[i]);
+    }
+    free(firsts);
+    fat_sync();
+}
+
+static void bench_generated(uint32_t size_mib, uint32_t frag) {
+    char name[16];
+    snprintf(name, sizeof(name), "bench%u", image_count++);
+    BlockDev* dev = imagedisk_create(name, (uint64_t)size_mib << 20);
+    if (dev == NULL) {
+        fprintf(stderr, "fatbench: no memory for a %u MiB image\n", size_mib);
+        return;
+    }
+    format(dev);
+    if (!mount(name)) {
+        fprintf(stderr, "fatbench: mounting the %u MiB image failed\n", size_mib);
+        return;
+    }
+    fragment(frag);
+    run("generated", size_mib, frag);
+    unmount();
+}
+
+// Crash check: files created and committed one by one until a commit has to
+// empty the log first. The power goes right after that checkpoint, while the
+// directory and FAT sectors of the last file were logged and changed again.
+// A copy of the disk as the power left it must mount with every committed file.
+static void check_checkpoint_crash(void) {
+    char name[16], disk[16], copy[16];
+    snprintf(disk, sizeof(disk), "crash%u", image_count++);
+    snprintf(copy, sizeof(copy), "crash%u", image_count++);
+    uint64_t bytes = (uint64_t)CRASH_SIZE_MIB << 20;
+    BlockDev* dev = imagedisk_create(disk, bytes);
+    if (dev == NULL) {
+        return;
+    }
+    format(dev);
+    if (!mount(disk)) {
+        fprintf(stderr, "crash: mounting the image failed\n");
+        failures++;
+        return;
+    }
+
+    // The log header is only written by checkpoints once the volume is mounted
+    JournalLocation* location = (JournalLocation*)boot_sector.reserved;
+    imagedisk_cut_after(dev, location->first_sector);
+    uint32_t committed = 0;
+    while (committed < CRASH_FILES_MAX) {
+        snprintf(name, sizeof(name), "c%05u.dat", committed);
+        int32_t fd = sys_open(name, O_WRONLY | O_CREAT);
+        uint8_t ok = fd >= 0 && sys_write(fd, name, sizeof(name)) == sizeof(name) && sys_fsync(fd) == 0;
+        sys_close(fd);
+        if (!ok) {
+            break;
+        }
+        committed++;
+    }
+
+    BlockDev* after = imagedisk_create(copy, bytes);
+    if (after == NULL) {
+        return;
+    }
+    memCpy(imagedisk_base(after), imagedisk_base(dev), bytes);
+    imagedisk_power_on(dev);
+    unmount();
+    if (committed == CRASH_FILES_MAX || !mount(copy)) {
+        fprintf(stderr, "crash: %u files committed, no checkpoint cut short\n", committed);
+        failures++;
+        return;
+    }
+
+    uint32_t lost = 0;
+    char back[16];
+    for (uint32_t i = 0; i < committed; i++) {
+        snprintf(name, sizeof(name), "c%05u.dat", i);
+        int32_t fd = sys_open(name, O_RDONLY);
+        lost += fd < 0 || sys_read(fd, back, sizeof(back)) != sizeof(back) || memCmp(back, name, sizeof(name)) != 0 ||
+                chain_length(name) != 1;
+        sys_close(fd);
+    }
+    if (lost > 0) {
+        fprintf(stderr, "crash: %u of %u committed files lost by the checkpoint\n", lost, committed);
+        failures++;
+    }
+    unmount();
+}
+
+// exFAT check: the kernel's mount code on a fresh exFAT volume. A directory,
+// files in it and at the root written and read back, then again after a remount.
+static uint32_t exfat_verify(char* contents, char* back) {
+    char path[32];
+    uint32_t bad = 0;
+    for (uint32_t i = 0; i < EXFAT_FILES; i++) {
+        snprintf(path, sizeof(path), i % 2 ? "Logs/Entry %u.txt" : "entry %u.txt", i);
+        int32_t fd = sys_open(path, O_RDONLY);
+        uint32_t size = EXFAT_FILE_SIZE - i;
+        bad += fd < 0 || sys_read(fd, back, EXFAT_FILE_SIZE) != size || memCmp(back, contents + i, size) != 0;
+        sys_close(fd);
+    }
+    return bad;
+}
+
+static void check_exfat(void) {
+    char disk[16], path[32];
+    snprintf(disk, sizeof(disk), "exfat%u", image_count++);
+    BlockDev* dev = imagedisk_create(disk, (uint64_t)EXFAT_SIZE_MIB << 20);
+    if (dev == NULL) {
+        return;
+    }
+    format_exfat(dev);
+    host_console(0);
+    initialize_fat_file_system(&fs, disk);
+    host_console(1);
+    if (!exfat_mounted() || journal_active() || sys_mkdir("Logs") != 0) {
+        fprintf(stderr, "exfat: mounting the image or making a directory failed\n");
+        failures++;
+        return;
+    }
+
+    char* contents = malloc(EXFAT_FILE_SIZE + EXFAT_FILES);
+    char* back = malloc(EXFAT_FILE_SIZE);
+    for (uint32_t i = 0; i < EXFAT_FILE_SIZE + EXFAT_FILES; i++) {
+        contents[i] = (char)random_next();
+    }
+    uint32_t bad = 0;
+    for (uint32_t i = 0; i < EXFAT_FILES; i++) {
+        snprintf(path, sizeof(path), i % 2 ? "Logs/Entry %u.txt" : "entry %u.txt", i);
+        int32_t fd = sys_open(path, O_WRONLY | O_CREAT);
+        uint32_t size = EXFAT_FILE_SIZE - i;
+        bad += fd < 0 || sys_write(fd, contents + i, size) != size;
+        sys_close(fd);
+    }
+    // The FAT-only helpers turn the volume down instead of reading it as FAT
+    DirectoryEntry entry;
+    FatBatchStat stat = { "entry 0.txt" };
+    bad += find_directory_entry(&entry, "entry 0.txt") != 0 || stat_dir_batch(&stat, 1) != 0 ||
+           stat.status != FAT_BATCH_UNSUPPORTED;
+    bad += exfat_verify(contents, back);
+
+    // Everything from the device, not from what the writes left cached
+    fat_sync();
+    bcache_invalidate(dev);
+    host_console(0);
+    initialize_fat_file_system(&fs, disk);
+    host_console(1);
+    bad += !exfat_mounted() || exfat_verify(contents, back) != 0;
+    if (bad > 0) {
+        fprintf(stderr, "exfat: %u files or checks went wrong\n", bad);
+        failures++;
+    }
+    free(contents);
+    free(back);
+}
+
+static void bench_file(char* path) {
+    char name[16];
+    snprintf(name, sizeof(name), "bench%u", image_count++);
+    BlockDev* dev = imagedisk_open(path, name, 0);
+
+    // Mount trusts the BPB, a blank or foreign image would divide by zero
+    BootSector* bs = dev != NULL ? (BootSector*)imagedisk_base(dev) : NULL;
+    if (bs == NULL || bs->bytes_per_sector != IMAGEDISK_SECTOR_SIZE || bs->sectors_per_cluster == 0 ||
+        bs->sectors_per_fat_32 == 0 || bs->fat_count == 0) {
+        fprintf(stderr, "fatbench: %s is not a FAT32 image with 512 byte sectors\n", path);
+        return;
+    }
+    if (!mount(name)) {
+        fprintf(stderr, "fatbench: cannot mount %s\n", path);
+        return;
+    }
+    char* base = path;
+    for (char* c = path; *c != '\0'; c++) {
+        if (*c == '/') {
+            base = c + 1;
+        }
+    }
+    run(base, (uint32_t)((dev->sector_count * dev->sector_size) >> 20), 0);
+    unmount();
+}
+
+// Regression check
+
+// Compare ops/s with the matching lines of an earlier --json run, 1 when
+// nothing dropped by more than 'tolerance' percent
+static uint8_t compare(char* path, double tolerance) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "fatbench: cannot read %s\n", path);
+        return 0;
+    }
+    uint8_t ok = 1;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        Result old;
+        double old_rate;
+        if (sscanf(line, "{\"image\":\"%63[^\"]\",\"size_mib\":%u,\"frag\":%u,\"op\":\"%15[^\"]\",\"ops\":%*u,\"bytes\":%*u,"
+                   "\"seconds\":%*f,\"ops_per_sec\":%lf", old.image, &old.size_mib, &old.frag, old.op, &old_rate) != 5) {
+            continue;
+        }
+        for (uint32_t i = 0; i < result_count; i++) {
+            Result* r = &results[i];
+            if (!strEqual(r->image, old.image) || r->size_mib != old.size_mib || r->frag != old.frag || !strEqual(r->op, old.op)) {
+                continue;
+            }
+            double rate = per_second(r->ops, r->seconds);
+            if (rate < old_rate * (1 - tolerance / 100)) {
+                fprintf(stderr, "REGRESSION %s %u MiB %u%% %s: %.1f ops/s, baseline %.1f\n",
+                        r->image, r->size_mib, r->frag, r->op, rate, old_rate);
+                ok = 0;
+            }
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: fatbench [--image PATH]... [--size MIB]... [--frag PERCENT]... [--json]\n"
+            "                [--repeat N] [--baseline FILE] [--tolerance PERCENT]\n"
+            "Without --size or --image, 64 and 512 MiB images are generated at 0%% and 90%% fragmentation.\n"
+            "Each workload runs N times (3) on fresh images and the fastest run is reported.\n");
+}
+
+int main(int argc, char** argv) {
+    char* images[BENCH_IMAGES_MAX];
+    uint32_t sizes[BENCH_SIZES_MAX];
+    uint32_t frags[BENCH_SIZES_MAX];
+    uint32_t images_given = 0, sizes_given = 0, frags_given = 0;
+    char* baseline = NULL;
+    double tolerance = 20;
+    uint32_t repeat = 3;
+
+    for (int i = 1; i < argc; i++) {
+        char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strEqual(argv[i], "--json")) {
+            json = 1;
+        }
+        else if (strEqual(argv[i], "--image") && value != NULL && images_given < BENCH_IMAGES_MAX) {
+            images[images_given++] = value;
+            i++;
+        }
+        else if (strEqual(argv[i], "--size") && value != NULL && sizes_given < BENCH_SIZES_MAX) {
+            sizes[sizes_given++] = atoi(value);
+            i++;
+        }
+        else if (strEqual(argv[i], "--frag") && value != NULL && frags_given < BENCH_SIZES_MAX) {
+            frags[frags_given++] = atoi(value);
+            i++;
+        }
+        else if (strEqual(argv[i], "--repeat") && value != NULL && atoi(value) > 0) {
+            repeat = atoi(value);
+            i++;
+        }
+        else if (strEqual(argv[i], "--baseline") && value != NULL) {
+            baseline = value;
+            i++;
+        }
+        else if (strEqual(argv[i], "--tolerance") && value != NULL) {
+            tolerance = atof(value);
+            i++;
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (sizes_given == 0 && images_given == 0) {
+        sizes[sizes_given++] = 64;
+        sizes[sizes_given++] = 512;
+    }
+    if (frags_given == 0) {
+        frags[frags_given++] = 0;
+        frags[frags_given++] = 90;
+    }
+
+    // The same start up the kernel does before it mounts the disk
+    cpu_detect_features();
+    memory_init();
+    bcache_init();
+    pcache_init();
+    tmpfs_mount("/tmp");
+
+    // Every repetition works on a fresh image
+    for (uint32_t pass = 0; pass < repeat; pass++) {
+        for (uint32_t i = 0; i < images_given; i++) {
+            bench_file(images[i]);
+        }
+        for (uint32_t i = 0; i < sizes_given; i++) {
+            for (uint32_t j = 0; j < frags_given; j++) {
+                bench_generated(sizes[i], frags[j] > 100 ? 100 : frags[j]);
+            }
+        }
+    }
+    check_checkpoint_crash();
+    check_exfat();
+    print_results();
+
+    if (baseline != NULL && !compare(baseline, tolerance)) {
+        return 1;
+    }
+    return failures != 0;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "vga.h"
+#include "memory.h"
+#include "mmap.h"
+
+// The direct map is the identity in a process, "physical" addresses are pointers
+uint64_t phys_map_base = 0;
+uint64_t pmm_max_phys = UINT64_MAX;
+
+static uint8_t console = 1;
+
+void host_console(uint8_t enabled) {
+    console = enabled;
+}
+
+// Console
+
+void print_str(char* string) {
+    if (console) {
+        fputs(string, stderr);
+    }
+}
+
+void print_char(char character) {
+    if (console) {
+        fputc(character, stderr);
+    }
+}
+
+void print_int(uint16_t num) {
+    if (console) {
+        fprintf(stderr, "%u", num);
+    }
+}
+
+void print_uint(uint64_t num) {
+    if (console) {
+        fprintf(stderr, "%llu", (unsigned long long)num);
+    }
+}
+
+void print_newline() {
+    print_char('\n');
+}
+
+void print_clear() {
+}
+
+void print_set_color(uint8_t foreground, uint8_t background) {
+}
+
+// Memory
+
+void* kmalloc(size_t size) {
+    return malloc(size ? size : 1);
+}
+
+void* kzalloc(size_t size) {
+    return calloc(1, size ? size : 1);
+}
+
+void kfree(void* ptr) {
+    free(ptr);
+}
+
+// A cache only has to remember its object size, malloc does the rest
+SlabCache* kmem_cache_create(char* name, size_t object_size, size_t align, uint8_t flags) {
+    SlabCache* cache = calloc(1, sizeof(SlabCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    cache->object_size = (object_size + align - 1) / align * align;
+    cache->flags = flags;
+    snprintf(cache->name, SLAB_CACHE_NAME_LENGTH, "%s", name);
+    return cache;
+}
+
+void* kmem_cache_alloc(SlabCache* cache) {
+    cache->objects_in_use++;
+    return aligned_alloc(sizeof(void*), cache->object_size);
+}
+
+void kmem_cache_free(SlabCache* cache, void* object) {
+    if (object != NULL) {
+        cache->objects_in_use--;
+        free(object);
+    }
+}
+
+uint64_t pmm_alloc_flags(uint8_t order, uint8_t flags) {
+    size_t size = (size_t)PAGE_SIZE << order;
+    void* block = aligned_alloc(PAGE_SIZE, size);
+    if (block == NULL) {
+        return 0;
+    }
+    if (flags & PMM_ZERO) {
+        memSet(block, 0, size);
+    }
+    return (uint64_t)block;
+}
+
+uint64_t pmm_alloc(uint8_t order) {
+    return pmm_alloc_flags(order, 0);
+}
+
+void pmm_free(uint64_t phys, uint8_t order) {
+    free((void*)phys);
+}
+
+void pmm_free_zeroed(uint64_t phys) {
+    free((void*)phys);
+}
+
+void* vmm_alloc(uint64_t size) {
+    return aligned_alloc(PAGE_SIZE, (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1));
+}
+
+void vmm_free(void* ptr, uint64_t size) {
+    free(ptr);
+}
+
+// There are no page tables in a process, nothing is ever mapped
+
+void mmap_unmap_page(CachedPage* page) {
+    page->mapcount = 0;
+}
+
+void mmap_protect_page(CachedPage* page) {
+}
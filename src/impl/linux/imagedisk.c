@@ -0,0 +1,158 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "imagedisk.h"
+#include "memory.h"
+
+typedef struct {
+    BlockDev dev;
+    uint8_t* base;      // the mapped image
+    size_t size;
+    uint8_t shared;     // writes go back to the file, flush has to msync
+    uint8_t cut_armed;
+    uint8_t cut;        // the power is gone, writes fail
+    uint64_t cut_sector;
+} ImageDisk;
+
+// 0 once the power is gone. The write that reaches the cut sector still lands.
+static uint8_t powered(ImageDisk* disk, uint64_t sector, uint64_t count) {
+    if (disk->cut) {
+        return 0;
+    }
+    if (disk->cut_armed && sector <= disk->cut_sector && disk->cut_sector < sector + count) {
+        disk->cut = 1;
+    }
+    return 1;
+}
+
+static uint8_t imagedisk_read(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    memCpy(buffer, disk->base + (sector << dev->sector_shift), (size_t)count << dev->sector_shift);
+    return 1;
+}
+
+static uint8_t imagedisk_write(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    if (!powered(disk, sector, count)) {
+        return 0;
+    }
+    memCpy(disk->base + (sector << dev->sector_shift), buffer, (size_t)count << dev->sector_shift);
+    return 1;
+}
+
+static uint8_t imagedisk_readv(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    uint8_t* position = disk->base + (sector << dev->sector_shift);
+    for (uint32_t i = 0; i < iov_count; i++) {
+        memCpy(iov[i].base, position, iov[i].length);
+        position += iov[i].length;
+    }
+    return 1;
+}
+
+static uint8_t imagedisk_writev(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < iov_count; i++) {
+        bytes += iov[i].length;
+    }
+    if (!powered(disk, sector, (bytes + dev->sector_size - 1) >> dev->sector_shift)) {
+        return 0;
+    }
+    uint8_t* position = disk->base + (sector << dev->sector_shift);
+    for (uint32_t i = 0; i < iov_count; i++) {
+        memCpy(position, iov[i].base, iov[i].length);
+        position += iov[i].length;
+    }
+    return 1;
+}
+
+// A private or anonymous mapping has nowhere to write back to
+static uint8_t imagedisk_flush(BlockDev* dev) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    return !disk->shared || msync(disk->base, disk->size, MS_SYNC) == 0;
+}
+
+static void* imagedisk_direct(BlockDev* dev, uint64_t sector) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    return disk->base + (sector << dev->sector_shift);
+}
+
+static BlockDevOps imagedisk_ops = {
+    .read = imagedisk_read,
+    .write = imagedisk_write,
+    .flush = imagedisk_flush,
+    .readv = imagedisk_readv,
+    .writev = imagedisk_writev,
+    .direct = imagedisk_direct,
+};
+
+static BlockDev* attach(char* name, uint8_t* base, size_t size, uint8_t shared) {
+    ImageDisk* disk = calloc(1, sizeof(ImageDisk));
+    if (disk == NULL) {
+        munmap(base, size);
+        return NULL;
+    }
+    disk->base = base;
+    disk->size = size;
+    disk->shared = shared;
+
+    uint32_t i = 0;
+    while (i < BLOCKDEV_NAME_LENGTH - 1 && name[i] != '\0') {
+        disk->dev.name[i] = name[i];
+        i++;
+    }
+    disk->dev.sector_size = IMAGEDISK_SECTOR_SIZE;
+    disk->dev.sector_count = size / IMAGEDISK_SECTOR_SIZE;
+    disk->dev.ops = &imagedisk_ops;
+    disk->dev.private_data = disk;
+    blockdev_register(&disk->dev);
+    return &disk->dev;
+}
+
+BlockDev* imagedisk_open(char* path, char* name, uint8_t shared) {
+    int fd = open(path, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < IMAGEDISK_SECTOR_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    // A private mapping is copy on write, the benchmark can scribble on the real image
+    int prot = PROT_READ | PROT_WRITE;
+    uint8_t* base = mmap(NULL, st.st_size, prot, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    return attach(name, base, st.st_size, shared);
+}
+
+BlockDev* imagedisk_create(char* name, uint64_t bytes) {
+    uint8_t* base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    return attach(name, base, bytes, 0);
+}
+
+uint8_t* imagedisk_base(BlockDev* dev) {
+    return ((ImageDisk*)dev->private_data)->base;
+}
+
+void imagedisk_cut_after(BlockDev* dev, uint64_t sector) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    disk->cut_armed = 1;
+    disk->cut_sector = sector;
+}
+
+void imagedisk_power_on(BlockDev* dev) {
+    ImageDisk* disk = (ImageDisk*)dev->private_data;
+    disk->cut_armed = 0;
+    disk->cut = 0;
+}
@@ -0,0 +1,753 @@
+#include "ahci.h"
+#include "apic.h"
+#include "ata.h"
+#include "constants.h"
+#include "cpu.h"
+#include "idt.h"
+#include "irq.h"
+#include "memory.h"
+#include "pci.h"
+#include "pmm.h"
+#include "ports.h"
+#include "vga.h"
+#include "vmm.h"
+
+extern void irq_ahci(void);
+
+typedef struct {
+    BlockDev dev;
+    volatile uint32_t* regs;        // the port's register block
+    uint8_t number;                 // port on the HBA
+    uint8_t lba48;
+    uint8_t ncq;                    // reads and writes go out as FPDMA QUEUED commands
+    uint8_t depth;                  // commands the drive takes at once
+    uint32_t slots;                 // slots requests may use, the low 'depth' ones
+    uint32_t busy;                  // slots issued and not reaped yet
+    volatile uint8_t error;         // the IRQ handler saw an error interrupt
+    AhciCommandHeader* command_list;
+    uint64_t command_list_phys;     // command list, received FIS area behind it in the same page
+    AhciCommandTable* tables;       // one per slot
+    uint64_t tables_phys;
+    uint8_t* bounce;                // for buffers the HBA cannot reach and for IDENTIFY data
+    uint64_t bounce_phys;
+    char model[41];
+} AhciPort;
+
+AhciStats ahci_stats;
+
+static volatile uint32_t* abar;
+static PciDevice hba_pci;
+static uint8_t dma64;               // the HBA reaches memory above 4 GiB
+static uint8_t irq_ready;           // ahci_enable_irq routed the interrupt here
+static uint8_t msi;                 // it arrives as a message, else on PIC line irq_line
+static uint8_t irq_line;
+static AhciPort ports[AHCI_MAX_DRIVES];
+static uint32_t port_count;
+
+static AhciPort* port_of(BlockDev* dev) {
+    return (AhciPort*)dev->private_data;
+}
+
+static uint32_t hba_read(uint32_t reg) {
+    return abar[reg / 4];
+}
+
+static void hba_write(uint32_t reg, uint32_t value) {
+    abar[reg / 4] = value;
+}
+
+static uint32_t port_read(AhciPort* p, uint32_t reg) {
+    return p->regs[reg / 4];
+}
+
+static void port_write(AhciPort* p, uint32_t reg, uint32_t value) {
+    p->regs[reg / 4] = value;
+}
+
+static uint32_t bit_count(uint32_t bits) {
+    uint32_t count = 0;
+    for (; bits != 0; bits &= bits - 1) {
+        count++;
+    }
+    return count;
+}
+
+// Wait for 'bits' of a port register to clear, 0 on a timeout
+static uint8_t wait_clear(AhciPort* p, uint32_t reg, uint32_t bits) {
+    for (uint32_t i = 0; i < AHCI_TIMEOUT; i++) {
+        if (!(port_read(p, reg) & bits)) {
+            return 1;
+        }
+        asm volatile("pause");
+    }
+    return 0;
+}
+
+// Stop processing the command list and receiving FISes, the registers that
+// point at the port's memory may only change while both are stopped
+static uint8_t port_stop(AhciPort* p) {
+    port_write(p, PORT_CMD, port_read(p, PORT_CMD) & ~PORT_CMD_ST);
+    if (!wait_clear(p, PORT_CMD, PORT_CMD_CR)) {
+        return 0;
+    }
+    port_write(p, PORT_CMD, port_read(p, PORT_CMD) & ~PORT_CMD_FRE);
+    return wait_clear(p, PORT_CMD, PORT_CMD_FR);
+}
+
+// Clear stale errors and start the port once the device is idle
+static uint8_t port_start(AhciPort* p) {
+    port_write(p, PORT_SERR, 0xFFFFFFFF);
+    port_write(p, PORT_IS, 0xFFFFFFFF);
+    port_write(p, PORT_CMD, port_read(p, PORT_CMD) | PORT_CMD_FRE);
+    if (!wait_clear(p, PORT_TFD, ATA_STATUS_BSY | ATA_STATUS_DRQ)) {
+        return 0;
+    }
+    port_write(p, PORT_CMD, port_read(p, PORT_CMD) | PORT_CMD_ST);
+    return 1;
+}
+
+// After an error the HBA stops taking commands: restart the port and drop
+// whatever was outstanding, the requests it belonged to fail. A device that
+// stays busy would need a COMRESET, the port then stays stopped.
+static void recover(AhciPort* p) {
+    port_stop(p);
+    p->busy = 0;
+    p->error = 0;
+    port_start(p);
+}
+
+// Describe 'bytes' of the list at (*index, *offset) in a command table and
+// advance. Returns the entry count, 0 when a piece is out of the HBA's reach:
+// on an odd address or of odd length, above 4 GiB on a 32-bit HBA, or too
+// scattered for one table.
+static uint32_t build_prdt(AhciCommandTable* table, IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, size_t bytes) {
+    uint32_t i = *index;
+    size_t o = *offset;
+    uint32_t entries = 0;
+    uint32_t length = 0;                // of the entry being built
+
+    while (bytes > 0) {
+        if (i >= iov_count) {
+            return 0;
+        }
+        if (o == iov[i].length) {
+            i++;
+            o = 0;
+            continue;
+        }
+        size_t take = iov[i].length - o < bytes ? iov[i].length - o : bytes;
+        // Translated page by page, consecutive frames join one entry
+        uint64_t phys = virt_to_phys((uint8_t*)iov[i].base + o);
+        uint64_t in_page = PAGE_SIZE - (phys & (PAGE_SIZE - 1));
+        if (take > in_page) {
+            take = in_page;
+        }
+        if ((phys & 1) || (take & 1) || (!dma64 && phys + take > 0x100000000ULL)) {
+            return 0;
+        }
+
+        if (entries > 0 && table->prdt[entries - 1].phys + length == phys && length + take <= AHCI_PRD_BYTES) {
+            length += take;
+        }
+        else {
+            if (entries == AHCI_PRD_MAX) {
+                return 0;
+            }
+            if (entries > 0) {
+                table->prdt[entries - 1].bytes = length - 1;
+            }
+            table->prdt[entries].phys = phys;
+            table->prdt[entries].reserved = 0;
+            entries++;
+            length = take;
+        }
+        o += take;
+        bytes -= take;
+    }
+    if (o == iov[i].length) {
+        i++;
+        o = 0;
+    }
+    table->prdt[entries - 1].bytes = length - 1;
+    *index = i;
+    *offset = o;
+    return entries;
+}
+
+// Command FIS and header of 'slot' for a command whose PRD table holds 'prds' entries
+static void fill_command(AhciPort* p, uint32_t slot, uint8_t command, uint64_t lba, uint32_t count, uint32_t prds, uint8_t write) {
+    AhciFisH2D* fis = (AhciFisH2D*)p->tables[slot].fis;
+    memSet(fis, 0, sizeof(AhciFisH2D));
+    fis->type = FIS_TYPE_REG_H2D;
+    fis->flags = FIS_H2D_COMMAND;
+    fis->command = command;
+    fis->device = FIS_DEVICE_LBA;
+    fis->lba0 = lba;
+    fis->lba1 = lba >> 8;
+    fis->lba2 = lba >> 16;
+    fis->lba3 = lba >> 24;
+    fis->lba4 = lba >> 32;
+    fis->lba5 = lba >> 40;
+    if (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        // The tag is the slot, the count moves to the features registers
+        fis->features = count;
+        fis->features_high = count >> 8;
+        fis->count = slot << 3;
+    }
+    else {
+        fis->count = count;
+        fis->count_high = count >> 8;
+    }
+    if (command == ATA_CMD_READ_DMA || command == ATA_CMD_WRITE_DMA) {
+        fis->device |= (lba >> 24) & 0x0F;
+    }
+
+    AhciCommandHeader* header = &p->command_list[slot];
+    header->flags = sizeof(AhciFisH2D) / 4 | (write ? AHCI_HEADER_WRITE : 0);
+    header->prdt_length = prds;
+    header->bytes = 0;
+}
+
+static void issue(AhciPort* p, uint32_t slot, uint8_t queued) {
+    // The command list and tables are plain memory the compiler must have written before the HBA looks
+    asm volatile("" ::: "memory");
+    p->busy |= 1u << slot;
+    if (queued) {
+        port_write(p, PORT_SACT, 1u << slot);
+    }
+    port_write(p, PORT_CI, 1u << slot);
+
+    ahci_stats.commands++;
+    if (queued) {
+        ahci_stats.queued++;
+    }
+    uint32_t depth = bit_count(p->busy);
+    if (depth > ahci_stats.max_depth) {
+        ahci_stats.max_depth = depth;
+    }
+}
+
+// Slots that finished since the last look. An NCQ command leaves CI once the
+// drive accepted it and SACT once its data moved.
+static uint32_t reap(AhciPort* p) {
+    uint32_t done = p->busy & ~(port_read(p, PORT_SACT) | port_read(p, PORT_CI));
+    p->busy &= ~done;
+    // The data the HBA wrote is read after this
+    asm volatile("" ::: "memory");
+    return done;
+}
+
+// Wait until at least one busy slot finished and return those that did in
+// 'done'. With interrupts on, as for shell commands, the CPU halts until the
+// HBA interrupts. Interrupt handlers run with interrupts off and boot runs
+// before the IDT is loaded, there the registers are polled. 0 on an
+// error or a timeout, the port then needs recover.
+static uint8_t wait_any(AhciPort* p, uint32_t* done) {
+    uint8_t halt = irq_ready && interrupts_enabled();
+    uint8_t ok = 1;
+    uint32_t i = 0;
+    if (halt) {
+        // sti takes effect after the next instruction, so the interrupt cannot slip in before the hlt
+        asm volatile("cli");
+    }
+    while ((*done = reap(p)) == 0) {
+        if (p->error || (port_read(p, PORT_IS) & PORT_IS_ERRORS)) {
+            ok = 0;
+            break;
+        }
+        if (halt) {
+            asm volatile("sti\n\thlt\n\tcli");
+        }
+        else if (++i == AHCI_TIMEOUT) {
+            ok = 0;
+            break;
+        }
+        else {
+            asm volatile("pause");
+        }
+    }
+    if (halt) {
+        asm volatile("sti");
+    }
+    return ok;
+}
+
+static uint8_t wait_idle(AhciPort* p) {
+    uint32_t done;
+    while (p->busy != 0) {
+        if (!wait_any(p, &done)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Lowest slot requests may use that is not busy, -1 when the queue is full
+static int32_t free_slot(AhciPort* p) {
+    uint32_t free = p->slots & ~p->busy;
+    return free != 0 ? (int32_t)__builtin_ctz(free) : -1;
+}
+
+static uint8_t rw_command(AhciPort* p, uint8_t write) {
+    if (p->ncq) {
+        return write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+    }
+    if (p->lba48) {
+        return write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    }
+    return write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+}
+
+// Issue 'count' sectors at 'lba' from the free slot 'slot' without waiting.
+// 0 when the buffers are out of the HBA's reach, the list position then stays where it was.
+static uint8_t start_command(AhciPort* p, uint32_t slot, uint64_t lba, uint32_t count, IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, uint8_t write) {
+    uint32_t prds = build_prdt(&p->tables[slot], iov, iov_count, index, offset, (size_t)count * ATA_SECTOR_SIZE);
+    if (prds == 0) {
+        return 0;
+    }
+    fill_command(p, slot, rw_command(p, write), lba, count, prds, write);
+    issue(p, slot, p->ncq);
+    return 1;
+}
+
+// One command through the bounce buffer once the queue drained
+static uint8_t bounce_command(AhciPort* p, uint64_t lba, uint32_t count, IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, uint8_t write) {
+    size_t bytes = (size_t)count * ATA_SECTOR_SIZE;
+    if (!wait_idle(p)) {
+        return 0;
+    }
+    ahci_stats.bounced++;
+    if (write) {
+        iov_copy(iov, iov_count, index, offset, p->bounce, bytes, 0);
+    }
+    IoVec piece = { p->bounce, bytes };
+    uint32_t piece_index = 0;
+    size_t piece_offset = 0;
+    start_command(p, 0, lba, count, &piece, 1, &piece_index, &piece_offset, write);
+    if (!wait_idle(p)) {
+        return 0;
+    }
+    if (!write) {
+        iov_copy(iov, iov_count, index, offset, p->bounce, bytes, 1);
+    }
+    return 1;
+}
+
+// Split a request into commands of at most AHCI_MAX_SECTORS and keep as many
+// of them queued as the drive takes, it works on them in whatever order suits it
+static uint8_t transfer(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count, uint8_t write) {
+    AhciPort* p = port_of(dev);
+    uint32_t total = iov_length(iov, iov_count) / ATA_SECTOR_SIZE;
+    uint32_t count = total;
+    uint32_t index = 0;
+    size_t offset = 0;
+    uint64_t start = read_tsc();
+    uint8_t ok = 1;
+
+    while (ok && (count > 0 || p->busy != 0)) {
+        int32_t slot = free_slot(p);
+        if (count > 0 && slot >= 0) {
+            uint32_t n = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+            if (!start_command(p, slot, sector, n, iov, iov_count, &index, &offset, write)) {
+                ok = bounce_command(p, sector, n, iov, iov_count, &index, &offset, write);
+            }
+            sector += n;
+            count -= n;
+        }
+        else {
+            uint32_t done;
+            ok = wait_any(p, &done);
+        }
+    }
+    if (ok) {
+        ahci_stats.sectors += total;
+    }
+    else {
+        ahci_stats.errors++;
+        recover(p);
+    }
+    ahci_stats.cycles += read_tsc() - start;
+    return ok;
+}
+
+static uint8_t ahci_read(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    IoVec iov = { buffer, (size_t)count * ATA_SECTOR_SIZE };
+    return transfer(dev, sector, &iov, 1, 0);
+}
+
+static uint8_t ahci_write(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    IoVec iov = { buffer, (size_t)count * ATA_SECTOR_SIZE };
+    return transfer(dev, sector, &iov, 1, 1);
+}
+
+static uint8_t ahci_readv(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    return transfer(dev, sector, iov, iov_count, 0);
+}
+
+static uint8_t ahci_writev(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    return transfer(dev, sector, iov, iov_count, 1);
+}
+
+// Empty the drive's write cache. FLUSH CACHE is not queued, every request
+// has drained by the time it returns so the queue is idle here.
+static uint8_t ahci_flush(BlockDev* dev) {
+    AhciPort* p = port_of(dev);
+    fill_command(p, 0, p->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE, 0, 0, 0, 0);
+    issue(p, 0, 0);
+    if (!wait_idle(p)) {
+        ahci_stats.errors++;
+        recover(p);
+        return 0;
+    }
+    return 1;
+}
+
+static BlockDevOps ahci_ops = {
+    .read = ahci_read,
+    .write = ahci_write,
+    .flush = ahci_flush,
+    .readv = ahci_readv,
+    .writev = ahci_writev,
+    .direct = NULL,
+};
+
+// Waiters look at SACT and CI themselves, the interrupt only wakes them and records errors
+void ahci_irq(void) {
+    uint32_t pending = hba_read(HBA_IS);
+    for (uint32_t i = 0; i < port_count; i++) {
+        AhciPort* p = &ports[i];
+        if (pending & (1u << p->number)) {
+            uint32_t status = port_read(p, PORT_IS);
+            if (status & PORT_IS_ERRORS) {
+                p->error = 1;
+            }
+            port_write(p, PORT_IS, status);
+        }
+    }
+    hba_write(HBA_IS, pending);
+    ahci_stats.irqs++;
+
+    if (msi) {
+        lapic_eoi();
+        return;
+    }
+    if (irq_line >= 8) {
+        outportb(PIC_SLAVE_CMD, PIC_EOI);
+    }
+    outportb(PIC_MASTER_CMD, PIC_EOI);
+}
+
+// IDENTIFY DEVICE into 'id' through the bounce buffer
+static uint8_t identify(AhciPort* p, uint16_t* id) {
+    IoVec piece = { p->bounce, ATA_SECTOR_SIZE };
+    uint32_t index = 0;
+    size_t offset = 0;
+    uint32_t prds = build_prdt(&p->tables[0], &piece, 1, &index, &offset, ATA_SECTOR_SIZE);
+    fill_command(p, 0, ATA_CMD_IDENTIFY, 0, 0, prds, 0);
+    issue(p, 0, 0);
+    if (!wait_idle(p)) {
+        recover(p);
+        return 0;
+    }
+    memCpy(id, p->bounce, ATA_SECTOR_SIZE);
+    return 1;
+}
+
+static void free_port_memory(AhciPort* p) {
+    if (p->command_list_phys != 0) {
+        pmm_free(p->command_list_phys, 0);
+    }
+    if (p->tables_phys != 0) {
+        pmm_free(p->tables_phys, AHCI_TABLES_ORDER);
+    }
+    if (p->bounce_phys != 0) {
+        pmm_free(p->bounce_phys, AHCI_BOUNCE_ORDER);
+    }
+    memSet(p, 0, sizeof(AhciPort));
+}
+
+// Command list, received FIS area, command tables and bounce buffer of a
+// port, below 4 GiB on a 32-bit HBA
+static uint8_t port_memory(AhciPort* p) {
+    uint64_t limit = dma64 ? ~0ULL : 0x100000000ULL;
+    p->command_list_phys = pmm_alloc_flags(0, PMM_ZERO);
+    p->tables_phys = pmm_alloc_flags(AHCI_TABLES_ORDER, PMM_ZERO);
+    p->bounce_phys = pmm_alloc(AHCI_BOUNCE_ORDER);
+    if (p->command_list_phys == 0 || p->tables_phys == 0 || p->bounce_phys == 0 ||
+        p->command_list_phys + PAGE_SIZE > limit || p->tables_phys + ((uint64_t)PAGE_SIZE << AHCI_TABLES_ORDER) > limit ||
+        p->bounce_phys + ((uint64_t)PAGE_SIZE << AHCI_BOUNCE_ORDER) > limit) {
+        return 0;
+    }
+    p->command_list = phys_to_virt(p->command_list_phys);
+    p->tables = phys_to_virt(p->tables_phys);
+    p->bounce = phys_to_virt(p->bounce_phys);
+    for (uint32_t slot = 0; slot < AHCI_SLOTS; slot++) {
+        p->command_list[slot].table_phys = p->tables_phys + slot * sizeof(AhciCommandTable);
+    }
+    uint64_t fis_phys = p->command_list_phys + AHCI_SLOTS * sizeof(AhciCommandHeader);
+    port_write(p, PORT_CLB, (uint32_t)p->command_list_phys);
+    port_write(p, PORT_CLBU, p->command_list_phys >> 32);
+    port_write(p, PORT_FB, (uint32_t)fis_phys);
+    port_write(p, PORT_FBU, fis_phys >> 32);
+    return 1;
+}
+
+static void add_port(uint32_t number, uint32_t cap) {
+    AhciPort* p = &ports[port_count];
+    p->regs = abar + (PORT_BASE + number * PORT_STRIDE) / 4;
+    p->number = number;
+    // Only ports with a link up to a disk, ATAPI drives and port multipliers are left alone
+    if ((port_read(p, PORT_SSTS) & PORT_SSTS_DET) != PORT_SSTS_DET_PRESENT || port_read(p, PORT_SIG) != PORT_SIG_ATA) {
+        memSet(p, 0, sizeof(AhciPort));
+        return;
+    }
+    uint16_t id[256];
+    p->slots = 1;
+    if (!port_stop(p) || !port_memory(p) || !port_start(p) || !identify(p, id)) {
+        print_str("AHCI: port ");
+        print_uint(number);
+        print_str(" did not come up\n");
+        port_stop(p);
+        free_port_memory(p);
+        return;
+    }
+
+    p->lba48 = (id[ATA_ID_COMMAND_SETS] & (1 << 10)) != 0;
+    if (p->lba48) {
+        p->dev.sector_count = id[ATA_ID_LBA48_SECTORS] | ((uint64_t)id[ATA_ID_LBA48_SECTORS + 1] << 16) | ((uint64_t)id[ATA_ID_LBA48_SECTORS + 2] << 32) | ((uint64_t)id[ATA_ID_LBA48_SECTORS + 3] << 48);
+    }
+    else {
+        p->dev.sector_count = id[ATA_ID_LBA28_SECTORS] | ((uint32_t)id[ATA_ID_LBA28_SECTORS + 1] << 16);
+    }
+    // NCQ needs it from both the HBA and the drive, the queue is as deep as the shallower of the two
+    uint32_t hba_slots = ((cap >> HBA_CAP_NCS_SHIFT) & 0x1F) + 1;
+    p->ncq = (cap & HBA_CAP_SNCQ) && (id[ATA_ID_SATA_CAPABILITIES] & (1 << 8));
+    p->depth = p->ncq ? (id[ATA_ID_QUEUE_DEPTH] & 0x1F) + 1 : 1;
+    if (p->depth > hba_slots) {
+        p->depth = hba_slots;
+    }
+    p->slots = p->depth == 32 ? 0xFFFFFFFF : (1u << p->depth) - 1;
+    for (uint32_t i = 0; i < 20; i++) {
+        p->model[i * 2] = id[ATA_ID_MODEL + i] >> 8;
+        p->model[i * 2 + 1] = id[ATA_ID_MODEL + i] & 0xFF;
+    }
+    for (int32_t i = 39; i >= 0 && p->model[i] == ' '; i--) {
+        p->model[i] = '\0';
+    }
+
+    memCpy(p->dev.name, "ahci0", 6);
+    p->dev.name[4] = '0' + port_count;
+    p->dev.sector_size = ATA_SECTOR_SIZE;
+    p->dev.ops = &ahci_ops;
+    p->dev.private_data = p;
+    blockdev_register(&p->dev);
+    port_count++;
+
+    print_str("AHCI disk ");
+    print_str(p->dev.name);
+    print_str(": ");
+    print_str(p->model);
+    print_str(", ");
+    print_uint((p->dev.sector_count * ATA_SECTOR_SIZE) >> 20);
+    print_str(" MiB, port ");
+    print_uint(number);
+    print_str(p->ncq ? ", NCQ depth " : ", no NCQ, depth ");
+    print_uint(p->depth);
+    print_str("\n");
+}
+
+// Firmware that still drives the HBA is asked to let go
+static void bios_handoff(void) {
+    if (!(hba_read(HBA_CAP2) & HBA_CAP2_BOH)) {
+        return;
+    }
+    hba_write(HBA_BOHC, hba_read(HBA_BOHC) | HBA_BOHC_OOS);
+    for (uint32_t i = 0; i < AHCI_TIMEOUT && (hba_read(HBA_BOHC) & HBA_BOHC_BOS); i++) {
+        asm volatile("pause");
+    }
+}
+
+void ahci_init(void) {
+    PciDevice pci;
+    if (!pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, 0, &pci) || pci.prog_if != PCI_PROG_IF_AHCI) {
+        return;
+    }
+    uint64_t base = pci_bar(&pci, 5);
+    pci_enable(&pci, PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+    // Device registers must not be cached
+    abar = vmm_map_kernel(base, AHCI_ABAR_SIZE, PTE_WRITABLE | PTE_CACHE_DISABLE | PTE_WRITE_THROUGH | PTE_NO_EXECUTE);
+    if (abar == NULL) {
+        print_str("AHCI: cannot map the registers\n");
+        return;
+    }
+    hba_pci = pci;
+
+    bios_handoff();
+    // Interrupts stay off until ahci_enable_irq, completions are polled until then
+    hba_write(HBA_GHC, (hba_read(HBA_GHC) | HBA_GHC_AE) & ~HBA_GHC_IE);
+    uint32_t cap = hba_read(HBA_CAP);
+    dma64 = (cap & HBA_CAP_S64A) != 0;
+    uint32_t implemented = hba_read(HBA_PI);
+    for (uint32_t number = 0; number < 32 && port_count < AHCI_MAX_DRIVES; number++) {
+        if (implemented & (1u << number)) {
+            add_port(number, cap);
+        }
+    }
+}
+
+void ahci_enable_irq(void) {
+    if (port_count == 0 || irq_ready) {
+        return;
+    }
+    // A message needs no PIC line and is never shared
+    msi = lapic_ready() && pci_enable_msi(&hba_pci, lapic_id(), AHCI_MSI_VECTOR);
+    if (msi) {
+        idt_set_gate(AHCI_MSI_VECTOR, irq_ahci);
+    }
+    else {
+        irq_line = pci_read8(&hba_pci, PCI_INTERRUPT_LINE);
+        // 0xFF: the firmware routed no line
+        if (irq_line == 0 || irq_line >= 16 || irq_line == PIC_CASCADE_IRQ) {
+            return;
+        }
+        idt_set_gate(IRQ_BASE_VECTOR + irq_line, irq_ahci);
+        clear_mask_IRQ(irq_line);
+    }
+    for (uint32_t i = 0; i < port_count; i++) {
+        port_write(&ports[i], PORT_IS, 0xFFFFFFFF);
+        port_write(&ports[i], PORT_IE, PORT_IS_DHRS | PORT_IS_SDBS | PORT_IS_ERRORS);
+    }
+    hba_write(HBA_IS, 0xFFFFFFFF);
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | HBA_GHC_IE);
+    irq_ready = 1;
+}
+
+// TSC ticks per second, counted over 10 ms of PIT channel 2
+static uint64_t tsc_frequency(void) {
+    uint16_t ticks = PIT_FREQUENCY / 100;
+    uint8_t gate = inportb(PIT_GATE_PORT);
+    outportb(PIT_GATE_PORT, gate & ~0x03);
+    // Channel 2, low byte then high byte, mode 0: the output goes up when the count runs out
+    outportb(PIT_COMMAND, 0xB0);
+    outportb(PIT_CHANNEL2_DATA, ticks & 0xFF);
+    outportb(PIT_CHANNEL2_DATA, ticks >> 8);
+    outportb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+    uint64_t start = read_tsc();
+    for (uint32_t i = 0; i < AHCI_TIMEOUT && !(inportb(PIT_GATE_PORT) & 0x20); i++) {
+    }
+    uint64_t hz = (read_tsc() - start) * 100;
+    outportb(PIT_GATE_PORT, gate);
+    return hz;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// TSC cycles AHCI_BENCH_IOS random 4 KiB reads take with 'depth' of them in
+// flight, each slot reading into its own page of 'buffers'. 0 on an error.
+static uint64_t bench_depth(AhciPort* p, uint8_t* buffers, uint32_t depth, uint64_t blocks, uint64_t* seed) {
+    uint32_t saved = p->slots;
+    p->slots = depth == 32 ? 0xFFFFFFFF : (1u << depth) - 1;
+    uint32_t issued = 0;
+    uint32_t completed = 0;
+    uint64_t start = read_tsc();
+    uint8_t ok = 1;
+
+    while (ok && completed < AHCI_BENCH_IOS) {
+        int32_t slot = free_slot(p);
+        if (issued < AHCI_BENCH_IOS && slot >= 0) {
+            IoVec piece = { buffers + slot * PAGE_SIZE, PAGE_SIZE };
+            uint32_t index = 0;
+            size_t offset = 0;
+            uint64_t sector = (next_random(seed) % blocks) * (PAGE_SIZE / ATA_SECTOR_SIZE);
+            ok = start_command(p, slot, sector, PAGE_SIZE / ATA_SECTOR_SIZE, &piece, 1, &index, &offset, 0);
+            issued++;
+        }
+        else {
+            uint32_t done;
+            ok = wait_any(p, &done);
+            completed += bit_count(done);
+        }
+    }
+    uint64_t cycles = read_tsc() - start;
+    if (!ok) {
+        ahci_stats.errors++;
+        recover(p);
+    }
+    p->slots = saved;
+    return ok ? cycles : 0;
+}
+
+void ahci_benchmark(void) {
+    if (port_count == 0) {
+        print_str("\nNo AHCI disk\n");
+        return;
+    }
+    AhciPort* p = &ports[0];
+    // One page per slot, the bounce buffer's size
+    uint64_t phys = pmm_alloc(AHCI_BOUNCE_ORDER);
+    if (phys == 0) {
+        print_str("\nNot enough memory for the AHCI benchmark\n");
+        return;
+    }
+    uint64_t span = p->dev.sector_count * ATA_SECTOR_SIZE;
+    if (span > AHCI_BENCH_SPAN) {
+        span = AHCI_BENCH_SPAN;
+    }
+    uint64_t blocks = span / PAGE_SIZE;
+    uint64_t hz = tsc_frequency();
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+    print_str("\n");
+    print_uint(AHCI_BENCH_IOS);
+    print_str(" random 4 KiB reads per depth within the first ");
+    print_uint(span >> 20);
+    print_str(" MiB of ");
+    print_str(p->dev.name);
+    print_str(p->ncq ? ", NCQ\n" : ", no NCQ: one command at a time\n");
+    print_str("depth\tIOPS\tspeedup over depth 1\n");
+    uint64_t base = 0;
+    for (uint32_t depth = 1; depth <= p->depth && blocks > 0; depth *= 2) {
+        uint64_t cycles = bench_depth(p, phys_to_virt(phys), depth, blocks, &seed);
+        if (cycles == 0) {
+            print_str("read error\n");
+            break;
+        }
+        uint64_t iops = AHCI_BENCH_IOS * hz / cycles;
+        if (base == 0) {
+            base = iops != 0 ? iops : 1;
+        }
+        uint64_t speedup = iops * 100 / base;
+        print_uint(depth);
+        print_str("\t");
+        print_uint(iops);
+        print_str("\t");
+        print_uint(speedup / 100);
+        print_str(speedup % 100 < 10 ? ".0" : ".");
+        print_uint(speedup % 100);
+        print_str("x\n");
+    }
+    pmm_free(phys, AHCI_BOUNCE_ORDER);
+}
+
+void ahci_print_stats(void) {
+    print_str("AHCI: commands: ");
+    print_uint(ahci_stats.commands);
+    print_str(" queued: ");
+    print_uint(ahci_stats.queued);
+    print_str(" sectors: ");
+    print_uint(ahci_stats.sectors);
+    print_str(" bounced: ");
+    print_uint(ahci_stats.bounced);
+    print_str(" max depth: ");
+    print_uint(ahci_stats.max_depth);
+    print_str(" irqs: ");
+    print_uint(ahci_stats.irqs);
+    print_str(" errors: ");
+    print_uint(ahci_stats.errors);
+    print_str("\n");
+}
@@ -0,0 +1,57 @@
+#include "apic.h"
+#include "cpu.h"
+#include "vmm.h"
+
+static volatile uint32_t* lapic;
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+void lapic_init(void) {
+    uint64_t base = read_msr(MSR_APIC_BASE);
+    write_msr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+
+    // Device registers must not be cached
+    lapic = (volatile uint32_t*)vmm_map_kernel(base & PTE_ADDR_MASK, PAGE_SIZE,
+                                               PTE_WRITABLE | PTE_CACHE_DISABLE | PTE_WRITE_THROUGH | PTE_NO_EXECUTE);
+    if (lapic == NULL) {
+        return;
+    }
+    lapic_write(LAPIC_SPURIOUS, LAPIC_SOFTWARE_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    cpu_apic_ids[cpu_id()] = lapic_id();
+    cpu_online_mask |= 1ULL << cpu_id();
+}
+
+uint8_t lapic_ready(void) {
+    return lapic != NULL;
+}
+
+uint32_t lapic_id(void) {
+    if (lapic == NULL) {
+        return 0;
+    }
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    if (lapic == NULL) {
+        return;
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, vector);     // fixed delivery, physical destination
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+}
+
+void lapic_eoi(void) {
+    if (lapic != NULL) {
+        lapic_write(LAPIC_EOI, 0);
+    }
+}
@@ -0,0 +1,628 @@
+#include "ata.h"
+#include "constants.h"
+#include "cpu.h"
+#include "idt.h"
+#include "irq.h"
+#include "memory.h"
+#include "pci.h"
+#include "pmm.h"
+#include "ports.h"
+#include "vga.h"
+
+extern void irq14(void);
+extern void irq15(void);
+
+typedef struct {
+    uint16_t io;                    // task file base
+    uint16_t ctrl;                  // device control and alternate status
+    uint16_t bm;                    // bus master registers, 0 when the channel cannot do DMA
+    uint8_t irq;                    // 14 or 15, 0 when it is not wired to a stub
+    uint8_t irq_ready;              // ata_enable_irq routed the IRQ here
+    volatile uint8_t done;          // the IRQ handler saw the DMA command finish
+    volatile uint64_t irq_tsc;      // TSC when the IRQ handler was entered
+    AtaPrd* prdt;                   // one page below 4 GiB
+    uint64_t prdt_phys;
+    uint8_t* bounce;                // for buffers the engine cannot reach and for PIO blocks
+    uint64_t bounce_phys;
+} AtaChannel;
+
+typedef struct {
+    BlockDev dev;
+    AtaChannel* channel;
+    uint8_t slave;
+    uint8_t lba48;
+    uint8_t dma;                    // the drive and its channel do DMA
+    uint16_t multiple;              // sectors per READ/WRITE MULTIPLE block, 0 for one sector commands
+    char model[41];
+} AtaDrive;
+
+AtaStats ata_stats;
+
+static AtaChannel channels[2];
+static AtaDrive drives[4];
+static uint32_t drive_count;
+
+// Cleared by the benchmark to time the PIO path on the same drive
+static uint8_t dma_allowed = 1;
+
+static AtaDrive* drive_of(BlockDev* dev) {
+    return (AtaDrive*)dev->private_data;
+}
+
+// Reading the alternate status four times gives the drive the 400ns it needs after a select
+static void settle(AtaChannel* ch) {
+    for (uint32_t i = 0; i < 4; i++) {
+        inportb(ch->ctrl);
+    }
+}
+
+// Status once BSY clears, with ATA_STATUS_ERR set on a timeout
+static uint8_t wait_ready(AtaChannel* ch) {
+    for (uint32_t i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t status = inportb(ch->ctrl);
+        if (!(status & ATA_STATUS_BSY)) {
+            return status;
+        }
+    }
+    return ATA_STATUS_ERR;
+}
+
+// Wait for the drive to want the next block, 0 on an error or timeout
+static uint8_t wait_drq(AtaChannel* ch) {
+    for (uint32_t i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t status = inportb(ch->ctrl);
+        if (status & ATA_STATUS_BSY) {
+            continue;
+        }
+        if (status & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+            return 0;
+        }
+        if (status & ATA_STATUS_DRQ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Load the task file and start 'command' on the drive. LBA48 registers are
+// only written when the range needs them.
+static void issue(AtaDrive* d, uint64_t lba, uint32_t count, uint8_t command, uint8_t lba48) {
+    AtaChannel* ch = d->channel;
+    outportb(ch->io + ATA_REG_DRIVE, ATA_DRIVE_LBA | (d->slave ? ATA_DRIVE_SLAVE : 0) | (lba48 ? 0 : (lba >> 24) & 0x0F));
+    settle(ch);
+    if (lba48) {
+        outportb(ch->io + ATA_REG_SECCOUNT, count >> 8);
+        outportb(ch->io + ATA_REG_LBA_LOW, lba >> 24);
+        outportb(ch->io + ATA_REG_LBA_MID, lba >> 32);
+        outportb(ch->io + ATA_REG_LBA_HIGH, lba >> 40);
+    }
+    outportb(ch->io + ATA_REG_SECCOUNT, count);
+    outportb(ch->io + ATA_REG_LBA_LOW, lba);
+    outportb(ch->io + ATA_REG_LBA_MID, lba >> 8);
+    outportb(ch->io + ATA_REG_LBA_HIGH, lba >> 16);
+    outportb(ch->io + ATA_REG_COMMAND, command);
+}
+
+// PIO with READ/WRITE MULTIPLE: the drive asks for one block of 'multiple'
+// sectors at a time and the CPU moves every word through the data port.
+// Interrupts are off at the drive, DRQ is polled.
+static uint8_t pio_command(AtaDrive* d, uint64_t lba, uint32_t count, IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, uint8_t write) {
+    AtaChannel* ch = d->channel;
+    uint8_t lba48 = lba + count > ATA_LBA28_LIMIT;
+    uint8_t command;
+    if (d->multiple != 0) {
+        command = write ? (lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE) : (lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE);
+    }
+    else {
+        command = write ? (lba48 ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS) : (lba48 ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS);
+    }
+    uint32_t block = d->multiple != 0 ? d->multiple : 1;
+
+    outportb(ch->ctrl, ATA_CTRL_NIEN);
+    if (wait_ready(ch) & ATA_STATUS_ERR) {
+        return 0;
+    }
+    issue(d, lba, count, command, lba48);
+    ata_stats.pio_commands++;
+
+    for (uint32_t done = 0; done < count; done += block) {
+        uint32_t sectors = count - done < block ? count - done : block;
+        size_t bytes = (size_t)sectors * ATA_SECTOR_SIZE;
+
+        uint64_t start = read_tsc();
+        uint8_t ready = wait_drq(ch);
+        ata_stats.wait_cycles += read_tsc() - start;
+        if (!ready) {
+            return 0;
+        }
+        if (write) {
+            iov_copy(iov, iov_count, index, offset, ch->bounce, bytes, 0);
+            outportsw(ch->io + ATA_REG_DATA, ch->bounce, bytes / 2);
+        }
+        else {
+            inportsw(ch->io + ATA_REG_DATA, ch->bounce, bytes / 2);
+            iov_copy(iov, iov_count, index, offset, ch->bounce, bytes, 1);
+        }
+    }
+    uint64_t start = read_tsc();
+    uint8_t status = wait_ready(ch);
+    ata_stats.wait_cycles += read_tsc() - start;
+    return !(status & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
+
+// Describe 'bytes' of the list at (*index, *offset) in the channel's PRD
+// table and advance. 0 when a piece is out of the engine's reach: above
+// 4 GiB, on an odd address or of odd length, or too scattered for one table.
+static uint8_t build_prdt(AtaChannel* ch, IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, size_t bytes) {
+    uint32_t i = *index;
+    size_t o = *offset;
+    uint32_t entries = 0;
+    uint32_t length = 0;                // of the entry being built
+
+    while (bytes > 0) {
+        if (i >= iov_count) {
+            return 0;
+        }
+        if (o == iov[i].length) {
+            i++;
+            o = 0;
+            continue;
+        }
+        size_t take = iov[i].length - o < bytes ? iov[i].length - o : bytes;
+        // Translated page by page, consecutive frames join one entry
+        uint64_t phys = virt_to_phys((uint8_t*)iov[i].base + o);
+        uint64_t in_page = PAGE_SIZE - (phys & (PAGE_SIZE - 1));
+        if (take > in_page) {
+            take = in_page;
+        }
+        if ((phys & 1) || (take & 1) || phys + take > 0x100000000ULL) {
+            return 0;
+        }
+
+        uint64_t end = entries > 0 ? ch->prdt[entries - 1].phys + (uint64_t)length : 0;
+        if (entries > 0 && end == phys && (phys & (ATA_PRD_BOUNDARY - 1)) != 0) {
+            // Same 64 KiB window as the entry before, which it continues
+            length += take;
+        }
+        else {
+            if (entries == ATA_PRD_MAX) {
+                return 0;
+            }
+            if (entries > 0) {
+                ch->prdt[entries - 1].bytes = (uint16_t)length;
+            }
+            ch->prdt[entries].phys = (uint32_t)phys;
+            ch->prdt[entries].flags = 0;
+            entries++;
+            length = take;
+        }
+        o += take;
+        bytes -= take;
+    }
+    if (o == iov[i].length) {
+        i++;
+        o = 0;
+    }
+    ch->prdt[entries - 1].bytes = (uint16_t)length;
+    ch->prdt[entries - 1].flags = ATA_PRD_EOT;
+    *index = i;
+    *offset = o;
+    return 1;
+}
+
+// The bounce buffer as the PRD table, in 64 KiB entries
+static void bounce_prdt(AtaChannel* ch, size_t bytes) {
+    uint32_t entries = 0;
+    for (size_t done = 0; done < bytes; done += ATA_PRD_BOUNDARY) {
+        size_t length = bytes - done < ATA_PRD_BOUNDARY ? bytes - done : ATA_PRD_BOUNDARY;
+        ch->prdt[entries].phys = (uint32_t)(ch->bounce_phys + done);
+        ch->prdt[entries].bytes = (uint16_t)length;
+        ch->prdt[entries].flags = 0;
+        entries++;
+    }
+    ch->prdt[entries - 1].flags = ATA_PRD_EOT;
+}
+
+// Wait for the bus master engine to finish. With interrupts on the CPU halts
+// until IRQ14/15 arrives, as for shell commands, which the idle loop runs.
+// Interrupt handlers run with interrupts off and boot runs before the IDT is
+// loaded, there the status register's IRQ bit is polled.
+static uint8_t wait_dma(AtaChannel* ch) {
+    uint64_t start = read_tsc();
+    if (ch->irq_ready && interrupts_enabled()) {
+        // sti takes effect after the next instruction, so the IRQ cannot slip in before the hlt
+        asm volatile("cli");
+        while (!ch->done) {
+            // Halted until the handler runs, another interrupt's wakeup counts up to the hlt's end
+            uint64_t halt = read_tsc();
+            ch->irq_tsc = 0;
+            asm volatile("sti\n\thlt\n\tcli");
+            ata_stats.halted_cycles += (ch->irq_tsc != 0 ? ch->irq_tsc : read_tsc()) - halt;
+        }
+        asm volatile("sti");
+        ata_stats.irq_completions++;
+    }
+    else {
+        uint32_t i = 0;
+        while (!(inportb(ch->bm + BM_STATUS) & (BM_STATUS_IRQ | BM_STATUS_ERROR))) {
+            if (++i == ATA_TIMEOUT) {
+                return 0;
+            }
+            asm volatile("pause");
+        }
+        ata_stats.polled_completions++;
+    }
+    ata_stats.wait_cycles += read_tsc() - start;
+    return 1;
+}
+
+// One READ/WRITE DMA command of 'count' sectors. The drive transfers straight
+// to or from the caller's buffers when the PRD table can describe them, the
+// CPU does not touch the data. Otherwise the data goes through the bounce buffer.
+static uint8_t dma_command(AtaDrive* d, uint64_t lba, uint32_t count, IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, uint8_t write) {
+    AtaChannel* ch = d->channel;
+    size_t bytes = (size_t)count * ATA_SECTOR_SIZE;
+    // A failed build leaves the list position where it was
+    uint8_t bounced = !build_prdt(ch, iov, iov_count, index, offset, bytes);
+    if (bounced) {
+        ata_stats.bounced++;
+        bounce_prdt(ch, bytes);
+        if (write) {
+            iov_copy(iov, iov_count, index, offset, ch->bounce, bytes, 0);
+        }
+    }
+
+    if (wait_ready(ch) & ATA_STATUS_ERR) {
+        return 0;
+    }
+    uint8_t lba48 = lba + count > ATA_LBA28_LIMIT;
+    uint8_t direction = write ? 0 : BM_CMD_READ;
+    outportb(ch->bm + BM_COMMAND, 0);
+    outportl(ch->bm + BM_PRDT, (uint32_t)ch->prdt_phys);
+    outportb(ch->bm + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERROR);
+    outportb(ch->bm + BM_COMMAND, direction);
+    ch->done = 0;
+    // The bus master IRQ bit follows INTRQ, polling needs it raised too
+    outportb(ch->ctrl, 0);
+    issue(d, lba, count, write ? (lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA) : (lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA), lba48);
+    outportb(ch->bm + BM_COMMAND, direction | BM_CMD_START);
+    ata_stats.dma_commands++;
+
+    uint8_t finished = wait_dma(ch);
+    outportb(ch->bm + BM_COMMAND, 0);
+    uint8_t bm_status = inportb(ch->bm + BM_STATUS);
+    // Reading the status register drops INTRQ
+    uint8_t status = inportb(ch->io + ATA_REG_STATUS);
+    outportb(ch->bm + BM_STATUS, BM_STATUS_IRQ | BM_STATUS_ERROR);
+    if (!finished || (bm_status & BM_STATUS_ERROR) || (status & (ATA_STATUS_ERR | ATA_STATUS_DF))) {
+        return 0;
+    }
+    if (bounced && !write) {
+        iov_copy(iov, iov_count, index, offset, ch->bounce, bytes, 1);
+    }
+    return 1;
+}
+
+// Split a request into commands of at most ATA_MAX_SECTORS
+static uint8_t transfer(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count, uint8_t write) {
+    AtaDrive* d = drive_of(dev);
+    uint32_t count = iov_length(iov, iov_count) / ATA_SECTOR_SIZE;
+    uint32_t index = 0;
+    size_t offset = 0;
+    uint64_t start = read_tsc();
+    uint8_t ok = 1;
+
+    while (count > 0 && ok) {
+        uint32_t n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        if (d->dma && dma_allowed) {
+            ok = dma_command(d, sector, n, iov, iov_count, &index, &offset, write);
+        }
+        else {
+            ok = pio_command(d, sector, n, iov, iov_count, &index, &offset, write);
+        }
+        if (ok) {
+            ata_stats.sectors += n;
+        }
+        sector += n;
+        count -= n;
+    }
+    if (!ok) {
+        ata_stats.errors++;
+    }
+    ata_stats.cycles += read_tsc() - start;
+    return ok;
+}
+
+static uint8_t ata_read(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    IoVec iov = { buffer, (size_t)count * ATA_SECTOR_SIZE };
+    return transfer(dev, sector, &iov, 1, 0);
+}
+
+static uint8_t ata_write(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    IoVec iov = { buffer, (size_t)count * ATA_SECTOR_SIZE };
+    return transfer(dev, sector, &iov, 1, 1);
+}
+
+static uint8_t ata_readv(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    return transfer(dev, sector, iov, iov_count, 0);
+}
+
+static uint8_t ata_writev(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    return transfer(dev, sector, iov, iov_count, 1);
+}
+
+// Empty the drive's write cache
+static uint8_t ata_flush(BlockDev* dev) {
+    AtaDrive* d = drive_of(dev);
+    AtaChannel* ch = d->channel;
+    outportb(ch->ctrl, ATA_CTRL_NIEN);
+    if (wait_ready(ch) & ATA_STATUS_ERR) {
+        return 0;
+    }
+    issue(d, 0, 0, d->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE, 0);
+    return !(wait_ready(ch) & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
+
+static BlockDevOps ata_ops = {
+    .read = ata_read,
+    .write = ata_write,
+    .flush = ata_flush,
+    .readv = ata_readv,
+    .writev = ata_writev,
+    .direct = NULL,
+};
+
+static void channel_irq(AtaChannel* ch) {
+    ch->irq_tsc = read_tsc();
+    // Only a DMA command that finished counts, a late IRQ of a polled one finds the bit cleared
+    if (ch->bm != 0 && (inportb(ch->bm + BM_STATUS) & BM_STATUS_IRQ)) {
+        ch->done = 1;
+    }
+    inportb(ch->io + ATA_REG_STATUS);
+    outportb(PIC_SLAVE_CMD, PIC_EOI);
+    outportb(PIC_MASTER_CMD, PIC_EOI);
+}
+
+void ata_primary_irq(void) {
+    channel_irq(&channels[0]);
+}
+
+void ata_secondary_irq(void) {
+    channel_irq(&channels[1]);
+}
+
+// IDENTIFY DEVICE into 'id', 0 when there is no ATA disk at the position.
+// ATAPI and SATA devices abort the command and leave their signature in the LBA registers.
+static uint8_t identify(AtaChannel* ch, uint8_t slave, uint16_t* id) {
+    outportb(ch->ctrl, ATA_CTRL_NIEN);
+    outportb(ch->io + ATA_REG_DRIVE, ATA_DRIVE_LBA | (slave ? ATA_DRIVE_SLAVE : 0));
+    settle(ch);
+    outportb(ch->io + ATA_REG_SECCOUNT, 0);
+    outportb(ch->io + ATA_REG_LBA_LOW, 0);
+    outportb(ch->io + ATA_REG_LBA_MID, 0);
+    outportb(ch->io + ATA_REG_LBA_HIGH, 0);
+    outportb(ch->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+
+    // Nothing drives a floating bus, it reads all ones
+    uint8_t status = inportb(ch->io + ATA_REG_STATUS);
+    if (status == 0 || status == 0xFF) {
+        return 0;
+    }
+    if (wait_ready(ch) & ATA_STATUS_ERR) {
+        return 0;
+    }
+    if (inportb(ch->io + ATA_REG_LBA_MID) != 0 || inportb(ch->io + ATA_REG_LBA_HIGH) != 0) {
+        return 0;
+    }
+    if (!wait_drq(ch)) {
+        return 0;
+    }
+    inportsw(ch->io + ATA_REG_DATA, id, 256);
+    return 1;
+}
+
+// Largest block READ/WRITE MULTIPLE may use, set on the drive. 0 when the drive has none.
+static uint16_t set_multiple(AtaDrive* d, uint16_t* id) {
+    uint16_t multiple = id[ATA_ID_MULTIPLE] & 0xFF;
+    if (multiple == 0) {
+        return 0;
+    }
+    AtaChannel* ch = d->channel;
+    issue(d, 0, multiple, ATA_CMD_SET_MULTIPLE, 0);
+    if (wait_ready(d->channel) & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+        inportb(ch->io + ATA_REG_ERROR);
+        return 0;
+    }
+    return multiple;
+}
+
+static void add_drive(AtaChannel* ch, uint8_t slave) {
+    uint16_t id[256];
+    if (drive_count == sizeof(drives) / sizeof(drives[0]) || !identify(ch, slave, id)) {
+        return;
+    }
+
+    AtaDrive* d = &drives[drive_count];
+    d->channel = ch;
+    d->slave = slave;
+    d->lba48 = (id[ATA_ID_COMMAND_SETS] & (1 << 10)) != 0;
+    if (d->lba48) {
+        d->dev.sector_count = id[ATA_ID_LBA48_SECTORS] | ((uint64_t)id[ATA_ID_LBA48_SECTORS + 1] << 16) | ((uint64_t)id[ATA_ID_LBA48_SECTORS + 2] << 32) | ((uint64_t)id[ATA_ID_LBA48_SECTORS + 3] << 48);
+    }
+    else {
+        d->dev.sector_count = id[ATA_ID_LBA28_SECTORS] | ((uint32_t)id[ATA_ID_LBA28_SECTORS + 1] << 16);
+    }
+    if (d->dev.sector_count == 0) {
+        return;
+    }
+    d->dma = ch->bm != 0 && (id[ATA_ID_CAPABILITIES] & (1 << 8));
+    d->multiple = set_multiple(d, id);
+    for (uint32_t i = 0; i < 20; i++) {
+        d->model[i * 2] = id[ATA_ID_MODEL + i] >> 8;
+        d->model[i * 2 + 1] = id[ATA_ID_MODEL + i] & 0xFF;
+    }
+    for (int32_t i = 39; i >= 0 && d->model[i] == ' '; i--) {
+        d->model[i] = '\0';
+    }
+
+    memCpy(d->dev.name, "ata0", 5);
+    d->dev.name[3] = '0' + drive_count;
+    d->dev.sector_size = ATA_SECTOR_SIZE;
+    d->dev.ops = &ata_ops;
+    d->dev.private_data = d;
+    blockdev_register(&d->dev);
+    drive_count++;
+
+    print_str("ATA disk ");
+    print_str(d->dev.name);
+    print_str(": ");
+    print_str(d->model);
+    print_str(", ");
+    print_uint((d->dev.sector_count * ATA_SECTOR_SIZE) >> 20);
+    print_str(" MiB, ");
+    print_str(d->dma ? "DMA" : "PIO");
+    print_str(", multiple ");
+    print_uint(d->multiple);
+    print_str("\n");
+}
+
+// PRD table and bounce buffer of a channel, both where 32-bit DMA reaches
+static uint8_t channel_dma_memory(AtaChannel* ch) {
+    uint64_t bounce_size = (uint64_t)PAGE_SIZE << ATA_BOUNCE_ORDER;
+    ch->prdt_phys = pmm_alloc(0);
+    ch->bounce_phys = pmm_alloc(ATA_BOUNCE_ORDER);
+    if (ch->prdt_phys == 0 || ch->bounce_phys == 0 || ch->prdt_phys + PAGE_SIZE > 0x100000000ULL || ch->bounce_phys + bounce_size > 0x100000000ULL) {
+        return 0;
+    }
+    ch->prdt = phys_to_virt(ch->prdt_phys);
+    ch->bounce = phys_to_virt(ch->bounce_phys);
+    return 1;
+}
+
+void ata_init(void) {
+    PciDevice pci;
+    uint8_t found = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0, &pci);
+    uint16_t bm = 0;
+    if (found) {
+        // Prog IF bit 7: the function has a bus master engine, BAR4 holds its ports
+        if (pci.prog_if & 0x80) {
+            bm = pci_bar(&pci, 4);
+        }
+        pci_enable(&pci, PCI_COMMAND_IO | (bm != 0 ? PCI_COMMAND_BUS_MASTER : 0));
+    }
+
+    for (uint32_t c = 0; c < 2; c++) {
+        AtaChannel* ch = &channels[c];
+        // Prog IF bits 0 and 2: the channel runs in native mode at the ports of BAR0/1 or BAR2/3
+        if (found && (pci.prog_if & (1 << (c * 2)))) {
+            ch->io = pci_bar(&pci, c * 2);
+            ch->ctrl = pci_bar(&pci, c * 2 + 1) + 2;
+            ch->irq = 0;
+        }
+        else {
+            ch->io = c == 0 ? ATA_PRIMARY_IO : ATA_SECONDARY_IO;
+            ch->ctrl = c == 0 ? ATA_PRIMARY_CTRL : ATA_SECONDARY_CTRL;
+            ch->irq = c == 0 ? ATA_PRIMARY_IRQ : ATA_SECONDARY_IRQ;
+        }
+        ch->bm = bm != 0 ? bm + c * BM_CHANNEL_STRIDE : 0;
+
+        // The bounce buffer also holds PIO blocks, a channel without it has no drives
+        if (!channel_dma_memory(ch)) {
+            print_str("ATA: no memory for channel buffers\n");
+            continue;
+        }
+        add_drive(ch, 0);
+        add_drive(ch, 1);
+    }
+}
+
+void ata_enable_irq(void) {
+    idt_set_gate(IRQ14_VECTOR, irq14);
+    idt_set_gate(IRQ15_VECTOR, irq15);
+    for (uint32_t i = 0; i < drive_count; i++) {
+        AtaChannel* ch = drives[i].channel;
+        if (ch->irq != 0 && !ch->irq_ready) {
+            ch->irq_ready = 1;
+            clear_mask_IRQ(ch->irq);
+        }
+    }
+}
+
+// Cycles per MiB for reads of 'request' bytes over the first ATA_BENCH_BYTES of the drive
+static void bench_mode(AtaDrive* d, uint8_t* buffer, uint32_t request, uint8_t dma) {
+    dma_allowed = dma;
+    AtaStats before = ata_stats;
+    uint32_t sectors = request / ATA_SECTOR_SIZE;
+    uint64_t total = ATA_BENCH_BYTES / ATA_SECTOR_SIZE;
+    if (total > d->dev.sector_count) {
+        total = d->dev.sector_count;
+    }
+    for (uint64_t sector = 0; sector + sectors <= total; sector += sectors) {
+        if (!ata_read(&d->dev, sector, sectors, buffer)) {
+            print_str("read error\n");
+            break;
+        }
+    }
+    dma_allowed = 1;
+
+    uint64_t mib = (total * ATA_SECTOR_SIZE) >> 20;
+    uint64_t cycles = ata_stats.cycles - before.cycles;
+    uint64_t halted = ata_stats.halted_cycles - before.halted_cycles;
+    print_uint(request >> 10);
+    print_str(" KiB\t");
+    print_str(dma ? "DMA\t" : "PIO\t");
+    print_uint(mib != 0 ? cycles / mib : 0);
+    print_str("\t");
+    print_uint(mib != 0 ? (cycles - halted) / mib : 0);
+    print_str("\n");
+}
+
+void ata_benchmark(void) {
+    AtaDrive* d = NULL;
+    for (uint32_t i = 0; i < drive_count && d == NULL; i++) {
+        if (drives[i].dma) {
+            d = &drives[i];
+        }
+    }
+    if (d == NULL) {
+        print_str("\nNo ATA disk with DMA\n");
+        return;
+    }
+    uint64_t phys = pmm_alloc(ATA_BOUNCE_ORDER);
+    if (phys == 0) {
+        print_str("\nNot enough memory for the ATA benchmark\n");
+        return;
+    }
+
+    // The cycles spent halted until the completion interrupt are what IRQ
+    // completion gives back to the CPU, polling and PIO transfers keep it busy
+    print_str("\nReads of the first ");
+    print_uint(ATA_BENCH_BYTES >> 20);
+    print_str(" MiB of ");
+    print_str(d->dev.name);
+    print_str(", cycles per MiB\nrequest\tmode\ttotal\t\tcpu (total - halted waiting for the drive)\n");
+    static const uint32_t requests[] = { 4096, 65536, 131072 };
+    for (uint32_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        bench_mode(d, phys_to_virt(phys), requests[i], 1);
+        bench_mode(d, phys_to_virt(phys), requests[i], 0);
+    }
+    pmm_free(phys, ATA_BOUNCE_ORDER);
+}
+
+void ata_print_stats(void) {
+    print_str("ATA: dma commands: ");
+    print_uint(ata_stats.dma_commands);
+    print_str(" pio commands: ");
+    print_uint(ata_stats.pio_commands);
+    print_str(" sectors: ");
+    print_uint(ata_stats.sectors);
+    print_str(" bounced: ");
+    print_uint(ata_stats.bounced);
+    print_str(" irq completions: ");
+    print_uint(ata_stats.irq_completions);
+    print_str(" polled: ");
+    print_uint(ata_stats.polled_completions);
+    print_str(" errors: ");
+    print_uint(ata_stats.errors);
+    print_str("\n");
+}
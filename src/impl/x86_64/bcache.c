@@ -0,0 +1,601 @@
+#include "bcache.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "vga.h"
+
+static Buffer* buffers;
+static Buffer* hash_table[BCACHE_HASH_SIZE];
+static uint32_t clock_hand;
+static BcacheStats stats;
+static uint32_t journal_count;      // buffers with BUF_JOURNAL
+static Spinlock bcache_lock = SPINLOCK_INIT;   // hash chains, refcounts, flags and the clock hand
+
+// Device I/O never runs under bcache_lock. The buffer it is for is pinned and
+// BUF_BUSY for the duration, lookups wait for it to finish.
+
+static uint32_t hash(BlockDev* dev, uint64_t sector) {
+    uint64_t key = sector ^ ((uint64_t)dev >> 4);
+    key ^= key >> 17;
+    return (uint32_t)(key * 0x9E3779B1u) & (BCACHE_HASH_SIZE - 1);
+}
+
+static Buffer* lookup(BlockDev* dev, uint64_t sector) {
+    for (Buffer* buf = hash_table[hash(dev, sector)]; buf != NULL; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->sector == sector) {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void unhash(Buffer* buf) {
+    Buffer** link = &hash_table[hash(buf->dev, buf->sector)];
+    while (*link != buf) {
+        link = &(*link)->hash_next;
+    }
+    *link = buf->hash_next;
+    buf->hash_next = NULL;
+}
+
+// A buffer read ahead leaves the cache, count it when it was never used
+static void drop(Buffer* buf) {
+    if (buf->flags & BUF_READAHEAD) {
+        stats.readahead_wasted++;
+        buf->flags &= ~BUF_READAHEAD;
+    }
+    unhash(buf);
+    buf->dev = NULL;
+}
+
+// Drop the lock until the I/O on 'buf' finished. The buffer may have been
+// dropped or reused meanwhile, callers look it up again.
+static uint64_t wait_busy(Buffer* buf, uint64_t flags) {
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    while (__atomic_load_n(&buf->flags, __ATOMIC_ACQUIRE) & BUF_BUSY) {
+        asm volatile("pause");
+    }
+    return spin_lock_irqsave(&bcache_lock);
+}
+
+// Claim a dirty buffer for writing: it stays pinned and busy until end_write.
+// A holder changing it meanwhile marks it dirty again.
+static void begin_write(Buffer* buf) {
+    buf->flags = (buf->flags & ~BUF_DIRTY) | BUF_BUSY;
+    buf->refcount++;
+    stats.writebacks++;
+}
+
+static void end_write(Buffer* buf, uint8_t ok) {
+    buf->flags &= ~BUF_BUSY;
+    if (!ok) {
+        buf->flags |= BUF_DIRTY;
+    }
+    buf->refcount--;
+}
+
+// CLOCK: sweep the buffers, giving each referenced one a second chance.
+// Two full turns find a candidate unless every buffer is pinned or waiting for the log.
+static Buffer* find_victim(void) {
+    for (uint32_t i = 0; i < 2 * BCACHE_BUFFERS; i++) {
+        Buffer* buf = &buffers[clock_hand];
+        clock_hand = (clock_hand + 1) % BCACHE_BUFFERS;
+
+        if (buf->refcount > 0 || (buf->flags & BUF_JOURNAL)) {
+            continue;
+        }
+        if (buf->dev == NULL) {
+            return buf;
+        }
+        if (buf->flags & BUF_REFERENCED) {
+            buf->flags &= ~BUF_REFERENCED;
+            continue;
+        }
+        return buf;
+    }
+    return NULL;
+}
+
+// An unused buffer to reuse, NULL when every buffer is pinned or waiting for
+// the log or a write back failed. A dirty candidate is written with the lock
+// dropped and the sweep goes on, '*unlocked' then tells the caller the cache
+// may have changed meanwhile.
+static Buffer* take_victim(uint64_t* flags, uint8_t* unlocked) {
+    *unlocked = 0;
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        Buffer* buf = find_victim();
+        if (buf == NULL || buf->dev == NULL) {
+            return buf;
+        }
+        // A direct buffer is the device memory, the write already happened
+        if ((buf->flags & (BUF_DIRTY | BUF_DIRECT)) != BUF_DIRTY) {
+            stats.evictions++;
+            drop(buf);
+            return buf;
+        }
+        begin_write(buf);
+        spin_unlock_irqrestore(&bcache_lock, *flags);
+        uint8_t ok = blockdev_write(buf->dev, buf->sector, 1, buf->data);
+        *flags = spin_lock_irqsave(&bcache_lock);
+        end_write(buf, ok);
+        *unlocked = 1;
+        if (!ok) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Give a free slot the data it needs for 'dev', a pointer into the device when it has one
+static uint8_t attach(Buffer* buf, BlockDev* dev, uint64_t sector) {
+    char* direct = dev->cache_copies ? NULL : blockdev_direct(dev, sector);
+
+    if (buf->flags & BUF_DIRECT) {
+        buf->data = NULL;
+        buf->size = 0;
+    }
+    buf->flags = 0;
+
+    if (direct != NULL) {
+        kfree(buf->data);
+        buf->data = direct;
+        buf->size = 0;
+        buf->flags = BUF_DIRECT | BUF_VALID;
+        return 1;
+    }
+    if (buf->size != dev->sector_size) {
+        kfree(buf->data);
+        buf->data = kmalloc(dev->sector_size);
+        buf->size = buf->data != NULL ? dev->sector_size : 0;
+    }
+    return buf->data != NULL;
+}
+
+// Take a reference on a cached buffer. The first use of a buffer read ahead
+// is a readahead hit and does not earn it a second chance: a streaming reader
+// is done with it, and the clock should take it before the unread window.
+static void pin(Buffer* buf) {
+    stats.hits++;
+    buf->refcount++;
+    if (buf->flags & BUF_READAHEAD) {
+        stats.readahead_hits++;
+        buf->flags &= ~BUF_READAHEAD;
+        return;
+    }
+    buf->flags |= BUF_REFERENCED;
+}
+
+static void hash_insert(Buffer* buf, BlockDev* dev, uint64_t sector) {
+    buf->dev = dev;
+    buf->sector = sector;
+    uint32_t bucket = hash(dev, sector);
+    buf->hash_next = hash_table[bucket];
+    hash_table[bucket] = buf;
+}
+
+static Buffer* get(BlockDev* dev, uint64_t sector, uint8_t read) {
+    if (buffers == NULL || dev == NULL || sector >= dev->sector_count) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    Buffer* buf;
+    while (1) {
+        buf = lookup(dev, sector);
+        // Being read in or written back by someone else
+        if (buf != NULL && (buf->flags & BUF_BUSY)) {
+            flags = wait_busy(buf, flags);
+            continue;
+        }
+        if (buf != NULL) {
+            pin(buf);
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            return buf;
+        }
+
+        uint8_t unlocked;
+        buf = take_victim(&flags, &unlocked);
+        if (buf == NULL) {
+            spin_unlock_irqrestore(&bcache_lock, flags);
+            return NULL;
+        }
+        // Another caller may have brought the sector in while a victim was written
+        if (!unlocked || lookup(dev, sector) == NULL) {
+            break;
+        }
+    }
+
+    stats.misses++;
+    if (!attach(buf, dev, sector)) {
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        return NULL;
+    }
+    hash_insert(buf, dev, sector);
+    buf->refcount = 1;
+    buf->flags |= BUF_REFERENCED;
+    if (buf->flags & BUF_VALID) {
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        return buf;
+    }
+
+    // Lookups of the sector wait until the data is in
+    buf->flags |= BUF_BUSY;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    uint8_t ok = !read || blockdev_read(dev, sector, 1, buf->data);
+
+    flags = spin_lock_irqsave(&bcache_lock);
+    buf->flags &= ~BUF_BUSY;
+    if (ok) {
+        buf->flags |= BUF_VALID;
+    }
+    else {
+        unhash(buf);
+        buf->dev = NULL;
+        buf->refcount = 0;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    return ok ? buf : NULL;
+}
+
+void bcache_init(void) {
+    buffers = kzalloc(BCACHE_BUFFERS * sizeof(Buffer));
+    if (buffers == NULL) {
+        print_str("Buffer cache: out of memory\n");
+    }
+}
+
+Buffer* bcache_get(BlockDev* dev, uint64_t sector) {
+    return get(dev, sector, 1);
+}
+
+Buffer* bcache_get_noread(BlockDev* dev, uint64_t sector) {
+    return get(dev, sector, 0);
+}
+
+Buffer* bcache_peek(BlockDev* dev, uint64_t sector) {
+    if (buffers == NULL) {
+        return NULL;
+    }
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    Buffer* buf = lookup(dev, sector);
+    // A buffer with I/O in flight counts as a miss, peek never waits
+    if (buf != NULL && (buf->flags & (BUF_VALID | BUF_BUSY)) == BUF_VALID) {
+        pin(buf);
+    }
+    else {
+        buf = NULL;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    return buf;
+}
+
+// Read one stretch of sectors that were all missing into the pinned buffers 'bufs'
+static void readahead_fill(BlockDev* dev, Buffer** bufs, IoVec* iov, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        iov[i].base = bufs[i]->data;
+        iov[i].length = dev->sector_size;
+    }
+    uint8_t ok = blockdev_readv(dev, bufs[0]->sector, iov, count);
+
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        bufs[i]->refcount--;
+        bufs[i]->flags &= ~BUF_BUSY;
+        if (ok) {
+            bufs[i]->flags |= BUF_VALID | BUF_READAHEAD;
+        }
+        else {
+            unhash(bufs[i]);
+            bufs[i]->dev = NULL;
+        }
+    }
+    if (ok) {
+        stats.readahead += count;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+uint32_t bcache_readahead(BlockDev* dev, uint64_t sector, uint32_t count) {
+    if (buffers == NULL || dev == NULL || sector >= dev->sector_count || (!dev->cache_copies && blockdev_direct(dev, sector) != NULL)) {
+        return 0;
+    }
+    if (count > BCACHE_READAHEAD_MAX) {
+        count = BCACHE_READAHEAD_MAX;
+    }
+    if (count > dev->sector_count - sector) {
+        count = dev->sector_count - sector;
+    }
+
+    Buffer** bufs = kmalloc(count * sizeof(Buffer*));
+    IoVec* iov = kmalloc(count * sizeof(IoVec));
+    if (bufs == NULL || iov == NULL) {
+        kfree(bufs);
+        kfree(iov);
+        return 0;
+    }
+
+    uint32_t issued = 0;
+    uint32_t pending = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        Buffer* buf = NULL;
+        if (i < count) {
+            uint64_t flags = spin_lock_irqsave(&bcache_lock);
+            if (lookup(dev, sector + i) == NULL) {
+                uint8_t unlocked;
+                buf = take_victim(&flags, &unlocked);
+                if (buf != NULL && (!unlocked || lookup(dev, sector + i) == NULL) && attach(buf, dev, sector + i)) {
+                    // Left unreferenced so an unused buffer is the clock's first pick
+                    hash_insert(buf, dev, sector + i);
+                    buf->refcount = 1;
+                    buf->flags |= BUF_BUSY;
+                }
+                else {
+                    buf = NULL;
+                }
+            }
+            spin_unlock_irqrestore(&bcache_lock, flags);
+        }
+
+        // A cached sector or the end of the range closes the current stretch
+        if (buf == NULL && pending > 0) {
+            readahead_fill(dev, bufs, iov, pending);
+            issued += pending;
+            pending = 0;
+        }
+        if (buf != NULL) {
+            bufs[pending++] = buf;
+        }
+    }
+
+    kfree(bufs);
+    kfree(iov);
+    return issued;
+}
+
+void bcache_mark_dirty(Buffer* buf) {
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    buf->flags |= BUF_DIRTY;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+void bcache_mark_journal(Buffer* buf) {
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    if (!(buf->flags & BUF_JOURNAL)) {
+        journal_count++;
+    }
+    buf->flags |= BUF_DIRTY | BUF_JOURNAL;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+uint32_t bcache_journal_count(void) {
+    return journal_count;
+}
+
+uint32_t bcache_journal_collect(Buffer** out, uint32_t max) {
+    if (buffers == NULL) {
+        return 0;
+    }
+    uint32_t count = 0;
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    for (uint32_t i = 0; i < BCACHE_BUFFERS && count < max; i++) {
+        if (buffers[i].dev != NULL && (buffers[i].flags & BUF_JOURNAL)) {
+            buffers[i].refcount++;
+            out[count++] = &buffers[i];
+        }
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    return count;
+}
+
+void bcache_journal_logged(Buffer** bufs, uint32_t count) {
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        if (bufs[i]->flags & BUF_JOURNAL) {
+            journal_count--;
+        }
+        bufs[i]->flags &= ~BUF_JOURNAL;
+        bufs[i]->refcount--;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+void bcache_put(Buffer* buf) {
+    if (buf == NULL) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    buf->refcount--;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+static uint8_t in_range(Buffer* buf, BlockDev* dev, uint64_t sector, uint64_t count) {
+    return buf->dev == dev && buf->sector >= sector && buf->sector - sector < count;
+}
+
+// Buffers of 'dev' in [sector, sector + count), of every device when 'dev' is NULL
+static uint8_t matches(Buffer* buf, BlockDev* dev, uint64_t sector, uint64_t count) {
+    return buf->dev != NULL && (dev == NULL || in_range(buf, dev, sector, count));
+}
+
+// Wait until no matching buffer has I/O in flight
+static uint64_t wait_range_idle(BlockDev* dev, uint64_t sector, uint64_t count, uint64_t flags) {
+    uint32_t i = 0;
+    while (i < BCACHE_BUFFERS) {
+        Buffer* buf = &buffers[i];
+        if (matches(buf, dev, sector, count) && (buf->flags & BUF_BUSY)) {
+            flags = wait_busy(buf, flags);
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+    return flags;
+}
+
+static uint8_t sorts_before(Buffer* a, Buffer* b) {
+    return a->dev != b->dev ? (uint64_t)a->dev < (uint64_t)b->dev : a->sector < b->sector;
+}
+
+// Write the matching dirty buffers in one pass: claim them all under the lock,
+// sort them by device and sector, then write each run of consecutive sectors
+// as one request with the lock dropped. Writes other callers had in flight
+// are waited for. Buffers waiting for the log are left alone.
+static uint8_t write_dirty(BlockDev* dev, uint64_t sector, uint64_t count) {
+    Buffer** list = kmalloc(BCACHE_BUFFERS * sizeof(Buffer*));
+    IoVec* iov = kmalloc(BCACHE_BUFFERS * sizeof(IoVec));
+    if (list == NULL || iov == NULL) {
+        kfree(list);
+        kfree(iov);
+        return 0;
+    }
+
+    uint32_t claimed = 0;
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        Buffer* buf = &buffers[i];
+        if (!matches(buf, dev, sector, count) || (buf->flags & (BUF_DIRTY | BUF_JOURNAL | BUF_BUSY)) != BUF_DIRTY) {
+            continue;
+        }
+        // A direct buffer is the device memory, the write already happened
+        if (buf->flags & BUF_DIRECT) {
+            buf->flags &= ~BUF_DIRTY;
+            continue;
+        }
+        begin_write(buf);
+        // Insertion sort, the list is at most BCACHE_BUFFERS long
+        uint32_t j = claimed++;
+        while (j > 0 && sorts_before(buf, list[j - 1])) {
+            list[j] = list[j - 1];
+            j--;
+        }
+        list[j] = buf;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    uint8_t ok = 1;
+    uint32_t first = 0;
+    while (first < claimed) {
+        Buffer* head = list[first];
+        uint32_t end = first;
+        while (end < claimed && list[end]->dev == head->dev && list[end]->sector == head->sector + (end - first)) {
+            iov[end - first].base = list[end]->data;
+            iov[end - first].length = head->dev->sector_size;
+            end++;
+        }
+        uint8_t written = blockdev_writev(head->dev, head->sector, iov, end - first);
+
+        flags = spin_lock_irqsave(&bcache_lock);
+        for (uint32_t i = first; i < end; i++) {
+            end_write(list[i], written);
+        }
+        spin_unlock_irqrestore(&bcache_lock, flags);
+        ok &= written;
+        first = end;
+    }
+
+    flags = spin_lock_irqsave(&bcache_lock);
+    flags = wait_range_idle(dev, sector, count, flags);
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    kfree(list);
+    kfree(iov);
+    return ok;
+}
+
+uint8_t bcache_sync(BlockDev* dev) {
+    if (buffers == NULL) {
+        return 1;
+    }
+    uint8_t ok = write_dirty(dev, 0, ~0ULL);
+    if (dev != NULL) {
+        ok &= blockdev_flush(dev);
+    }
+    return ok;
+}
+
+void bcache_invalidate(BlockDev* dev) {
+    if (buffers == NULL) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        Buffer* buf = &buffers[i];
+        if (buf->dev == dev && buf->refcount == 0 && !(buf->flags & BUF_DIRTY)) {
+            drop(buf);
+        }
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+uint8_t bcache_writeback_range(BlockDev* dev, uint64_t sector, uint64_t count) {
+    if (buffers == NULL) {
+        return 1;
+    }
+    return write_dirty(dev, sector, count);
+}
+
+void bcache_invalidate_range(BlockDev* dev, uint64_t sector, uint64_t count) {
+    if (buffers == NULL) {
+        return;
+    }
+    Buffer** reread = kmalloc(BCACHE_BUFFERS * sizeof(Buffer*));
+    uint32_t pinned = 0;
+
+    // A write back still in flight would put the old data over the new
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    flags = wait_range_idle(dev, sector, count, flags);
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        Buffer* buf = &buffers[i];
+        // A direct buffer is the device memory and already holds the new data
+        if (!in_range(buf, dev, sector, count) || (buf->flags & (BUF_DIRECT | BUF_JOURNAL))) {
+            continue;
+        }
+        buf->flags &= ~BUF_DIRTY;
+        if (buf->refcount == 0) {
+            drop(buf);
+        }
+        else if (reread != NULL) {
+            // Someone holds it, it is read again below and lookups wait for that
+            buf->flags |= BUF_BUSY;
+            buf->refcount++;
+            reread[pinned++] = buf;
+        }
+        else {
+            // Out of memory for the list: the old way, under the lock
+            blockdev_read(dev, buf->sector, 1, buf->data);
+        }
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+
+    for (uint32_t i = 0; i < pinned; i++) {
+        blockdev_read(dev, reread[i]->sector, 1, reread[i]->data);
+    }
+    flags = spin_lock_irqsave(&bcache_lock);
+    for (uint32_t i = 0; i < pinned; i++) {
+        reread[i]->flags &= ~BUF_BUSY;
+        reread[i]->refcount--;
+    }
+    spin_unlock_irqrestore(&bcache_lock, flags);
+    kfree(reread);
+}
+
+void bcache_get_stats(BcacheStats* out) {
+    uint64_t flags = spin_lock_irqsave(&bcache_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+void bcache_print_stats(void) {
+    BcacheStats snapshot;
+    bcache_get_stats(&snapshot);
+
+    print_str("Buffer cache: hits: ");
+    print_uint(snapshot.hits);
+    print_str(" misses: ");
+    print_uint(snapshot.misses);
+    print_str(" writebacks: ");
+    print_uint(snapshot.writebacks);
+    print_str(" evictions: ");
+    print_uint(snapshot.evictions);
+    print_str("\n");
+}
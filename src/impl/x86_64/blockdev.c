@@ -0,0 +1,189 @@
+#include "blockdev.h"
+#include "strings.h"
+#include "kmalloc.h"
+#include "memory.h"
+
+static BlockDev* device_list;
+
+void blockdev_register(BlockDev* dev) {
+    dev->sector_shift = 0;
+    while ((1u << dev->sector_shift) < dev->sector_size) {
+        dev->sector_shift++;
+    }
+    dev->next = device_list;
+    device_list = dev;
+}
+
+BlockDev* blockdev_find(char* name) {
+    for (BlockDev* dev = device_list; dev != NULL; dev = dev->next) {
+        if (strEqual(dev->name, name)) {
+            return dev;
+        }
+    }
+    return NULL;
+}
+
+static uint8_t in_range(BlockDev* dev, uint64_t sector, uint32_t count) {
+    return dev != NULL && sector < dev->sector_count && count <= dev->sector_count - sector;
+}
+
+uint8_t blockdev_read(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    if (!in_range(dev, sector, count)) {
+        return 0;
+    }
+    dev->requests++;
+    dev->sectors_moved += count;
+    return dev->ops->read(dev, sector, count, buffer);
+}
+
+uint8_t blockdev_write(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    if (!in_range(dev, sector, count)) {
+        return 0;
+    }
+    dev->requests++;
+    dev->sectors_moved += count;
+    return dev->ops->write(dev, sector, count, buffer);
+}
+
+uint8_t blockdev_flush(BlockDev* dev) {
+    if (dev == NULL || dev->ops->flush == NULL) {
+        return dev != NULL;
+    }
+    return dev->ops->flush(dev);
+}
+
+size_t iov_length(IoVec* iov, uint32_t iov_count) {
+    size_t length = 0;
+    for (uint32_t i = 0; i < iov_count; i++) {
+        length += iov[i].length;
+    }
+    return length;
+}
+
+void iov_copy(IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, void* buffer, size_t length, uint8_t to_iov) {
+    uint8_t* flat = buffer;
+    while (length > 0 && *index < iov_count) {
+        size_t piece = iov[*index].length - *offset;
+        if (piece > length) {
+            piece = length;
+        }
+        uint8_t* base = (uint8_t*)iov[*index].base + *offset;
+        if (to_iov) {
+            memCpy(base, flat, piece);
+        }
+        else {
+            memCpy(flat, base, piece);
+        }
+        flat += piece;
+        length -= piece;
+        *offset += piece;
+        if (*offset == iov[*index].length) {
+            (*index)++;
+            *offset = 0;
+        }
+    }
+}
+
+uint32_t iov_slice(IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, size_t length, IoVec* out) {
+    uint32_t pieces = 0;
+    while (length > 0 && *index < iov_count) {
+        size_t piece = iov[*index].length - *offset;
+        if (piece > length) {
+            piece = length;
+        }
+        if (piece > 0) {
+            out[pieces].base = (uint8_t*)iov[*index].base + *offset;
+            out[pieces].length = piece;
+            pieces++;
+        }
+        length -= piece;
+        *offset += piece;
+        if (*offset == iov[*index].length) {
+            (*index)++;
+            *offset = 0;
+        }
+    }
+    return pieces;
+}
+
+// readv/writev for drivers without them: whole sectors inside a piece go to the
+// driver in place, a sector split between pieces is bounced
+static uint8_t transfer_pieces(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count, uint8_t write) {
+    uint32_t index = 0;
+    size_t offset = 0;
+    uint8_t* bounce = NULL;
+    uint8_t ok = 1;
+
+    while (ok && index < iov_count) {
+        size_t left = iov[index].length - offset;
+        if (left == 0) {
+            index++;
+            offset = 0;
+            continue;
+        }
+
+        if (left >= dev->sector_size) {
+            uint32_t count = left >> dev->sector_shift;
+            uint8_t* base = (uint8_t*)iov[index].base + offset;
+            ok = write ? dev->ops->write(dev, sector, count, base) : dev->ops->read(dev, sector, count, base);
+            dev->requests++;
+            sector += count;
+            offset += (size_t)count << dev->sector_shift;
+            continue;
+        }
+
+        if (bounce == NULL) {
+            bounce = kmalloc(dev->sector_size);
+            if (bounce == NULL) {
+                return 0;
+            }
+        }
+        if (write) {
+            iov_copy(iov, iov_count, &index, &offset, bounce, dev->sector_size, 0);
+            ok = dev->ops->write(dev, sector, 1, bounce);
+        }
+        else {
+            ok = dev->ops->read(dev, sector, 1, bounce);
+            iov_copy(iov, iov_count, &index, &offset, bounce, dev->sector_size, 1);
+        }
+        dev->requests++;
+        sector++;
+    }
+
+    kfree(bounce);
+    return ok;
+}
+
+static uint8_t transfer_vector(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count, uint8_t write) {
+    size_t length = iov_length(iov, iov_count);
+    if (dev == NULL || (length & (dev->sector_size - 1)) != 0) {
+        return 0;
+    }
+    uint64_t count = length >> dev->sector_shift;
+    if (count > 0xFFFFFFFF || !in_range(dev, sector, (uint32_t)count)) {
+        return 0;
+    }
+
+    dev->sectors_moved += count;
+    uint8_t (*vector)(BlockDev*, uint64_t, IoVec*, uint32_t) = write ? dev->ops->writev : dev->ops->readv;
+    if (vector != NULL) {
+        dev->requests++;
+        return vector(dev, sector, iov, iov_count);
+    }
+    return transfer_pieces(dev, sector, iov, iov_count, write);
+}
+
+uint8_t blockdev_readv(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    return transfer_vector(dev, sector, iov, iov_count, 0);
+}
+
+uint8_t blockdev_writev(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    return transfer_vector(dev, sector, iov, iov_count, 1);
+}
+
+void* blockdev_direct(BlockDev* dev, uint64_t sector) {
+    if (!in_range(dev, sector, 1) || dev->ops->direct == NULL) {
+        return NULL;
+    }
+    return dev->ops->direct(dev, sector);
+}
@@ -1,4 +1,5 @@
 global start    ; start can be accessed outside this file
+global multiboot_info_ptr   ; multiboot2 information address handed over by GRUB
 extern long_mode_start  ; extern is a file outside of boot.asm that can be accessed
 
 section .text   ; This is a section directive that indicates 
@@ -14,6 +15,10 @@ start:
     ; since there are no frames on the stack at boot.
     mov esp, stack_top      ; stack pointer
 
+    ; GRUB leaves the physical address of the multiboot2 information structure
+    ; in EBX. check_for_cpuid clobbers EBX, so save it now for kernel_main.
+    mov [multiboot_info_ptr], ebx
+
     ; In order to avoid bugs and errors with old and outdated CPUs we need to check
     ; if the CPU supports every needed feature to run the kernel/OS.
     call check_for_multiboot    ; checks if the kernel has been uploaded by a multiboot2 loader
@@ -207,6 +212,9 @@ p3_table:       ; Page-Directory Pointer Table (PDP)
 p2_table:       ; Page-Directory Table (PD)
     resb 4096
 
+multiboot_info_ptr: ; Physical address of the multiboot2 boot information
+    resb 4
+
 ;STACK
 stack_bottom:   ; Set up stack  
     ; The stack will contain statically allocated variables.In this context, 
@@ -9,36 +9,122 @@ global long_mode_start
 section .text
 bits 64
 
+XSAVE_AREA_SIZE equ 1024    ; Legacy area, header and AVX state (832 bytes) plus room to align
+
 extern IDT
 extern kernel_main
 extern keyboard_handler
+extern tlb_shootdown_handler
+extern page_fault_handler
+extern ata_primary_irq
+extern ata_secondary_irq
+extern ahci_irq
+extern multiboot_info_ptr
 
 idt_common_handler:
+    ; RAX holds the address of the C handler, see IRQ_STUB
     push rax
     push rcx
     push rdx
+    push rsi
+    push rdi
     push r8
     push r9
     push r10
     push r11
     pushfq
 
-    call keyboard_handler   ; IRQ1 handler
+    ; The interrupted code may be in the middle of an SSE/AVX memCpy, so the
+    ; vector registers are saved as well. FXSAVE only covers the lower halves
+    ; of the YMM registers, with XSAVE enabled every state component in XCR0
+    ; is saved. The area is 64-byte aligned as XSAVE needs, which also leaves
+    ; the stack aligned for the C handler.
+    push rbp
+    mov rbp, rsp
+    mov r11, rax            ; C handler picked by the stub, EDX:EAX carry the XSAVE mask
+    sub rsp, XSAVE_AREA_SIZE
+    and rsp, -64
+    mov rax, [xsave_mask]
+    test rax, rax
+    jz .fxsave
+    ; XRSTOR faults unless the reserved header bytes are zero, the stack holds garbage
+    xor eax, eax
+%assign offset 512
+%rep 8
+    mov [rsp + offset], rax
+%assign offset offset + 8
+%endrep
+    mov eax, [xsave_mask]
+    mov edx, [xsave_mask + 4]
+    xsave64 [rsp]
+    jmp .saved
+.fxsave:
+    fxsave64 [rsp]
+.saved:
+
+    call r11
+
+    mov rax, [xsave_mask]
+    test rax, rax
+    jz .fxrstor
+    mov eax, [xsave_mask]
+    mov edx, [xsave_mask + 4]
+    xrstor64 [rsp]
+    jmp .restored
+.fxrstor:
+    fxrstor64 [rsp]
+.restored:
+    mov rsp, rbp
+    pop rbp
 
     popfq
     pop r11
     pop r10
     pop r9
     pop r8
+    pop rdi
+    pop rsi
     pop rdx
     pop rcx
     pop rax
 
     ret
-irq1:
+
+; Entry point of an interrupt vector that calls a C handler with every
+; caller saved register preserved: IRQ_STUB <stub name>, <C handler>
+%macro IRQ_STUB 2
+%1:
+    push rax
+    mov rax, %2
+    call idt_common_handler
+    pop rax
+    iretq
+    GLOBAL %1
+%endmacro
+
+; Same for an exception that pushes an error code: the C handler gets it as
+; its argument and it is dropped before returning: ERROR_STUB <stub name>, <C handler>
+%macro ERROR_STUB 2
+%1:
+    push rax
+    push rdi
+    mov rdi, [rsp + 16]     ; error code, below the two registers just saved
+    mov rax, %2
     call idt_common_handler
+    pop rdi
+    pop rax
+    add rsp, 8              ; the error code
     iretq
-    GLOBAL irq1
+    GLOBAL %1
+%endmacro
+
+IRQ_STUB irq1, keyboard_handler                         ; IRQ1 keyboard
+IRQ_STUB irq_tlb_shootdown, tlb_shootdown_handler       ; TLB shootdown IPI
+ERROR_STUB isr_page_fault, page_fault_handler           ; #PF, file mappings
+IRQ_STUB irq14, ata_primary_irq                         ; IRQ14 primary ATA channel
+IRQ_STUB irq15, ata_secondary_irq                       ; IRQ15 secondary ATA channel
+IRQ_STUB irq_ahci, ahci_irq                             ; AHCI controller, MSI or its PCI line
+
 idt_descriptor:
     dw 4095
     dq IDT
@@ -55,7 +141,55 @@ long_mode_start:
     mov es, ax          ; Set the F-segment to the A-register.
     mov fs, ax          ; Set the G-segment to the A-register.
     mov gs, ax          ; Set the stack segment to the A-register.
-    
+
+    call enable_sse     ; memCpy/memSet use SSE and AVX registers
+
+    mov edi, [multiboot_info_ptr]   ; First argument of kernel_main, zero extended to RDI
     call kernel_main
     
     hlt
+
+enable_sse:
+    ; SSE instructions raise #UD until the OS says it will save the XMM state.
+    ; CR0: clear the emulation (EM) bit 2 and set the monitor coprocessor (MP) bit 1.
+    mov rax, cr0
+    and ax, 0xFFFB      ; clear EM
+    or ax, 1 << 1       ; set MP
+    mov cr0, rax
+
+    ; CR4: OSFXSR (bit 9) enables FXSAVE/FXRSTOR and SSE, OSXMMEXCPT (bit 10)
+    ; reports SIMD floating point exceptions as #XM instead of #UD.
+    mov rax, cr4
+    or rax, (1 << 9) | (1 << 10)
+    mov cr4, rax
+    fninit              ; Start with a clean x87/SSE state
+
+    ; AVX needs XSAVE support, CR4.OSXSAVE and the YMM state enabled in XCR0.
+    mov eax, 1
+    cpuid               ; CPUID.1:ECX bit 26 = XSAVE, bit 28 = AVX
+    test ecx, 1 << 26
+    jz .done            ; No XSAVE, stay with plain SSE
+
+    mov r8d, ecx        ; Keep the feature bits, xgetbv needs ecx
+    mov rax, cr4
+    or rax, 1 << 18     ; Set OSXSAVE (bit 18) so XGETBV/XSETBV can be used
+    mov cr4, rax
+
+    xor ecx, ecx        ; XCR0 is extended control register 0
+    xgetbv              ; EDX:EAX = XCR0
+    or eax, 0b11        ; x87 (bit 0) and SSE (bit 1) state
+    test r8d, 1 << 28
+    jz .set_xcr0
+    or eax, 0b100       ; AVX upper halves of the YMM registers (bit 2)
+.set_xcr0:
+    xor ecx, ecx
+    xsetbv
+    and eax, 0b111          ; The components the kernel uses, XSAVE_AREA_SIZE holds them
+    mov [xsave_mask], eax   ; What idt_common_handler saves, the upper half stays 0
+.done:
+    ret
+
+section .bss
+align 8
+xsave_mask:
+    resq 1                  ; XCR0 components saved on interrupts, 0 means FXSAVE
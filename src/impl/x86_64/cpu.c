@@ -0,0 +1,92 @@
+#include "cpu.h"
+
+CpuFeatures cpu_features;
+uint64_t cpu_online_mask = 1;
+uint32_t cpu_apic_ids[MAX_CPUS];
+
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid"
+                 : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                 : "a" (leaf), "c" (subleaf));
+}
+
+// XCR0 tells us which register state the OS (long_mode_start) agreed to save
+static uint64_t read_xcr0(void) {
+    uint32_t low, high;
+    asm volatile("xgetbv" : "=a" (low), "=d" (high) : "c" (0));
+    return ((uint64_t)high << 32) | low;
+}
+
+void cpu_detect_features(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t max_leaf;
+
+    cpuid(0, 0, &max_leaf, &ebx, &ecx, &edx);
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    cpu_features.sse2 = (edx >> 26) & 1;
+    cpu_features.xsave = (ecx >> 26) & 1;
+    cpu_features.osxsave = (ecx >> 27) & 1;
+    cpu_features.pge = (edx >> 13) & 1;
+    cpu_features.pcid = (ecx >> 17) & 1;
+
+    // AVX is only usable when the CPU has it and XCR0 enables both XMM (bit 1) and YMM (bit 2) state
+    if (((ecx >> 28) & 1) && cpu_features.osxsave) {
+        cpu_features.avx = (read_xcr0() & 0x6) == 0x6;
+    }
+
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        cpu_features.avx2 = cpu_features.avx && ((ebx >> 5) & 1);
+        cpu_features.erms = (ebx >> 9) & 1;
+        cpu_features.fsrm = (edx >> 4) & 1;
+    }
+
+    // boot.asm already made sure leaf 0x80000001 exists before entering long mode
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    cpu_features.nx = (edx >> 20) & 1;
+    cpu_features.pdpe1gb = (edx >> 26) & 1;
+}
+
+uint64_t read_tsc(void) {
+    uint32_t low, high;
+    // lfence keeps earlier instructions from drifting past the counter read
+    asm volatile("lfence\n\trdtsc" : "=a" (low), "=d" (high) : : "memory");
+    return ((uint64_t)high << 32) | low;
+}
+
+uint64_t read_msr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+void write_msr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
+
+uint64_t read_cr2(void) {
+    uint64_t value;
+    asm volatile("mov %%cr2, %0" : "=r" (value));
+    return value;
+}
+
+uint64_t read_cr3(void) {
+    uint64_t value;
+    asm volatile("mov %%cr3, %0" : "=r" (value));
+    return value;
+}
+
+void write_cr3(uint64_t value) {
+    asm volatile("mov %0, %%cr3" : : "r" (value) : "memory");
+}
+
+uint64_t read_cr4(void) {
+    uint64_t value;
+    asm volatile("mov %%cr4, %0" : "=r" (value));
+    return value;
+}
+
+void write_cr4(uint64_t value) {
+    asm volatile("mov %0, %%cr4" : : "r" (value) : "memory");
+}
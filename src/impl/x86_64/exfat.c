@@ -0,0 +1,1368 @@
+#include "exfat.h"
+#include "bcache.h"
+#include "hdd.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "vga.h"
+
+#define NAME_BUCKETS 1024               /* Heads of the root directory index, by name hash */
+#define SUBDIR_BUCKETS 64               /* Heads of a subdirectory's index */
+#define NO_SLOT 0xFFFFFFFF
+#define SET_MAX (2 + (EXFAT_NAME_MAX + EXFAT_NAME_PER_ENTRY - 1) / EXFAT_NAME_PER_ENTRY)
+#define DEFAULT_TIME ((44u << 25) | (1u << 21) | (1u << 16))   /* 2024-01-01, there is no clock to ask */
+
+ExfatStats exfat_stats;
+
+// A file of a directory in its name index
+typedef struct {
+    uint16_t hash;                      // NameHash of its stream extension
+    uint32_t entry_index;               // NO_SLOT while the slot is free
+    uint32_t next;                      // next slot in the bucket or on the free list
+} NameSlot;
+
+// A directory whose entry sets are indexed by name hash. Indexed on first
+// use and kept until the next mount or until it is removed.
+typedef struct {
+    ExfatChain chain;
+    uint32_t parent;                    // first cluster of the directory holding its entry set, 0 for the root
+    uint32_t entry_index;               // its File entry there
+    uint32_t free_hint;                 // no free entry below this one
+    NameSlot* slots;
+    uint32_t slot_count;
+    uint32_t slot_free;                 // free list of slots
+    uint32_t* buckets;
+    uint32_t bucket_count;
+} ExfatDir;
+
+typedef struct {
+    BlockDev* dev;
+    uint32_t fat_offset;                // sectors
+    uint32_t fat_length;
+    uint8_t fat_count;                  // 2 on TexFAT volumes, both copies are kept the same
+    uint8_t active_fat;                 // VolumeFlags ActiveFat, the copy lookups read
+    uint32_t heap_offset;
+    uint32_t cluster_count;
+    uint8_t sector_shift;
+    uint8_t cluster_shift;              // log2 of the cluster size in bytes
+    uint32_t cluster_size;
+    uint16_t volume_flags;
+
+    uint64_t* bitmap;                   // bit set while the cluster is in use, as on the disk
+    uint64_t* bitmap_dirty;             // one bit per bitmap sector that changed
+    uint32_t bitmap_sectors;
+    ExfatChain bitmap_chain;
+    ExfatChain bitmap_mirror;           // second bitmap of a TexFAT volume, empty otherwise
+    uint32_t free_count;
+    uint32_t next_free;                 // search hint, a bitmap index
+
+    uint16_t* upcase;                   // every UTF-16 code unit to its upper case
+
+    ExfatDir** dirs;                    // indexed directories, the root first
+    uint32_t dir_count;
+    uint32_t dir_capacity;
+
+    uint32_t dirty_files;               // open files whose entry set is behind, the volume stays dirty
+} ExfatVolume;
+
+static ExfatVolume volume;
+static uint8_t mounted;
+
+uint8_t exfat_detect(void* sector) {
+    return memCmp(((ExfatBootSector*)sector)->file_system_name, EXFAT_SIGNATURE, 8) == 0;
+}
+
+uint8_t exfat_mounted(void) {
+    return mounted;
+}
+
+static uint32_t cluster_sector(uint32_t cluster) {
+    return volume.heap_offset + ((cluster - EXFAT_FIRST_CLUSTER) << (volume.cluster_shift - volume.sector_shift));
+}
+
+// The FAT is only read to map fragmented chains and written when one grows
+
+// Entries are 4 bytes, the byte offset of a high cluster does not fit 32 bits
+static uint32_t fat_sector(uint8_t copy, uint32_t cluster) {
+    return volume.fat_offset + copy * volume.fat_length + (uint32_t)(((uint64_t)cluster * 4) >> volume.sector_shift);
+}
+
+static uint32_t fat_byte(uint32_t cluster) {
+    return (uint32_t)(((uint64_t)cluster * 4) & ((1u << volume.sector_shift) - 1));
+}
+
+static uint32_t fat_next(uint32_t cluster) {
+    uint32_t value;
+    if (!read_at(fat_sector(volume.active_fat, cluster), fat_byte(cluster), (char*)&value, 4)) {
+        return EXFAT_FAT_EOC;
+    }
+    return value;
+}
+
+static void fat_set(uint32_t cluster, uint32_t value) {
+    for (uint8_t copy = 0; copy < volume.fat_count; copy++) {
+        write_at(fat_sector(copy, cluster), fat_byte(cluster), (char*)&value, 4);
+    }
+}
+
+static uint8_t valid_cluster(uint32_t cluster) {
+    return cluster >= EXFAT_FIRST_CLUSTER && cluster - EXFAT_FIRST_CLUSTER < volume.cluster_count;
+}
+
+// Chains
+
+static uint8_t chain_append(ExfatChain* chain, uint32_t disk_cluster, uint32_t count) {
+    if (chain->count > 0) {
+        Extent* last = &chain->extents[chain->count - 1];
+        if (last->disk_cluster + last->length == disk_cluster) {
+            last->length += count;
+            chain->clusters += count;
+            return 1;
+        }
+    }
+    if (chain->count == chain->capacity) {
+        uint32_t capacity = chain->capacity ? chain->capacity * 2 : EXTENT_MAP_INITIAL;
+        Extent* extents = kmalloc(capacity * sizeof(Extent));
+        if (extents == NULL) {
+            return 0;
+        }
+        memCpy(extents, chain->extents, chain->count * sizeof(Extent));
+        kfree(chain->extents);
+        chain->extents = extents;
+        chain->capacity = capacity;
+    }
+    if (chain->count == 0) {
+        chain->first_cluster = disk_cluster;
+    }
+    chain->extents[chain->count].file_cluster = chain->clusters;
+    chain->extents[chain->count].disk_cluster = disk_cluster;
+    chain->extents[chain->count].length = count;
+    chain->count++;
+    chain->clusters += count;
+    return 1;
+}
+
+// Map a chain of 'clusters' clusters, or up to its end of chain mark when 0.
+// A NoFatChain chain is one extent, a FAT chain is walked once here.
+static uint8_t chain_build(ExfatChain* chain, uint32_t first, uint32_t clusters, uint8_t no_fat_chain) {
+    memSet(chain, 0, sizeof(ExfatChain));
+    chain->no_fat_chain = no_fat_chain;
+    if (!valid_cluster(first)) {
+        return first == 0;
+    }
+    if (no_fat_chain) {
+        return clusters > 0 && clusters <= volume.cluster_count - (first - EXFAT_FIRST_CLUSTER) &&
+               chain_append(chain, first, clusters);
+    }
+
+    uint32_t cluster = first;
+    uint32_t limit = clusters ? clusters : volume.cluster_count;
+    while (chain->clusters < limit && valid_cluster(cluster)) {
+        if (!chain_append(chain, cluster, 1)) {
+            return 0;
+        }
+        cluster = fat_next(cluster);
+    }
+    return clusters == 0 || chain->clusters == clusters;
+}
+
+// Disk cluster of file cluster 'index', *run gets the clusters that follow it on disk
+static uint32_t chain_lookup(ExfatChain* chain, uint32_t index, uint32_t* run) {
+    uint32_t low = 0, high = chain->count;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        Extent* extent = &chain->extents[middle];
+        if (index < extent->file_cluster) {
+            high = middle;
+        }
+        else if (index - extent->file_cluster >= extent->length) {
+            low = middle + 1;
+        }
+        else {
+            *run = extent->length - (index - extent->file_cluster);
+            return extent->disk_cluster + (index - extent->file_cluster);
+        }
+    }
+    return 0;
+}
+
+static uint32_t chain_last(ExfatChain* chain) {
+    if (chain->count == 0) {
+        return 0;
+    }
+    Extent* last = &chain->extents[chain->count - 1];
+    return last->disk_cluster + last->length - 1;
+}
+
+static void chain_free(ExfatChain* chain) {
+    kfree(chain->extents);
+    memSet(chain, 0, sizeof(ExfatChain));
+}
+
+// Volume state
+
+// The first change after a sync marks the volume dirty on the disk before it happens
+static void volume_touch(void) {
+    if (volume.volume_flags & EXFAT_VOLUME_DIRTY) {
+        return;
+    }
+    volume.volume_flags |= EXFAT_VOLUME_DIRTY;
+    write_at(0, 106, (char*)&volume.volume_flags, 2);
+    bcache_writeback_range(volume.dev, 0, 1);
+    blockdev_flush(volume.dev);
+}
+
+// Allocation bitmap
+
+// No libgcc in the kernel for __builtin_popcountll
+static uint32_t bits_set(uint64_t word) {
+    word = word - ((word >> 1) & 0x5555555555555555ull);
+    word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (word * 0x0101010101010101ull) >> 56;
+}
+
+static uint8_t bitmap_used(uint32_t index) {
+    return (volume.bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+static void bitmap_mark(uint32_t cluster, uint32_t count, uint8_t used) {
+    uint32_t index = cluster - EXFAT_FIRST_CLUSTER;
+    for (uint32_t i = index; i < index + count; i++) {
+        uint64_t bit = 1ull << (i % 64);
+        if (((volume.bitmap[i / 64] & bit) != 0) != used) {
+            volume.bitmap[i / 64] ^= bit;
+            volume.free_count += used ? -1 : 1;
+        }
+    }
+    uint32_t first = (index / 8) >> volume.sector_shift;
+    uint32_t last = ((index + count - 1) / 8) >> volume.sector_shift;
+    for (uint32_t s = first; s <= last; s++) {
+        volume.bitmap_dirty[s / 64] |= 1ull << (s % 64);
+    }
+}
+
+// Free clusters from 'cluster' on, up to 'want'
+static uint32_t bitmap_free_run(uint32_t cluster, uint32_t want) {
+    uint32_t index = cluster - EXFAT_FIRST_CLUSTER;
+    uint32_t length = 0;
+    while (length < want && index + length < volume.cluster_count && !bitmap_used(index + length)) {
+        length++;
+    }
+    return length;
+}
+
+// First free cluster at or after the hint, wrapping once, a whole word at a time
+static uint32_t bitmap_find(void) {
+    uint32_t words = (volume.cluster_count + 63) / 64;
+    uint32_t start = volume.next_free / 64;
+    for (uint32_t n = 0; n <= words; n++) {
+        uint32_t word = (start + n) % words;
+        uint64_t free_bits = ~volume.bitmap[word];
+        if (n == 0) {
+            free_bits &= ~0ull << (volume.next_free % 64);
+        }
+        uint32_t index = word * 64 + __builtin_ctzll(free_bits | (1ull << 63));
+        if (free_bits != 0 && index < volume.cluster_count) {
+            return index + EXFAT_FIRST_CLUSTER;
+        }
+    }
+    return 0;
+}
+
+// Give the chain 'count' more clusters. They continue the last run when the
+// clusters after it are free, so a file written front to back stays one
+// NoFatChain extent. Anything else needs the chain written to the FAT.
+static uint8_t chain_grow(ExfatChain* chain, uint32_t count) {
+    if (count > volume.free_count) {
+        return 0;
+    }
+    volume_touch();
+    while (count > 0) {
+        uint32_t last = chain_last(chain);
+        uint32_t first = 0;
+        uint32_t got = last ? bitmap_free_run(last + 1, count) : 0;
+        if (got > 0) {
+            first = last + 1;
+        }
+        else {
+            first = bitmap_find();
+            if (first == 0) {
+                return 0;
+            }
+            got = bitmap_free_run(first, count);
+        }
+
+        if (chain->count > 0 && first != last + 1 && chain->no_fat_chain) {
+            // The run breaks, so the FAT has to describe the clusters from now on
+            for (uint32_t i = 0; i < chain->count; i++) {
+                Extent* extent = &chain->extents[i];
+                for (uint32_t c = 0; c + 1 < extent->length; c++) {
+                    fat_set(extent->disk_cluster + c, extent->disk_cluster + c + 1);
+                }
+                if (i + 1 < chain->count) {
+                    fat_set(extent->disk_cluster + extent->length - 1, chain->extents[i + 1].disk_cluster);
+                }
+            }
+            chain->no_fat_chain = 0;
+            exfat_stats.chain_conversions++;
+        }
+        else if (chain->count == 0) {
+            chain->no_fat_chain = 1;
+        }
+        else if (chain->no_fat_chain) {
+            exfat_stats.contiguous_extends++;
+        }
+
+        bitmap_mark(first, got, 1);
+        if (!chain->no_fat_chain) {
+            if (last) {
+                fat_set(last, first);
+            }
+            for (uint32_t c = 0; c + 1 < got; c++) {
+                fat_set(first + c, first + c + 1);
+            }
+            fat_set(first + got - 1, EXFAT_FAT_EOC);
+        }
+        if (!chain_append(chain, first, got)) {
+            return 0;
+        }
+        volume.next_free = first + got - EXFAT_FIRST_CLUSTER;
+        count -= got;
+    }
+    return 1;
+}
+
+// Keep the first 'clusters' clusters of the chain and free the rest
+static void chain_shrink(ExfatChain* chain, uint32_t clusters) {
+    if (clusters >= chain->clusters) {
+        return;
+    }
+    volume_touch();
+    while (chain->count > 0) {
+        Extent* extent = &chain->extents[chain->count - 1];
+        if (extent->file_cluster >= clusters) {
+            bitmap_mark(extent->disk_cluster, extent->length, 0);
+            chain->count--;
+            continue;
+        }
+        uint32_t keep = clusters - extent->file_cluster;
+        if (keep < extent->length) {
+            bitmap_mark(extent->disk_cluster + keep, extent->length - keep, 0);
+            extent->length = keep;
+        }
+        break;
+    }
+    chain->clusters = clusters;
+    if (clusters == 0) {
+        chain->first_cluster = 0;
+        chain->no_fat_chain = 0;
+    }
+    else if (!chain->no_fat_chain) {
+        fat_set(chain_last(chain), EXFAT_FAT_EOC);
+    }
+}
+
+// Names
+
+// The name as UTF-16 code units, 0 when it is empty, too long or has a character exFAT forbids
+static uint32_t name_units(char* name, uint16_t* units) {
+    uint32_t length = 0;
+    for (; name[length] != '\0'; length++) {
+        uint8_t c = name[length];
+        if (length == EXFAT_NAME_MAX || c < 0x20 || c == '"' || c == '*' || c == '/' || c == ':' || c == '<' ||
+            c == '>' || c == '?' || c == '\\' || c == '|') {
+            return 0;
+        }
+        units[length] = c;
+    }
+    return length;
+}
+
+// NameHash of the up-cased name, as stored in the stream extension
+static uint16_t name_hash(uint16_t* units, uint32_t length) {
+    uint16_t hash = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        uint16_t c = volume.upcase[units[i]];
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+    }
+    return hash;
+}
+
+static uint16_t set_checksum(uint8_t* set, uint32_t entries) {
+    uint16_t sum = 0;
+    for (uint32_t i = 0; i < entries * EXFAT_ENTRY_SIZE; i++) {
+        if (i != 2 && i != 3) {
+            sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + set[i];
+        }
+    }
+    return sum;
+}
+
+// Directory entries
+
+static uint8_t entry_location(ExfatDir* dir, uint32_t index, uint32_t* sector, uint32_t* offset) {
+    uint64_t byte = (uint64_t)index * EXFAT_ENTRY_SIZE;
+    uint32_t run;
+    uint32_t cluster = chain_lookup(&dir->chain, byte >> volume.cluster_shift, &run);
+    if (cluster == 0) {
+        return 0;
+    }
+    *sector = cluster_sector(cluster);
+    *offset = byte & (volume.cluster_size - 1);
+    return 1;
+}
+
+static uint8_t entries_read(ExfatDir* dir, uint32_t index, uint32_t count, void* out) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t sector, offset;
+        if (!entry_location(dir, index + i, &sector, &offset)) {
+            return 0;
+        }
+        if (!read_at(sector, offset, (char*)out + i * EXFAT_ENTRY_SIZE, EXFAT_ENTRY_SIZE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint8_t entries_write(ExfatDir* dir, uint32_t index, uint32_t count, void* in) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t sector, offset;
+        if (!entry_location(dir, index + i, &sector, &offset)) {
+            return 0;
+        }
+        if (!write_at(sector, offset, (char*)in + i * EXFAT_ENTRY_SIZE, EXFAT_ENTRY_SIZE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint32_t dir_entries(ExfatDir* dir) {
+    return (uint32_t)(((uint64_t)dir->chain.clusters << volume.cluster_shift) / EXFAT_ENTRY_SIZE);
+}
+
+// Name index
+
+static void index_insert(ExfatDir* dir, uint16_t hash, uint32_t entry_index) {
+    uint32_t slot = dir->slot_free;
+    if (slot == NO_SLOT) {
+        uint32_t count = dir->slot_count ? dir->slot_count * 2 : 64;
+        NameSlot* slots = kmalloc(count * sizeof(NameSlot));
+        if (slots == NULL) {
+            return;
+        }
+        memCpy(slots, dir->slots, dir->slot_count * sizeof(NameSlot));
+        for (uint32_t i = dir->slot_count; i < count; i++) {
+            slots[i].entry_index = NO_SLOT;
+            slots[i].next = i + 1 < count ? i + 1 : NO_SLOT;
+        }
+        kfree(dir->slots);
+        dir->slots = slots;
+        slot = dir->slot_count;
+        dir->slot_count = count;
+    }
+    dir->slot_free = dir->slots[slot].next;
+    dir->slots[slot].hash = hash;
+    dir->slots[slot].entry_index = entry_index;
+    dir->slots[slot].next = dir->buckets[hash % dir->bucket_count];
+    dir->buckets[hash % dir->bucket_count] = slot;
+}
+
+static void index_remove(ExfatDir* dir, uint16_t hash, uint32_t entry_index) {
+    uint32_t* link = &dir->buckets[hash % dir->bucket_count];
+    while (*link != NO_SLOT) {
+        NameSlot* slot = &dir->slots[*link];
+        if (slot->entry_index == entry_index) {
+            uint32_t freed = *link;
+            *link = slot->next;
+            slot->entry_index = NO_SLOT;
+            slot->next = dir->slot_free;
+            dir->slot_free = freed;
+            return;
+        }
+        link = &slot->next;
+    }
+}
+
+// Entry set whose name matches, compared only when the 16 bit hash already does.
+// 'set' gets the whole set, the return value is its File entry index or NO_SLOT.
+static uint32_t lookup(ExfatDir* dir, uint16_t* units, uint32_t length, uint8_t* set) {
+    uint16_t hash = name_hash(units, length);
+    exfat_stats.lookups++;
+    for (uint32_t s = dir->buckets[hash % dir->bucket_count]; s != NO_SLOT; s = dir->slots[s].next) {
+        NameSlot* slot = &dir->slots[s];
+        if (slot->hash != hash || !entries_read(dir, slot->entry_index, 2, set)) {
+            continue;
+        }
+        ExfatFileEntry* file = (ExfatFileEntry*)set;
+        ExfatStreamEntry* stream = (ExfatStreamEntry*)(set + EXFAT_ENTRY_SIZE);
+        if (stream->name_length != length || file->secondary_count < 2 || file->secondary_count >= SET_MAX ||
+            !entries_read(dir, slot->entry_index + 2, file->secondary_count - 1, set + 2 * EXFAT_ENTRY_SIZE)) {
+            exfat_stats.hash_rejects++;
+            continue;
+        }
+        uint8_t same = 1;
+        for (uint32_t i = 0; i < length && same; i++) {
+            ExfatNameEntry* name = (ExfatNameEntry*)(set + (2 + i / EXFAT_NAME_PER_ENTRY) * EXFAT_ENTRY_SIZE);
+            same = volume.upcase[name->name[i % EXFAT_NAME_PER_ENTRY]] == volume.upcase[units[i]];
+        }
+        if (same) {
+            return slot->entry_index;
+        }
+        exfat_stats.hash_rejects++;
+    }
+    return NO_SLOT;
+}
+
+// Directories
+
+// Put every File entry set of the directory into its index, by the NameHash
+// its stream extension stores
+static void dir_index(ExfatDir* dir) {
+    uint8_t raw[EXFAT_ENTRY_SIZE * 2];
+    uint32_t total = dir_entries(dir);
+    for (uint32_t i = 0; i < total; i++) {
+        ExfatFileEntry* file = (ExfatFileEntry*)raw;
+        if (!entries_read(dir, i, 2, raw) || raw[0] == EXFAT_TYPE_END) {
+            break;
+        }
+        if (file->type == EXFAT_TYPE_FILE && raw[EXFAT_ENTRY_SIZE] == EXFAT_TYPE_STREAM && file->secondary_count >= 2) {
+            index_insert(dir, ((ExfatStreamEntry*)(raw + EXFAT_ENTRY_SIZE))->name_hash, i);
+            i += file->secondary_count;
+        }
+    }
+}
+
+static void dir_free(ExfatDir* dir) {
+    chain_free(&dir->chain);
+    kfree(dir->slots);
+    kfree(dir->buckets);
+    kfree(dir);
+}
+
+// Take the directory off the list and free it
+static void dir_drop(ExfatDir* dir) {
+    for (uint32_t i = 0; i < volume.dir_count; i++) {
+        if (volume.dirs[i] == dir) {
+            volume.dirs[i] = volume.dirs[--volume.dir_count];
+            break;
+        }
+    }
+    dir_free(dir);
+}
+
+// Empty directory on the list, its chain and index still to be filled in
+static ExfatDir* dir_new(uint32_t parent, uint32_t entry_index, uint32_t bucket_count) {
+    if (volume.dir_count == volume.dir_capacity) {
+        uint32_t capacity = volume.dir_capacity ? volume.dir_capacity * 2 : 8;
+        ExfatDir** dirs = kmalloc(capacity * sizeof(ExfatDir*));
+        if (dirs == NULL) {
+            return NULL;
+        }
+        memCpy(dirs, volume.dirs, volume.dir_count * sizeof(ExfatDir*));
+        kfree(volume.dirs);
+        volume.dirs = dirs;
+        volume.dir_capacity = capacity;
+    }
+    ExfatDir* dir = kzalloc(sizeof(ExfatDir));
+    uint32_t* buckets = kmalloc(bucket_count * sizeof(uint32_t));
+    if (dir == NULL || buckets == NULL) {
+        kfree(dir);
+        kfree(buckets);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < bucket_count; i++) {
+        buckets[i] = NO_SLOT;
+    }
+    dir->parent = parent;
+    dir->entry_index = entry_index;
+    dir->slot_free = NO_SLOT;
+    dir->buckets = buckets;
+    dir->bucket_count = bucket_count;
+    volume.dirs[volume.dir_count++] = dir;
+    return dir;
+}
+
+// Indexed directory whose clusters start at 'first_cluster', NULL when it was not used yet
+static ExfatDir* dir_find(uint32_t first_cluster) {
+    for (uint32_t i = 0; i < volume.dir_count; i++) {
+        if (volume.dirs[i]->chain.first_cluster == first_cluster) {
+            return volume.dirs[i];
+        }
+    }
+    return NULL;
+}
+
+// The directory an open file stands for, the root for NULL. A subdirectory is
+// mapped and indexed the first time it is used.
+static ExfatDir* dir_open(ExfatFile* file) {
+    if (file == NULL) {
+        return volume.dirs[0];
+    }
+    if (!(file->attributes & EXFAT_ATTR_DIRECTORY) || file->chain.first_cluster == 0) {
+        return NULL;
+    }
+    ExfatDir* dir = dir_find(file->chain.first_cluster);
+    if (dir != NULL) {
+        return dir;
+    }
+    dir = dir_new(file->dir_cluster, file->entry_index, SUBDIR_BUCKETS);
+    if (dir == NULL) {
+        return NULL;
+    }
+    if (!chain_build(&dir->chain, file->chain.first_cluster, file->chain.clusters, file->chain.no_fat_chain)) {
+        dir_drop(dir);
+        return NULL;
+    }
+    dir_index(dir);
+    return dir;
+}
+
+// A subdirectory that grew has its stream extension in the parent rewritten
+static uint8_t dir_update_stream(ExfatDir* dir) {
+    ExfatDir* parent = dir_find(dir->parent);
+    uint8_t set[SET_MAX * EXFAT_ENTRY_SIZE];
+    if (parent == NULL || !entries_read(parent, dir->entry_index, 2, set)) {
+        return 0;
+    }
+    ExfatFileEntry* entry = (ExfatFileEntry*)set;
+    uint32_t count = entry->secondary_count + 1;
+    if (count > SET_MAX || !entries_read(parent, dir->entry_index, count, set)) {
+        return 0;
+    }
+    ExfatStreamEntry* stream = (ExfatStreamEntry*)(set + EXFAT_ENTRY_SIZE);
+    stream->data_length = stream->valid_length = (uint64_t)dir->chain.clusters << volume.cluster_shift;
+    stream->first_cluster = dir->chain.first_cluster;
+    stream->flags = EXFAT_ALLOCATION_POSSIBLE | (dir->chain.no_fat_chain ? EXFAT_NO_FAT_CHAIN : 0);
+    entry->set_checksum = set_checksum(set, count);
+    return entries_write(parent, dir->entry_index, count, set);
+}
+
+// Mount
+
+// Read 'length' bytes of a chain into memory, a run of clusters per request
+static uint8_t chain_load(ExfatChain* chain, void* out, uint64_t length) {
+    uint8_t* position = out;
+    for (uint32_t i = 0; i < chain->count && length > 0; i++) {
+        uint64_t bytes = (uint64_t)chain->extents[i].length << volume.cluster_shift;
+        if (bytes > length) {
+            bytes = length;
+        }
+        uint32_t sectors = (bytes + volume.dev->sector_size - 1) >> volume.sector_shift;
+        uint32_t whole = bytes >> volume.sector_shift;
+        uint32_t sector = cluster_sector(chain->extents[i].disk_cluster);
+        if (whole > 0 && !blockdev_read(volume.dev, sector, whole, position)) {
+            return 0;
+        }
+        if (sectors > whole && !read_at(sector + whole, 0, (char*)position + ((uint64_t)whole << volume.sector_shift),
+                                        bytes - ((uint64_t)whole << volume.sector_shift))) {
+            return 0;
+        }
+        position += bytes;
+        length -= bytes;
+    }
+    return length == 0;
+}
+
+static uint8_t load_bitmap(ExfatTableEntry* entry, ExfatTableEntry* mirror) {
+    uint32_t clusters = (entry->data_length + volume.cluster_size - 1) >> volume.cluster_shift;
+    if (entry->data_length * 8 < volume.cluster_count || !chain_build(&volume.bitmap_chain, entry->first_cluster, clusters, 0)) {
+        return 0;
+    }
+    if (mirror != NULL && (mirror->data_length != entry->data_length ||
+                           !chain_build(&volume.bitmap_mirror, mirror->first_cluster, clusters, 0))) {
+        return 0;
+    }
+    uint32_t words = (volume.cluster_count + 63) / 64;
+    volume.bitmap = vmm_alloc((uint64_t)words * 8);
+    volume.bitmap_sectors = (entry->data_length + volume.dev->sector_size - 1) >> volume.sector_shift;
+    volume.bitmap_dirty = kzalloc(((volume.bitmap_sectors + 63) / 64) * 8);
+    if (volume.bitmap == NULL || volume.bitmap_dirty == NULL) {
+        return 0;
+    }
+    memSet(volume.bitmap, 0, (uint64_t)words * 8);
+    if (!chain_load(&volume.bitmap_chain, volume.bitmap, (volume.cluster_count + 7) / 8)) {
+        return 0;
+    }
+
+    // Bits past the last cluster are not clusters, the count skips them
+    if (volume.cluster_count % 64) {
+        volume.bitmap[words - 1] &= (1ull << (volume.cluster_count % 64)) - 1;
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < words; i++) {
+        used += bits_set(volume.bitmap[i]);
+    }
+    volume.free_count = volume.cluster_count - used;
+    return 1;
+}
+
+// Expand the compressed up-case table, a 0xFFFF entry is followed by a count
+// of characters that map to themselves. Falls back to ASCII without a valid one.
+static void load_upcase(ExfatTableEntry* entry) {
+    for (uint32_t i = 0; i < EXFAT_UPCASE_ENTRIES; i++) {
+        volume.upcase[i] = (i >= 'a' && i <= 'z') ? i - 32 : i;
+    }
+    if (entry == NULL || entry->data_length == 0 || entry->data_length > EXFAT_UPCASE_ENTRIES * 2 * 2) {
+        return;
+    }
+
+    ExfatChain chain;
+    uint32_t clusters = (entry->data_length + volume.cluster_size - 1) >> volume.cluster_shift;
+    uint8_t* table = kmalloc(entry->data_length);
+    if (table == NULL || !chain_build(&chain, entry->first_cluster, clusters, 0) || !chain_load(&chain, table, entry->data_length)) {
+        kfree(table);
+        chain_free(&chain);
+        return;
+    }
+    chain_free(&chain);
+
+    uint32_t checksum = 0;
+    for (uint32_t i = 0; i < entry->data_length; i++) {
+        checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + table[i];
+    }
+    if (checksum == entry->table_checksum) {
+        uint16_t* units = (uint16_t*)table;
+        uint32_t c = 0;
+        for (uint32_t i = 0; i < entry->data_length / 2 && c < EXFAT_UPCASE_ENTRIES; i++) {
+            if (units[i] == 0xFFFF && i + 1 < entry->data_length / 2) {
+                for (uint32_t n = units[++i]; n > 0 && c < EXFAT_UPCASE_ENTRIES; n--, c++) {
+                    volume.upcase[c] = c;
+                }
+            }
+            else {
+                volume.upcase[c++] = units[i];
+            }
+        }
+    }
+    kfree(table);
+}
+
+// Boot region checksum, kept in sector 11 and covering sectors 0 to 10
+// except VolumeFlags and PercentInUse
+static uint8_t boot_checksum_valid(BlockDev* dev, uint8_t* sector) {
+    uint32_t checksum = 0;
+    for (uint32_t s = 0; s < 11; s++) {
+        if (!blockdev_read(dev, s, 1, sector)) {
+            return 0;
+        }
+        for (uint32_t i = 0; i < dev->sector_size; i++) {
+            if (s == 0 && (i == 106 || i == 107 || i == 112)) {
+                continue;
+            }
+            checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + sector[i];
+        }
+    }
+    if (!blockdev_read(dev, 11, 1, sector)) {
+        return 0;
+    }
+    return *(uint32_t*)sector == checksum;
+}
+
+uint8_t exfat_mount(BlockDev* dev) {
+    uint8_t* sector = kmalloc(dev->sector_size);
+    if (sector == NULL) {
+        return 0;
+    }
+    if (!boot_checksum_valid(dev, sector) || !blockdev_read(dev, 0, 1, sector)) {
+        print_str("exFAT: boot region checksum mismatch\n");
+        kfree(sector);
+        return 0;
+    }
+    ExfatBootSector* bs = (ExfatBootSector*)sector;
+    if (!exfat_detect(bs) || (1u << bs->bytes_per_sector_shift) != dev->sector_size ||
+        bs->bytes_per_sector_shift + bs->sectors_per_cluster_shift > 25) {
+        kfree(sector);
+        return 0;
+    }
+
+    mounted = 0;
+    chain_free(&volume.bitmap_chain);
+    chain_free(&volume.bitmap_mirror);
+    for (uint32_t i = 0; i < volume.dir_count; i++) {
+        dir_free(volume.dirs[i]);
+    }
+    volume.dir_count = 0;
+
+    volume.dev = dev;
+    volume.fat_offset = bs->fat_offset;
+    volume.fat_length = bs->fat_length;
+    volume.fat_count = bs->fat_count == 2 ? 2 : 1;
+    volume.active_fat = volume.fat_count == 2 ? (bs->volume_flags & EXFAT_ACTIVE_FAT) : 0;
+    volume.heap_offset = bs->cluster_heap_offset;
+    volume.cluster_count = bs->cluster_count;
+    volume.sector_shift = bs->bytes_per_sector_shift;
+    volume.cluster_shift = bs->bytes_per_sector_shift + bs->sectors_per_cluster_shift;
+    volume.cluster_size = 1u << volume.cluster_shift;
+    volume.volume_flags = bs->volume_flags;
+    volume.next_free = 0;
+    volume.dirty_files = 0;
+    uint32_t root_cluster = bs->root_cluster;
+    kfree(sector);
+
+    if (volume.upcase == NULL) {
+        volume.upcase = vmm_alloc(EXFAT_UPCASE_ENTRIES * sizeof(uint16_t));
+    }
+    ExfatDir* root = volume.upcase != NULL ? dir_new(0, 0, NAME_BUCKETS) : NULL;
+    if (root == NULL || !chain_build(&root->chain, root_cluster, 0, 0) || root->chain.clusters == 0) {
+        return 0;
+    }
+
+    // The bitmaps and the up-case table are entries of the root directory.
+    // Bit 0 of a bitmap's flags says which FAT it goes with.
+    ExfatTableEntry bitmap_entry, mirror_entry, upcase_entry;
+    uint8_t have_bitmap = 0, have_mirror = 0, have_upcase = 0;
+    uint8_t raw[EXFAT_ENTRY_SIZE];
+    uint32_t total = dir_entries(root);
+    for (uint32_t i = 0; i < total; i++) {
+        if (!entries_read(root, i, 1, raw)) {
+            return 0;
+        }
+        if (raw[0] == EXFAT_TYPE_END) {
+            break;
+        }
+        if (raw[0] == EXFAT_TYPE_BITMAP && !have_bitmap && (raw[1] & 1) == volume.active_fat) {
+            memCpy(&bitmap_entry, raw, EXFAT_ENTRY_SIZE);
+            have_bitmap = 1;
+        }
+        else if (raw[0] == EXFAT_TYPE_BITMAP && !have_mirror && volume.fat_count == 2) {
+            memCpy(&mirror_entry, raw, EXFAT_ENTRY_SIZE);
+            have_mirror = 1;
+        }
+        else if (raw[0] == EXFAT_TYPE_UPCASE && !have_upcase) {
+            memCpy(&upcase_entry, raw, EXFAT_ENTRY_SIZE);
+            have_upcase = 1;
+        }
+    }
+    if (!have_bitmap || !load_bitmap(&bitmap_entry, have_mirror ? &mirror_entry : NULL)) {
+        print_str("exFAT: no usable allocation bitmap\n");
+        return 0;
+    }
+    load_upcase(have_upcase ? &upcase_entry : NULL);
+
+    dir_index(root);
+
+    mounted = 1;
+    return 1;
+}
+
+// Files
+
+// The entry set of an open file is behind from its first change until it is synced
+static void file_touch(ExfatFile* file) {
+    if (!file->dirty) {
+        file->dirty = 1;
+        volume.dirty_files++;
+    }
+}
+
+static void file_from_set(ExfatFile* file, ExfatDir* dir, uint32_t entry_index, uint8_t* set) {
+    ExfatFileEntry* entry = (ExfatFileEntry*)set;
+    ExfatStreamEntry* stream = (ExfatStreamEntry*)(set + EXFAT_ENTRY_SIZE);
+    file->dir_cluster = dir->chain.first_cluster;
+    file->entry_index = entry_index;
+    file->secondary_count = entry->secondary_count;
+    file->attributes = entry->attributes;
+    file->size = stream->data_length;
+    file->valid_length = stream->valid_length;
+    file->dirty = 0;
+    uint32_t clusters = (uint32_t)((file->size + volume.cluster_size - 1) >> volume.cluster_shift);
+    if (!chain_build(&file->chain, stream->first_cluster, clusters, (stream->flags & EXFAT_NO_FAT_CHAIN) != 0)) {
+        // A damaged chain is cut where it ends, the rest reads as a short file
+        file->size = (uint64_t)file->chain.clusters << volume.cluster_shift;
+        if (file->valid_length > file->size) {
+            file->valid_length = file->size;
+        }
+    }
+}
+
+// Free run of 'count' entries in the directory, growing it by a cluster when it is full
+static uint32_t find_free_entries(ExfatDir* dir, uint32_t count) {
+    uint8_t raw[EXFAT_ENTRY_SIZE];
+    uint32_t run = 0;
+    for (uint32_t i = dir->free_hint; ; i++) {
+        if (i == dir_entries(dir)) {
+            if (!chain_grow(&dir->chain, 1)) {
+                return NO_SLOT;
+            }
+            // A new directory cluster reads as end of directory entries
+            uint32_t first = cluster_sector(chain_last(&dir->chain));
+            uint32_t sectors = volume.cluster_size >> volume.sector_shift;
+            for (uint32_t s = 0; s < sectors; s++) {
+                if (!write_at(first + s, 0, zero_page(), 1u << volume.sector_shift)) {
+                    return NO_SLOT;
+                }
+            }
+            // The root's size is its chain, a subdirectory's is in its stream extension
+            if (dir != volume.dirs[0] && !dir_update_stream(dir)) {
+                return NO_SLOT;
+            }
+        }
+        if (!entries_read(dir, i, 1, raw)) {
+            return NO_SLOT;
+        }
+        if (raw[0] & EXFAT_IN_USE) {
+            run = 0;
+            dir->free_hint = i + 1;
+            continue;
+        }
+        if (++run == count) {
+            return i + 1 - count;
+        }
+    }
+}
+
+static uint32_t create(ExfatDir* dir, uint16_t* units, uint32_t length, uint8_t* set, uint16_t attributes) {
+    uint32_t names = (length + EXFAT_NAME_PER_ENTRY - 1) / EXFAT_NAME_PER_ENTRY;
+    uint32_t count = 2 + names;
+    volume_touch();
+    uint32_t index = find_free_entries(dir, count);
+    if (index == NO_SLOT) {
+        return NO_SLOT;
+    }
+
+    memSet(set, 0, count * EXFAT_ENTRY_SIZE);
+    ExfatFileEntry* file = (ExfatFileEntry*)set;
+    file->type = EXFAT_TYPE_FILE;
+    file->secondary_count = count - 1;
+    file->attributes = attributes;
+    file->create_time = file->modify_time = file->access_time = DEFAULT_TIME;
+
+    ExfatStreamEntry* stream = (ExfatStreamEntry*)(set + EXFAT_ENTRY_SIZE);
+    stream->type = EXFAT_TYPE_STREAM;
+    stream->flags = EXFAT_ALLOCATION_POSSIBLE;
+    stream->name_length = length;
+    stream->name_hash = name_hash(units, length);
+
+    for (uint32_t i = 0; i < length; i++) {
+        ExfatNameEntry* name = (ExfatNameEntry*)(set + (2 + i / EXFAT_NAME_PER_ENTRY) * EXFAT_ENTRY_SIZE);
+        name->type = EXFAT_TYPE_NAME;
+        name->name[i % EXFAT_NAME_PER_ENTRY] = units[i];
+    }
+    for (uint32_t i = 0; i < names; i++) {
+        set[(2 + i) * EXFAT_ENTRY_SIZE] = EXFAT_TYPE_NAME;
+    }
+    file->set_checksum = set_checksum(set, count);
+
+    if (!entries_write(dir, index, count, set)) {
+        return NO_SLOT;
+    }
+    index_insert(dir, stream->name_hash, index);
+    return index;
+}
+
+// Clearing InUse frees the entries of the set, the rest of it stays as it was
+static uint8_t remove_set(ExfatDir* dir, uint32_t index, uint8_t* set) {
+    uint32_t count = ((ExfatFileEntry*)set)->secondary_count + 1;
+    for (uint32_t i = 0; i < count; i++) {
+        set[i * EXFAT_ENTRY_SIZE] &= ~EXFAT_IN_USE;
+    }
+    index_remove(dir, ((ExfatStreamEntry*)(set + EXFAT_ENTRY_SIZE))->name_hash, index);
+    if (index < dir->free_hint) {
+        dir->free_hint = index;
+    }
+    return entries_write(dir, index, count, set);
+}
+
+uint8_t exfat_open(ExfatFile* dir, ExfatFile* file, char* name, uint8_t create_missing) {
+    uint16_t units[EXFAT_NAME_MAX];
+    uint8_t set[SET_MAX * EXFAT_ENTRY_SIZE];
+    uint32_t length = name_units(name, units);
+    ExfatDir* parent = mounted ? dir_open(dir) : NULL;
+    if (parent == NULL || length == 0) {
+        return 0;
+    }
+    uint32_t index = lookup(parent, units, length, set);
+    if (index == NO_SLOT && create_missing) {
+        index = create(parent, units, length, set, EXFAT_ATTR_ARCHIVE);
+    }
+    if (index == NO_SLOT) {
+        return 0;
+    }
+    file_from_set(file, parent, index, set);
+    return 1;
+}
+
+uint8_t exfat_mkdir(ExfatFile* dir, char* name) {
+    uint16_t units[EXFAT_NAME_MAX];
+    uint8_t set[SET_MAX * EXFAT_ENTRY_SIZE];
+    uint32_t length = name_units(name, units);
+    ExfatDir* parent = mounted ? dir_open(dir) : NULL;
+    if (parent == NULL || length == 0 || lookup(parent, units, length, set) != NO_SLOT) {
+        return 0;
+    }
+    uint32_t index = create(parent, units, length, set, EXFAT_ATTR_DIRECTORY);
+    if (index == NO_SLOT) {
+        return 0;
+    }
+
+    // One cluster of zeros, which reads as an empty directory
+    ExfatFile file;
+    file_from_set(&file, parent, index, set);
+    uint8_t ok = chain_grow(&file.chain, 1);
+    uint32_t first = cluster_sector(file.chain.first_cluster);
+    for (uint32_t s = 0; ok && s < (volume.cluster_size >> volume.sector_shift); s++) {
+        ok = write_at(first + s, 0, zero_page(), 1u << volume.sector_shift);
+    }
+    if (ok) {
+        file.size = file.valid_length = volume.cluster_size;
+        file_touch(&file);
+        ok = exfat_file_sync(&file);
+    }
+    if (!ok) {
+        chain_shrink(&file.chain, 0);
+        remove_set(parent, index, set);
+    }
+    exfat_close(&file);
+    return ok;
+}
+
+uint8_t exfat_file_sync(ExfatFile* file) {
+    if (!file->dirty) {
+        return 1;
+    }
+    ExfatDir* dir = dir_find(file->dir_cluster);
+    uint8_t set[SET_MAX * EXFAT_ENTRY_SIZE];
+    uint32_t count = file->secondary_count + 1;
+    if (dir == NULL || count > SET_MAX || !entries_read(dir, file->entry_index, count, set)) {
+        return 0;
+    }
+    ExfatFileEntry* entry = (ExfatFileEntry*)set;
+    ExfatStreamEntry* stream = (ExfatStreamEntry*)(set + EXFAT_ENTRY_SIZE);
+    entry->attributes = file->attributes | ((file->attributes & EXFAT_ATTR_DIRECTORY) ? 0 : EXFAT_ATTR_ARCHIVE);
+    stream->data_length = file->size;
+    stream->valid_length = file->valid_length;
+    stream->first_cluster = file->chain.first_cluster;
+    stream->flags = EXFAT_ALLOCATION_POSSIBLE | (file->chain.no_fat_chain ? EXFAT_NO_FAT_CHAIN : 0);
+    entry->set_checksum = set_checksum(set, count);
+    if (!entries_write(dir, file->entry_index, count, set)) {
+        return 0;
+    }
+    file->dirty = 0;
+    volume.dirty_files--;
+    return 1;
+}
+
+void exfat_close(ExfatFile* file) {
+    // A set that cannot be written is given up with the file
+    if (!exfat_file_sync(file)) {
+        volume.dirty_files--;
+    }
+    chain_free(&file->chain);
+}
+
+// Data transfer
+
+// Move 'length' bytes at 'offset', all inside the allocated clusters. Runs of
+// clusters that are contiguous on disk are one request for their whole
+// sectors, a head or tail that does not fill a sector goes through the cache.
+static uint64_t transfer(ExfatFile* file, uint64_t offset, IoVec* iov, uint32_t iov_count,
+                         uint32_t* index, size_t* piece_offset, uint64_t length, uint8_t write) {
+    uint32_t sector_size = 1u << volume.sector_shift;
+    IoVec* slice = kmalloc(iov_count * sizeof(IoVec));
+    char* bounce = kmalloc(sector_size);
+    uint64_t done = 0;
+    if (slice == NULL || bounce == NULL) {
+        kfree(slice);
+        kfree(bounce);
+        return 0;
+    }
+
+    while (done < length) {
+        uint32_t run;
+        uint32_t cluster = chain_lookup(&file->chain, offset >> volume.cluster_shift, &run);
+        if (cluster == 0) {
+            break;
+        }
+        uint32_t sector = cluster_sector(cluster);
+        uint32_t in_run = offset & (volume.cluster_size - 1);
+        uint64_t available = ((uint64_t)run << volume.cluster_shift) - in_run;
+        uint64_t chunk = length - done < available ? length - done : available;
+
+        // Runs of a multi-GiB file can exceed what one request should carry
+        if (chunk > (1u << 30)) {
+            chunk = 1u << 30;
+        }
+        uint32_t head = (sector_size - in_run % sector_size) % sector_size;
+        if (head > chunk) {
+            head = chunk;
+        }
+        uint32_t tail = (chunk - head) % sector_size;
+        uint64_t middle = chunk - head - tail;
+
+        if (head > 0) {
+            uint8_t ok;
+            if (write) {
+                iov_copy(iov, iov_count, index, piece_offset, bounce, head, 0);
+                ok = write_at(sector, in_run, bounce, head);
+            }
+            else {
+                ok = read_at(sector, in_run, bounce, head);
+                iov_copy(iov, iov_count, index, piece_offset, bounce, head, 1);
+            }
+            if (!ok) {
+                break;
+            }
+        }
+        if (middle > 0) {
+            uint32_t first = sector + (in_run + head) / sector_size;
+            uint32_t pieces = iov_slice(iov, iov_count, index, piece_offset, middle, slice);
+            if (!(write ? writev_sectors(first, slice, pieces) : readv_sectors(first, slice, pieces))) {
+                done += head;
+                break;
+            }
+        }
+        if (tail > 0) {
+            uint32_t tail_offset = in_run + head + middle;
+            uint8_t ok;
+            if (write) {
+                iov_copy(iov, iov_count, index, piece_offset, bounce, tail, 0);
+                ok = write_at(sector, tail_offset, bounce, tail);
+            }
+            else {
+                ok = read_at(sector, tail_offset, bounce, tail);
+                iov_copy(iov, iov_count, index, piece_offset, bounce, tail, 1);
+            }
+            if (!ok) {
+                done += head + middle;
+                break;
+            }
+        }
+        done += chunk;
+        offset += chunk;
+    }
+
+    kfree(slice);
+    kfree(bounce);
+    return done;
+}
+
+uint64_t exfat_readv(ExfatFile* file, uint64_t offset, IoVec* iov, uint32_t iov_count) {
+    uint64_t length = iov_length(iov, iov_count);
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    uint64_t done = 0;
+    if (offset < file->valid_length) {
+        uint64_t valid = file->valid_length - offset < length ? file->valid_length - offset : length;
+        done = transfer(file, offset, iov, iov_count, &index, &piece_offset, valid, 0);
+        if (done < valid) {
+            return done;
+        }
+    }
+
+    // Past ValidDataLength the clusters hold whatever was there, the file reads zeros
+    while (done < length) {
+        uint32_t piece = length - done < PAGE_SIZE ? length - done : PAGE_SIZE;
+        iov_copy(iov, iov_count, &index, &piece_offset, zero_page(), piece, 1);
+        done += piece;
+    }
+    return done;
+}
+
+uint64_t exfat_writev(ExfatFile* file, uint64_t offset, IoVec* iov, uint32_t iov_count) {
+    uint64_t length = iov_length(iov, iov_count);
+    if (length == 0) {
+        return 0;
+    }
+    uint64_t needed = (offset + length + volume.cluster_size - 1) >> volume.cluster_shift;
+    if (needed > volume.cluster_count) {
+        return 0;
+    }
+    if (needed > file->chain.clusters && !chain_grow(&file->chain, needed - file->chain.clusters)) {
+        return 0;
+    }
+
+    // The gap between the valid data and the write becomes file data, zero it
+    // first. A gap that is still past the end stays unwritten.
+    if (offset > file->valid_length) {
+        uint64_t gap = offset - file->valid_length;
+        uint64_t at = file->valid_length;
+        while (gap > 0) {
+            IoVec zeros = { zero_page(), gap < PAGE_SIZE ? gap : PAGE_SIZE };
+            uint32_t index = 0;
+            size_t piece_offset = 0;
+            if (transfer(file, at, &zeros, 1, &index, &piece_offset, zeros.length, 1) != zeros.length) {
+                return 0;
+            }
+            at += zeros.length;
+            gap -= zeros.length;
+        }
+    }
+
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    uint64_t done = transfer(file, offset, iov, iov_count, &index, &piece_offset, length, 1);
+    if (offset + done > file->valid_length) {
+        file->valid_length = offset + done;
+    }
+    if (file->valid_length > file->size) {
+        file->size = file->valid_length;
+    }
+    file_touch(file);
+    return done;
+}
+
+uint8_t exfat_truncate(ExfatFile* file, uint64_t size) {
+    if (size >= file->size) {
+        return 1;
+    }
+    chain_shrink(&file->chain, (uint32_t)((size + volume.cluster_size - 1) >> volume.cluster_shift));
+    file->size = size;
+    if (file->valid_length > size) {
+        file->valid_length = size;
+    }
+    file_touch(file);
+    return 1;
+}
+
+uint8_t exfat_remove(ExfatFile* dir, char* name) {
+    uint16_t units[EXFAT_NAME_MAX];
+    uint8_t set[SET_MAX * EXFAT_ENTRY_SIZE];
+    uint32_t length = name_units(name, units);
+    ExfatDir* parent = mounted ? dir_open(dir) : NULL;
+    if (parent == NULL || length == 0) {
+        return 0;
+    }
+    uint32_t index = lookup(parent, units, length, set);
+    if (index == NO_SLOT) {
+        return 0;
+    }
+
+    ExfatFile file;
+    file_from_set(&file, parent, index, set);
+    if (file.attributes & EXFAT_ATTR_DIRECTORY) {
+        // Only an empty directory goes, and its index with it
+        ExfatDir* removed = dir_open(&file);
+        for (uint32_t i = 0; removed != NULL && i < removed->slot_count; i++) {
+            if (removed->slots[i].entry_index != NO_SLOT) {
+                removed = NULL;
+            }
+        }
+        if (removed == NULL && file.chain.first_cluster != 0) {
+            chain_free(&file.chain);
+            return 0;
+        }
+        if (removed != NULL) {
+            dir_drop(removed);
+        }
+    }
+    volume_touch();
+    chain_shrink(&file.chain, 0);
+    chain_free(&file.chain);
+    return remove_set(parent, index, set);
+}
+
+uint32_t exfat_free_clusters(void) {
+    return volume.free_count;
+}
+
+uint32_t exfat_sector_size(void) {
+    return 1u << volume.sector_shift;
+}
+
+// Write bitmap sectors [s, s + count) to the bitmap at 'chain', one request
+// per stretch that is contiguous on the disk
+static uint8_t bitmap_write(ExfatChain* chain, uint32_t s, uint32_t count) {
+    uint32_t per_cluster = volume.cluster_size >> volume.sector_shift;
+    uint64_t bitmap_bytes = (volume.cluster_count + 7) / 8;
+    uint8_t ok = 1;
+    while (count > 0) {
+        uint32_t run;
+        uint32_t cluster = chain_lookup(chain, s / per_cluster, &run);
+        uint64_t bytes = (uint64_t)s << volume.sector_shift;
+        if (cluster == 0 || bytes >= bitmap_bytes) {
+            return 0;
+        }
+        uint32_t stretch = run * per_cluster - s % per_cluster;
+        if (stretch > count) {
+            stretch = count;
+        }
+
+        // The bitmap in memory stops at the last cluster, a final partial sector goes through the cache
+        uint32_t sector = cluster_sector(cluster) + s % per_cluster;
+        uint64_t length = (uint64_t)stretch << volume.sector_shift;
+        if (bytes + length > bitmap_bytes) {
+            length = bitmap_bytes - bytes;
+        }
+        uint32_t whole = length >> volume.sector_shift;
+        if (whole > 0) {
+            IoVec piece = { (uint8_t*)volume.bitmap + bytes, (size_t)whole << volume.sector_shift };
+            ok &= writev_sectors(sector, &piece, 1);
+        }
+        if (length > ((uint64_t)whole << volume.sector_shift)) {
+            ok &= write_at(sector + whole, 0, (char*)volume.bitmap + bytes + ((uint64_t)whole << volume.sector_shift),
+                           length - ((uint64_t)whole << volume.sector_shift));
+        }
+        s += stretch;
+        count -= stretch;
+    }
+    return ok;
+}
+
+uint8_t exfat_sync(void) {
+    if (!mounted || !(volume.volume_flags & EXFAT_VOLUME_DIRTY)) {
+        return 1;
+    }
+
+    // Dirty bitmap sectors in runs, to both bitmaps of a TexFAT volume
+    uint8_t ok = 1;
+    for (uint32_t s = 0; s < volume.bitmap_sectors; ) {
+        if (!(volume.bitmap_dirty[s / 64] & (1ull << (s % 64)))) {
+            s++;
+            continue;
+        }
+        uint32_t count = 0;
+        while (s + count < volume.bitmap_sectors && (volume.bitmap_dirty[(s + count) / 64] & (1ull << ((s + count) % 64)))) {
+            volume.bitmap_dirty[(s + count) / 64] &= ~(1ull << ((s + count) % 64));
+            count++;
+        }
+        ok &= bitmap_write(&volume.bitmap_chain, s, count);
+        if (volume.bitmap_mirror.count > 0) {
+            ok &= bitmap_write(&volume.bitmap_mirror, s, count);
+        }
+        exfat_stats.bitmap_writes += count;
+        s += count;
+    }
+
+    // Everything else is in the cache. An open file whose entry set is still
+    // behind keeps the volume dirty, the set would be lost in a crash.
+    ok &= bcache_sync(volume.dev);
+    if (!ok || volume.dirty_files > 0) {
+        return ok;
+    }
+    uint8_t in_use = (uint8_t)((uint64_t)(volume.cluster_count - volume.free_count) * 100 / volume.cluster_count);
+    volume.volume_flags &= ~EXFAT_VOLUME_DIRTY;
+    write_at(0, 106, (char*)&volume.volume_flags, 2);
+    write_at(0, 112, (char*)&in_use, 1);
+    return bcache_sync(volume.dev);
+}
+
+void exfat_print_stats(void) {
+    if (!mounted) {
+        return;
+    }
+    print_str("exFAT: free clusters: ");
+    print_uint(volume.free_count);
+    print_str(" lookups: ");
+    print_uint(exfat_stats.lookups);
+    print_str(" hash rejects: ");
+    print_uint(exfat_stats.hash_rejects);
+    print_str(" contiguous extends: ");
+    print_uint(exfat_stats.contiguous_extends);
+    print_str(" chain conversions: ");
+    print_uint(exfat_stats.chain_conversions);
+    print_str(" bitmap writes: ");
+    print_uint(exfat_stats.bitmap_writes);
+    print_str("\n");
+}
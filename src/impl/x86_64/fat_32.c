@@ -5,172 +5,224 @@
 #include "common.h"
 #include "memory.h"
 #include "strings.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "bcache.h"
+#include "fat_cache.h"
+#include "fat_geometry.h"
+#include "fat_alloc.h"
+#include "fat_dir.h"
+#include "fat_journal.h"
+#include "fat_vfs.h"
+#include "pcache.h"
+#include "exfat.h"
+#include "fd.h"
 
 
 fat_type fatType; 
 BootSector boot_sector;
 
+// Scratch sector buffers and directory entry copies, kept off the boot stack
+SlabCache* sector_cache;
+SlabCache* dir_entry_cache;
+
 
 
 // This function reads the boot sector, detects the FAT type, and initializes the file system structure.
 void initialize_fat_file_system(FatFileSystem* fs, char* file)
 {
     print_set_color(GREEN, BLACK);
+    fs->device = blockdev_find(file);
+    if (fs->device == NULL) {
+        print_set_color(RED, BLACK);
+        print_str("No disk named ");
+        print_str(file);
+        print_str("\n");
+        return;
+    }
+    disk_device = fs->device;
+    // The log of the previous volume does not cover this one, journal_open starts this one's
+    journal_close();
+
     // Read the boot sector
     read_boot_sector(&fs->boot_sector);
-    // Default root cluster for FAT32
-    fs->boot_sector.root_cluster = 2;
 
-    // Calculate offset of the FAT table
-    uint32_t fat_offset = fs->boot_sector.reserved_sector_count;
-    // Calculate offset of the data region
-    uint32_t data_offset = fat_offset + fs->boot_sector.fat_count * fs->boot_sector.sectors_per_fat_32;
-    // Calculate offset of the root directory
-    uint32_t root_offset = data_offset + fs->boot_sector.root_cluster * fs->boot_sector.sectors_per_cluster;
+    // exFAT has a boot sector of its own and keeps its volume state in exfat.c
+    if (exfat_detect(&fs->boot_sector)) {
+        print_str("Detected ExFAT\n");
+        fatType = ExFAT;
+        fs->file = file;
+        if (!exfat_mount(fs->device)) {
+            print_set_color(RED, BLACK);
+            print_str("exFAT: mount failed\n");
+            return;
+        }
+        print_str("Free Clusters: ");
+        print_uint(exfat_free_clusters());
+        print_str("\n");
+        fat_vfs_mount();
+        return;
+    }
+    // Every sector and cluster computation works from this, the BPB is not read again
+    if (!fat_geometry_init(&fs->boot_sector)) {
+        print_set_color(RED, BLACK);
+        print_str("Unsupported volume geometry\n");
+        return;
+    }
+    if (fat_geometry.bytes_per_sector != fs->device->sector_size) {
+        print_str("Warning: volume and device sector sizes differ\n");
+    }
+    // root_cluster_count is the BPB field holding the root directory's first cluster
+    fs->boot_sector.root_cluster = fs->boot_sector.root_cluster_count >= 2 ? fs->boot_sector.root_cluster_count : FAT32_ROOT_DIR_CLUSTER;
+
+    // Committed metadata still in the log goes home before anything reads it
+    if (!journal_replay(fs->device, &fs->boot_sector)) {
+        print_str("Journal: replay failed\n");
+    }
 
     // Initialize the file system structure
     fs->file = file;
-    fs->fat_offset = fat_offset;
-    fs->data_offset = data_offset;
+    fs->fat_offset = fat_geometry.fat_start;
+    fs->data_offset = fat_geometry.data_start;
     fs->current_cluster = fs->boot_sector.root_cluster;
-    
-     // Total sectors in volume (including VBR):
-    uint32_t total_sectors = (fs->boot_sector.total_sectors_32 == 0) ? fs->boot_sector.total_sectors_32 : fs->boot_sector.total_sectors_16;
+
     print_str("Total Sectors: ");
-    print_int (total_sectors);
+    print_uint(fat_geometry.total_sectors);
     print_str("\n");
-    // Total sectors per cluster
     print_str("Sectors per Cluster: ");
-    print_int (fs->boot_sector.sectors_per_cluster);
+    print_uint(fat_geometry.sectors_per_cluster);
     print_str("\n");
-    // FAT size in sectors:
-    uint32_t fat_size = fs->boot_sector.sectors_per_fat_32 * fs->boot_sector.bytes_per_sector;
     print_str("FAT Size (in sectors): ");
-    print_int (fat_size);
+    print_uint(fat_geometry.sectors_per_fat);
     print_str("\n");
-    // Sectors occupied by the root directory:
-    uint32_t root_dir_sectors = ((fs->boot_sector.root_entry_count * 32) + (fs->boot_sector.bytes_per_sector - 1)) / fs->boot_sector.bytes_per_sector;
     print_str("Root Directory Sectors: ");
-    print_int (root_dir_sectors);
+    print_uint(fat_geometry.root_dir_sectors);
     print_str("\n");
-    // First data sector number:
-    uint32_t first_data_sector = fs->boot_sector.reserved_sector_count + (fs->boot_sector.fat_count * fat_size) + root_dir_sectors;
     print_str("First Data Sector: ");
-    print_int (first_data_sector);
+    print_uint(fat_geometry.data_start);
     print_str("\n");
-    // Total data sectors:
-    uint32_t first_fat_sector = fs->boot_sector.reserved_sector_count;
     print_str("First FAT Sector: ");
-    print_int (first_fat_sector);
+    print_uint(fat_geometry.fat_start);
     print_str("\n");
-    // Total data sectors:
-    uint32_t data_sectors = total_sectors - (fs->boot_sector.reserved_sector_count + (fs->boot_sector.fat_count * fat_size) + root_dir_sectors);
     print_str("Data Sectors: ");
-    print_int (data_sectors);
+    print_uint(fat_geometry.total_sectors - fat_geometry.data_start);
     print_str("\n");
-    // Total clusters in volume:
-    uint32_t total_clusters = data_sectors / fs->boot_sector.sectors_per_cluster;
     print_str("Total Clusters: ");
-    print_int (total_clusters);
+    print_uint(fat_geometry.cluster_count);
     print_str("\n");
 
     print_set_color(YELLOW, BLACK);
     print_str("\nFile system initialized:\n");
-    fs->boot_sector.total_clusters = total_clusters;
+    fs->boot_sector.total_clusters = fat_geometry.cluster_count;
     identify_fat_system(fs->boot_sector.total_clusters);
+
+    // FAT lookups are served from memory from here on
+    if (!fat_cache_init(fs->device, &fs->boot_sector)) {
+        print_str("FAT cache: out of memory\n");
+    }
+    // Free clusters come from a bitmap built off the cached FAT
+    else if (!fat_alloc_init(fs->device, &fs->boot_sector)) {
+        print_str("Free cluster bitmap: out of memory\n");
+    }
+    print_str("Free Clusters: ");
+    print_uint(fs->boot_sector.fs_info_free_cluster_count);
+    print_str("\n");
+
+    // The sector and FAT helpers in hdd.c work on the global copy
+    memCpy(&boot_sector, &fs->boot_sector, sizeof(BootSector));
+
+    // Sector buffers are sized by the volume, so the caches are made at mount
+    if (sector_cache == NULL) {
+        sector_cache = kmem_cache_create("fat-sector", fat_geometry.bytes_per_sector, 16, 0);
+        dir_entry_cache = kmem_cache_create("fat-dirent", sizeof(DirectoryEntry), 32, 0);
+    }
+
+    // Metadata changes are grouped into transactions in the log from here on
+    if (!journal_open(fs->device)) {
+        print_str("Journal: unavailable, metadata is written in place\n");
+    }
+    // The volume is the root of the file tree
+    fat_vfs_mount();
+}
+
+uint8_t fat_sync(void)
+{
+    if (fatType == ExFAT) {
+        return exfat_sync();
+    }
+    // File pages first, their writeback marks clusters written
+    uint8_t ok = pcache_sync();
+    ok &= fat_alloc_sync();
+    // With a log the metadata is durable once its transaction is, homes are written at checkpoints
+    if (journal_active()) {
+        return journal_commit() && ok;
+    }
+    // FAT first, its writes bypass the buffer cache, then FSInfo and the cached data and directory sectors
+    ok &= fat_cache_sync();
+    return bcache_sync(disk_device) && ok;
 }
 
 //
 void read_boot_sector(BootSector* bs)
 {
-    // Disk is memory-mapped at address 0x100000
-    uint8_t *disk = (uint8_t *)0x100000;
-
-    // Copy the boot sector into the structure
-    memCpy(bs, disk, sizeof(BootSector));
+    // Copy the boot sector into the structure, a RAM disk copies straight out of the module
+    read_sector(0, (char*)bs, sizeof(BootSector));
+}
 
+// The directory, batch and cluster helpers below work on FAT volumes only,
+// an exFAT volume is reached through the VFS
+static uint8_t fat_volume(void) {
+    return fatType != ExFAT;
 }
 
-// Function to find an empty directory entry in a cluster
+// Find a file in the root directory through its hashed index
 uint32_t find_directory_entry(DirectoryEntry* entry, char* filename) {
+    if (!fat_volume()) {
+        return 0;
+    }
+    return dir_lookup(root_directory_cluster(), filename, entry, NULL);
+}
 
-    read_boot_sector(&boot_sector);
-    // Calculate the sector number of the first sector in the cluster
-    uint32_t root_dir_sectors = ((boot_sector.root_entry_count * 32) + (boot_sector.bytes_per_sector - 1)) / boot_sector.bytes_per_sector;
-    uint32_t first_data_sector = boot_sector.reserved_sector_count + (boot_sector.fat_count * boot_sector.table_size_16) + root_dir_sectors;
-    uint32_t first_sectorofRootDir = first_data_sector - root_dir_sectors;
-
-    // Read the sector into a buffer
-    char buffer[boot_sector.bytes_per_sector];
-    read_sector(first_sectorofRootDir, buffer, boot_sector.bytes_per_sector);
-
-    // Iterate over all directory entries in the cluster
-    for (size_t i = 0; i < boot_sector.bytes_per_sector; i += 32) {
-        // Check if the entry is unused
-        if (strEqual((buffer + i), filename) == 0) {
-            // Copy the directory entry into a structure
-            memCpy(entry, buffer + i, sizeof(DirectoryEntry));
-            return one;
-        }
+// Build the 8.3 name from a base name and an extension given apart
+static uint8_t entry_name(char* filename, char* extension, uint8_t* name) {
+    if (strChr(filename, '.') != NULL || extension == NULL || extension[0] == '\0') {
+        return fat_name_normalize(filename, name);
     }
 
-    // No empty entry found in this cluster
-    return zero;
+    char full[FILENAME_LENGTH + EXTENSION_LENGTH + 2];
+    uint32_t base = strLength(filename);
+    uint32_t ext = strLength(extension);
+    if (base > FILENAME_LENGTH || ext > EXTENSION_LENGTH) {
+        return 0;
+    }
+    memCpy(full, filename, base);
+    full[base] = '.';
+    memCpy(full + base + 1, extension, ext);
+    full[base + 1 + ext] = '\0';
+    return fat_name_normalize(full, name);
 }
 
+// Fill 'entry' and store it in the root directory, over the file's current entry when it has one
 void update_directory_entry(DirectoryEntry* entry, char* filename, char* extension, uint8_t attributes, uint32_t first_cluster, uint32_t file_size) {
-    read_boot_sector(&boot_sector);
-
-    // root directory sector
-    uint32_t root_dir_sectors = ((boot_sector.root_entry_count * 32) + (boot_sector.bytes_per_sector - 1)) / boot_sector.bytes_per_sector;
-    uint32_t first_data_sector = boot_sector.reserved_sector_count + (boot_sector.fat_count * boot_sector.table_size_16) + root_dir_sectors;
-    uint32_t first_sectorofRootDir = first_data_sector - root_dir_sectors;
-
-    // Read the root directory into a buffer
-    char buffer[boot_sector.bytes_per_sector];
-    read_sector(first_sectorofRootDir, buffer, boot_sector.bytes_per_sector);
-
-    // Find an empty directory entry (first byte of filename will be 0x00)
-    for (int i = 0; i < boot_sector.bytes_per_sector; i += 32) {
-        if (buffer[i] == 0x00) {
-            // Find an available cluster
-            uint32_t firstCluster = allocate_cluster();
-
-            // If no available cluster was found, print an error message and return
-            if (firstCluster == 0) {
-                // Replace this with your actual VGA print function
-                print_str("\nNo available clusters found\n");
-                return;
-            }
-
-            // Copy the filename and extension
-            memCpy(buffer + i, filename, FILENAME_LENGTH);
-            memCpy(buffer + i + 8, extension, EXTENSION_LENGTH);
-
-            // Set the file attributes
-            buffer[i + 11] = attributes;
-
-            // Set the file size
-            *(uint32_t*)(buffer + i + 28) = file_size;
-
-            // Set the first cluster
-            *(uint16_t*)(buffer + i + 26) = firstCluster;
-
-            // Write the sector back to disk
-            write_sector(first_sectorofRootDir, buffer, boot_sector.bytes_per_sector);
+    if (!fat_volume()) {
+        print_str("\nNot a FAT volume\n");
+        return;
+    }
+    uint8_t name[DIR_NAME_LENGTH];
+    if (!entry_name(filename, extension, name)) {
+        print_str("\nInvalid file name\n");
+        return;
+    }
 
-            // Replace this with your actual VGA print function
-            print_str("\nFile created successfully: ");
-            print_str(filename);
-            print_str("\nFile size: ");
-            print_int(file_size);
-            return;
-        }
+    uint32_t dir = root_directory_cluster();
+    uint32_t slot;
+    uint8_t exists = dir_find(dir, name, entry, &slot);
+    if (!exists) {
+        memSet(entry, 0, sizeof(DirectoryEntry));
     }
-    
+
     // Copy the filename and extension
-    memCpy(entry->filename, filename, FILENAME_LENGTH);
-    memCpy(entry->ext, extension, EXTENSION_LENGTH);
+    memCpy(entry->filename, name, DIR_NAME_LENGTH);
 
     // Set the file attributes
     entry->attributes = attributes;
@@ -181,6 +233,272 @@ void update_directory_entry(DirectoryEntry* entry, char* filename, char* extensi
     // Set the first cluster
     entry->cluster_low = first_cluster & 0xFFFF;
     entry->cluster_high = (first_cluster >> 16) & 0xFFFF;
+
+    if (exists ? !dir_write_entry(dir, slot, entry) : !dir_add_entry(dir, entry, NULL)) {
+        print_str("\nNo empty directory entries found\n");
+    }
+    journal_maybe_commit();
+}
+
+// Where a file of a batch went, the entry slot and its first cluster
+typedef struct {
+    uint32_t slot;
+    uint32_t first;
+} BatchSlot;
+
+// The contents of a batch, gathered into writes of consecutive sectors
+typedef struct {
+    IoVec iov[FAT_BATCH_IOV];
+    uint32_t pieces;
+    uint32_t sector;                // where the gathered data starts
+    uint32_t next_sector;           // sector right after it
+    uint8_t ok;
+} BatchWriter;
+
+static void batch_flush(BatchWriter* w) {
+    if (w->pieces > 0) {
+        w->ok &= writev_sectors(w->sector, w->iov, w->pieces);
+        w->pieces = 0;
+    }
+}
+
+// Queue 'clusters' clusters from 'cluster' that hold 'length' bytes of 'data'.
+// The rest of the last one is zeros, so the next file's clusters follow in the same request.
+static void batch_add(BatchWriter* w, uint32_t cluster, uint32_t clusters, char* data, uint64_t length) {
+    uint32_t sector = cluster_to_sector(cluster);
+    uint64_t pad = ((uint64_t)clusters << fat_cluster_shift()) - length;
+    uint32_t zero_pieces = (pad + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (w->pieces > 0 && (sector != w->next_sector || w->pieces + 1 + zero_pieces > FAT_BATCH_IOV)) {
+        batch_flush(w);
+    }
+    if (w->pieces == 0) {
+        w->sector = sector;
+    }
+
+    if (length > 0) {
+        w->iov[w->pieces].base = data;
+        w->iov[w->pieces].length = length;
+        w->pieces++;
+    }
+    while (pad > 0) {
+        w->iov[w->pieces].base = zero_page();
+        w->iov[w->pieces].length = pad < PAGE_SIZE ? pad : PAGE_SIZE;
+        pad -= w->iov[w->pieces].length;
+        w->pieces++;
+    }
+    w->next_sector = sector + (clusters << (fat_cluster_shift() - fat_sector_shift()));
+    fat_mark_written(cluster, clusters);
+}
+
+// Next file from 'i' on that was added and has contents
+static uint32_t batch_next(FatBatchCreate* files, uint32_t count, uint32_t i) {
+    while (i < count && (files[i].status != FAT_BATCH_OK || files[i].size == 0)) {
+        i++;
+    }
+    return i;
+}
+
+// Take back every file the batch added, they end with 'status'. Each removal
+// is whole, a full transaction is committed between two of them.
+static void batch_undo(FatBatchCreate* files, BatchSlot* slots, uint32_t count, uint32_t dir, uint8_t status) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (files[i].status != FAT_BATCH_OK) {
+            continue;
+        }
+        journal_reserve(FAT_BATCH_ENTRY_SECTORS);
+        if (slots[i].first != 0) {
+            fat_free_chain(slots[i].first);
+        }
+        dir_remove_entry(dir, slots[i].slot);
+        files[i].status = status;
+    }
+}
+
+// Add, fill and point the entries of the files from 'start' on, as many as
+// the transaction has directory sectors for. Returns where the part ends.
+static uint32_t batch_part(FatBatchCreate* files, BatchSlot* slots, BatchWriter* w, uint32_t start, uint32_t count,
+                           uint32_t dir, uint8_t* status) {
+    uint8_t name[DIR_NAME_LENGTH];
+    DirectoryEntry entry;
+
+    // Entries go in empty, a name that repeats in the batch finds the earlier one.
+    // Once one cannot be added the batch is given up, the rest are not tried.
+    uint64_t clusters = 0;
+    uint32_t i;
+    for (i = start; i < count; i++) {
+        if (*status != FAT_BATCH_OK) {
+            files[i].status = *status;
+            continue;
+        }
+        if (journal_room() < FAT_BATCH_ENTRY_SECTORS) {
+            break;
+        }
+        if (!fat_name_normalize(files[i].name, name)) {
+            files[i].status = FAT_BATCH_INVALID;
+            continue;
+        }
+        if (dir_find(dir, name, NULL, NULL)) {
+            files[i].status = FAT_BATCH_EXISTS;
+            continue;
+        }
+        memSet(&entry, 0, sizeof(DirectoryEntry));
+        memCpy(entry.filename, name, DIR_NAME_LENGTH);
+        entry.attributes = ATTR_ARCHIVE;
+        if (!dir_add_entry(dir, &entry, &slots[i].slot)) {
+            files[i].status = FAT_BATCH_NO_SPACE;
+            *status = FAT_BATCH_NO_SPACE;
+            continue;
+        }
+        files[i].status = FAT_BATCH_OK;
+        clusters += ((uint64_t)files[i].size + fat_cluster_mask()) >> fat_cluster_shift();
+    }
+    uint32_t end = i;
+
+    // Every cluster of the part from as few runs as the free space allows,
+    // each run dealt out to the files in order and their contents written
+    if (*status == FAT_BATCH_OK && clusters > fat_free_clusters()) {
+        *status = FAT_BATCH_NO_SPACE;
+    }
+    w->pieces = 0;
+    w->ok = 1;
+    uint32_t f = batch_next(files, end, start);
+    uint64_t written = 0;
+    uint32_t tail = 0;
+    while (*status == FAT_BATCH_OK && f < end) {
+        uint32_t length;
+        uint32_t run = fat_alloc_extent(clusters, &length);
+        if (run == 0) {
+            *status = FAT_BATCH_NO_SPACE;
+            break;
+        }
+        clusters -= length;
+
+        for (uint32_t used = 0; used < length && f < end; ) {
+            uint32_t need = (files[f].size - written + fat_cluster_mask()) >> fat_cluster_shift();
+            uint32_t take = need < length - used ? need : length - used;
+            uint32_t cluster = run + used;
+            if (slots[f].first == 0) {
+                slots[f].first = cluster;
+            }
+            else {
+                fat_cache_set(tail, cluster);
+            }
+            uint64_t bytes = (uint64_t)take << fat_cluster_shift();
+            if (bytes > files[f].size - written) {
+                bytes = files[f].size - written;
+            }
+            batch_add(w, cluster, take, (char*)files[f].data + written, bytes);
+            used += take;
+            written += bytes;
+            tail = cluster + take - 1;
+            if (written == files[f].size) {
+                fat_cache_set(tail, FAT32_EOF);
+                f = batch_next(files, end, f + 1);
+                written = 0;
+            }
+        }
+    }
+    batch_flush(w);
+    if (*status == FAT_BATCH_OK && !w->ok) {
+        *status = FAT_BATCH_FAILED;
+    }
+
+    // The contents are on the device, now the entries can point at them
+    for (uint32_t i = start; *status == FAT_BATCH_OK && i < end; i++) {
+        if (files[i].status != FAT_BATCH_OK) {
+            continue;
+        }
+        fat_name_normalize(files[i].name, name);
+        memSet(&entry, 0, sizeof(DirectoryEntry));
+        memCpy(entry.filename, name, DIR_NAME_LENGTH);
+        entry.attributes = ATTR_ARCHIVE;
+        entry.file_size = files[i].size;
+        entry.cluster_low = slots[i].first & 0xFFFF;
+        entry.cluster_high = (slots[i].first >> 16) & 0xFFFF;
+        if (files[i].size > 0 && !dir_write_entry(dir, slots[i].slot, &entry)) {
+            *status = FAT_BATCH_FAILED;
+        }
+    }
+    return end;
+}
+
+uint32_t create_files_batch(FatBatchCreate* files, uint32_t count) {
+    if (!fat_volume()) {
+        for (uint32_t i = 0; i < count; i++) {
+            files[i].status = FAT_BATCH_UNSUPPORTED;
+        }
+        return 0;
+    }
+    uint32_t dir = root_directory_cluster();
+    BatchSlot* slots = kmalloc(count * sizeof(BatchSlot));
+    BatchWriter* w = kmalloc(sizeof(BatchWriter));
+
+    // Room for every entry first, the directory grows once instead of a cluster at a time
+    if (slots == NULL || w == NULL || !dir_reserve(dir, count)) {
+        for (uint32_t i = 0; i < count; i++) {
+            files[i].status = FAT_BATCH_NO_SPACE;
+        }
+        kfree(slots);
+        kfree(w);
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        slots[i].first = 0;
+    }
+
+    // A batch whose entries do not fit one transaction goes in as several,
+    // each one a whole number of files. A crash can leave the first ones in.
+    uint8_t status = FAT_BATCH_OK;
+    uint32_t start = 0;
+    while (status == FAT_BATCH_OK && start < count) {
+        if (!journal_reserve(JOURNAL_BUFFER_LIMIT)) {
+            status = FAT_BATCH_FAILED;
+            break;
+        }
+        start = batch_part(files, slots, w, start, count, dir, &status);
+    }
+    for (uint32_t i = start; i < count; i++) {
+        files[i].status = status;
+    }
+
+    // A batch goes in whole or not at all
+    uint32_t created = 0;
+    if (status != FAT_BATCH_OK) {
+        batch_undo(files, slots, count, dir, status);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        created += files[i].status == FAT_BATCH_OK;
+    }
+    kfree(slots);
+    kfree(w);
+    journal_maybe_commit();
+    return created;
+}
+
+uint32_t stat_dir_batch(FatBatchStat* files, uint32_t count) {
+    if (!fat_volume()) {
+        for (uint32_t i = 0; i < count; i++) {
+            files[i].status = FAT_BATCH_UNSUPPORTED;
+        }
+        return 0;
+    }
+    // The first lookup builds the directory's index in one pass, the rest are hash probes
+    uint32_t dir = root_directory_cluster();
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t name[DIR_NAME_LENGTH];
+        if (!fat_name_normalize(files[i].name, name)) {
+            files[i].status = FAT_BATCH_INVALID;
+        }
+        else if (!dir_find(dir, name, &files[i].entry, NULL)) {
+            files[i].status = FAT_BATCH_MISSING;
+        }
+        else {
+            files[i].status = FAT_BATCH_OK;
+            found++;
+        }
+    }
+    return found;
 }
 
 // Identify fat system
@@ -213,65 +531,55 @@ void identify_fat_system(uint32_t total_clusters) {
 
 // write file
 void write_file(char* filename, uint32_t* FAT, uint32_t file_size) {
-    // Find the directory entry for the file
-    DirectoryEntry entry;
-    if (!find_directory_entry(&entry, filename)) {
+    // The FAT is reached through the FAT cache now, 'FAT' is not used anymore
+    (void)FAT;
+    int32_t fd = sys_open(filename, O_WRONLY | O_TRUNC);
+    if (fd < 0) {
         // Replace this with your actual VGA print function
         print_str("\nFile not found\n");
         return;
     }
 
-    // Allocate a new cluster chain for the file
-    uint32_t first_cluster = allocate_cluster();
-    update_cluster(first_cluster);
-    FAT[first_cluster] = FAT32_EOF;
-
-    // Update the directory entry
-    update_directory_entry(&entry, filename, "txt", 0x20, first_cluster, file_size);
-
-    // Write the file content to disk
-    write_cluster(first_cluster, "Hello World!", file_size);
+    // Write the file content, never past the end of the text
+    char* content = "Hello World!";
+    uint32_t length = strLength(content) + 1;
+    int64_t written = sys_write(fd, content, file_size < length ? file_size : length);
+    sys_close(fd);
 
     // Replace this with your actual VGA print function
-    print_str("\nFile written successfully\n");
+    print_str(written < 0 ? "\nWrite failed\n" : "\nFile written successfully\n");
 }
 
 // read_file
 void read_file(char* filename, char* buffer, uint32_t buffer_size) {
-
-    char* name[FILENAME_LENGTH + 1];
-    char* ext[EXTENSION_LENGTH + 1];
-
-    // Parse the filename and extension
-    //parse_filename(filename, name, ext);
+    if (buffer_size == 0) {
+        return;
+    }
 
     // Find the directory entry for the file
-    DirectoryEntry newEntry;
-    if (find_directory_entry(&newEntry, filename) == 0) {
+    int32_t fd = sys_open(filename, O_RDONLY);
+    if (fd < 0) {
         // Replace this with your actual VGA print function
         print_str("\nFile not found\n");
         return;
     }
 
-    // Read the content of the file
-    read_cluster(newEntry.cluster_low | (newEntry.cluster_high << 16), buffer, buffer_size);
+    // Read the content of the file, following the whole cluster chain
+    int64_t length = sys_read(fd, buffer, buffer_size - 1);
+    buffer[length < 0 ? 0 : length] = '\0';
+    sys_close(fd);
 
     print_str("\nData read completed\n");
     print_str("\nFile content:\n");
     print_str(buffer);
     print_str("\n");
-    buffer[newEntry.file_size] = '\0';
-
 }
 
 void read_cluster(uint32_t cluster, char* buffer, uint32_t buffer_size) {
-    read_boot_sector(&boot_sector);
-
-    // Calculate the sector number of the first sector in the cluster
-    uint32_t first_sector_of_cluster = ((cluster - 2) * boot_sector.sectors_per_cluster) + boot_sector.reserved_sector_count + (boot_sector.fat_count * boot_sector.sectors_per_fat_32) + ((boot_sector.root_entry_count * 32) + (boot_sector.bytes_per_sector - 1)) / boot_sector.bytes_per_sector;
-
-    // Read the cluster into a buffer
-    read_sector(first_sector_of_cluster, buffer, buffer_size);
+    if (!fat_volume()) {
+        return;
+    }
+    read_sector(cluster_to_sector(cluster), buffer, buffer_size);
 }
 
 // Parse the filename and extension
@@ -296,70 +604,40 @@ void parse_filename(char* filename, char* name, char* ext) {
 }
 
 void create_file(char* filename, FatFileSystem* fs) {
+    // Entries go to the mounted volume's root directory, 'fs' is not needed
+    (void)fs;
     print_set_color(RED, BLACK);
-    read_boot_sector(&fs->boot_sector);
-
-    char name[FILENAME_LENGTH + 1];
-    char ext[EXTENSION_LENGTH + 1];
-
-    // Parse the filename and extension
-    parse_filename(filename, name, ext);
-
-    // Sectors occupied by the root directory:
-    uint32_t root_dir_sectors = ((fs->boot_sector.root_entry_count * 32) + (fs->boot_sector.bytes_per_sector - 1)) / fs->boot_sector.bytes_per_sector;
-
-    uint32_t fat_size = fs->boot_sector.sectors_per_fat_32 * fs->boot_sector.bytes_per_sector;
-
-    // First data sector number:
-    uint32_t first_data_sector = fs->boot_sector.reserved_sector_count + (fs->boot_sector.fat_count * fat_size) + root_dir_sectors;
-
-    // Total data sectors:
-    uint32_t first_fat_sector = fs->boot_sector.reserved_sector_count;
-
-    char buff[fs->boot_sector.bytes_per_sector];
-    read_sector(first_data_sector, buff, fs->boot_sector.bytes_per_sector);
-
-    // Find an empty directory entry (first byte of filename will be 0x00)
-    for (int i = 0; i < fs->boot_sector.bytes_per_sector; i += 64)
-    {
-        if (buff[i] == '\0')
-        {
-            // Find an available cluster
-            uint32_t first_cluster = allocate_cluster();
-
-            // If no available cluster was found, print an error message and return
-            if (first_cluster == 0)
-            {
-                print_str("\nNo available clusters found\n");
-                print_str("\n");
-                return;
-            }
-
-            DirectoryEntry entry;
-            // Copy the filename and extension
-            memCpy(entry.filename, filename, FILENAME_LENGTH);
-            memCpy(entry.ext, ext, EXTENSION_LENGTH);
-
-            // Set the file attributes
-            entry.attributes = 0x20;
-
-            // Set the file size
-            *(uint32_t *)&entry.file_size = FILE_SIZE;
+    if (!fat_volume()) {
+        print_str("\nNot a FAT volume\n");
+        return;
+    }
 
-            // Set the first cluster
-            *(uint16_t *)&entry.cluster_low = first_cluster;
+    uint8_t name[DIR_NAME_LENGTH];
+    if (!fat_name_normalize(filename, name)) {
+        print_str("\nInvalid file name\n");
+        return;
+    }
 
-            // Write the directory entry back to the buffer
-            memCpy(buff + i, &entry, sizeof(DirectoryEntry));
+    // One hash probe instead of a directory scan, missing names are cached too
+    uint32_t dir = root_directory_cluster();
+    if (dir_find(dir, name, NULL, NULL)) {
+        print_str("\nFile already exists\n");
+        return;
+    }
 
-            // Write the sector back to disk
-            write_sector(first_data_sector, buff, fs->boot_sector.bytes_per_sector);
+    DirectoryEntry* entry = kmem_cache_alloc(dir_entry_cache);
+    if (entry == NULL) {
+        return;
+    }
+    memSet(entry, 0, sizeof(DirectoryEntry));
 
-            // Update the directory entry
-            update_directory_entry(&entry, name, ext, 0x20, first_cluster, 0);
+    // An empty file owns no cluster until it is written
+    memCpy(entry->filename, name, DIR_NAME_LENGTH);
+    entry->attributes = ATTR_ARCHIVE;
 
-            return;
-        }
+    if (!dir_add_entry(dir, entry, NULL)) {
+        print_str("\nNo empty directory entries found\n");
     }
-    print_str("\nNo empty directory entries found\n");
-} 
+    kmem_cache_free(dir_entry_cache, entry);
+    journal_maybe_commit();
+}
@@ -0,0 +1,515 @@
+#include "fat_alloc.h"
+#include "fat_geometry.h"
+#include "fat_cache.h"
+#include "fat_journal.h"
+#include "bcache.h"
+#include "constants.h"
+#include "cpu.h"
+#include "kmalloc.h"
+#include "vga.h"
+
+static BlockDev* device;
+static uint64_t* free_map;          // one bit per cluster, set when the cluster is free
+static uint64_t* unwritten_map;     // set while an allocated cluster has not been written yet
+static uint32_t cluster_limit;      // clusters 2 .. cluster_limit - 1 exist
+static uint32_t free_count;
+static uint32_t next_free;          // next-fit cursor, saved as the FSInfo hint
+static uint16_t fs_info_sector;     // 0 when the volume has no valid FSInfo
+static uint8_t fs_info_dirty;
+static FatAllocStats stats;
+
+// Free runs of one group of FAT_RUN_GROUP_CLUSTERS clusters, so find_run can
+// step over a group whose holes are all too short without visiting each one
+typedef struct {
+    uint16_t tail;                  // free clusters at the group's end, the run may go on in the next group
+    uint16_t longest;               // longest free run inside the group
+    uint16_t longest_at;            // its first cluster, from the group's first
+    uint8_t stale;                  // the bitmap changed since, recounted on the next look
+} RunGroup;
+
+static RunGroup* groups;
+static uint32_t map_bits;           // clusters the bitmaps have room for
+
+// Entries have their reserved top bits masked off before the compare
+static const uint32_t entry_mask[8] __attribute__((aligned(32))) = {
+    FAT_ENTRY_MASK, FAT_ENTRY_MASK, FAT_ENTRY_MASK, FAT_ENTRY_MASK,
+    FAT_ENTRY_MASK, FAT_ENTRY_MASK, FAT_ENTRY_MASK, FAT_ENTRY_MASK
+};
+
+// Bit i of the result is set when entries[i] is zero, 64 entries per call
+static uint64_t free_bits_sse(uint32_t* entries)
+{
+    uint64_t word = 0;
+
+    for (uint32_t i = 0; i < 64; i += 16)
+    {
+        uint32_t bits;
+        asm volatile("movdqa   (%2), %%xmm5\n\t"
+                     "pxor     %%xmm4, %%xmm4\n\t"
+                     "movdqu   (%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "pand     %%xmm5, %%xmm0\n\t"
+                     "pand     %%xmm5, %%xmm1\n\t"
+                     "pand     %%xmm5, %%xmm2\n\t"
+                     "pand     %%xmm5, %%xmm3\n\t"
+                     "pcmpeqd  %%xmm4, %%xmm0\n\t"
+                     "pcmpeqd  %%xmm4, %%xmm1\n\t"
+                     "pcmpeqd  %%xmm4, %%xmm2\n\t"
+                     "pcmpeqd  %%xmm4, %%xmm3\n\t"
+                     "movmskps %%xmm0, %0\n\t"
+                     "movmskps %%xmm1, %%edx\n\t"
+                     "shl      $4, %%edx\n\t"
+                     "or       %%edx, %0\n\t"
+                     "movmskps %%xmm2, %%edx\n\t"
+                     "shl      $8, %%edx\n\t"
+                     "or       %%edx, %0\n\t"
+                     "movmskps %%xmm3, %%edx\n\t"
+                     "shl      $12, %%edx\n\t"
+                     "or       %%edx, %0"
+                     : "=&r" (bits)
+                     : "r" (entries + i), "r" (entry_mask)
+                     : "rdx", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "memory");
+        word |= (uint64_t)bits << i;
+    }
+    return word;
+}
+
+static uint64_t free_bits_avx2(uint32_t* entries)
+{
+    uint64_t word = 0;
+
+    for (uint32_t i = 0; i < 64; i += 16)
+    {
+        uint32_t bits;
+        asm volatile("vmovdqa   (%2), %%ymm5\n\t"
+                     "vpxor     %%ymm4, %%ymm4, %%ymm4\n\t"
+                     "vpand     (%1), %%ymm5, %%ymm0\n\t"
+                     "vpand   32(%1), %%ymm5, %%ymm1\n\t"
+                     "vpcmpeqd  %%ymm4, %%ymm0, %%ymm0\n\t"
+                     "vpcmpeqd  %%ymm4, %%ymm1, %%ymm1\n\t"
+                     "vmovmskps %%ymm0, %0\n\t"
+                     "vmovmskps %%ymm1, %%edx\n\t"
+                     "shl       $8, %%edx\n\t"
+                     "or        %%edx, %0"
+                     : "=&r" (bits)
+                     : "r" (entries + i), "r" (entry_mask)
+                     : "rdx", "xmm0", "xmm1", "xmm4", "xmm5", "memory");
+        word |= (uint64_t)bits << i;
+    }
+    asm volatile("vzeroupper" : : : "memory");
+    return word;
+}
+
+// Population count without POPCNT, the kernel is built for baseline x86_64
+static uint32_t count_bits(uint64_t word)
+{
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (word * 0x0101010101010101ULL) >> 56;
+}
+
+static uint8_t is_set(uint64_t* map, uint32_t cluster)
+{
+    return (map[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+static uint8_t is_free(uint32_t cluster)
+{
+    return is_set(free_map, cluster);
+}
+
+static void mark_bits(uint64_t* map, uint32_t first, uint32_t count, uint8_t value)
+{
+    for (uint32_t cluster = first; cluster < first + count; cluster++) {
+        if (value) {
+            map[cluster / 64] |= 1ULL << (cluster % 64);
+        }
+        else {
+            map[cluster / 64] &= ~(1ULL << (cluster % 64));
+        }
+    }
+}
+
+static void mark(uint32_t first, uint32_t count, uint8_t free)
+{
+    mark_bits(free_map, first, count, free);
+    if (groups != NULL && count > 0) {
+        for (uint32_t g = first >> FAT_RUN_GROUP_SHIFT; g <= (first + count - 1) >> FAT_RUN_GROUP_SHIFT; g++) {
+            groups[g].stale = 1;
+        }
+    }
+}
+
+// First cluster in [cluster, end) whose bit in 'map' equals 'value', 'end' when there is none
+static uint32_t find_bit_in(uint64_t* map, uint32_t cluster, uint32_t end, uint8_t value)
+{
+    while (cluster < end) {
+        uint64_t word = map[cluster / 64];
+        if (!value) {
+            word = ~word;
+        }
+        word >>= cluster % 64;
+        if (word != 0) {
+            cluster += __builtin_ctzll(word);
+            return cluster < end ? cluster : end;
+        }
+        cluster = (cluster / 64 + 1) * 64;
+    }
+    return end;
+}
+
+// First cluster in [cluster, end) whose bit equals 'free', 'end' when there is none
+static uint32_t find_bit(uint32_t cluster, uint32_t end, uint8_t free)
+{
+    return find_bit_in(free_map, cluster, end, free);
+}
+
+static uint32_t group_end(uint32_t g)
+{
+    uint32_t end = (g + 1) << FAT_RUN_GROUP_SHIFT;
+    return end < map_bits ? end : map_bits;
+}
+
+// Summary of group 'g', recounted when an allocation or a free touched it since
+static RunGroup* group_summary(uint32_t g)
+{
+    RunGroup* group = &groups[g];
+    if (!group->stale) {
+        return group;
+    }
+
+    uint32_t base = g << FAT_RUN_GROUP_SHIFT;
+    uint32_t end = group_end(g);
+    uint32_t cluster = base;
+    group->tail = 0;
+    group->longest = 0;
+    group->longest_at = 0;
+    while ((cluster = find_bit(cluster, end, 1)) < end) {
+        uint32_t run_end = find_bit(cluster, end, 0);
+        if (run_end - cluster > group->longest) {
+            group->longest = run_end - cluster;
+            group->longest_at = cluster - base;
+        }
+        if (run_end == end) {
+            group->tail = run_end - cluster;
+        }
+        cluster = run_end;
+    }
+    group->stale = 0;
+    return group;
+}
+
+// Where the search from 'cluster' goes on. A group whose runs are all shorter
+// than 'want' is skipped up to its trailing run, which may continue in the
+// next group, and its longest run is kept in case nothing fits.
+static uint32_t skip_short_runs(uint32_t cluster, uint32_t end, uint32_t want, uint32_t* longest, uint32_t* longest_length)
+{
+    uint32_t g = cluster >> FAT_RUN_GROUP_SHIFT;
+    RunGroup* group = group_summary(g);
+    if (group->longest >= want) {
+        return cluster;
+    }
+    if (group->longest > *longest_length) {
+        *longest = (g << FAT_RUN_GROUP_SHIFT) + group->longest_at;
+        *longest_length = group->longest;
+    }
+    uint32_t next = group_end(g) - group->tail;
+    if (next <= cluster) {
+        return cluster;
+    }
+    return next < end ? next : end;
+}
+
+// Free run for 'want' clusters. With 'first_fit' the first run from the cursor
+// that is long enough wins, otherwise the shortest such run, ties going to the
+// one met first. *length is the run length, when nothing is long enough the
+// longest run is returned instead.
+static uint32_t find_run(uint32_t want, uint8_t first_fit, uint32_t* length)
+{
+    uint32_t best = 0, best_length = 0;
+    uint32_t longest = 0, longest_length = 0;
+
+    // From the cursor to the end of the volume, then from the start up to the cursor
+    for (uint8_t pass = 0; pass < 2; pass++) {
+        uint32_t cluster = pass == 0 ? next_free : 2;
+        uint32_t end = pass == 0 ? cluster_limit : next_free;
+
+        // A run starting before the cursor is measured whole, it may go on past it
+        while ((cluster = skip_short_runs(cluster, end, want, &longest, &longest_length)) < end &&
+               (cluster = find_bit(cluster, end, 1)) < end) {
+            uint32_t run_end = find_bit(cluster, cluster_limit, 0);
+            uint32_t run_length = run_end - cluster;
+
+            if (run_length >= want && (best_length == 0 || run_length < best_length)) {
+                best = cluster;
+                best_length = run_length;
+                if (first_fit || run_length == want) {
+                    *length = best_length;
+                    return best;
+                }
+            }
+            if (run_length > longest_length) {
+                longest = cluster;
+                longest_length = run_length;
+            }
+            cluster = run_end;
+        }
+    }
+
+    if (best_length != 0) {
+        *length = best_length;
+        return best;
+    }
+    *length = longest_length;
+    return longest;
+}
+
+static void read_fs_info(BootSector* bs)
+{
+    fs_info_sector = 0;
+    if (bs->fs_info_sector == 0 || bs->fs_info_sector == 0xFFFF) {
+        return;
+    }
+
+    Buffer* buf = bcache_get(device, bs->fs_info_sector);
+    if (buf == NULL) {
+        return;
+    }
+    FsInfo* info = (FsInfo*)buf->data;
+    if (info->lead_signature == FSINFO_LEAD_SIGNATURE && info->struct_signature == FSINFO_STRUCT_SIGNATURE &&
+        info->trail_signature == FSINFO_TRAIL_SIGNATURE) {
+        fs_info_sector = bs->fs_info_sector;
+        bs->fs_info_lead_signature = info->lead_signature;
+        bs->fs_info_struct_signature = info->struct_signature;
+        bs->fs_info_free_cluster_count = info->free_cluster_count;
+        bs->fs_info_next_free_cluster_hint = info->next_free_cluster;
+        bs->fs_info_trail_signature = info->trail_signature;
+    }
+    bcache_put(buf);
+}
+
+uint8_t fat_alloc_init(BlockDev* dev, BootSector* bs)
+{
+    device = dev;
+
+    // Maps of a previously mounted volume
+    kfree(free_map);
+    kfree(unwritten_map);
+    kfree(groups);
+    free_map = NULL;
+    unwritten_map = NULL;
+    groups = NULL;
+
+    // Clusters the data region holds, capped by the entries the FAT has room for
+    if (fat_geometry.cluster_count == 0) {
+        return 0;
+    }
+    cluster_limit = fat_geometry.cluster_count + 2;
+    if (cluster_limit > fat_cache.entry_count) {
+        cluster_limit = fat_cache.entry_count;
+    }
+
+    uint32_t words = (fat_cache.entry_count + 63) / 64;
+    free_map = kzalloc(words * sizeof(uint64_t));
+    unwritten_map = kzalloc(words * sizeof(uint64_t));
+    map_bits = words * 64;
+    uint32_t group_count = (map_bits + FAT_RUN_GROUP_CLUSTERS - 1) >> FAT_RUN_GROUP_SHIFT;
+    groups = kmalloc(group_count * sizeof(RunGroup));
+    if (free_map == NULL || unwritten_map == NULL || groups == NULL) {
+        return 0;
+    }
+    for (uint32_t g = 0; g < group_count; g++) {
+        groups[g].stale = 1;
+    }
+
+    // Compare 64 entries at a time against zero, each result is one bitmap word.
+    // FAT sizes are whole sectors, so entry_count is a multiple of 64.
+    uint64_t (*free_bits)(uint32_t*) = cpu_features.avx2 ? free_bits_avx2 : free_bits_sse;
+    for (uint32_t chunk = 0; chunk < fat_cache.chunk_count; chunk++) {
+        uint32_t* entries = fat_cache_chunk(chunk);
+        if (entries == NULL) {
+            return 0;
+        }
+        uint32_t first = chunk * FAT_CHUNK_ENTRIES;
+        uint32_t count = fat_cache.entry_count - first < FAT_CHUNK_ENTRIES ? fat_cache.entry_count - first : FAT_CHUNK_ENTRIES;
+        for (uint32_t i = 0; i < count; i += 64) {
+            free_map[(first + i) / 64] = free_bits(entries + i);
+        }
+    }
+
+    // Clusters 0 and 1 are reserved, entries past the data region do not map to clusters
+    mark(0, 2, 0);
+    mark(cluster_limit, words * 64 - cluster_limit, 0);
+
+    free_count = 0;
+    for (uint32_t i = 0; i < words; i++) {
+        free_count += count_bits(free_map[i]);
+    }
+
+    // The FSInfo numbers are only hints, the FAT wins when they disagree
+    read_fs_info(bs);
+    next_free = 2;
+    if (fs_info_sector != 0) {
+        uint32_t hint = bs->fs_info_next_free_cluster_hint;
+        if (hint >= 2 && hint < cluster_limit) {
+            next_free = hint;
+        }
+        fs_info_dirty = bs->fs_info_free_cluster_count != free_count;
+    }
+    bs->fs_info_free_cluster_count = free_count;
+    bs->fs_info_next_free_cluster_hint = next_free;
+    return 1;
+}
+
+uint32_t fat_alloc_extent(uint32_t want, uint32_t* length)
+{
+    *length = 0;
+    if (free_map == NULL || want == 0 || free_count == 0) {
+        return 0;
+    }
+
+    uint32_t run_length;
+    uint32_t first = find_run(want, want < FAT_BEST_FIT_MIN, &run_length);
+    if (run_length == 0) {
+        return 0;
+    }
+    if (run_length > want) {
+        run_length = want;
+    }
+
+    mark(first, run_length, 0);
+    mark_bits(unwritten_map, first, run_length, 1);
+    for (uint32_t i = 0; i < run_length; i++) {
+        fat_cache_set(first + i, i + 1 < run_length ? first + i + 1 : FAT32_EOF);
+    }
+
+    free_count -= run_length;
+    next_free = first + run_length < cluster_limit ? first + run_length : 2;
+    fs_info_dirty = 1;
+    stats.extents++;
+    stats.clusters += run_length;
+
+    *length = run_length;
+    return first;
+}
+
+uint32_t fat_alloc_chain(uint32_t count, uint32_t previous)
+{
+    if (count == 0 || count > free_count) {
+        return 0;
+    }
+
+    uint32_t first = 0;
+    uint32_t tail = previous;
+    while (count > 0) {
+        uint32_t length;
+        uint32_t run = fat_alloc_extent(count, &length);
+        if (run == 0) {
+            fat_free_chain(first);
+            if (previous != 0) {
+                fat_cache_set(previous, FAT32_EOF);
+            }
+            return 0;
+        }
+        if (tail != 0) {
+            fat_cache_set(tail, run);
+        }
+        if (first == 0) {
+            first = run;
+        }
+        tail = run + length - 1;
+        count -= length;
+    }
+    return first;
+}
+
+void fat_free_chain(uint32_t first)
+{
+    uint32_t cluster = first;
+
+    while (cluster >= 2 && cluster < cluster_limit && !is_free(cluster)) {
+        uint32_t next = fat_cache_get(cluster);
+        fat_cache_set(cluster, 0);
+        mark(cluster, 1, 1);
+        mark_bits(unwritten_map, cluster, 1, 0);
+        free_count++;
+        stats.freed++;
+        fs_info_dirty = 1;
+        cluster = next;
+    }
+}
+
+uint32_t fat_unwritten_run(uint32_t cluster, uint32_t max, uint8_t* unwritten)
+{
+    *unwritten = 0;
+    if (unwritten_map == NULL || cluster < 2 || cluster >= cluster_limit) {
+        return max;
+    }
+    uint32_t end = max < cluster_limit - cluster ? cluster + max : cluster_limit;
+    *unwritten = is_set(unwritten_map, cluster);
+    return find_bit_in(unwritten_map, cluster, end, !*unwritten) - cluster;
+}
+
+void fat_mark_written(uint32_t first, uint32_t count)
+{
+    if (unwritten_map != NULL && first >= 2 && first < cluster_limit) {
+        if (count > cluster_limit - first) {
+            count = cluster_limit - first;
+        }
+        mark_bits(unwritten_map, first, count, 0);
+    }
+}
+
+uint32_t fat_free_clusters(void)
+{
+    return free_count;
+}
+
+uint32_t fat_cluster_count(void)
+{
+    return cluster_limit > 2 ? cluster_limit - 2 : 0;
+}
+
+uint8_t fat_alloc_sync(void)
+{
+    if (!fs_info_dirty || fs_info_sector == 0) {
+        return 1;
+    }
+
+    // Called between operations, a full transaction is committed to make room
+    Buffer* buf = journal_reserve(1) ? bcache_get(device, fs_info_sector) : NULL;
+    if (buf == NULL) {
+        return 0;
+    }
+    if (!journal_mark_dirty(buf)) {
+        bcache_put(buf);
+        return 0;
+    }
+    FsInfo* info = (FsInfo*)buf->data;
+    info->free_cluster_count = free_count;
+    info->next_free_cluster = next_free;
+    bcache_put(buf);
+
+    boot_sector.fs_info_free_cluster_count = free_count;
+    boot_sector.fs_info_next_free_cluster_hint = next_free;
+    fs_info_dirty = 0;
+    return 1;
+}
+
+void fat_alloc_print_stats(void)
+{
+    print_str("Clusters free: ");
+    print_uint(free_count);
+    print_str(" of ");
+    print_uint(fat_cluster_count());
+    print_str(", allocated: ");
+    print_uint(stats.clusters);
+    print_str(" in extents: ");
+    print_uint(stats.extents);
+    print_str(" freed: ");
+    print_uint(stats.freed);
+    print_str("\n");
+}
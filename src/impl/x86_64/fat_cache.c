@@ -0,0 +1,292 @@
+#include "fat_cache.h"
+#include "fat_geometry.h"
+#include "bcache.h"
+#include "constants.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "vga.h"
+
+FatCache fat_cache;
+
+static uint32_t* load_chunk(uint32_t chunk) {
+    FatCache* fc = &fat_cache;
+    uint32_t sectors_per_chunk = FAT_CHUNK_SIZE >> fc->sector_shift;
+    uint32_t first = chunk * sectors_per_chunk;
+    uint32_t count = sectors_per_chunk;
+    if (first + count > fc->sectors_per_fat) {
+        count = fc->sectors_per_fat - first;
+    }
+
+    uint64_t page = pmm_alloc_flags(0, PMM_ZERO);
+    if (page == 0) {
+        return NULL;
+    }
+    uint32_t* data = phys_to_virt(page);
+    uint64_t start = fc->first_sector + (uint64_t)fc->active_fat * fc->sectors_per_fat + first;
+    if (!blockdev_read(fc->dev, start, count, data)) {
+        pmm_free_zeroed(page);
+        return NULL;
+    }
+
+    fc->chunks[chunk] = data;
+    fc->stats.chunk_faults++;
+    return data;
+}
+
+static uint32_t* entry_address(uint32_t cluster) {
+    FatCache* fc = &fat_cache;
+    if (fc->table != NULL) {
+        return &fc->table[cluster];
+    }
+
+    uint32_t* chunk = fc->chunks[cluster / FAT_CHUNK_ENTRIES];
+    if (chunk == NULL) {
+        chunk = load_chunk(cluster / FAT_CHUNK_ENTRIES);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+    return &chunk[cluster % FAT_CHUNK_ENTRIES];
+}
+
+uint32_t* fat_cache_chunk(uint32_t chunk) {
+    FatCache* fc = &fat_cache;
+    if (chunk >= fc->chunk_count) {
+        return NULL;
+    }
+    if (fc->table != NULL) {
+        return &fc->table[chunk * FAT_CHUNK_ENTRIES];
+    }
+    return fc->chunks[chunk] != NULL ? fc->chunks[chunk] : load_chunk(chunk);
+}
+
+// Free the tables of the previously mounted volume, while the old geometry still sizes them
+static void release(void) {
+    FatCache* fc = &fat_cache;
+    if (fc->table != NULL) {
+        vmm_free(fc->table, (uint64_t)fc->sectors_per_fat << fc->sector_shift);
+        fc->table = NULL;
+    }
+    if (fc->chunks != NULL) {
+        for (uint32_t i = 0; i < fc->chunk_count; i++) {
+            if (fc->chunks[i] != NULL) {
+                pmm_free(virt_to_phys(fc->chunks[i]), 0);
+            }
+        }
+        kfree(fc->chunks);
+        fc->chunks = NULL;
+    }
+    kfree(fc->dirty);
+    fc->dirty = NULL;
+}
+
+uint8_t fat_cache_init(BlockDev* dev, BootSector* bs) {
+    FatCache* fc = &fat_cache;
+
+    release();
+    fc->dev = dev;
+    fc->first_sector = fat_geometry.fat_start;
+    fc->sectors_per_fat = fat_geometry.sectors_per_fat;
+    fc->fat_count = fat_geometry.fat_count;
+    fc->mirror = !(bs->flags & FAT_FLAGS_NO_MIRROR);
+    fc->active_fat = fc->mirror ? 0 : (bs->flags & FAT_FLAGS_ACTIVE_MASK);
+    fc->sector_shift = dev->sector_shift;
+    if (fc->active_fat >= fc->fat_count || dev->sector_size > FAT_CHUNK_SIZE) {
+        return 0;
+    }
+
+    uint64_t fat_bytes = (uint64_t)fc->sectors_per_fat << fc->sector_shift;
+    fc->entry_count = fat_bytes / FAT_ENTRY_SIZE;
+    fc->chunk_count = (fat_bytes + FAT_CHUNK_SIZE - 1) / FAT_CHUNK_SIZE;
+
+    // The log of the previous volume does not cover this one, journal_open turns it back on
+    kfree(fc->unlogged);
+    fc->unlogged = NULL;
+    fc->unlogged_count = 0;
+
+    fc->dirty = kzalloc(((fc->sectors_per_fat + 63) / 64) * sizeof(uint64_t));
+    if (fc->dirty == NULL) {
+        return 0;
+    }
+
+    // Small FAT: one sequential read at mount and plain array loads afterwards
+    if (fat_bytes <= FAT_RESIDENT_MAX) {
+        fc->table = vmm_alloc(fat_bytes);
+        if (fc->table != NULL) {
+            uint64_t start = fc->first_sector + (uint64_t)fc->active_fat * fc->sectors_per_fat;
+            if (blockdev_read(dev, start, fc->sectors_per_fat, fc->table)) {
+                fc->stats.chunk_faults += fc->chunk_count;
+                return 1;
+            }
+            vmm_free(fc->table, fat_bytes);
+            fc->table = NULL;
+        }
+    }
+
+    fc->chunks = kzalloc(fc->chunk_count * sizeof(uint32_t*));
+    return fc->chunks != NULL;
+}
+
+uint32_t fat_cache_get(uint32_t cluster) {
+    if (cluster >= fat_cache.entry_count) {
+        return FAT32_EOF;
+    }
+    uint32_t* entry = entry_address(cluster);
+    if (entry == NULL) {
+        return FAT32_EOF;
+    }
+    return *entry & FAT_ENTRY_MASK;
+}
+
+void fat_cache_set(uint32_t cluster, uint32_t value) {
+    FatCache* fc = &fat_cache;
+    if (cluster >= fc->entry_count) {
+        return;
+    }
+    uint32_t* entry = entry_address(cluster);
+    if (entry == NULL) {
+        return;
+    }
+    *entry = (*entry & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+
+    uint32_t sector = fat_entry_sector(cluster);
+    fc->dirty[sector / 64] |= 1ULL << (sector % 64);
+    if (fc->unlogged != NULL && !((fc->unlogged[sector / 64] >> (sector % 64)) & 1)) {
+        fc->unlogged[sector / 64] |= 1ULL << (sector % 64);
+        fc->unlogged_count++;
+    }
+}
+
+// Dirty and, with an intent log, already logged so it may go home
+static uint8_t is_dirty(uint32_t sector) {
+    uint64_t word = fat_cache.dirty[sector / 64];
+    if (fat_cache.unlogged != NULL) {
+        word &= ~fat_cache.unlogged[sector / 64];
+    }
+    return (word >> (sector % 64)) & 1;
+}
+
+// Write sectors [first, first + count) of the cached FAT to every copy
+static uint8_t write_run(uint32_t first, uint32_t count) {
+    FatCache* fc = &fat_cache;
+    uint8_t ok = 1;
+
+    // A run never crosses a chunk when the FAT is faulted in piecewise, so its
+    // sectors are contiguous in memory either way
+    uint64_t byte = (uint64_t)first << fc->sector_shift;
+    void* data = fc->table != NULL
+        ? (void*)((uint8_t*)fc->table + byte)
+        : (void*)((uint8_t*)fc->chunks[byte / FAT_CHUNK_SIZE] + byte % FAT_CHUNK_SIZE);
+
+    for (uint8_t copy = 0; copy < fc->fat_count; copy++) {
+        if (!fc->mirror && copy != fc->active_fat) {
+            continue;
+        }
+        uint64_t start = fc->first_sector + (uint64_t)copy * fc->sectors_per_fat + first;
+        ok &= blockdev_write(fc->dev, start, count, data);
+        // Readers going through the buffer cache must not see the old sectors
+        bcache_invalidate_range(fc->dev, start, count);
+        fc->stats.sectors_written += count;
+        fc->stats.runs_written++;
+    }
+    return ok;
+}
+
+uint8_t fat_cache_sync(void) {
+    FatCache* fc = &fat_cache;
+    if (fc->dirty == NULL) {
+        return 1;
+    }
+
+    uint32_t sectors_per_chunk = FAT_CHUNK_SIZE >> fc->sector_shift;
+    uint8_t ok = 1;
+    uint32_t sector = 0;
+
+    // The bitmap is walked in ascending order, so runs come out sorted
+    while (sector < fc->sectors_per_fat) {
+        if (fc->dirty[sector / 64] == 0) {
+            sector = (sector / 64 + 1) * 64;
+            continue;
+        }
+        if (!is_dirty(sector)) {
+            sector++;
+            continue;
+        }
+
+        uint32_t end = sector + 1;
+        while (end < fc->sectors_per_fat && is_dirty(end)) {
+            if (fc->table == NULL && end % sectors_per_chunk == 0) {
+                break;
+            }
+            end++;
+        }
+
+        // Sectors that failed to write stay dirty for the next sync
+        if (write_run(sector, end - sector)) {
+            for (uint32_t s = sector; s < end; s++) {
+                fc->dirty[s / 64] &= ~(1ULL << (s % 64));
+            }
+        }
+        else {
+            ok = 0;
+        }
+        sector = end;
+    }
+
+    return ok;
+}
+
+uint8_t fat_cache_enable_log(void) {
+    FatCache* fc = &fat_cache;
+    if (fc->unlogged == NULL) {
+        fc->unlogged = kzalloc(((fc->sectors_per_fat + 63) / 64) * sizeof(uint64_t));
+        fc->unlogged_count = 0;
+    }
+    return fc->unlogged != NULL;
+}
+
+uint32_t fat_cache_collect_unlogged(uint32_t* sectors, uint32_t max) {
+    FatCache* fc = &fat_cache;
+    uint32_t count = 0;
+    if (fc->unlogged == NULL) {
+        return 0;
+    }
+    for (uint32_t word = 0; word < (fc->sectors_per_fat + 63) / 64 && count < max; word++) {
+        uint64_t bits = fc->unlogged[word];
+        while (bits != 0 && count < max) {
+            uint32_t bit = __builtin_ctzll(bits);
+            sectors[count++] = word * 64 + bit;
+            bits &= bits - 1;
+        }
+    }
+    return count;
+}
+
+void fat_cache_logged(uint32_t* sectors, uint32_t count) {
+    FatCache* fc = &fat_cache;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t bit = 1ULL << (sectors[i] % 64);
+        if (fc->unlogged[sectors[i] / 64] & bit) {
+            fc->unlogged[sectors[i] / 64] &= ~bit;
+            fc->unlogged_count--;
+        }
+    }
+}
+
+void* fat_cache_sector(uint32_t sector) {
+    uint32_t entries_per_sector = (1 << fat_cache.sector_shift) / FAT_ENTRY_SIZE;
+    return entry_address(sector * entries_per_sector);
+}
+
+void fat_cache_print_stats(void) {
+    print_str("FAT cache: ");
+    print_str(fat_cache.table != NULL ? "resident" : "chunked");
+    print_str(", chunks read: ");
+    print_uint(fat_cache.stats.chunk_faults);
+    print_str(" sectors written: ");
+    print_uint(fat_cache.stats.sectors_written);
+    print_str(" in runs: ");
+    print_uint(fat_cache.stats.runs_written);
+    print_str("\n");
+}
@@ -0,0 +1,566 @@
+#include "fat_dir.h"
+#include "fat_alloc.h"
+#include "fat_geometry.h"
+#include "fat_journal.h"
+#include "bcache.h"
+#include "constants.h"
+#include "hdd.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "strings.h"
+#include "vga.h"
+
+DirStats dir_stats;
+
+static DirIndex* indexes[DIR_INDEX_MAX];
+static uint64_t use_clock;
+
+// A name recently looked up and not found, dir_cluster 0 marks an unused entry
+typedef struct {
+    uint32_t dir_cluster;
+    uint8_t name[DIR_NAME_LENGTH];
+} NegativeEntry;
+
+static NegativeEntry negative[DIR_NEGATIVE_MAX];
+static uint32_t negative_next;
+
+static uint8_t valid_name_char(char c) {
+    return (uint8_t)c >= 0x20 && strChr("\"*+,/:;<=>?[\\]|", c) == NULL;
+}
+
+static uint8_t upper(char c) {
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+uint8_t fat_name_normalize(char* filename, uint8_t* name) {
+    memSet(name, ' ', DIR_NAME_LENGTH);
+
+    // "." and ".." are the only names starting with a dot
+    if (filename[0] == '.') {
+        if (strEqual(filename, ".") || strEqual(filename, "..")) {
+            memCpy(name, filename, strLength(filename));
+            return 1;
+        }
+        return 0;
+    }
+
+    uint32_t i;
+    for (i = 0; filename[i] != '\0' && filename[i] != '.'; i++) {
+        if (i >= FILENAME_LENGTH || !valid_name_char(filename[i])) {
+            return 0;
+        }
+        name[i] = upper(filename[i]);
+    }
+    if (i == 0) {
+        return 0;
+    }
+
+    if (filename[i] == '.') {
+        char* ext = &filename[i + 1];
+        for (uint32_t j = 0; ext[j] != '\0'; j++) {
+            if (j >= EXTENSION_LENGTH || ext[j] == '.' || !valid_name_char(ext[j])) {
+                return 0;
+            }
+            name[FILENAME_LENGTH + j] = upper(ext[j]);
+        }
+    }
+
+    // 0xE5 in the first byte would read as a deleted entry
+    if (name[0] == DIR_ENTRY_DELETED) {
+        name[0] = DIR_ENTRY_KANJI;
+    }
+    return 1;
+}
+
+uint32_t root_directory_cluster(void) {
+    // root_cluster_count is the BPB field holding the root directory's first cluster
+    return boot_sector.root_cluster_count >= 2 ? boot_sector.root_cluster_count : FAT32_ROOT_DIR_CLUSTER;
+}
+
+static uint32_t hash(uint8_t* name) {
+    uint32_t value = 2166136261u;
+    for (uint32_t i = 0; i < DIR_NAME_LENGTH; i++) {
+        value = (value ^ name[i]) * 16777619u;
+    }
+    return value;
+}
+
+static uint32_t slots_per_cluster(void) {
+    return 1u << (fat_cluster_shift() - DIR_ENTRY_SHIFT);
+}
+
+// Index entries
+
+static int32_t index_find(DirIndex* index, uint8_t* name) {
+    int32_t e = index->buckets[hash(name) & (index->bucket_count - 1)];
+    while (e >= 0 && memCmp(index->entries[e].name, name, DIR_NAME_LENGTH) != 0) {
+        e = index->entries[e].next;
+    }
+    return e;
+}
+
+static uint8_t resize_buckets(DirIndex* index, uint32_t bucket_count) {
+    int32_t* buckets = kmalloc(bucket_count * sizeof(int32_t));
+    if (buckets == NULL) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < bucket_count; i++) {
+        buckets[i] = -1;
+    }
+
+    // Every live entry moves to its bucket in the new table, removed ones stay on the free chain
+    for (uint32_t i = 0; i < index->bucket_count; i++) {
+        int32_t e = index->buckets[i];
+        while (e >= 0) {
+            int32_t next = index->entries[e].next;
+            uint32_t bucket = hash(index->entries[e].name) & (bucket_count - 1);
+            index->entries[e].next = buckets[bucket];
+            buckets[bucket] = e;
+            e = next;
+        }
+    }
+
+    kfree(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+    return 1;
+}
+
+static uint8_t index_insert(DirIndex* index, uint8_t* name, uint32_t slot) {
+    // Keep chains short: at most one name per bucket on average
+    if (index->live >= index->bucket_count && !resize_buckets(index, index->bucket_count * 2)) {
+        return 0;
+    }
+
+    int32_t e = index->free_entry;
+    if (e >= 0) {
+        index->free_entry = index->entries[e].next;
+    }
+    else {
+        if (index->entry_count == index->entry_capacity) {
+            uint32_t capacity = index->entry_capacity * 2;
+            DirIndexEntry* entries = kmalloc(capacity * sizeof(DirIndexEntry));
+            if (entries == NULL) {
+                return 0;
+            }
+            memCpy(entries, index->entries, index->entry_count * sizeof(DirIndexEntry));
+            kfree(index->entries);
+            index->entries = entries;
+            index->entry_capacity = capacity;
+        }
+        e = index->entry_count++;
+    }
+
+    uint32_t bucket = hash(name) & (index->bucket_count - 1);
+    memCpy(index->entries[e].name, name, DIR_NAME_LENGTH);
+    index->entries[e].slot = slot;
+    index->entries[e].next = index->buckets[bucket];
+    index->buckets[bucket] = e;
+    index->live++;
+    return 1;
+}
+
+static void index_unlink(DirIndex* index, uint8_t* name, uint32_t slot) {
+    int32_t* link = &index->buckets[hash(name) & (index->bucket_count - 1)];
+    while (*link >= 0) {
+        DirIndexEntry* entry = &index->entries[*link];
+        if (entry->slot == slot) {
+            int32_t e = *link;
+            *link = entry->next;
+            entry->next = index->free_entry;
+            index->free_entry = e;
+            index->live--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+static uint8_t push_free_slot(DirIndex* index, uint32_t slot) {
+    if (index->free_slot_count == index->free_slot_capacity) {
+        uint32_t capacity = index->free_slot_capacity == 0 ? 16 : index->free_slot_capacity * 2;
+        uint32_t* slots = kmalloc(capacity * sizeof(uint32_t));
+        if (slots == NULL) {
+            return 0;
+        }
+        memCpy(slots, index->free_slots, index->free_slot_count * sizeof(uint32_t));
+        kfree(index->free_slots);
+        index->free_slots = slots;
+        index->free_slot_capacity = capacity;
+    }
+    index->free_slots[index->free_slot_count++] = slot;
+    return 1;
+}
+
+// Negative cache
+
+static int32_t negative_find(uint32_t dir_cluster, uint8_t* name) {
+    for (uint32_t i = 0; i < DIR_NEGATIVE_MAX; i++) {
+        if (negative[i].dir_cluster == dir_cluster && memCmp(negative[i].name, name, DIR_NAME_LENGTH) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void negative_add(uint32_t dir_cluster, uint8_t* name) {
+    NegativeEntry* entry = &negative[negative_next];
+    negative_next = (negative_next + 1) % DIR_NEGATIVE_MAX;
+    entry->dir_cluster = dir_cluster;
+    memCpy(entry->name, name, DIR_NAME_LENGTH);
+}
+
+static void negative_forget(uint32_t dir_cluster, uint8_t* name) {
+    int32_t i = negative_find(dir_cluster, name);
+    if (i >= 0) {
+        negative[i].dir_cluster = 0;
+    }
+}
+
+// Building and caching indexes
+
+uint8_t dir_slot_location(DirIndex* index, uint32_t slot, uint32_t* sector, uint32_t* offset) {
+    if (slot >= index->slot_count) {
+        return 0;
+    }
+    uint64_t byte = (uint64_t)slot << DIR_ENTRY_SHIFT;
+    uint32_t run;
+    uint32_t cluster = extent_map_lookup(&index->extents, byte >> fat_cluster_shift(), &run);
+    if (cluster == 0) {
+        return 0;
+    }
+    uint32_t in_cluster = byte & fat_cluster_mask();
+    *sector = cluster_to_sector(cluster) + (in_cluster >> fat_sector_shift());
+    *offset = in_cluster & fat_sector_mask();
+    return 1;
+}
+
+static void index_free(DirIndex* index) {
+    extent_map_free(&index->extents);
+    kfree(index->entries);
+    kfree(index->buckets);
+    kfree(index->free_slots);
+    kfree(index);
+}
+
+// Walk every slot of the directory once: names go into the hash table, deleted
+// slots on the free stack, the walk stops at the first never used slot
+static uint8_t build(DirIndex* index) {
+    uint32_t slots_per_sector = 1u << (fat_sector_shift() - DIR_ENTRY_SHIFT);
+    uint32_t clusters = extent_map_length(&index->extents);
+
+    index->slot_count = clusters * slots_per_cluster();
+    index->end_slot = index->slot_count;
+
+    uint32_t slot = 0;
+    for (uint32_t k = 0; k < clusters && index->end_slot == index->slot_count; k++) {
+        uint32_t run;
+        uint32_t cluster = extent_map_lookup(&index->extents, k, &run);
+        uint32_t first_sector = cluster_to_sector(cluster);
+
+        for (uint32_t s = 0; s < fat_geometry.sectors_per_cluster && index->end_slot == index->slot_count; s++) {
+            Buffer* buf = bcache_get(disk_device, first_sector + s);
+            if (buf == NULL) {
+                return 0;
+            }
+
+            for (uint32_t j = 0; j < slots_per_sector; j++, slot++) {
+                DirectoryEntry* entry = (DirectoryEntry*)(buf->data + j * DIR_ENTRY_SIZE);
+                dir_stats.slots_scanned++;
+
+                if (entry->filename[0] == DIR_ENTRY_END) {
+                    index->end_slot = slot;
+                    break;
+                }
+                if (entry->filename[0] == DIR_ENTRY_DELETED) {
+                    if (!push_free_slot(index, slot)) {
+                        bcache_put(buf);
+                        return 0;
+                    }
+                }
+                // Long name pieces and the volume label are not files
+                else if ((entry->attributes & ATTR_LONG_NAME) != ATTR_LONG_NAME && !(entry->attributes & ATTR_VOLUME_ID)) {
+                    if (!index_insert(index, entry->filename, slot)) {
+                        bcache_put(buf);
+                        return 0;
+                    }
+                }
+            }
+            bcache_put(buf);
+        }
+    }
+    return 1;
+}
+
+static DirIndex* index_create(uint32_t cluster) {
+    DirIndex* index = kzalloc(sizeof(DirIndex));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->first_cluster = cluster;
+    index->free_entry = -1;
+    extent_map_init(&index->extents, cluster);
+
+    index->entry_capacity = DIR_HASH_INITIAL;
+    index->entries = kmalloc(index->entry_capacity * sizeof(DirIndexEntry));
+    index->bucket_count = DIR_HASH_INITIAL;
+    index->buckets = kmalloc(index->bucket_count * sizeof(int32_t));
+    if (index->entries == NULL || index->buckets == NULL) {
+        index_free(index);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < index->bucket_count; i++) {
+        index->buckets[i] = -1;
+    }
+
+    dir_stats.builds++;
+    if (!build(index)) {
+        index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+DirIndex* dir_index_get(uint32_t cluster) {
+    uint32_t victim = 0;
+    for (uint32_t i = 0; i < DIR_INDEX_MAX; i++) {
+        if (indexes[i] != NULL && indexes[i]->first_cluster == cluster) {
+            indexes[i]->last_used = ++use_clock;
+            return indexes[i];
+        }
+        // Empty places first, then the least recently used index
+        if (indexes[victim] != NULL && (indexes[i] == NULL || indexes[i]->last_used < indexes[victim]->last_used)) {
+            victim = i;
+        }
+    }
+
+    DirIndex* index = index_create(cluster);
+    if (index == NULL) {
+        return NULL;
+    }
+    if (indexes[victim] != NULL) {
+        index_free(indexes[victim]);
+    }
+    index->last_used = ++use_clock;
+    indexes[victim] = index;
+    return index;
+}
+
+void dir_index_drop_all(void) {
+    for (uint32_t i = 0; i < DIR_INDEX_MAX; i++) {
+        if (indexes[i] != NULL) {
+            index_free(indexes[i]);
+            indexes[i] = NULL;
+        }
+    }
+    for (uint32_t i = 0; i < DIR_NEGATIVE_MAX; i++) {
+        negative[i].dir_cluster = 0;
+    }
+}
+
+// Slot I/O through the buffer cache
+
+static uint8_t read_slot(DirIndex* index, uint32_t slot, DirectoryEntry* entry) {
+    uint32_t sector, offset;
+    if (!dir_slot_location(index, slot, &sector, &offset)) {
+        return 0;
+    }
+    Buffer* buf = bcache_get(disk_device, sector);
+    if (buf == NULL) {
+        return 0;
+    }
+    memCpy(entry, buf->data + offset, sizeof(DirectoryEntry));
+    bcache_put(buf);
+    return 1;
+}
+
+static uint8_t write_slot(DirIndex* index, uint32_t slot, void* data, uint32_t length) {
+    uint32_t sector, offset;
+    if (!dir_slot_location(index, slot, &sector, &offset)) {
+        return 0;
+    }
+    Buffer* buf = bcache_get(disk_device, sector);
+    if (buf == NULL) {
+        return 0;
+    }
+    // The transaction may be full, the sector is left as it was then
+    uint8_t ok = journal_mark_dirty(buf);
+    if (ok) {
+        memCpy(buf->data + offset, data, length);
+    }
+    bcache_put(buf);
+    return ok;
+}
+
+// Lookups and changes
+
+uint8_t dir_find(uint32_t dir_cluster, uint8_t* name, DirectoryEntry* entry, uint32_t* slot) {
+    dir_stats.lookups++;
+
+    // A name that was just missing is answered without touching the index
+    if (negative_find(dir_cluster, name) >= 0) {
+        dir_stats.negative_hits++;
+        return 0;
+    }
+
+    DirIndex* index = dir_index_get(dir_cluster);
+    if (index == NULL) {
+        return 0;
+    }
+    int32_t e = index_find(index, name);
+    if (e < 0) {
+        negative_add(dir_cluster, name);
+        return 0;
+    }
+
+    dir_stats.hits++;
+    if (slot != NULL) {
+        *slot = index->entries[e].slot;
+    }
+    if (entry != NULL && !read_slot(index, index->entries[e].slot, entry)) {
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t dir_lookup(uint32_t dir_cluster, char* filename, DirectoryEntry* entry, uint32_t* slot) {
+    uint8_t name[DIR_NAME_LENGTH];
+    if (!fat_name_normalize(filename, name)) {
+        return 0;
+    }
+    return dir_find(dir_cluster, name, entry, slot);
+}
+
+// Add a cluster to the end of the directory, its slots are all unused
+static uint8_t grow(DirIndex* index) {
+    uint32_t clusters = extent_map_length(&index->extents);
+    uint32_t run;
+    uint32_t last = clusters > 0 ? extent_map_lookup(&index->extents, clusters - 1, &run) : 0;
+    if (last == 0) {
+        return 0;
+    }
+
+    uint32_t cluster = fat_alloc_chain(1, last);
+    if (cluster == 0) {
+        return 0;
+    }
+    clear_cluster_data(cluster);
+    extent_map_extended(&index->extents, cluster);
+    index->slot_count += slots_per_cluster();
+    return 1;
+}
+
+uint8_t dir_reserve(uint32_t dir_cluster, uint32_t count) {
+    DirIndex* index = dir_index_get(dir_cluster);
+    if (index == NULL) {
+        return 0;
+    }
+    uint32_t room = index->free_slot_count + (index->slot_count - index->end_slot);
+    if (room >= count) {
+        return 1;
+    }
+
+    uint32_t per_cluster = slots_per_cluster();
+    uint32_t clusters = (count - room + per_cluster - 1) / per_cluster;
+    uint32_t length = extent_map_length(&index->extents);
+    uint32_t run;
+    uint32_t last = length > 0 ? extent_map_lookup(&index->extents, length - 1, &run) : 0;
+    if (last == 0) {
+        return 0;
+    }
+
+    // All of it as one chain, then every new cluster reads as unused slots
+    uint32_t first = fat_alloc_chain(clusters, last);
+    if (first == 0) {
+        return 0;
+    }
+    extent_map_extended(&index->extents, first);
+    for (uint32_t i = length; i < length + clusters; i++) {
+        clear_cluster_data(extent_map_lookup(&index->extents, i, &run));
+    }
+    index->slot_count += clusters * per_cluster;
+    return 1;
+}
+
+uint8_t dir_add_entry(uint32_t dir_cluster, DirectoryEntry* entry, uint32_t* slot) {
+    DirIndex* index = dir_index_get(dir_cluster);
+    if (index == NULL) {
+        return 0;
+    }
+
+    uint32_t free_slot;
+    if (index->free_slot_count > 0) {
+        free_slot = index->free_slots[--index->free_slot_count];
+    }
+    else {
+        if (index->end_slot == index->slot_count && !grow(index)) {
+            return 0;
+        }
+        // The slot after the last entry has to mark the end of the directory,
+        // without the mark a scan would run on into stale entries
+        if (index->end_slot + 1 < index->slot_count) {
+            uint8_t end = DIR_ENTRY_END;
+            if (!write_slot(index, index->end_slot + 1, &end, 1)) {
+                return 0;
+            }
+        }
+        free_slot = index->end_slot++;
+    }
+
+    if (!write_slot(index, free_slot, entry, sizeof(DirectoryEntry)) || !index_insert(index, entry->filename, free_slot)) {
+        push_free_slot(index, free_slot);
+        return 0;
+    }
+    negative_forget(dir_cluster, entry->filename);
+    if (slot != NULL) {
+        *slot = free_slot;
+    }
+    return 1;
+}
+
+uint8_t dir_write_entry(uint32_t dir_cluster, uint32_t slot, DirectoryEntry* entry) {
+    DirIndex* index = dir_index_get(dir_cluster);
+    DirectoryEntry old;
+    if (index == NULL || !read_slot(index, slot, &old)) {
+        return 0;
+    }
+
+    if (memCmp(old.filename, entry->filename, DIR_NAME_LENGTH) != 0) {
+        index_unlink(index, old.filename, slot);
+        if (!index_insert(index, entry->filename, slot)) {
+            return 0;
+        }
+        negative_forget(dir_cluster, entry->filename);
+    }
+    return write_slot(index, slot, entry, sizeof(DirectoryEntry));
+}
+
+uint8_t dir_remove_entry(uint32_t dir_cluster, uint32_t slot) {
+    DirIndex* index = dir_index_get(dir_cluster);
+    DirectoryEntry old;
+    if (index == NULL || !read_slot(index, slot, &old)) {
+        return 0;
+    }
+
+    uint8_t deleted = DIR_ENTRY_DELETED;
+    if (!write_slot(index, slot, &deleted, 1)) {
+        return 0;
+    }
+    index_unlink(index, old.filename, slot);
+    push_free_slot(index, slot);
+    return 1;
+}
+
+void dir_print_stats(void) {
+    print_str("Directory index: lookups: ");
+    print_uint(dir_stats.lookups);
+    print_str(" hits: ");
+    print_uint(dir_stats.hits);
+    print_str(" negative hits: ");
+    print_uint(dir_stats.negative_hits);
+    print_str(" builds: ");
+    print_uint(dir_stats.builds);
+    print_str(" slots scanned: ");
+    print_uint(dir_stats.slots_scanned);
+    print_str("\n");
+}
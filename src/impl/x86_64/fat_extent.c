@@ -0,0 +1,145 @@
+#include "fat_extent.h"
+#include "fat_alloc.h"
+#include "hdd.h"
+#include "kmalloc.h"
+#include "memory.h"
+
+ExtentStats extent_stats;
+
+void extent_map_init(ExtentMap* map, uint32_t first_cluster) {
+    map->first_cluster = first_cluster;
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->mapped = 0;
+    map->complete = first_cluster == 0;
+}
+
+static uint8_t push(ExtentMap* map, uint32_t disk_cluster) {
+    if (map->count == map->capacity) {
+        uint32_t capacity = map->capacity == 0 ? EXTENT_MAP_INITIAL : map->capacity * 2;
+        Extent* extents = kmalloc(capacity * sizeof(Extent));
+        if (extents == NULL) {
+            return 0;
+        }
+        if (map->extents != NULL) {
+            memCpy(extents, map->extents, map->count * sizeof(Extent));
+            kfree(map->extents);
+        }
+        map->extents = extents;
+        map->capacity = capacity;
+    }
+
+    Extent* extent = &map->extents[map->count++];
+    extent->file_cluster = map->mapped;
+    extent->disk_cluster = disk_cluster;
+    extent->length = 1;
+    return 1;
+}
+
+// Map the next cluster of the chain, 0 at its end
+static uint8_t walk(ExtentMap* map) {
+    Extent* last = map->count > 0 ? &map->extents[map->count - 1] : NULL;
+    uint32_t next = map->first_cluster;
+
+    if (last != NULL) {
+        next = getNextCluster(last->disk_cluster + last->length - 1);
+        extent_stats.links_walked++;
+    }
+
+    // A free, reserved or out of range link ends the chain, so does a loop
+    if (next < 2 || next >= fat_cluster_count() + 2 || map->mapped > fat_cluster_count()) {
+        map->complete = 1;
+        return 0;
+    }
+
+    if (last != NULL && last->disk_cluster + last->length == next) {
+        last->length++;
+    }
+    else if (!push(map, next)) {
+        return 0;
+    }
+    map->mapped++;
+    return 1;
+}
+
+uint32_t extent_map_lookup(ExtentMap* map, uint32_t index, uint32_t* run) {
+    extent_stats.lookups++;
+
+    while (index >= map->mapped && !map->complete) {
+        if (!walk(map)) {
+            break;
+        }
+    }
+    if (index >= map->mapped) {
+        return 0;
+    }
+
+    // Last extent starting at or before 'index'
+    uint32_t low = 0;
+    uint32_t high = map->count - 1;
+    while (low < high) {
+        uint32_t middle = (low + high + 1) / 2;
+        if (map->extents[middle].file_cluster <= index) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+
+    Extent* extent = &map->extents[low];
+    *run = extent->file_cluster + extent->length - index;
+    return extent->disk_cluster + (index - extent->file_cluster);
+}
+
+uint32_t extent_map_length(ExtentMap* map) {
+    while (!map->complete) {
+        if (!walk(map)) {
+            break;
+        }
+    }
+    return map->mapped;
+}
+
+void extent_map_extended(ExtentMap* map, uint32_t first_cluster) {
+    if (map->first_cluster == 0) {
+        map->first_cluster = first_cluster;
+    }
+    map->complete = map->first_cluster == 0;
+}
+
+void extent_map_truncate(ExtentMap* map, uint32_t clusters) {
+    if (clusters == 0) {
+        extent_map_free(map);
+        extent_map_init(map, 0);
+        return;
+    }
+
+    while (map->count > 0 && map->extents[map->count - 1].file_cluster >= clusters) {
+        map->count--;
+    }
+    if (map->count > 0) {
+        Extent* last = &map->extents[map->count - 1];
+        if (last->file_cluster + last->length > clusters) {
+            last->length = clusters - last->file_cluster;
+        }
+    }
+
+    // Still unmapped clusters below the cut are found by the next walk
+    if (map->mapped >= clusters) {
+        map->mapped = clusters;
+        map->complete = 1;
+    }
+    else {
+        map->complete = 0;
+    }
+}
+
+void extent_map_free(ExtentMap* map) {
+    kfree(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->mapped = 0;
+}
@@ -0,0 +1,489 @@
+#include "fat_file.h"
+#include "fat_geometry.h"
+#include "fat_alloc.h"
+#include "fat_cache.h"
+#include "bcache.h"
+#include "constants.h"
+#include "hdd.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "pmm.h"
+#include "vga.h"
+
+ReadaheadStats readahead_stats;
+ZeroStats zero_stats;
+
+// What transfer does with the bytes
+#define MOVE_READ  0
+#define MOVE_WRITE 1
+#define MOVE_ZERO  2    /* write the zeros in iov, except over unwritten clusters that read as zeros already */
+
+uint8_t fat_file_open(FatFile* file, char* filename) {
+    DirectoryEntry entry;
+    if (!find_directory_entry(&entry, filename)) {
+        return 0;
+    }
+    fat_file_init(file, &entry);
+    return 1;
+}
+
+void fat_file_init(FatFile* file, DirectoryEntry* entry) {
+    memCpy(&file->entry, entry, sizeof(DirectoryEntry));
+    file->size = file->entry.file_size;
+    file->cluster_size = fat_geometry.cluster_size;
+    extent_map_init(&file->extents, file->entry.cluster_low | ((uint32_t)file->entry.cluster_high << 16));
+    file->readahead.next_offset = 0;
+    file->readahead.window = READAHEAD_MIN;
+    file->readahead.ahead_end = 0;
+    file->cached_pages = 0;
+}
+
+// Move the part of a run that does not cover whole sectors through the buffer cache
+static uint8_t transfer_partial(uint32_t sector, uint32_t offset, IoVec* iov, uint32_t iov_count, uint32_t* index,
+                                size_t* piece_offset, char* bounce, uint32_t length, uint8_t write) {
+    if (write) {
+        iov_copy(iov, iov_count, index, piece_offset, bounce, length, 0);
+        return write_at(sector, offset, bounce, length);
+    }
+    uint8_t ok = read_at(sector, offset, bounce, length);
+    iov_copy(iov, iov_count, index, piece_offset, bounce, length, 1);
+    return ok;
+}
+
+// Read whole sectors into the iovec list. Stretches found in the cache are
+// copied from it, the stretches between them are one device request each.
+static uint8_t read_sectors(uint32_t sector, uint32_t count, IoVec* iov, uint32_t iov_count,
+                            uint32_t* index, size_t* piece_offset, IoVec* slice) {
+    uint32_t sector_size = 1u << fat_sector_shift();
+    uint32_t i = 0;
+    while (i < count) {
+        Buffer* buf = bcache_peek(disk_device, sector + i);
+        if (buf != NULL) {
+            iov_copy(iov, iov_count, index, piece_offset, buf->data, sector_size, 1);
+            bcache_put(buf);
+            i++;
+            continue;
+        }
+
+        // Uncached up to the next cached sector
+        uint32_t missing = 1;
+        while (i + missing < count) {
+            buf = bcache_peek(disk_device, sector + i + missing);
+            if (buf != NULL) {
+                bcache_put(buf);
+                break;
+            }
+            missing++;
+        }
+        uint32_t pieces = iov_slice(iov, iov_count, index, piece_offset, missing * sector_size, slice);
+        if (!readv_sectors(sector + i, slice, pieces)) {
+            return 0;
+        }
+        readahead_stats.misses += missing;
+        i += missing;
+    }
+    return 1;
+}
+
+// Write zeros over 'length' bytes starting 'offset' bytes into the cluster at
+// 'sector'. Whole sectors go to the device in one request, partial ones through the cache.
+static uint8_t zero_bytes(uint32_t sector, uint32_t offset, uint32_t length) {
+    uint32_t sector_size = 1u << fat_sector_shift();
+    char* zeros = zero_page();
+    if (zeros == NULL) {
+        return 0;
+    }
+    zero_stats.zeroed += length;
+
+    uint32_t head = (sector_size - (offset & fat_sector_mask())) & fat_sector_mask();
+    if (head > length) {
+        head = length;
+    }
+    if (head > 0 && !write_at(sector, offset, zeros, head)) {
+        return 0;
+    }
+    offset += head;
+    length -= head;
+
+    IoVec pieces[MAX_CLUSTER_SIZE / PAGE_SIZE];
+    uint32_t whole = length & ~fat_sector_mask();
+    uint32_t count = 0;
+    for (uint32_t left = whole; left > 0 && count < MAX_CLUSTER_SIZE / PAGE_SIZE; count++) {
+        pieces[count].base = zeros;
+        pieces[count].length = left < PAGE_SIZE ? left : PAGE_SIZE;
+        left -= pieces[count].length;
+    }
+    if (count > 0 && !writev_sectors(sector + (offset >> fat_sector_shift()), pieces, count)) {
+        return 0;
+    }
+
+    if (length > whole) {
+        return write_at(sector, offset + whole, zeros, length - whole);
+    }
+    return 1;
+}
+
+// Give an unwritten run its first data: the bytes of [in_run, in_run + length)
+// were just written, zero the rest of its clusters the file can see. The run
+// stays unwritten when the zeros cannot be written.
+static uint8_t settle_run(FatFile* file, uint32_t cluster, uint32_t run_offset, uint32_t in_run, uint32_t length) {
+    uint32_t sector = cluster_to_sector(cluster);
+    uint32_t clusters = (in_run + length + fat_cluster_mask()) >> fat_cluster_shift();
+    uint32_t end = in_run + length;
+
+    // Everything before the write becomes part of the file, what follows it only below the current size
+    uint32_t visible = file->size > run_offset ? file->size - run_offset : 0;
+    if (visible > clusters * file->cluster_size) {
+        visible = clusters * file->cluster_size;
+    }
+    if (in_run > 0 && !zero_bytes(sector, 0, in_run)) {
+        return 0;
+    }
+    if (end < visible && !zero_bytes(sector, end, visible - end)) {
+        return 0;
+    }
+    fat_mark_written(cluster, clusters);
+    return 1;
+}
+
+// Move 'length' bytes of the file at 'offset' to or from the iovec list. The
+// range is split into runs of clusters that follow each other on disk. Each
+// run is one device request for its whole sectors plus a cached head and tail
+// when it does not start or end on a sector boundary. Unwritten clusters are
+// not read, they give zeros. Returns the bytes moved.
+static uint32_t transfer(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count, uint32_t length, uint8_t mode, uint8_t direct) {
+    uint32_t sector_size = 1u << fat_sector_shift();
+    IoVec* slice = kmalloc(iov_count * sizeof(IoVec));
+    char* bounce = kmem_cache_alloc(sector_cache);
+    uint32_t done = 0;
+
+    if (slice == NULL || bounce == NULL) {
+        kfree(slice);
+        if (bounce != NULL) {
+            kmem_cache_free(sector_cache, bounce);
+        }
+        return 0;
+    }
+
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    while (done < length) {
+        uint32_t run;
+        uint32_t cluster = extent_map_lookup(&file->extents, offset >> fat_cluster_shift(), &run);
+        if (cluster == 0) {
+            break;
+        }
+
+        // Cut the run where the clusters switch between written and unwritten
+        uint8_t unwritten;
+        run = fat_unwritten_run(cluster, run, &unwritten);
+
+        uint32_t sector = cluster_to_sector(cluster);
+        uint32_t in_run = offset & fat_cluster_mask();
+        uint64_t available = ((uint64_t)run << fat_cluster_shift()) - in_run;
+        uint32_t chunk = length - done < available ? length - done : (uint32_t)available;
+
+        if (unwritten && mode != MOVE_WRITE) {
+            if (mode == MOVE_READ) {
+                zero_stats.zero_reads += chunk;
+                for (uint32_t left = chunk; left > 0; ) {
+                    uint32_t piece = left < PAGE_SIZE ? left : PAGE_SIZE;
+                    iov_copy(iov, iov_count, &index, &piece_offset, zero_page(), piece, 1);
+                    left -= piece;
+                }
+            }
+            else {
+                zero_stats.skipped += chunk;
+                iov_slice(iov, iov_count, &index, &piece_offset, chunk, slice);
+            }
+            done += chunk;
+            offset += chunk;
+            continue;
+        }
+        uint8_t write = mode != MOVE_READ;
+
+        // Misaligned head up to the next sector boundary, whole sectors, then a short tail
+        uint32_t head = (sector_size - (in_run & fat_sector_mask())) & fat_sector_mask();
+        if (head > chunk) {
+            head = chunk;
+        }
+        uint32_t tail = (chunk - head) & fat_sector_mask();
+        uint32_t middle = chunk - head - tail;
+
+        if (head > 0 && !transfer_partial(sector, in_run, iov, iov_count, &index, &piece_offset, bounce, head, write)) {
+            break;
+        }
+        if (middle > 0) {
+            uint32_t first = sector + ((in_run + head) >> fat_sector_shift());
+            uint8_t ok;
+            if (write) {
+                uint32_t pieces = iov_slice(iov, iov_count, &index, &piece_offset, middle, slice);
+                ok = writev_sectors(first, slice, pieces);
+            }
+            else if (direct) {
+                uint32_t pieces = iov_slice(iov, iov_count, &index, &piece_offset, middle, slice);
+                ok = readv_sectors(first, slice, pieces);
+            }
+            else {
+                ok = read_sectors(first, middle >> fat_sector_shift(), iov, iov_count, &index, &piece_offset, slice);
+            }
+            if (!ok) {
+                done += head;
+                break;
+            }
+        }
+        if (tail > 0 && !transfer_partial(sector, in_run + head + middle, iov, iov_count, &index, &piece_offset, bounce, tail, write)) {
+            done += head + middle;
+            break;
+        }
+        // Data in a run that is still unwritten reads back as zeros, it does not count as moved
+        if (unwritten && !settle_run(file, cluster, offset - in_run, in_run, chunk)) {
+            break;
+        }
+
+        done += chunk;
+        offset += chunk;
+    }
+
+    kfree(slice);
+    kmem_cache_free(sector_cache, bounce);
+    return done;
+}
+
+// Make the chain long enough for 'size' bytes, returns 0 when the volume is full
+static uint8_t grow(FatFile* file, uint32_t size) {
+    uint32_t needed = (uint32_t)(((uint64_t)size + fat_cluster_mask()) >> fat_cluster_shift());
+    uint32_t have = extent_map_length(&file->extents);
+    if (needed <= have) {
+        return 1;
+    }
+
+    uint32_t run;
+    uint32_t last = have > 0 ? extent_map_lookup(&file->extents, have - 1, &run) : 0;
+    uint32_t first = fat_alloc_chain(needed - have, last);
+    if (first == 0) {
+        return 0;
+    }
+    if (last == 0) {
+        file->entry.cluster_low = first & 0xFFFF;
+        file->entry.cluster_high = first >> 16;
+    }
+    extent_map_extended(&file->extents, first);
+    return 1;
+}
+
+// Prefetch the file bytes [start, end) into the buffer cache, run by run along the chain
+static void prefetch(FatFile* file, uint32_t start, uint32_t end) {
+    while (start < end) {
+        uint32_t run;
+        uint32_t cluster = extent_map_lookup(&file->extents, start >> fat_cluster_shift(), &run);
+        if (cluster == 0) {
+            return;
+        }
+        uint8_t unwritten;
+        run = fat_unwritten_run(cluster, run, &unwritten);
+        uint32_t in_run = start & fat_cluster_mask();
+        uint64_t available = ((uint64_t)run << fat_cluster_shift()) - in_run;
+        uint32_t chunk = end - start < available ? end - start : (uint32_t)available;
+
+        // Unwritten clusters read as zeros, there is nothing to fetch
+        if (!unwritten) {
+            uint32_t first = in_run >> fat_sector_shift();
+            uint32_t last = (in_run + chunk + fat_sector_mask()) >> fat_sector_shift();
+            bcache_readahead(disk_device, cluster_to_sector(cluster) + first, last - first);
+        }
+        start += chunk;
+    }
+}
+
+// Update the window after a read of [offset, end) and top up the readahead.
+// It runs once the caller's data has been copied, so a device that completes
+// requests in the background would fill the next window while it is consumed.
+static void readahead(FatFile* file, uint32_t offset, uint32_t end) {
+    Readahead* ra = &file->readahead;
+    uint32_t window = ra->window << fat_sector_shift();
+
+    if (offset != ra->next_offset) {
+        readahead_stats.random++;
+        ra->window = READAHEAD_MIN;
+        ra->ahead_end = 0;
+        ra->next_offset = end;
+        return;
+    }
+    readahead_stats.sequential++;
+    ra->next_offset = end;
+
+    // Refill once less than half a window is left ahead of the reader
+    if (ra->ahead_end >= end && ra->ahead_end - end >= window / 2) {
+        return;
+    }
+    uint32_t start = ra->ahead_end > end ? ra->ahead_end : end;
+    uint32_t stop = (uint64_t)end + window < file->size ? end + window : file->size;
+    if (start < stop) {
+        prefetch(file, start, stop);
+        ra->ahead_end = stop;
+    }
+    if (ra->window < READAHEAD_MAX) {
+        ra->window *= 2;
+    }
+}
+
+// Bytes of the iovec list a read at 'offset' can fill before the end of the file
+static uint32_t read_length(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count) {
+    if (offset >= file->size) {
+        return 0;
+    }
+    uint64_t length = iov_length(iov, iov_count);
+    return length > file->size - offset ? file->size - offset : (uint32_t)length;
+}
+
+uint32_t fat_file_readv(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count) {
+    uint32_t length = read_length(file, offset, iov, iov_count);
+    if (length == 0) {
+        return 0;
+    }
+    uint32_t done = transfer(file, offset, iov, iov_count, length, MOVE_READ, 0);
+    readahead(file, offset, offset + done);
+    return done;
+}
+
+uint32_t fat_file_readv_direct(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count) {
+    uint32_t length = read_length(file, offset, iov, iov_count);
+    if (length == 0) {
+        return 0;
+    }
+    return transfer(file, offset, iov, iov_count, length, MOVE_READ, 1);
+}
+
+// Move the end of the file up to 'end'. Bytes between the old end and it read
+// back as zeros, only written clusters need them on disk.
+static uint8_t zero_gap(FatFile* file, uint32_t end) {
+    while (file->size < end) {
+        uint32_t gap = end - file->size < PAGE_SIZE ? end - file->size : PAGE_SIZE;
+        IoVec zeros = { zero_page(), gap };
+        if (zeros.base == NULL || transfer(file, file->size, &zeros, 1, gap, MOVE_ZERO, 0) != gap) {
+            return 0;
+        }
+        file->size += gap;
+    }
+    return 1;
+}
+
+uint32_t fat_file_writev(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count) {
+    uint64_t length = iov_length(iov, iov_count);
+    if (length == 0 || (uint64_t)offset + length > 0xFFFFFFFF) {
+        return 0;
+    }
+    if (!grow(file, offset + (uint32_t)length) || !zero_gap(file, offset)) {
+        return 0;
+    }
+
+    uint32_t done = transfer(file, offset, iov, iov_count, (uint32_t)length, MOVE_WRITE, 0);
+    if (offset + done > file->size) {
+        file->size = offset + done;
+        file->entry.file_size = file->size;
+    }
+    return done;
+}
+
+uint8_t fat_file_extend(FatFile* file, uint32_t size) {
+    if (size <= file->size) {
+        return 1;
+    }
+    uint8_t ok = grow(file, size) && zero_gap(file, size);
+    file->entry.file_size = file->size;
+    return ok;
+}
+
+uint8_t fat_file_truncate(FatFile* file, uint32_t size) {
+    if (size >= file->size) {
+        return 1;
+    }
+    uint32_t keep = (uint32_t)(((uint64_t)size + fat_cluster_mask()) >> fat_cluster_shift());
+    uint32_t have = extent_map_length(&file->extents);
+
+    if (keep < have) {
+        uint32_t run;
+        if (keep == 0) {
+            fat_free_chain(file->extents.first_cluster);
+            file->entry.cluster_low = 0;
+            file->entry.cluster_high = 0;
+        }
+        else {
+            // The last kept cluster ends the chain, everything after it is freed
+            uint32_t last = extent_map_lookup(&file->extents, keep - 1, &run);
+            uint32_t next = extent_map_lookup(&file->extents, keep, &run);
+            fat_cache_set(last, FAT32_EOF);
+            fat_free_chain(next);
+        }
+        extent_map_truncate(&file->extents, keep);
+    }
+
+    file->size = size;
+    file->entry.file_size = size;
+    return 1;
+}
+
+void fat_file_settle(FatFile* file) {
+    uint32_t clusters = (uint32_t)(((uint64_t)file->size + fat_cluster_mask()) >> fat_cluster_shift());
+    uint32_t k = 0;
+    while (k < clusters) {
+        uint32_t run;
+        uint32_t cluster = extent_map_lookup(&file->extents, k, &run);
+        if (cluster == 0) {
+            return;
+        }
+        if (run > clusters - k) {
+            run = clusters - k;
+        }
+
+        uint8_t unwritten;
+        run = fat_unwritten_run(cluster, run, &unwritten);
+        for (uint32_t i = 0; unwritten && i < run; i++) {
+            clear_cluster_data(cluster + i);
+            zero_stats.zeroed += file->cluster_size;
+        }
+        k += run;
+    }
+}
+
+uint32_t fat_file_read(FatFile* file, uint32_t offset, char* buffer, uint32_t count) {
+    IoVec iov = { buffer, count };
+    return fat_file_readv(file, offset, &iov, 1);
+}
+
+uint32_t fat_file_write(FatFile* file, uint32_t offset, char* buffer, uint32_t count) {
+    IoVec iov = { buffer, count };
+    return fat_file_writev(file, offset, &iov, 1);
+}
+
+void fat_file_close(FatFile* file) {
+    extent_map_free(&file->extents);
+}
+
+void fat_file_print_stats(void) {
+    BcacheStats cache;
+    bcache_get_stats(&cache);
+
+    print_str("Readahead: sequential: ");
+    print_uint(readahead_stats.sequential);
+    print_str(" random: ");
+    print_uint(readahead_stats.random);
+    print_str(" sectors read ahead: ");
+    print_uint(cache.readahead);
+    print_str(" hits: ");
+    print_uint(cache.readahead_hits);
+    print_str(" misses: ");
+    print_uint(readahead_stats.misses);
+    print_str(" wasted: ");
+    print_uint(cache.readahead_wasted);
+    print_str("\n");
+
+    print_str("Unwritten clusters: bytes read as zeros: ");
+    print_uint(zero_stats.zero_reads);
+    print_str(" zeroed: ");
+    print_uint(zero_stats.zeroed);
+    print_str(" zeroing skipped: ");
+    print_uint(zero_stats.skipped);
+    print_str("\n");
+}
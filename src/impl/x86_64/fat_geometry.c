@@ -0,0 +1,40 @@
+#include "fat_geometry.h"
+
+FatGeometry fat_geometry;
+
+// log2 of a power of two, 0xFF for anything else
+static uint8_t shift_of(uint32_t value) {
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return 0xFF;
+    }
+    return __builtin_ctz(value);
+}
+
+uint8_t fat_geometry_init(BootSector* bs) {
+    FatGeometry g;
+    g.sector_shift = shift_of(bs->bytes_per_sector);
+    g.cluster_sector_shift = shift_of(bs->sectors_per_cluster);
+    if (g.sector_shift < 9 || g.sector_shift > 12 || g.cluster_sector_shift == 0xFF || g.sector_shift + g.cluster_sector_shift > 16) {
+        return 0;
+    }
+    g.bytes_per_sector = bs->bytes_per_sector;
+    g.sectors_per_cluster = bs->sectors_per_cluster;
+    g.cluster_shift = g.sector_shift + g.cluster_sector_shift;
+    g.cluster_size = 1u << g.cluster_shift;
+    g.common = g.sector_shift == FAT_COMMON_SECTOR_SHIFT && g.cluster_shift == FAT_COMMON_CLUSTER_SHIFT;
+
+    // FAT12 and FAT16 give the FAT size in the old field, FAT32 in its own
+    g.fat_count = bs->fat_count;
+    g.fat_start = bs->reserved_sector_count;
+    g.sectors_per_fat = bs->table_size_16 != 0 ? bs->table_size_16 : bs->sectors_per_fat_32;
+    g.root_dir_sectors = ((uint32_t)bs->root_entry_count * 32 + g.bytes_per_sector - 1) >> g.sector_shift;
+    g.data_start = g.fat_start + g.fat_count * g.sectors_per_fat + g.root_dir_sectors;
+    g.total_sectors = bs->total_sectors_32 != 0 ? bs->total_sectors_32 : bs->total_sectors_16;
+    if (g.fat_count == 0 || g.sectors_per_fat == 0 || g.total_sectors <= g.data_start) {
+        return 0;
+    }
+    g.cluster_count = (g.total_sectors - g.data_start) >> g.cluster_sector_shift;
+
+    fat_geometry = g;
+    return 1;
+}
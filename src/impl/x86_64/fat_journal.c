@@ -0,0 +1,532 @@
+#include "fat_journal.h"
+#include "fat_geometry.h"
+#include "fat_cache.h"
+#include "fat_alloc.h"
+#include "fat_dir.h"
+#include "hdd.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "vga.h"
+
+JournalStats journal_stats;
+
+static BlockDev* device;
+static uint8_t active;
+static uint32_t log_start;          // first sector of the log, its header
+static uint32_t log_sectors;
+static uint32_t epoch;
+static uint32_t head;               // next unused sector of the log
+static uint32_t sequence;           // of the next transaction
+static JournalRecord* live;         // home of each image in the log since the checkpoint, copies 0 elsewhere
+
+static uint32_t checksum(uint32_t sum, void* data, uint32_t length) {
+    uint32_t* words = data;
+    for (uint32_t i = 0; i < length / 4; i++) {
+        sum = (sum ^ words[i]) * 16777619u;
+    }
+    return sum;
+}
+
+static uint32_t descriptor_sectors(uint32_t records) {
+    uint32_t bytes = sizeof(JournalDescriptor) + records * sizeof(JournalRecord);
+    return (bytes + device->sector_size - 1) >> device->sector_shift;
+}
+
+static uint8_t write_header(void) {
+    JournalHeader* header = kzalloc(device->sector_size);
+    if (header == NULL) {
+        return 0;
+    }
+    header->magic = JOURNAL_MAGIC;
+    header->epoch = epoch;
+    uint8_t ok = blockdev_write(device, log_start, 1, header) && blockdev_flush(device);
+    kfree(header);
+    return ok;
+}
+
+// Replay
+
+// Check the transaction at 'head' and write its sectors home. 0 when there is
+// no transaction of this epoch there or it did not reach the log whole.
+static uint8_t replay_one(char* bounce) {
+    if (!blockdev_read(device, log_start + head, 1, bounce)) {
+        return 0;
+    }
+    JournalDescriptor* first = (JournalDescriptor*)bounce;
+    if (first->magic != JOURNAL_MAGIC || first->epoch != epoch || first->sequence != sequence ||
+        first->record_count == 0 || first->record_count >= log_sectors) {
+        return 0;
+    }
+    uint32_t count = first->record_count;
+    uint32_t descriptor_count = descriptor_sectors(count);
+    if (head + descriptor_count + count > log_sectors) {
+        return 0;
+    }
+
+    JournalDescriptor* descriptor = kmalloc(descriptor_count << device->sector_shift);
+    if (descriptor == NULL || !blockdev_read(device, log_start + head, descriptor_count, descriptor)) {
+        kfree(descriptor);
+        return 0;
+    }
+    uint32_t images = log_start + head + descriptor_count;
+
+    // Every image has to be there before any of them goes home
+    uint32_t expected = descriptor->checksum;
+    descriptor->checksum = 0;
+    uint32_t sum = checksum(2166136261u, descriptor, descriptor_count << device->sector_shift);
+    uint8_t ok = 1;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        ok = blockdev_read(device, images + i, 1, bounce);
+        sum = checksum(sum, bounce, device->sector_size);
+    }
+    ok = ok && sum == expected;
+
+    for (uint32_t i = 0; i < count && ok; i++) {
+        JournalRecord* record = &descriptor->records[i];
+        ok = blockdev_read(device, images + i, 1, bounce);
+        for (uint32_t copy = 0; copy < record->copies && ok; copy++) {
+            ok = blockdev_write(device, record->sector + copy * record->stride, 1, bounce);
+        }
+    }
+
+    kfree(descriptor);
+    if (ok) {
+        head += descriptor_count + count;
+        sequence++;
+    }
+    return ok;
+}
+
+uint8_t journal_replay(BlockDev* dev, BootSector* bs) {
+    JournalLocation* location = (JournalLocation*)bs->reserved;
+    if (location->magic != JOURNAL_MAGIC || location->sector_count < 2 ||
+        (uint64_t)location->first_sector + location->sector_count > dev->sector_count) {
+        return 1;
+    }
+    device = dev;
+    log_start = location->first_sector;
+    log_sectors = location->sector_count;
+
+    char* bounce = kmalloc(dev->sector_size);
+    if (bounce == NULL || !blockdev_read(dev, log_start, 1, bounce)) {
+        kfree(bounce);
+        return 0;
+    }
+    JournalHeader* header = (JournalHeader*)bounce;
+    epoch = header->magic == JOURNAL_MAGIC ? header->epoch : 0;
+
+    head = 1;
+    sequence = 0;
+    uint32_t replayed = 0;
+    while (head < log_sectors && replay_one(bounce)) {
+        replayed++;
+    }
+    kfree(bounce);
+
+    // Nothing read so far may hold the sectors from before the replay
+    bcache_invalidate(dev);
+    head = 1;
+    sequence = 0;
+    if (replayed == 0) {
+        return 1;
+    }
+    journal_stats.replayed += replayed;
+
+    // The transactions are home, retire them
+    epoch++;
+    return blockdev_flush(dev) && write_header();
+}
+
+// Setting up the log
+
+// Sectors the biggest transaction needs: every FAT sector and as many cached
+// sectors as a transaction may hold, behind the log header
+static uint32_t log_size(void) {
+    uint32_t records = fat_cache.sectors_per_fat + JOURNAL_BUFFER_LIMIT;
+    uint32_t sectors = 1 + descriptor_sectors(records) + records;
+    return sectors < JOURNAL_SECTORS ? JOURNAL_SECTORS : sectors;
+}
+
+static uint8_t set_location(BlockDev* dev, JournalLocation* location) {
+    Buffer* buf = bcache_get(dev, 0);
+    if (buf == NULL) {
+        return 0;
+    }
+    memCpy(buf->data + ((char*)boot_sector.reserved - (char*)&boot_sector), location, sizeof(JournalLocation));
+    bcache_mark_dirty(buf);
+    bcache_put(buf);
+    memCpy(boot_sector.reserved, location, sizeof(JournalLocation));
+    return bcache_sync(dev);
+}
+
+// Give the volume a log: a hidden contiguous file plus its location in the boot sector
+static uint8_t create(BlockDev* dev, uint32_t sectors) {
+    uint32_t clusters = (uint32_t)((((uint64_t)sectors << fat_sector_shift()) + fat_cluster_mask()) >> fat_cluster_shift());
+
+    // One run, so a commit is one sequential write
+    uint32_t length;
+    uint32_t first = fat_alloc_extent(clusters, &length);
+    if (first == 0) {
+        return 0;
+    }
+    if (length < clusters) {
+        fat_free_chain(first);
+        return 0;
+    }
+    fat_mark_written(first, clusters);
+
+    DirectoryEntry entry;
+    memSet(&entry, 0, sizeof(DirectoryEntry));
+    fat_name_normalize(JOURNAL_NAME, entry.filename);
+    entry.attributes = ATTR_HIDDEN | ATTR_SYSTEM | ATTR_READ_ONLY;
+    entry.cluster_low = first & 0xFFFF;
+    entry.cluster_high = first >> 16;
+    entry.file_size = clusters << fat_cluster_shift();
+    if (!dir_add_entry(root_directory_cluster(), &entry, NULL)) {
+        fat_free_chain(first);
+        return 0;
+    }
+
+    log_start = cluster_to_sector(first);
+    log_sectors = clusters << (fat_cluster_shift() - fat_sector_shift());
+    // Past the epoch of any log that was here before, its leftovers never replay
+    epoch++;
+    head = 1;
+    sequence = 0;
+
+    // The file and an empty log reach the disk before the boot sector points at them
+    if (!fat_cache_sync() || !fat_alloc_sync() || !bcache_sync(dev) || !write_header()) {
+        return 0;
+    }
+    JournalLocation location = { JOURNAL_MAGIC, log_start, log_sectors };
+    return set_location(dev, &location);
+}
+
+// Take an outgrown log off the volume, the boot sector lets go of it first
+static uint8_t remove_log(BlockDev* dev, uint32_t slot, uint32_t first) {
+    JournalLocation none;
+    memSet(&none, 0, sizeof(JournalLocation));
+    if (!set_location(dev, &none) || !dir_remove_entry(root_directory_cluster(), slot)) {
+        return 0;
+    }
+    fat_free_chain(first);
+    return 1;
+}
+
+uint8_t journal_open(BlockDev* dev) {
+    if (dev->sector_size != fat_geometry.bytes_per_sector) {
+        return 0;
+    }
+
+    device = dev;
+    uint32_t sectors = log_size();
+    if (sectors > JOURNAL_SECTORS_MAX) {
+        return 0;
+    }
+
+    // A log whose file is gone (another system deleted it) is made again, one
+    // too small for the FAT is replaced
+    JournalLocation* location = (JournalLocation*)boot_sector.reserved;
+    DirectoryEntry entry;
+    uint32_t slot;
+    uint8_t found = location->magic == JOURNAL_MAGIC && dir_lookup(root_directory_cluster(), JOURNAL_NAME, &entry, &slot) &&
+                    cluster_to_sector(entry.cluster_low | ((uint32_t)entry.cluster_high << 16)) == location->first_sector;
+    if (found && location->sector_count < sectors) {
+        if (!remove_log(dev, slot, entry.cluster_low | ((uint32_t)entry.cluster_high << 16))) {
+            return 0;
+        }
+        found = 0;
+    }
+    if (found) {
+        log_start = location->first_sector;
+        log_sectors = location->sector_count;
+    }
+    else if (!create(dev, sectors)) {
+        return 0;
+    }
+
+    kfree(live);
+    live = kzalloc(log_sectors * sizeof(JournalRecord));
+    if (live == NULL || !fat_cache_enable_log()) {
+        return 0;
+    }
+
+    // Logged sectors have to be held back from their homes, which a cache
+    // pointing straight into a RAM disk cannot do
+    if (!dev->cache_copies) {
+        bcache_sync(dev);
+        dev->cache_copies = 1;
+        bcache_invalidate(dev);
+    }
+    active = 1;
+    return 1;
+}
+
+void journal_close(void) {
+    active = 0;
+}
+
+uint8_t journal_active(void) {
+    return active;
+}
+
+uint8_t journal_mark_dirty(Buffer* buf) {
+    if (!active) {
+        bcache_mark_dirty(buf);
+        return 1;
+    }
+    // Keep half the cache evictable, or a big operation runs the cache dry
+    if (!(buf->flags & BUF_JOURNAL) && bcache_journal_count() >= JOURNAL_BUFFER_LIMIT) {
+        return 0;
+    }
+    bcache_mark_journal(buf);
+    return 1;
+}
+
+uint32_t journal_room(void) {
+    if (!active) {
+        return 0xFFFFFFFF;
+    }
+    uint32_t held = bcache_journal_count();
+    return held < JOURNAL_BUFFER_LIMIT ? JOURNAL_BUFFER_LIMIT - held : 0;
+}
+
+uint8_t journal_reserve(uint32_t buffers) {
+    if (buffers > JOURNAL_BUFFER_LIMIT) {
+        return !active;
+    }
+    return journal_room() >= buffers || journal_commit();
+}
+
+// Commits and checkpoints
+
+// 1 when the sector changed again after it was logged, the syncs leave it alone then
+static uint8_t held_back(JournalRecord* record) {
+    FatCache* fc = &fat_cache;
+    uint32_t fat = fc->first_sector + (fc->mirror ? 0 : fc->active_fat * fc->sectors_per_fat);
+    if (record->sector >= fat && record->sector - fat < fc->sectors_per_fat) {
+        uint32_t sector = record->sector - fat;
+        return (fc->unlogged[sector / 64] >> (sector % 64)) & 1;
+    }
+    Buffer* buf = bcache_peek(device, record->sector);
+    if (buf == NULL) {
+        return 0;
+    }
+    uint8_t held = (buf->flags & BUF_JOURNAL) != 0;
+    bcache_put(buf);
+    return held;
+}
+
+// A sector held back by the syncs has its last committed image only in the
+// log. The newest one goes home from there before the log is retired.
+static uint8_t write_held_back(void) {
+    FatCache* fc = &fat_cache;
+    uint64_t* fat_done = kzalloc(((fc->sectors_per_fat + 63) / 64) * sizeof(uint64_t));
+    uint32_t* done = kmalloc(JOURNAL_BUFFER_LIMIT * sizeof(uint32_t));
+    char* bounce = kmalloc(device->sector_size);
+    if (fat_done == NULL || done == NULL || bounce == NULL) {
+        kfree(fat_done);
+        kfree(done);
+        kfree(bounce);
+        return 0;
+    }
+
+    uint32_t fat = fc->first_sector + (fc->mirror ? 0 : fc->active_fat * fc->sectors_per_fat);
+    uint32_t done_count = 0;
+    uint32_t written = 0;
+    uint8_t ok = 1;
+    for (uint32_t i = head - 1; i >= 1 && ok; i--) {
+        JournalRecord* record = &live[i];
+        if (record->copies == 0 || !held_back(record)) {
+            continue;
+        }
+        // Older images of the sector further down the log are stale
+        if (record->sector >= fat && record->sector - fat < fc->sectors_per_fat) {
+            uint32_t sector = record->sector - fat;
+            if ((fat_done[sector / 64] >> (sector % 64)) & 1) {
+                continue;
+            }
+            fat_done[sector / 64] |= 1ull << (sector % 64);
+        }
+        else {
+            uint32_t d = 0;
+            while (d < done_count && done[d] != record->sector) {
+                d++;
+            }
+            if (d < done_count) {
+                continue;
+            }
+            done[done_count++] = record->sector;
+        }
+
+        ok = blockdev_read(device, log_start + i, 1, bounce);
+        for (uint32_t copy = 0; copy < record->copies && ok; copy++) {
+            ok = blockdev_write(device, record->sector + copy * record->stride, 1, bounce);
+            written++;
+        }
+    }
+    kfree(fat_done);
+    kfree(done);
+    kfree(bounce);
+    journal_stats.home_writes += written;
+    return ok && (written == 0 || blockdev_flush(device));
+}
+
+// Write every logged sector home and retire the log. Sectors changed since
+// the last commit stay back in the caches, their committed images go home
+// from the log.
+static uint8_t checkpoint_home(void) {
+    BcacheStats before;
+    bcache_get_stats(&before);
+    uint64_t fat_before = fat_cache.stats.sectors_written;
+
+    // The FAT first, then the cached sectors in one ascending sweep and a flush
+    uint8_t ok = fat_cache_sync();
+    ok &= bcache_sync(device);
+    BcacheStats after;
+    bcache_get_stats(&after);
+    journal_stats.home_writes += after.writebacks - before.writebacks + fat_cache.stats.sectors_written - fat_before;
+    if (!ok || !write_held_back()) {
+        return 0;
+    }
+
+    journal_stats.checkpoints++;
+    epoch++;
+    memSet(live, 0, head * sizeof(JournalRecord));
+    head = 1;
+    sequence = 0;
+    return write_header();
+}
+
+static void fat_record(JournalRecord* record, uint32_t sector) {
+    FatCache* fc = &fat_cache;
+    record->copies = fc->mirror ? fc->fat_count : 1;
+    record->stride = fc->sectors_per_fat;
+    record->sector = fc->first_sector + (fc->mirror ? 0 : fc->active_fat * fc->sectors_per_fat) + sector;
+    record->reserved = 0;
+}
+
+// Write the transaction to the log with one request and a flush
+static uint8_t write_transaction(uint32_t* fat_sectors, uint32_t fat_count, Buffer** bufs, uint32_t buf_count) {
+    uint32_t count = fat_count + buf_count;
+    uint32_t descriptor_count = descriptor_sectors(count);
+    JournalDescriptor* descriptor = kzalloc(descriptor_count << device->sector_shift);
+    IoVec* iov = kmalloc((count + 1) * sizeof(IoVec));
+    if (descriptor == NULL || iov == NULL) {
+        kfree(descriptor);
+        kfree(iov);
+        return 0;
+    }
+
+    descriptor->magic = JOURNAL_MAGIC;
+    descriptor->epoch = epoch;
+    descriptor->sequence = sequence;
+    descriptor->record_count = count;
+    iov[0].base = descriptor;
+    iov[0].length = descriptor_count << device->sector_shift;
+    for (uint32_t i = 0; i < fat_count; i++) {
+        fat_record(&descriptor->records[i], fat_sectors[i]);
+        iov[i + 1].base = fat_cache_sector(fat_sectors[i]);
+        iov[i + 1].length = device->sector_size;
+    }
+    for (uint32_t i = 0; i < buf_count; i++) {
+        JournalRecord* record = &descriptor->records[fat_count + i];
+        record->sector = bufs[i]->sector;
+        record->copies = 1;
+        iov[fat_count + i + 1].base = bufs[i]->data;
+        iov[fat_count + i + 1].length = device->sector_size;
+    }
+
+    uint32_t sum = checksum(2166136261u, descriptor, iov[0].length);
+    for (uint32_t i = 1; i <= count; i++) {
+        sum = checksum(sum, iov[i].base, iov[i].length);
+    }
+    descriptor->checksum = sum;
+
+    uint8_t ok = blockdev_writev(device, log_start + head, iov, count + 1) && blockdev_flush(device);
+    if (ok) {
+        memSet(&live[head], 0, descriptor_count * sizeof(JournalRecord));
+        memCpy(&live[head + descriptor_count], descriptor->records, count * sizeof(JournalRecord));
+        head += descriptor_count + count;
+        sequence++;
+        journal_stats.commits++;
+        journal_stats.sectors_logged += count;
+    }
+    kfree(descriptor);
+    kfree(iov);
+    return ok;
+}
+
+uint8_t journal_commit(void) {
+    if (!active) {
+        return 1;
+    }
+    uint32_t fat_max = fat_cache.unlogged_count;
+    uint32_t buf_max = bcache_journal_count();
+    if (fat_max + buf_max == 0) {
+        return 1;
+    }
+
+    uint32_t* fat_sectors = kmalloc((fat_max + 1) * sizeof(uint32_t));
+    Buffer** bufs = kmalloc((buf_max + 1) * sizeof(Buffer*));
+    if (fat_sectors == NULL || bufs == NULL) {
+        kfree(fat_sectors);
+        kfree(bufs);
+        return 0;
+    }
+    uint32_t fat_count = fat_cache_collect_unlogged(fat_sectors, fat_max);
+    uint32_t buf_count = bcache_journal_collect(bufs, buf_max);
+    uint32_t count = fat_count + buf_count;
+    uint32_t needed = descriptor_sectors(count) + count;
+
+    // The log is sized for the biggest transaction, one that does not fit stays waiting.
+    // Make room, then order the data the metadata points at ahead of the log write.
+    uint8_t ok = 1 + needed <= log_sectors;
+    ok = ok && (head + needed <= log_sectors || checkpoint_home());
+    ok = ok && bcache_sync(device) && write_transaction(fat_sectors, fat_count, bufs, buf_count);
+    if (ok) {
+        fat_cache_logged(fat_sectors, fat_count);
+        bcache_journal_logged(bufs, buf_count);
+    }
+    else {
+        for (uint32_t i = 0; i < buf_count; i++) {
+            bcache_put(bufs[i]);
+        }
+    }
+
+    kfree(fat_sectors);
+    kfree(bufs);
+    return ok;
+}
+
+void journal_maybe_commit(void) {
+    if (active && fat_cache.unlogged_count + bcache_journal_count() >= JOURNAL_COMMIT_RECORDS) {
+        journal_commit();
+    }
+}
+
+uint8_t journal_checkpoint(void) {
+    if (!active) {
+        return fat_cache_sync() && bcache_sync(disk_device);
+    }
+    return journal_commit() && checkpoint_home();
+}
+
+void journal_print_stats(void) {
+    print_str("Journal: ");
+    if (!active) {
+        print_str("off\n");
+        return;
+    }
+    print_str("commits: ");
+    print_uint(journal_stats.commits);
+    print_str(" sectors logged: ");
+    print_uint(journal_stats.sectors_logged);
+    print_str(" checkpoints: ");
+    print_uint(journal_stats.checkpoints);
+    print_str(" home writes: ");
+    print_uint(journal_stats.home_writes);
+    print_str(" replayed: ");
+    print_uint(journal_stats.replayed);
+    print_str("\n");
+}
@@ -0,0 +1,349 @@
+#include "fat_vfs.h"
+#include "fat_alloc.h"
+#include "fat_dir.h"
+#include "fat_geometry.h"
+#include "fat_journal.h"
+#include "fd.h"
+#include "pcache.h"
+#include "constants.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "pmm.h"
+
+static FatNode* node_of(Inode* inode) {
+    return inode->private_data;
+}
+
+// Inode cache key of the entry in (dir_cluster, slot)
+static uint64_t entry_key(uint32_t dir_cluster, uint32_t slot) {
+    return ((uint64_t)dir_cluster << 32) | slot;
+}
+
+// Cluster holding the entries of a directory inode
+static uint32_t dir_cluster_of(Inode* dir) {
+    if (dir == dir->mount->root) {
+        return root_directory_cluster();
+    }
+    DirectoryEntry* entry = &node_of(dir)->file.entry;
+    return entry->cluster_low | ((uint32_t)entry->cluster_high << 16);
+}
+
+static uint8_t node_write_entry(FatNode* node) {
+    if (!node->entry_dirty) {
+        return 1;
+    }
+    // The size must not reach the disk ahead of the zeros it covers
+    fat_file_settle(&node->file);
+    if (!dir_write_entry(node->dir_cluster, node->slot, &node->file.entry)) {
+        return 0;
+    }
+    node->entry_dirty = 0;
+    return 1;
+}
+
+// FAT32 files
+
+// O_DIRECT only skips the caches when the transfer covers whole sectors
+static uint8_t direct_io(uint32_t flags, uint64_t offset, uint64_t count) {
+    return (flags & O_DIRECT) && (offset & fat_sector_mask()) == 0 && (count & fat_sector_mask()) == 0;
+}
+
+static uint64_t fat_readv(Inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags) {
+    FatFile* file = &node_of(inode)->file;
+    uint64_t count = iov_length(iov, iov_count);
+    if (offset >= file->size || count == 0) {
+        return 0;
+    }
+    if (direct_io(flags, offset, count)) {
+        // Stores through a mapping may not be on the device yet
+        uint64_t last = offset + count - 1 < file->size ? offset + count - 1 : file->size - 1;
+        pcache_writeback(file, offset >> PAGE_SHIFT, (uint32_t)((last >> PAGE_SHIFT) - (offset >> PAGE_SHIFT) + 1));
+        fd_stats.direct_reads++;
+        return fat_file_readv_direct(file, (uint32_t)offset, iov, iov_count);
+    }
+    return pcache_readv(file, (uint32_t)offset, iov, iov_count);
+}
+
+// Writes land in the page cache and reach the device on writeback. O_DIRECT
+// writes go to the device at once, after the dirty pages they overlap, and
+// the cached copies are brought up to date.
+static uint64_t fat_writev(Inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags) {
+    FatNode* node = node_of(inode);
+    FatFile* file = &node->file;
+    uint32_t size = file->size;
+    uint16_t cluster_low = file->entry.cluster_low;
+    uint16_t cluster_high = file->entry.cluster_high;
+    uint64_t count = iov_length(iov, iov_count);
+
+    uint32_t done;
+    if (direct_io(flags, offset, count) && count > 0) {
+        uint64_t last = offset + count - 1;
+        if (!pcache_writeback(file, offset >> PAGE_SHIFT, (uint32_t)((last >> PAGE_SHIFT) - (offset >> PAGE_SHIFT) + 1))) {
+            return 0;
+        }
+        done = fat_file_writev(file, (uint32_t)offset, iov, iov_count);
+        pcache_written(file, (uint32_t)offset, iov, iov_count, done);
+        fd_stats.direct_writes++;
+    }
+    else {
+        done = pcache_writev(file, (uint32_t)offset, iov, iov_count);
+    }
+    if (done == 0) {
+        return 0;
+    }
+    if (file->size != size || file->entry.cluster_low != cluster_low || file->entry.cluster_high != cluster_high) {
+        node->entry_dirty = 1;
+    }
+    inode->size = file->size;
+    journal_maybe_commit();
+    return done;
+}
+
+static uint8_t fat_truncate(Inode* inode, uint64_t size) {
+    FatNode* node = node_of(inode);
+    pcache_truncate(&node->file, (uint32_t)size);
+    if (!fat_file_truncate(&node->file, (uint32_t)size)) {
+        return 0;
+    }
+    node->entry_dirty = 1;
+    inode->size = node->file.size;
+    return 1;
+}
+
+// Pages stored to through mappings and the directory entry go to the buffer
+// cache first, then everything reaches the device
+static uint8_t fat_sync_inode(Inode* inode) {
+    FatNode* node = node_of(inode);
+    return pcache_writeback(&node->file, 0, 0xFFFFFFFF) && node_write_entry(node) && fat_sync();
+}
+
+static InodeOps fat_inode_ops = {
+    .readv = fat_readv,
+    .writev = fat_writev,
+    .truncate = fat_truncate,
+    .sync = fat_sync_inode,
+};
+
+static Inode* fat_lookup(Inode* dir, char* name, uint8_t create) {
+    uint8_t short_name[DIR_NAME_LENGTH];
+    if (!fat_name_normalize(name, short_name)) {
+        return NULL;
+    }
+
+    uint32_t dir_cluster = dir_cluster_of(dir);
+    DirectoryEntry entry;
+    uint32_t slot;
+    if (!dir_find(dir_cluster, short_name, &entry, &slot)) {
+        if (!create) {
+            return NULL;
+        }
+        memSet(&entry, 0, sizeof(DirectoryEntry));
+        memCpy(entry.filename, short_name, DIR_NAME_LENGTH);
+        entry.attributes = ATTR_ARCHIVE;
+        if (!dir_add_entry(dir_cluster, &entry, &slot)) {
+            return NULL;
+        }
+    }
+    if (entry.attributes & ATTR_VOLUME_ID) {
+        return NULL;
+    }
+
+    uint8_t created;
+    Inode* inode = vfs_iget(dir->mount, entry_key(dir_cluster, slot), &created);
+    if (inode == NULL || !created) {
+        return inode;
+    }
+    FatNode* node = kzalloc(sizeof(FatNode));
+    if (node == NULL) {
+        vfs_iput(inode);
+        return NULL;
+    }
+    node->dir_cluster = dir_cluster;
+    node->slot = slot;
+    fat_file_init(&node->file, &entry);
+    inode->private_data = node;
+    inode->ops = &fat_inode_ops;
+    inode->type = (entry.attributes & ATTR_DIRECTORY) ? VFS_DIR : VFS_FILE;
+    inode->read_only = (entry.attributes & ATTR_READ_ONLY) != 0;
+    inode->size = node->file.size;
+    return inode;
+}
+
+// Files only, and only while nobody has them open
+static uint8_t fat_unlink(Inode* dir, char* name) {
+    uint8_t short_name[DIR_NAME_LENGTH];
+    if (!fat_name_normalize(name, short_name)) {
+        return 0;
+    }
+    uint32_t dir_cluster = dir_cluster_of(dir);
+    DirectoryEntry entry;
+    uint32_t slot;
+    if (!dir_find(dir_cluster, short_name, &entry, &slot) || (entry.attributes & (ATTR_DIRECTORY | ATTR_VOLUME_ID | ATTR_READ_ONLY))) {
+        return 0;
+    }
+    if (vfs_ifind(dir->mount, entry_key(dir_cluster, slot)) != NULL) {
+        return 0;
+    }
+
+    uint32_t first = entry.cluster_low | ((uint32_t)entry.cluster_high << 16);
+    if (!dir_remove_entry(dir_cluster, slot)) {
+        return 0;
+    }
+    if (first != 0) {
+        fat_free_chain(first);
+    }
+    journal_maybe_commit();
+    return 1;
+}
+
+// The directory entry is written when the last descriptor or mapping goes
+static void fat_release(Inode* inode) {
+    FatNode* node = node_of(inode);
+    if (node == NULL) {
+        return;
+    }
+    if (inode->ops == &fat_inode_ops) {
+        pcache_release(&node->file);
+        node_write_entry(node);
+        fat_file_close(&node->file);
+    }
+    else {
+        exfat_close(&node->exfat);
+    }
+    kfree(node);
+    journal_maybe_commit();
+}
+
+FsOps fat_fs_ops = {
+    .name = "fat32",
+    .max_file_size = 0xFFFFFFFF,
+    .lookup = fat_lookup,
+    .mkdir = NULL,
+    .unlink = fat_unlink,
+    .release = fat_release,
+};
+
+// exFAT files, matched case-insensitively through the volume's up-case table.
+// There is no page cache on exFAT: whole sectors always go straight to the
+// device and only a partial head or tail sector passes the buffer cache. The
+// data of an O_DIRECT transfer of whole sectors therefore never touches a
+// cache, other O_DIRECT transfers use it for their partial sectors as on FAT32.
+
+static uint8_t exfat_direct_io(uint32_t flags, uint64_t offset, uint64_t count) {
+    uint32_t mask = exfat_sector_size() - 1;
+    return (flags & O_DIRECT) && (offset & mask) == 0 && (count & mask) == 0;
+}
+
+static uint64_t exfat_vfs_readv(Inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags) {
+    if (exfat_direct_io(flags, offset, iov_length(iov, iov_count))) {
+        fd_stats.direct_reads++;
+    }
+    return exfat_readv(&node_of(inode)->exfat, offset, iov, iov_count);
+}
+
+static uint64_t exfat_vfs_writev(Inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags) {
+    ExfatFile* file = &node_of(inode)->exfat;
+    if (exfat_direct_io(flags, offset, iov_length(iov, iov_count))) {
+        fd_stats.direct_writes++;
+    }
+    uint64_t done = exfat_writev(file, offset, iov, iov_count);
+    inode->size = file->size;
+    return done;
+}
+
+static uint8_t exfat_vfs_truncate(Inode* inode, uint64_t size) {
+    ExfatFile* file = &node_of(inode)->exfat;
+    uint8_t ok = exfat_truncate(file, size);
+    inode->size = file->size;
+    return ok;
+}
+
+static uint8_t exfat_vfs_sync(Inode* inode) {
+    return exfat_file_sync(&node_of(inode)->exfat) && fat_sync();
+}
+
+static InodeOps exfat_inode_ops = {
+    .readv = exfat_vfs_readv,
+    .writev = exfat_vfs_writev,
+    .truncate = exfat_vfs_truncate,
+    .sync = exfat_vfs_sync,
+};
+
+// The directory 'dir' stands for, NULL for the root
+static ExfatFile* exfat_dir_of(Inode* dir) {
+    return dir == dir->mount->root ? NULL : &node_of(dir)->exfat;
+}
+
+static Inode* exfat_lookup(Inode* dir, char* name, uint8_t create) {
+    ExfatFile file;
+    if (!exfat_open(exfat_dir_of(dir), &file, name, create)) {
+        return NULL;
+    }
+
+    uint8_t created;
+    Inode* inode = vfs_iget(dir->mount, entry_key(file.dir_cluster, file.entry_index), &created);
+    if (inode == NULL || !created) {
+        // Already open, its node has the current chain and size
+        exfat_close(&file);
+        return inode;
+    }
+    FatNode* node = kzalloc(sizeof(FatNode));
+    if (node == NULL) {
+        exfat_close(&file);
+        vfs_iput(inode);
+        return NULL;
+    }
+    node->dir_cluster = file.dir_cluster;
+    node->slot = file.entry_index;
+    node->exfat = file;
+    inode->private_data = node;
+    inode->ops = &exfat_inode_ops;
+    inode->type = (file.attributes & EXFAT_ATTR_DIRECTORY) ? VFS_DIR : VFS_FILE;
+    inode->read_only = (file.attributes & EXFAT_ATTR_READ_ONLY) != 0;
+    inode->size = file.size;
+    return inode;
+}
+
+static uint8_t exfat_vfs_mkdir(Inode* dir, char* name) {
+    return exfat_mkdir(exfat_dir_of(dir), name);
+}
+
+// Files and empty directories, only while nobody has them open
+static uint8_t exfat_unlink(Inode* dir, char* name) {
+    ExfatFile file;
+    if (!exfat_open(exfat_dir_of(dir), &file, name, 0)) {
+        return 0;
+    }
+    uint8_t busy = vfs_ifind(dir->mount, entry_key(file.dir_cluster, file.entry_index)) != NULL;
+    exfat_close(&file);
+    return !busy && exfat_remove(exfat_dir_of(dir), name);
+}
+
+FsOps exfat_fs_ops = {
+    .name = "exfat",
+    .max_file_size = 0x7FFFFFFFFFFFFFFF,
+    .lookup = exfat_lookup,
+    .mkdir = exfat_vfs_mkdir,
+    .unlink = exfat_unlink,
+    .release = fat_release,
+};
+
+uint8_t fat_vfs_mount(void) {
+    FsOps* ops = fatType == ExFAT ? &exfat_fs_ops : &fat_fs_ops;
+    Inode* root = vfs_inode_alloc(NULL, VFS_DIR, NULL);
+    if (root == NULL) {
+        return 0;
+    }
+    if (!vfs_mount("/", ops, root, NULL)) {
+        kfree(root);
+        return 0;
+    }
+    return 1;
+}
+
+FatFile* fat_vfs_file(Inode* inode) {
+    if (inode->ops != &fat_inode_ops || inode->type != VFS_FILE) {
+        return NULL;
+    }
+    return &node_of(inode)->file;
+}
@@ -0,0 +1,186 @@
+#include "fd.h"
+#include "constants.h"
+#include "vga.h"
+
+FdStats fd_stats;
+
+static FileDescriptor descriptors[FD_MAX];
+
+static FileDescriptor* descriptor(int32_t fd) {
+    if (fd < 0 || fd >= FD_MAX || descriptors[fd].inode == NULL) {
+        return NULL;
+    }
+    return &descriptors[fd];
+}
+
+// Largest position a file of the inode's filesystem can reach, FAT sizes are 32 bits
+static uint64_t size_limit(Inode* inode) {
+    return inode->mount->ops->max_file_size;
+}
+
+static int32_t free_descriptor(void) {
+    for (int32_t i = 0; i < FD_MAX; i++) {
+        if (descriptors[i].inode == NULL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int32_t sys_open(char* path, uint32_t flags) {
+    int32_t fd = free_descriptor();
+    if (fd < 0) {
+        return -1;
+    }
+    Inode* inode = vfs_open(path, (flags & O_CREAT) != 0);
+    if (inode == NULL) {
+        return -1;
+    }
+
+    uint8_t writable = (flags & O_ACCMODE) != O_RDONLY;
+    if (inode->type != VFS_FILE || (writable && inode->read_only)) {
+        vfs_iput(inode);
+        return -1;
+    }
+    if ((flags & O_TRUNC) && writable && inode->size > 0) {
+        inode->ops->truncate(inode, 0);
+    }
+
+    descriptors[fd].inode = inode;
+    descriptors[fd].flags = flags;
+    descriptors[fd].position = 0;
+    fd_stats.opens++;
+    return fd;
+}
+
+int64_t sys_read(int32_t fd, void* buffer, uint32_t count) {
+    FileDescriptor* d = descriptor(fd);
+    if (d == NULL || (d->flags & O_ACCMODE) == O_WRONLY) {
+        return -1;
+    }
+
+    IoVec iov = { buffer, count };
+    uint64_t done = d->inode->ops->readv(d->inode, d->position, &iov, 1, d->flags);
+    d->position += done;
+    return done;
+}
+
+int64_t sys_write(int32_t fd, void* buffer, uint32_t count) {
+    FileDescriptor* d = descriptor(fd);
+    if (d == NULL || (d->flags & O_ACCMODE) == O_RDONLY) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    Inode* inode = d->inode;
+    if (d->flags & O_APPEND) {
+        d->position = inode->size;
+    }
+    if (d->position + count > size_limit(inode)) {
+        return -1;
+    }
+
+    IoVec iov = { buffer, count };
+    uint64_t done = inode->ops->writev(inode, d->position, &iov, 1, d->flags);
+    if (done == 0) {
+        return -1;
+    }
+    d->position += done;
+
+    if (d->flags & O_SYNC) {
+        fd_stats.sync_writes++;
+        if (!inode->ops->sync(inode)) {
+            return -1;
+        }
+    }
+    return done;
+}
+
+int64_t sys_lseek(int32_t fd, int64_t offset, uint32_t whence) {
+    FileDescriptor* d = descriptor(fd);
+    if (d == NULL) {
+        return -1;
+    }
+
+    int64_t base;
+    switch (whence) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = d->position;
+            break;
+        case SEEK_END:
+            base = d->inode->size;
+            break;
+        default:
+            return -1;
+    }
+    if (offset > 0 ? base > (int64_t)size_limit(d->inode) - offset : base + offset < 0) {
+        return -1;
+    }
+    d->position = base + offset;
+    return d->position;
+}
+
+int32_t sys_fsync(int32_t fd) {
+    FileDescriptor* d = descriptor(fd);
+    if (d == NULL || !d->inode->ops->sync(d->inode)) {
+        return -1;
+    }
+    return 0;
+}
+
+int32_t sys_ftruncate(int32_t fd, uint64_t size) {
+    FileDescriptor* d = descriptor(fd);
+    if (d == NULL || (d->flags & O_ACCMODE) == O_RDONLY) {
+        return -1;
+    }
+    if (size >= d->inode->size) {
+        return 0;
+    }
+    return d->inode->ops->truncate(d->inode, size) ? 0 : -1;
+}
+
+int32_t sys_close(int32_t fd) {
+    FileDescriptor* d = descriptor(fd);
+    if (d == NULL) {
+        return -1;
+    }
+    Inode* inode = d->inode;
+    d->inode = NULL;
+    vfs_iput(inode);
+    return 0;
+}
+
+int32_t sys_mkdir(char* path) {
+    return vfs_mkdir(path) ? 0 : -1;
+}
+
+int32_t sys_unlink(char* path) {
+    return vfs_unlink(path) ? 0 : -1;
+}
+
+Inode* fd_inode_get(int32_t fd, uint32_t* flags) {
+    FileDescriptor* d = descriptor(fd);
+    if (d == NULL) {
+        return NULL;
+    }
+    *flags = d->flags;
+    vfs_ihold(d->inode);
+    return d->inode;
+}
+
+void fd_print_stats(void) {
+    print_str("Descriptors: opens: ");
+    print_uint(fd_stats.opens);
+    print_str(" direct reads: ");
+    print_uint(fd_stats.direct_reads);
+    print_str(" direct writes: ");
+    print_uint(fd_stats.direct_writes);
+    print_str(" sync writes: ");
+    print_uint(fd_stats.sync_writes);
+    print_str("\n");
+}
@@ -3,29 +3,62 @@
 #include "constants.h"
 #include "memory.h"
 #include "vga.h"
-
-void read_sector(uint32_t sector_number, char* buffer, uint32_t sector_size)
+#include "kmalloc.h"
+#include "pmm.h"
+#include "blockdev.h"
+#include "bcache.h"
+#include "fat_cache.h"
+#include "fat_alloc.h"
+#include "fat_geometry.h"
+
+// Device the mounted volume lives on, set by initialize_fat_file_system
+BlockDev* disk_device;
+
+uint8_t read_sector(uint32_t sector_number, char* buffer, uint32_t size)
 {
-    // Assuming that the disk is memory-mapped at address 0x100000
-    uint8_t *disk = (uint8_t *)0x100000;
+    return read_at(sector_number, 0, buffer, size);
+}
 
-    // Calculate the address of the sector
-    uint8_t *sector_address = disk + sector_number * sector_size;
+uint8_t read_at(uint32_t sector_number, uint32_t offset, char* buffer, uint32_t size)
+{
+    if (disk_device == NULL) {
+        memSet(buffer, 0, size);
+        return 0;
+    }
+    sector_number += offset >> disk_device->sector_shift;
+    offset &= disk_device->sector_size - 1;
+
+    // Sector by sector through the buffer cache, the first and last one may be partial
+    while (size > 0) {
+        uint32_t chunk = disk_device->sector_size - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+        Buffer* buf = bcache_get(disk_device, sector_number);
+        if (buf == NULL) {
+            memSet(buffer, 0, size);
+            return 0;
+        }
+        memCpy(buffer, buf->data + offset, chunk);
+        bcache_put(buf);
 
-    // Copy the sector into the buffer
-   memCpy(buffer, sector_address, sector_size);
+        buffer += chunk;
+        size -= chunk;
+        offset = 0;
+        sector_number++;
+    }
+    return 1;
 }
 
 // This function reads the next cluster in the chain.
 uint32_t read_fat_table(uint32_t active_cluster, uint32_t first_fat_sector)
 {
-    char FAT_table[boot_sector.bytes_per_sector];
-    uint32_t fat_offset = active_cluster * 4;
-    uint32_t fat_sector = first_fat_sector + (fat_offset / SECTOR_SIZE);
-    uint32_t ent_offset = fat_offset % SECTOR_SIZE;
+    char FAT_table[fat_geometry.bytes_per_sector];
+    uint32_t fat_sector = first_fat_sector + fat_entry_sector(active_cluster);
+    uint32_t ent_offset = fat_entry_offset(active_cluster);
 
     //at this point you need to read from sector "fat_sector" on the disk into "FAT_table".
-    read_sector(fat_sector, FAT_table, boot_sector.bytes_per_sector);
+    read_sector(fat_sector, FAT_table, fat_geometry.bytes_per_sector);
 
     //remember to ignore the high 4 bits.
     uint32_t table_value = *(uint32_t*)&FAT_table[ent_offset];
@@ -54,27 +87,14 @@ uint32_t read_fat_table(uint32_t active_cluster, uint32_t first_fat_sector)
 // Function to update FAT entries for a new cluster chain
 void update_cluster(uint32_t start_cluster) {
 
-    // Iterate through the cluster chain
-    while (start_cluster < 0x0FFFFFF8) {
-        // Calculate the offset in the FAT table
-        uint32_t fat_offset = start_cluster * 4;
-
-        // Calculate the sector number of the FAT table
-        uint32_t fat_sector = boot_sector.reserved_sector_count + (fat_offset / boot_sector.bytes_per_sector);
-
-        // Calculate the entry offset within the sector
-        uint32_t ent_offset = fat_offset % boot_sector.bytes_per_sector;
-
-        // Read the sector into a buffer
-        char fat_table[boot_sector.bytes_per_sector];
-        read_sector(fat_sector, fat_table, boot_sector.bytes_per_sector);
-
-        // Update the FAT entry with the next cluster in the chain
+    // Iterate through the cluster chain and terminate it at the last link
+    while (start_cluster >= 2 && start_cluster < 0x0FFFFFF8) {
         uint32_t next_cluster = getNextCluster(start_cluster);
-        *(uint32_t*)&fat_table[ent_offset] = next_cluster;
-
-        // Write the updated buffer back to the sector
-        write_sector(fat_sector, fat_table, boot_sector.bytes_per_sector);
+        if (next_cluster == 0) {
+            fat_cache_set(start_cluster, FAT32_EOF);
+            return;
+        }
+        start_cluster = next_cluster;
     }
 }
 
@@ -84,21 +104,8 @@ uint32_t extractLittleEndian32(uint8_t* buffer, uint32_t offset) {
 
 // Function to get the next cluster in the file chain
 uint32_t getNextCluster(uint32_t current_cluster) {
-    // Calculate the offset of the FAT entry for the current cluster
-    uint32_t fat_offset = current_cluster * FAT_ENTRY_SIZE;
-
-    // Calculate the sector and offset within the sector where the FAT entry is located
-    uint32_t fat_sector = boot_sector.reserved_sector_count + (fat_offset / boot_sector.bytes_per_sector);
-    uint32_t ent_offset = fat_offset % boot_sector.bytes_per_sector;
-
-    // Read the sector containing the FAT entry
-    // Implement the logic to read the sector at 'fatSector' into a buffer
-    uint8_t buffer[boot_sector.bytes_per_sector];
-    // Read the sector into the buffer (replace the following line with your actual read logic)
-    read_sector(fat_sector, buffer, boot_sector.bytes_per_sector);
-
-    // Extract the FAT entry from the buffer
-    uint32_t fat_entry = extractLittleEndian32(buffer, ent_offset);
+    // An array load once the FAT is resident
+    uint32_t fat_entry = fat_cache_get(current_cluster);
 
     // Check for end-of-file marker in FAT
     if (fat_entry >= 0x0FFFFFF8 && fat_entry <= 0x0FFFFFFF) {
@@ -112,52 +119,100 @@ uint32_t getNextCluster(uint32_t current_cluster) {
 
 void write_cluster(uint32_t cluster, char* buffer, uint32_t buffer_size)
 {
-    // Calculate the sector number of the first sector in the cluster
-    uint32_t cluster_address = ((cluster - 2) * boot_sector.sectors_per_cluster) + boot_sector.reserved_sector_count + (boot_sector.fat_count * boot_sector.sectors_per_fat_32);
-
-    // Read the sector into a buffer
-    write_sector(cluster_address, buffer, buffer_size);
+    write_sector(cluster_to_sector(cluster), buffer, buffer_size);
 }
 
-void write_sector(uint32_t sector_number, char* buffer, uint32_t sector_size)
+uint8_t write_sector(uint32_t sector_number, char* buffer, uint32_t size)
 {
-    // Assuming that the disk is memory-mapped at address 0x100000
-    uint8_t *disk = (uint8_t *)0x100000;
+    return write_at(sector_number, 0, buffer, size);
+}
 
-    // Calculate the address of the sector
-    uint8_t *sector_address = disk + sector_number * sector_size;
+uint8_t write_at(uint32_t sector_number, uint32_t offset, char* buffer, uint32_t size)
+{
+    if (disk_device == NULL) {
+        return 0;
+    }
+    sector_number += offset >> disk_device->sector_shift;
+    offset &= disk_device->sector_size - 1;
+
+    // Written sectors stay dirty in the cache until eviction or bcache_sync
+    while (size > 0) {
+        uint32_t chunk = disk_device->sector_size - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
 
-    // Copy the sector into the buffer
-   memCpy(sector_address, buffer, sector_size);
+        // A whole sector is overwritten without reading it, a partial one keeps the rest of its bytes
+        Buffer* buf = chunk == disk_device->sector_size
+            ? bcache_get_noread(disk_device, sector_number)
+            : bcache_get(disk_device, sector_number);
+        if (buf == NULL) {
+            return 0;
+        }
+        memCpy(buf->data + offset, buffer, chunk);
+        bcache_mark_dirty(buf);
+        bcache_put(buf);
+
+        buffer += chunk;
+        size -= chunk;
+        offset = 0;
+        sector_number++;
+    }
+    return 1;
 }
 
-// Function to allocate a cluster in the FAT and return its cluster number
-uint32_t allocate_cluster() {
-    uint32_t cluster;
-    uint32_t fat_entry;
+uint8_t readv_sectors(uint32_t sector_number, IoVec* iov, uint32_t iov_count)
+{
+    if (disk_device == NULL) {
+        return 0;
+    }
 
-    // Iterate through each FAT entry to find a free cluster
-    for (cluster = 2; cluster < boot_sector.total_clusters + 2; cluster++) {
-        fat_entry = get_fat_entry(cluster);
+    // Newer data may still sit dirty in the buffer cache
+    uint64_t count = iov_length(iov, iov_count) >> disk_device->sector_shift;
+    if (!bcache_writeback_range(disk_device, sector_number, count)) {
+        return 0;
+    }
+    return blockdev_readv(disk_device, sector_number, iov, iov_count);
+}
 
-        print_set_color(RED, BLACK);
-        print_str("\nfat_entry: ");
-        print_int(fat_entry);
-        print_str("\n");
-        // Check if the cluster is free (0x00000000 in FAT32)
-        if (fat_entry == 0x00000000) {
-            // Mark the cluster as occupied in the FAT
-            set_fat_entry(cluster, 0xFFFFFFFF);
+uint8_t writev_sectors(uint32_t sector_number, IoVec* iov, uint32_t iov_count)
+{
+    if (disk_device == NULL) {
+        return 0;
+    }
 
-            // Clear the cluster's data in the data region (optional step)
-            clear_cluster_data(cluster);
+    uint64_t count = iov_length(iov, iov_count) >> disk_device->sector_shift;
+    uint8_t ok = blockdev_writev(disk_device, sector_number, iov, iov_count);
+    bcache_invalidate_range(disk_device, sector_number, count);
+    return ok;
+}
 
-            return cluster;
+char* zero_page(void)
+{
+    // Taken from the pre-zeroed pool once and never written
+    static char* page;
+    if (page == NULL) {
+        uint64_t phys = pmm_alloc_flags(0, PMM_ZERO);
+        if (phys != 0) {
+            page = phys_to_virt(phys);
         }
     }
+    return page;
+}
 
-    // No free clusters found
-    return 0;
+// Function to allocate a cluster in the FAT and return its cluster number
+uint32_t allocate_cluster() {
+    // The free cluster bitmap finds it, the FAT entry is set to end of chain
+    uint32_t length;
+    uint32_t cluster = fat_alloc_extent(1, &length);
+    if (cluster == 0) {
+        // No free clusters found
+        return 0;
+    }
+
+    // Left unwritten, files read it as zeros until it is written. Anything that
+    // reads its sectors directly (a directory) has to clear_cluster_data first.
+    return cluster;
 }
 
 // Helper function to get the value of a FAT entry given the cluster number
@@ -183,49 +238,38 @@ void set_fat_entry(uint32_t cluster, uint32_t value) {
 
 // Helper function to read a FAT entry from the FAT table
 void read_fat_entry(uint32_t offset, uint32_t* value) {
-    // Calculate the sector and offset within the sector for the FAT entry
-    uint32_t fat_sector = boot_sector.reserved_sector_count + (offset / boot_sector.bytes_per_sector);
-    uint32_t fat_offset = offset % boot_sector.bytes_per_sector;
-
-    // Read the sector containing the FAT entry
-    char fat_buffer[boot_sector.bytes_per_sector];
-    read_sector(fat_sector, fat_buffer, boot_sector.bytes_per_sector);
-
-    // Copy the FAT entry value from the buffer
-    memCpy(value, fat_buffer + fat_offset, sizeof(uint32_t));
+    *value = fat_cache_get(offset / FAT_ENTRY_SIZE);
 }
 
-// Helper function to write a FAT entry to the FAT table
+// Helper function to write a FAT entry to the FAT table. The change stays in
+// the FAT cache until the volume syncs, then reaches every FAT copy.
 void write_fat_entry(uint32_t offset, uint32_t value) {
-    // Calculate the sector and offset within the sector for the FAT entry
-    uint32_t fat_sector = boot_sector.reserved_sector_count + (offset / boot_sector.bytes_per_sector);
-    uint32_t fat_offset = offset % boot_sector.bytes_per_sector;
-
-    // Read the sector containing the FAT entry
-    char fat_buffer[boot_sector.bytes_per_sector];
-    read_sector(fat_sector, fat_buffer, boot_sector.bytes_per_sector);
-
-    // Copy the new FAT entry value to the buffer
-    memCpy(fat_buffer + fat_offset, &value, sizeof(uint32_t));
-
-    // Write the updated sector back to disk
-    write_sector(fat_sector, fat_buffer, boot_sector.bytes_per_sector);
+    fat_cache_set(offset / FAT_ENTRY_SIZE, value);
 }
 
 // Helper function to clear the data in a cluster (optional step)
 void clear_cluster_data(uint32_t cluster) {
     // Calculate the sector number where the cluster's data begins
-    uint32_t data_sector = boot_sector.reserved_sector_count +
-        (boot_sector.fat_count * boot_sector.sectors_per_fat_32) +
-        ((cluster - 2) * boot_sector.sectors_per_cluster);
+    uint32_t data_sector = cluster_to_sector(cluster);
 
-    // Clear the data in the cluster (set to 0x00)
-    char zero_buffer[boot_sector.bytes_per_sector];
-    memSet(zero_buffer, 0x00, boot_sector.bytes_per_sector);
+    char* zero_buffer = zero_page();
+    if (zero_buffer == NULL) {
+        return;
+    }
 
-    // Write the zeroed data to each sector in the cluster
-    for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++) {
-        write_sector(data_sector + i, zero_buffer, boot_sector.bytes_per_sector);
+    // Clear the data in the cluster (set to 0x00) with one request, every piece
+    // of the vector is the same zero page
+    IoVec iov[MAX_CLUSTER_SIZE / PAGE_SIZE];
+    uint32_t remaining = fat_geometry.cluster_size;
+    uint32_t pieces = 0;
+    while (remaining > 0 && pieces < MAX_CLUSTER_SIZE / PAGE_SIZE) {
+        iov[pieces].base = zero_buffer;
+        iov[pieces].length = remaining < PAGE_SIZE ? remaining : PAGE_SIZE;
+        remaining -= iov[pieces].length;
+        pieces++;
+    }
+    if (writev_sectors(data_sector, iov, pieces)) {
+        fat_mark_written(cluster, 1);
     }
 }
 
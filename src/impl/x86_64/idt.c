@@ -3,25 +3,28 @@
 #include "ports.h"
 
 extern void load_IDT(void);
+extern struct IDT_entry IDT[IDT_SIZE];
+
+void idt_set_gate(uint8_t vector, void (*handler)(void)) {
+    uint64_t address = (uint64_t)handler;
+    IDT[vector].offset_low = (uint16_t)(address & 0xFFFF);
+    IDT[vector].selector = KERNEL_CODE_SEGMENT_OFFSET; // KERNEL_CODE_SEGMENT_OFFSET
+    IDT[vector].ist = 0;
+    IDT[vector].type_attr = INTERRUPT_GATE; // 64-bit INTERRUPT_GATE
+    IDT[vector].offset_mid = (uint16_t)((address & 0xFFFF0000) >> 16);
+    IDT[vector].offset_high = (uint32_t)((address & 0xFFFFFFFF00000000) >> 32);
+    IDT[vector].zero = 0;
+}
 
 
 void idt_init(void) {
-  extern struct IDT_entry IDT[IDT_SIZE];
   extern void irq1();
   // ISR - The addresses of individual Interrupt Service Routines (ISRs) for
   // hardware interrupts (IRQs) are declared. These addresses correspond to functions
   // like irq0, irq1, and so on, which are responsible for handling specific interrupts.
 
   // Fill the IDT descriptor
-  uint64_t irq_address = (uint64_t)irq1;
-    uint8_t IRQ1 = 33; 
-    IDT[IRQ1].offset_low = (uint16_t)(irq_address & 0xFFFF);
-    IDT[IRQ1].selector = KERNEL_CODE_SEGMENT_OFFSET; // KERNEL_CODE_SEGMENT_OFFSET
-    IDT[IRQ1].ist = 0;
-    IDT[IRQ1].type_attr = INTERRUPT_GATE; // 64-bit INTERRUPT_GATE
-    IDT[IRQ1].offset_mid = (uint16_t)((irq_address & 0xFFFF0000) >> 16);
-    IDT[IRQ1].offset_high = (uint32_t)((irq_address & 0xFFFFFFFF00000000) >> 32);
-    IDT[IRQ1].zero = 0;
+    idt_set_gate(IRQ1_VECTOR, irq1);
 
     // Initiating PIC
     remapPIC();
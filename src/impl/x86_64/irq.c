@@ -13,4 +13,12 @@ void set_mask_IRQ() {
     }
     value = inportb(port) | (1 << IRQline);
     outportb(port, value);        
-}
\ No newline at end of file
+}
+
+void clear_mask_IRQ(uint8_t irq) {
+    if (irq >= 8) {
+        outportb(PIC_SLAVE_DATA, inportb(PIC_SLAVE_DATA) & ~(1 << (irq - 8)));
+        irq = PIC_CASCADE_IRQ;
+    }
+    outportb(PIC_MASTER_DATA, inportb(PIC_MASTER_DATA) & ~(1 << irq));
+}
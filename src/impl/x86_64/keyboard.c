@@ -4,7 +4,99 @@
 #include "keyboard.h"
 #include "strings.h"
 #include "common.h"
+#include "memory.h"
+#include "pmm.h"
+#include "kmalloc.h"
+#include "tlb.h"
+#include "bcache.h"
+#include "fat_cache.h"
+#include "fat_alloc.h"
+#include "fat_dir.h"
+#include "fat_file.h"
+#include "fat_journal.h"
+#include "exfat.h"
+#include "fd.h"
+#include "mmap.h"
+#include "vfs.h"
+#include "tmpfs.h"
+#include "hdd.h"
+#include "ata.h"
+#include "ahci.h"
 
+static char command[KEYBOARD_LINE_MAX];
+static volatile uint8_t command_pending;
+
+// Shell commands, run by keyboard_run_command
+static void run_command(char* line) {
+    if (strEqual(line, "clear")) {
+        print_clear();
+        print_set_color(GREEN, BLACK);
+    }
+    else if (strEqual(line, "create")) {
+
+    }
+    else if (strEqual(line, "membench")) {
+        memory_benchmark();
+    }
+    else if (strEqual(line, "meminfo")) {
+        print_newline();
+        pmm_print_stats();
+        kmalloc_print_stats();
+    }
+    else if (strEqual(line, "tlbbench")) {
+        tlb_benchmark();
+    }
+    else if (strEqual(line, "atabench")) {
+        ata_benchmark();
+    }
+    else if (strEqual(line, "ahcibench")) {
+        ahci_benchmark();
+    }
+    else if (strEqual(line, "mmaptest")) {
+        mmap_selftest();
+    }
+    else if (strEqual(line, "sync")) {
+        fat_sync();
+        journal_checkpoint();
+    }
+    else if (strEqual(line, "diskinfo")) {
+        print_newline();
+        bcache_print_stats();
+        fat_cache_print_stats();
+        fat_alloc_print_stats();
+        dir_print_stats();
+        fat_file_print_stats();
+        pcache_print_stats();
+        mmap_print_stats();
+        fd_print_stats();
+        vfs_print_stats();
+        tmpfs_print_stats();
+        journal_print_stats();
+        exfat_print_stats();
+        ata_print_stats();
+        ahci_print_stats();
+    }
+    else {
+        print_set_color(BRIGHT_GREEN, BLACK);
+        print_str("\nERR: Bad command!");
+    }
+    print_set_color(MAGENTA, BLACK);
+    print_str("\nJDOS> ");
+    print_set_color(GREEN, BLACK);
+    reset_key_buffer();
+}
+
+uint8_t keyboard_command_pending(void) {
+    return command_pending;
+}
+
+void keyboard_run_command(void) {
+    if (!command_pending) {
+        return;
+    }
+    run_command(command);
+    command_pending = 0;
+}
 
 // Every time you press a key, the keyboard send a signal to the PIC and triggers IRQ1 (Interrupt Request 1), 
 // and the corresponding interrupt handler is called.
@@ -129,22 +221,13 @@ void keyboard_handler() {
                     break;
                 case 28:
                     print_char('\0');           //ENTER
-                    if (strEqual(key_buffer, "clear")) {
-                        print_clear();
-                        print_set_color(GREEN, BLACK);
-                    }
-                    else if (strEqual(key_buffer, "create")) {
-
-                    }
-
-                    else {
-                        print_set_color(BRIGHT_GREEN, BLACK);
-                        print_str("\nERR: Bad command!");
+                    // The line runs from the idle loop with interrupts on, so disk
+                    // commands can sleep until their completion interrupt. Enter
+                    // while a command still runs is dropped.
+                    if (!command_pending) {
+                        memCpy(command, key_buffer, key_buffer_index);
+                        command_pending = 1;
                     }
-                    print_set_color(MAGENTA, BLACK);
-                    print_str("\nJDOS> ");
-                    print_set_color(GREEN, BLACK);
-                    reset_key_buffer();
                     break;
                 // case 29:
                 //     print_char (char)27;     //Left Control
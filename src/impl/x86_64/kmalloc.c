@@ -0,0 +1,481 @@
+#include "kmalloc.h"
+#include "pmm.h"
+#include "memory.h"
+#include "strings.h"
+#include "vga.h"
+
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define SLAB_MIN_OBJECTS 8      /* Grow the slab order until at least this many objects fit */
+#define SLAB_MAX_ORDER 3        /* 32 KiB slabs at most */
+
+static SlabCache cache_cache;       // holds every other SlabCache, set up by hand
+static SlabCache magazine_cache;    // magazines for all caches
+static SlabCache* size_classes[KMALLOC_CLASSES];
+static SlabCache* cache_list;
+static Spinlock cache_list_lock = SPINLOCK_INIT;
+
+static char* size_class_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Smallest shift with (1 << shift) >= value
+static uint8_t ceil_log2(size_t value) {
+    uint8_t shift = 0;
+    while (((size_t)1 << shift) < value) {
+        shift++;
+    }
+    return shift;
+}
+
+static void slab_list_push(Slab** head, Slab* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+static void slab_list_remove(Slab** head, Slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static void cache_setup(SlabCache* cache, char* name, size_t object_size, size_t align, uint8_t flags) {
+    memSet(cache, 0, sizeof(SlabCache));
+    for (int i = 0; i < SLAB_CACHE_NAME_LENGTH - 1 && name[i]; i++) {
+        cache->name[i] = name[i];
+    }
+
+    // Free objects hold the free list link, so they are at least a pointer in size
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    if (object_size < sizeof(void*)) {
+        object_size = sizeof(void*);
+    }
+    cache->object_size = align_up(object_size, align);
+    cache->object_offset = align_up(sizeof(Slab), align);
+    cache->flags = flags;
+
+    uint8_t order = 0;
+    while (order < SLAB_MAX_ORDER &&
+           ((PAGE_SIZE << order) - cache->object_offset) / cache->object_size < SLAB_MIN_OBJECTS) {
+        order++;
+    }
+    cache->slab_order = order;
+    cache->objects_per_slab = ((PAGE_SIZE << order) - cache->object_offset) / cache->object_size;
+
+    uint64_t irq_flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next_cache = cache_list;
+    cache_list = cache;
+    spin_unlock_irqrestore(&cache_list_lock, irq_flags);
+}
+
+// Take a fresh block from the page allocator and thread its objects into a free list
+static Slab* slab_create(SlabCache* cache) {
+    uint64_t phys = pmm_alloc(cache->slab_order);
+    if (phys == 0) {
+        return NULL;
+    }
+
+    // Tag every page so kfree can find the slab header from any object
+    for (uint64_t i = 0; i < (1ULL << cache->slab_order); i++) {
+        Page* page = pmm_page(phys + i * PAGE_SIZE);
+        page->flags |= PAGE_SLAB;
+        page->order = cache->slab_order;
+    }
+
+    Slab* slab = (Slab*)phys_to_virt(phys);
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_objects = NULL;
+
+    uint8_t* objects = (uint8_t*)slab + cache->object_offset;
+    for (uint32_t i = cache->objects_per_slab; i > 0; i--) {
+        void** object = (void**)(objects + (i - 1) * cache->object_size);
+        *object = slab->free_objects;
+        slab->free_objects = object;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+static void slab_destroy(SlabCache* cache, Slab* slab) {
+    uint64_t phys = virt_to_phys(slab);
+    for (uint64_t i = 0; i < (1ULL << cache->slab_order); i++) {
+        pmm_page(phys + i * PAGE_SIZE)->flags &= ~PAGE_SLAB;
+    }
+    pmm_free(phys, cache->slab_order);
+    cache->slabs--;
+}
+
+static Slab* slab_of(SlabCache* cache, void* object) {
+    return (Slab*)((uint64_t)object & ~((PAGE_SIZE << cache->slab_order) - 1));
+}
+
+// Slab layer, called with the cache lock held
+static void* slab_alloc_object(SlabCache* cache) {
+    Slab* slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+        }
+        else {
+            slab = slab_create(cache);
+            if (slab == NULL) {
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void** object = (void**)slab->free_objects;
+    slab->free_objects = *object;
+    slab->in_use++;
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->slab_allocs++;
+    cache->objects_in_use++;
+    return object;
+}
+
+static void slab_free_object(SlabCache* cache, void* object) {
+    Slab* slab = slab_of(cache, object);
+
+    if (slab->in_use == cache->objects_per_slab) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *(void**)object = slab->free_objects;
+    slab->free_objects = object;
+    slab->in_use--;
+    cache->objects_in_use--;
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        // Keep one empty slab around so an alloc/free cycle at a slab boundary
+        // does not bounce pages through the buddy allocator
+        if (cache->empty) {
+            slab_destroy(cache, slab);
+        }
+        else {
+            slab_list_push(&cache->empty, slab);
+        }
+    }
+}
+
+// Magazine layer, called with interrupts off on the owning CPU
+static void* magazine_alloc(SlabCache* cache, CpuCache* cpu) {
+    if (cpu->loaded && cpu->loaded->count > 0) {
+        return cpu->loaded->objects[--cpu->loaded->count];
+    }
+    if (cpu->previous && cpu->previous->count > 0) {
+        Magazine* swap = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = swap;
+        return cpu->loaded->objects[--cpu->loaded->count];
+    }
+
+    // Both magazines are empty, trade one for a full magazine from the depot
+    spin_lock(&cache->lock);
+    Magazine* full = cache->depot_full;
+    if (full) {
+        cache->depot_full = full->next;
+        if (cpu->previous) {
+            cpu->previous->next = cache->depot_empty;
+            cache->depot_empty = cpu->previous;
+        }
+        cpu->previous = cpu->loaded;
+        cpu->loaded = full;
+        cache->depot_swaps++;
+    }
+    spin_unlock(&cache->lock);
+
+    if (full) {
+        return cpu->loaded->objects[--cpu->loaded->count];
+    }
+    return NULL;
+}
+
+static uint8_t magazine_free(SlabCache* cache, CpuCache* cpu, void* object) {
+    if (cpu->loaded && cpu->loaded->count < MAGAZINE_SIZE) {
+        cpu->loaded->objects[cpu->loaded->count++] = object;
+        return 1;
+    }
+    if (cpu->previous && cpu->previous->count == 0) {
+        Magazine* swap = cpu->loaded;
+        cpu->loaded = cpu->previous;
+        cpu->previous = swap;
+        cpu->loaded->objects[cpu->loaded->count++] = object;
+        return 1;
+    }
+
+    // Loaded is full and previous is not empty: park previous in the depot
+    // and start over with an empty magazine
+    spin_lock(&cache->lock);
+    Magazine* empty = cache->depot_empty;
+    if (empty) {
+        cache->depot_empty = empty->next;
+    }
+    spin_unlock(&cache->lock);
+
+    if (empty == NULL) {
+        empty = (Magazine*)kmem_cache_alloc(&magazine_cache);
+        if (empty == NULL) {
+            return 0;
+        }
+    }
+    empty->count = 0;
+
+    spin_lock(&cache->lock);
+    if (cpu->previous) {
+        if (cpu->previous->count > 0) {
+            cpu->previous->next = cache->depot_full;
+            cache->depot_full = cpu->previous;
+        }
+        else {
+            cpu->previous->next = cache->depot_empty;
+            cache->depot_empty = cpu->previous;
+        }
+    }
+    cache->depot_swaps++;
+    spin_unlock(&cache->lock);
+
+    cpu->previous = cpu->loaded;
+    cpu->loaded = empty;
+    cpu->loaded->objects[cpu->loaded->count++] = object;
+    return 1;
+}
+
+void kmalloc_init(void) {
+    cache_setup(&cache_cache, "slab-cache", sizeof(SlabCache), 64, SLAB_NO_MAGAZINES);
+    cache_setup(&magazine_cache, "magazine", sizeof(Magazine), 64, SLAB_NO_MAGAZINES);
+
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        size_classes[i] = kmem_cache_create(size_class_names[i], (size_t)1 << (KMALLOC_MIN_SHIFT + i), 16, 0);
+    }
+}
+
+SlabCache* kmem_cache_create(char* name, size_t object_size, size_t align, uint8_t flags) {
+    SlabCache* cache = (SlabCache*)kmem_cache_alloc(&cache_cache);
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache_setup(cache, name, object_size, align, flags);
+    if (cache->objects_per_slab == 0) {
+        print_str("kmem_cache_create: object too large\n");
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void* kmem_cache_alloc(SlabCache* cache) {
+    void* object = NULL;
+    uint64_t flags = irq_save();
+
+    if (!(cache->flags & SLAB_NO_MAGAZINES)) {
+        CpuCache* cpu = &cache->cpu[cpu_id()];
+        object = magazine_alloc(cache, cpu);
+        cpu->allocs++;
+        if (object) {
+            cpu->magazine_hits++;
+        }
+    }
+
+    if (object == NULL) {
+        spin_lock(&cache->lock);
+        object = slab_alloc_object(cache);
+        spin_unlock(&cache->lock);
+    }
+
+    irq_restore(flags);
+    return object;
+}
+
+void kmem_cache_free(SlabCache* cache, void* object) {
+    if (object == NULL) {
+        return;
+    }
+    uint64_t flags = irq_save();
+
+    if (!(cache->flags & SLAB_NO_MAGAZINES)) {
+        CpuCache* cpu = &cache->cpu[cpu_id()];
+        cpu->frees++;
+        if (magazine_free(cache, cpu, object)) {
+            irq_restore(flags);
+            return;
+        }
+    }
+
+    spin_lock(&cache->lock);
+    slab_free_object(cache, object);
+    spin_unlock(&cache->lock);
+    irq_restore(flags);
+}
+
+void kmem_cache_stats(SlabCache* cache, SlabStats* stats) {
+    memSet(stats, 0, sizeof(SlabStats));
+    for (int i = 0; i < MAX_CPUS; i++) {
+        stats->allocs += cache->cpu[i].allocs;
+        stats->frees += cache->cpu[i].frees;
+        stats->magazine_hits += cache->cpu[i].magazine_hits;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    // Caches without magazines only count at the slab layer
+    if (cache->flags & SLAB_NO_MAGAZINES) {
+        stats->allocs = cache->slab_allocs;
+    }
+    stats->depot_swaps = cache->depot_swaps;
+    stats->slab_allocs = cache->slab_allocs;
+    stats->slabs = cache->slabs;
+    stats->objects_in_use = cache->objects_in_use;
+    stats->objects_total = cache->slabs * cache->objects_per_slab;
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_shrink(SlabCache* cache) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    // Objects parked in full depot magazines go back to their slabs
+    while (cache->depot_full) {
+        Magazine* magazine = cache->depot_full;
+        cache->depot_full = magazine->next;
+        while (magazine->count > 0) {
+            slab_free_object(cache, magazine->objects[--magazine->count]);
+        }
+        magazine->next = cache->depot_empty;
+        cache->depot_empty = magazine;
+    }
+    Magazine* spare = cache->depot_empty;
+    cache->depot_empty = NULL;
+
+    while (cache->empty) {
+        Slab* slab = cache->empty;
+        slab_list_remove(&cache->empty, slab);
+        slab_destroy(cache, slab);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    while (spare) {
+        Magazine* next = spare->next;
+        kmem_cache_free(&magazine_cache, spare);
+        spare = next;
+    }
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size <= ((size_t)1 << KMALLOC_MAX_SHIFT)) {
+        uint8_t shift = ceil_log2(size);
+        if (shift < KMALLOC_MIN_SHIFT) {
+            shift = KMALLOC_MIN_SHIFT;
+        }
+        return kmem_cache_alloc(size_classes[shift - KMALLOC_MIN_SHIFT]);
+    }
+
+    // Too big for a size class, hand out whole pages
+    uint8_t order = ceil_log2((size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    if (order > PMM_MAX_ORDER) {
+        return NULL;
+    }
+    uint64_t phys = pmm_alloc(order);
+    if (phys == 0) {
+        return NULL;
+    }
+    return phys_to_virt(phys);
+}
+
+void* kzalloc(size_t size) {
+    void* ptr = kmalloc(size);
+    if (ptr) {
+        memSet(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    uint64_t phys = virt_to_phys(ptr);
+    Page* page = pmm_page(phys);
+    if (page == NULL) {
+        return;
+    }
+
+    if (page->flags & PAGE_SLAB) {
+        Slab* slab = (Slab*)((uint64_t)ptr & ~((PAGE_SIZE << page->order) - 1));
+        kmem_cache_free(slab->cache, ptr);
+    }
+    else {
+        pmm_free(phys, page->order);
+    }
+}
+
+static void print_padded(uint64_t value, size_t width) {
+    char digits[21];
+    uint_to_str(value, digits, sizeof(digits));
+    for (size_t pad = strLength(digits); pad < width; pad++) {
+        print_char(' ');
+    }
+    print_str(digits);
+}
+
+void kmalloc_print_stats(void) {
+    print_str("cache            size   in use    total  slabs  waste%  hit%\n");
+
+    for (SlabCache* cache = cache_list; cache; cache = cache->next_cache) {
+        SlabStats stats;
+        kmem_cache_stats(cache, &stats);
+        if (stats.slabs == 0) {
+            continue;
+        }
+
+        // Bytes of slab memory not holding a live object: headers, tails and free slots
+        uint64_t slab_bytes = stats.slabs * (PAGE_SIZE << cache->slab_order);
+        uint64_t live_bytes = stats.objects_in_use * cache->object_size;
+        uint64_t waste = ((slab_bytes - live_bytes) * 100) / slab_bytes;
+        uint64_t hit = stats.allocs ? (stats.magazine_hits * 100) / stats.allocs : 0;
+
+        print_str(cache->name);
+        for (size_t pad = strLength(cache->name); pad < 14; pad++) {
+            print_char(' ');
+        }
+        print_padded(cache->object_size, 6);
+        print_padded(stats.objects_in_use, 9);
+        print_padded(stats.objects_total, 9);
+        print_padded(stats.slabs, 7);
+        print_padded(waste, 8);
+        print_padded(hit, 6);
+        print_str("\n");
+    }
+}
@@ -1,22 +1,495 @@
 #include "memory.h"
+#include "cpu.h"
+#include "vga.h"
+#include "strings.h"
 
-void memCpy(void *dest, void *src, size_t count)
+// Copies and fills shorter than this stay in general purpose registers
+#define MEM_SMALL_LIMIT 64
+
+// Unaligned 8-byte access that may alias any other type
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+
+// Keep GCC from turning the fallback loops back into calls to memcpy/memset
+#define NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+size_t mem_rep_threshold = 2048;
+size_t mem_nt_threshold = 256 * 1024;
+
+// Byte at a time, kept as the baseline for memory_benchmark()
+NO_LIBCALL static void copy_bytes(uint8_t *dest, uint8_t *src, size_t count)
 {
-    char *dest_ptr = (char *)dest;
-    char *src_ptr = (char *)src;
     for (size_t i = 0; i < count; ++i)
     {
-        dest_ptr[i] = src_ptr[i];
+        dest[i] = src[i];
     }
 }
 
+// Eight bytes per step, then the tail
+NO_LIBCALL static void copy_small(uint8_t *dest, uint8_t *src, size_t count)
+{
+    while (count >= 8)
+    {
+        *(unaligned_u64 *)dest = *(unaligned_u64 *)src;
+        dest += 8;
+        src += 8;
+        count -= 8;
+    }
+    while (count--)
+    {
+        *dest++ = *src++;
+    }
+}
+
+// Microcoded string copy, fast for large sizes on CPUs with ERMS
+static void copy_rep_movsb(uint8_t *dest, uint8_t *src, size_t count)
+{
+    asm volatile("rep movsb" : "+D" (dest), "+S" (src), "+c" (count) : : "memory");
+}
+
+// 16-byte SSE2 copy, 64 bytes per iteration with aligned stores
+static void copy_sse(uint8_t *dest, uint8_t *src, size_t count)
+{
+    size_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+    copy_small(dest, src, head);
+    dest += head;
+    src += head;
+    count -= head;
+
+    for (; count >= 64; count -= 64, dest += 64, src += 64)
+    {
+        asm volatile("movdqu   (%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "movdqa %%xmm0,   (%0)\n\t"
+                     "movdqa %%xmm1, 16(%0)\n\t"
+                     "movdqa %%xmm2, 32(%0)\n\t"
+                     "movdqa %%xmm3, 48(%0)"
+                     : : "r" (dest), "r" (src)
+                     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+    copy_small(dest, src, count);
+}
+
+// 32-byte AVX copy, 128 bytes per iteration with aligned stores
+static void copy_avx(uint8_t *dest, uint8_t *src, size_t count)
+{
+    size_t head = (32 - ((uintptr_t)dest & 31)) & 31;
+    copy_small(dest, src, head);
+    dest += head;
+    src += head;
+    count -= head;
+
+    for (; count >= 128; count -= 128, dest += 128, src += 128)
+    {
+        asm volatile("vmovdqu   (%1), %%ymm0\n\t"
+                     "vmovdqu 32(%1), %%ymm1\n\t"
+                     "vmovdqu 64(%1), %%ymm2\n\t"
+                     "vmovdqu 96(%1), %%ymm3\n\t"
+                     "vmovdqa %%ymm0,   (%0)\n\t"
+                     "vmovdqa %%ymm1, 32(%0)\n\t"
+                     "vmovdqa %%ymm2, 64(%0)\n\t"
+                     "vmovdqa %%ymm3, 96(%0)"
+                     : : "r" (dest), "r" (src)
+                     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+    // Avoid the AVX to SSE transition penalty in whatever runs next
+    asm volatile("vzeroupper" : : : "memory");
+    copy_small(dest, src, count);
+}
+
+// Non-temporal SSE2 copy, the destination bypasses the cache
+static void copy_nt_sse(uint8_t *dest, uint8_t *src, size_t count)
+{
+    size_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+    copy_small(dest, src, head);
+    dest += head;
+    src += head;
+    count -= head;
+
+    for (; count >= 64; count -= 64, dest += 64, src += 64)
+    {
+        asm volatile("prefetchnta 512(%1)\n\t"
+                     "movdqu   (%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "movntdq %%xmm0,   (%0)\n\t"
+                     "movntdq %%xmm1, 16(%0)\n\t"
+                     "movntdq %%xmm2, 32(%0)\n\t"
+                     "movntdq %%xmm3, 48(%0)"
+                     : : "r" (dest), "r" (src)
+                     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+    // Streaming stores are weakly ordered, fence before anyone reads the data
+    asm volatile("sfence" : : : "memory");
+    copy_small(dest, src, count);
+}
+
+// Non-temporal AVX copy
+static void copy_nt_avx(uint8_t *dest, uint8_t *src, size_t count)
+{
+    size_t head = (32 - ((uintptr_t)dest & 31)) & 31;
+    copy_small(dest, src, head);
+    dest += head;
+    src += head;
+    count -= head;
+
+    for (; count >= 128; count -= 128, dest += 128, src += 128)
+    {
+        asm volatile("prefetchnta 512(%1)\n\t"
+                     "vmovdqu   (%1), %%ymm0\n\t"
+                     "vmovdqu 32(%1), %%ymm1\n\t"
+                     "vmovdqu 64(%1), %%ymm2\n\t"
+                     "vmovdqu 96(%1), %%ymm3\n\t"
+                     "vmovntdq %%ymm0,   (%0)\n\t"
+                     "vmovntdq %%ymm1, 32(%0)\n\t"
+                     "vmovntdq %%ymm2, 64(%0)\n\t"
+                     "vmovntdq %%ymm3, 96(%0)"
+                     : : "r" (dest), "r" (src)
+                     : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+    }
+    asm volatile("sfence\n\tvzeroupper" : : : "memory");
+    copy_small(dest, src, count);
+}
+
+NO_LIBCALL static void set_small(uint8_t *dest, uint64_t pattern, size_t count)
+{
+    while (count >= 8)
+    {
+        *(unaligned_u64 *)dest = pattern;
+        dest += 8;
+        count -= 8;
+    }
+    while (count--)
+    {
+        *dest++ = (uint8_t)pattern;
+    }
+}
+
+static void set_rep_stosb(uint8_t *dest, uint64_t pattern, size_t count)
+{
+    asm volatile("rep stosb" : "+D" (dest), "+c" (count) : "a" (pattern) : "memory");
+}
+
+static void set_sse(uint8_t *dest, uint64_t pattern, size_t count)
+{
+    size_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+    set_small(dest, pattern, head);
+    dest += head;
+    count -= head;
+
+    // Broadcast and store loop stay in one asm block so xmm0 cannot be reused in between
+    if (count >= 64)
+    {
+        asm volatile("movq %2, %%xmm0\n\t"
+                     "punpcklqdq %%xmm0, %%xmm0\n"
+                     "1:\n\t"
+                     "movdqa %%xmm0,   (%0)\n\t"
+                     "movdqa %%xmm0, 16(%0)\n\t"
+                     "movdqa %%xmm0, 32(%0)\n\t"
+                     "movdqa %%xmm0, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "sub $64, %1\n\t"
+                     "cmp $64, %1\n\t"
+                     "jae 1b"
+                     : "+r" (dest), "+r" (count) : "r" (pattern) : "memory", "cc", "xmm0");
+    }
+    set_small(dest, pattern, count);
+}
+
+static void set_avx(uint8_t *dest, uint64_t pattern, size_t count)
+{
+    size_t head = (32 - ((uintptr_t)dest & 31)) & 31;
+    set_small(dest, pattern, head);
+    dest += head;
+    count -= head;
+
+    // Broadcast the pattern into both halves of ymm0, AVX1 has no vpbroadcastq
+    if (count >= 128)
+    {
+        asm volatile("vmovq %2, %%xmm0\n\t"
+                     "vpunpcklqdq %%xmm0, %%xmm0, %%xmm0\n\t"
+                     "vinsertf128 $1, %%xmm0, %%ymm0, %%ymm0\n"
+                     "1:\n\t"
+                     "vmovdqa %%ymm0,   (%0)\n\t"
+                     "vmovdqa %%ymm0, 32(%0)\n\t"
+                     "vmovdqa %%ymm0, 64(%0)\n\t"
+                     "vmovdqa %%ymm0, 96(%0)\n\t"
+                     "add $128, %0\n\t"
+                     "sub $128, %1\n\t"
+                     "cmp $128, %1\n\t"
+                     "jae 1b\n\t"
+                     "vzeroupper"
+                     : "+r" (dest), "+r" (count) : "r" (pattern) : "memory", "cc", "xmm0");
+    }
+    set_small(dest, pattern, count);
+}
+
+static void set_nt_sse(uint8_t *dest, uint64_t pattern, size_t count)
+{
+    size_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+    set_small(dest, pattern, head);
+    dest += head;
+    count -= head;
+
+    if (count >= 64)
+    {
+        asm volatile("movq %2, %%xmm0\n\t"
+                     "punpcklqdq %%xmm0, %%xmm0\n"
+                     "1:\n\t"
+                     "movntdq %%xmm0,   (%0)\n\t"
+                     "movntdq %%xmm0, 16(%0)\n\t"
+                     "movntdq %%xmm0, 32(%0)\n\t"
+                     "movntdq %%xmm0, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "sub $64, %1\n\t"
+                     "cmp $64, %1\n\t"
+                     "jae 1b"
+                     : "+r" (dest), "+r" (count) : "r" (pattern) : "memory", "cc", "xmm0");
+    }
+    asm volatile("sfence" : : : "memory");
+    set_small(dest, pattern, count);
+}
+
+// Kernels picked by memory_init(), SSE2 is always there in long mode so it is the safe default
+static void (*copy_vector)(uint8_t *, uint8_t *, size_t) = copy_sse;
+static void (*copy_large)(uint8_t *, uint8_t *, size_t) = copy_sse;
+static void (*copy_stream)(uint8_t *, uint8_t *, size_t) = copy_nt_sse;
+static void (*set_vector)(uint8_t *, uint64_t, size_t) = set_sse;
+static void (*set_large)(uint8_t *, uint64_t, size_t) = set_sse;
+static void (*set_stream)(uint8_t *, uint64_t, size_t) = set_nt_sse;
+
+void memory_init(void)
+{
+    if (cpu_features.avx)
+    {
+        copy_vector = copy_avx;
+        copy_stream = copy_nt_avx;
+        set_vector = set_avx;
+    }
+
+    // With ERMS the string instructions win once the size covers their startup cost
+    copy_large = cpu_features.erms ? copy_rep_movsb : copy_vector;
+    set_large = cpu_features.erms ? set_rep_stosb : set_vector;
+}
+
+void memCpy(void *dest, void *src, size_t count)
+{
+    uint8_t *dest_ptr = (uint8_t *)dest;
+    uint8_t *src_ptr = (uint8_t *)src;
+
+    if (count < MEM_SMALL_LIMIT)
+    {
+        // Fast Short REP MOVSB makes even tiny string copies cheap
+        if (cpu_features.fsrm)
+            copy_rep_movsb(dest_ptr, src_ptr, count);
+        else
+            copy_small(dest_ptr, src_ptr, count);
+    }
+    else if (count >= mem_nt_threshold)
+        copy_stream(dest_ptr, src_ptr, count);
+    else if (count >= mem_rep_threshold)
+        copy_large(dest_ptr, src_ptr, count);
+    else
+        copy_vector(dest_ptr, src_ptr, count);
+}
+
 void memSet(void *dest, char value, size_t count)
 {
-    char *dest_ptr = (char *)dest;
-    for (size_t i = 0; i < count; ++i)
+    uint8_t *dest_ptr = (uint8_t *)dest;
+    uint64_t pattern = (uint8_t)value * 0x0101010101010101ULL;
+
+    if (count < MEM_SMALL_LIMIT)
+        set_small(dest_ptr, pattern, count);
+    else if (count >= mem_nt_threshold)
+        set_stream(dest_ptr, pattern, count);
+    else if (count >= mem_rep_threshold)
+        set_large(dest_ptr, pattern, count);
+    else
+        set_vector(dest_ptr, pattern, count);
+}
+
+void memSetStream(void *dest, char value, size_t count)
+{
+    uint64_t pattern = (uint8_t)value * 0x0101010101010101ULL;
+    set_stream((uint8_t *)dest, pattern, count);
+}
+
+NO_LIBCALL void memMove(void *dest, void *src, size_t count)
+{
+    uint8_t *dest_ptr = (uint8_t *)dest;
+    uint8_t *src_ptr = (uint8_t *)src;
+
+    // No overlap, take the fast path
+    if (dest_ptr + count <= src_ptr || src_ptr + count <= dest_ptr)
+    {
+        memCpy(dest, src, count);
+        return;
+    }
+
+    if (dest_ptr < src_ptr)
+    {
+        // Forward rep movsb is architecturally byte-by-byte, so it is safe here
+        copy_rep_movsb(dest_ptr, src_ptr, count);
+        return;
+    }
+
+    // Destination above the source: copy from the end, every load happens before
+    // the store that could overwrite it
+    dest_ptr += count;
+    src_ptr += count;
+    while (count >= 8)
+    {
+        dest_ptr -= 8;
+        src_ptr -= 8;
+        count -= 8;
+        *(unaligned_u64 *)dest_ptr = *(unaligned_u64 *)src_ptr;
+    }
+    while (count--)
+    {
+        *--dest_ptr = *--src_ptr;
+    }
+}
+
+NO_LIBCALL int memCmp(void *ptr1, void *ptr2, size_t count)
+{
+    uint8_t *a = (uint8_t *)ptr1;
+    uint8_t *b = (uint8_t *)ptr2;
+
+    // Skip equal words, then find the first differing byte
+    while (count >= 8 && *(unaligned_u64 *)a == *(unaligned_u64 *)b)
+    {
+        a += 8;
+        b += 8;
+        count -= 8;
+    }
+    for (; count; --count, ++a, ++b)
+    {
+        if (*a != *b)
+            return *a - *b;
+    }
+    return 0;
+}
+
+// The compiler may emit calls to these for struct copies and initializers
+void *memcpy(void *dest, const void *src, size_t count)
+{
+    memCpy(dest, (void *)src, count);
+    return dest;
+}
+
+void *memset(void *dest, int value, size_t count)
+{
+    memSet(dest, (char)value, count);
+    return dest;
+}
+
+void *memmove(void *dest, const void *src, size_t count)
+{
+    memMove(dest, (void *)src, count);
+    return dest;
+}
+
+int memcmp(const void *ptr1, const void *ptr2, size_t count)
+{
+    return memCmp((void *)ptr1, (void *)ptr2, count);
+}
+
+// Benchmark
+
+#define BENCH_MAX_SIZE (1024 * 1024)
+#define BENCH_COLUMN 10
+
+static uint8_t bench_src[BENCH_MAX_SIZE] __attribute__((aligned(64)));
+static uint8_t bench_dest[BENCH_MAX_SIZE] __attribute__((aligned(64)));
+
+typedef struct {
+    char *name;
+    void (*copy)(uint8_t *, uint8_t *, size_t);
+} BenchKernel;
+
+static void bench_auto(uint8_t *dest, uint8_t *src, size_t count)
+{
+    memCpy(dest, src, count);
+}
+
+static void print_column(uint64_t value)
+{
+    char digits[21];
+    uint_to_str(value, digits, sizeof(digits));
+    for (size_t pad = strLength(digits); pad < BENCH_COLUMN; pad++)
+        print_char(' ');
+    print_str(digits);
+}
+
+static void print_column_str(char *text)
+{
+    for (size_t pad = strLength(text); pad < BENCH_COLUMN; pad++)
+        print_char(' ');
+    print_str(text);
+}
+
+// Best of several runs, averaged over enough repeats to make small sizes measurable
+static uint64_t bench_cycles(void (*copy)(uint8_t *, uint8_t *, size_t), size_t size)
+{
+    size_t repeats = (64 * 1024) / size;
+    if (repeats == 0)
+        repeats = 1;
+
+    uint64_t best = (uint64_t)-1;
+    copy(bench_dest, bench_src, size);  // warm up caches and TLB
+    for (int run = 0; run < 5; run++)
     {
-        dest_ptr[i] = value;
+        uint64_t start = read_tsc();
+        for (size_t i = 0; i < repeats; i++)
+            copy(bench_dest, bench_src, size);
+        uint64_t cycles = (read_tsc() - start) / repeats;
+        if (cycles < best)
+            best = cycles;
     }
+    return best;
 }
 
-// malloc
\ No newline at end of file
+void memory_benchmark(void)
+{
+    BenchKernel kernels[] = {
+        { "bytes", copy_bytes },
+        { "movsb", copy_rep_movsb },
+        { "sse", copy_sse },
+        { "avx", cpu_features.avx ? copy_avx : 0 },
+        { "nt", copy_stream },
+        { "memCpy", bench_auto },
+    };
+    size_t kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+
+    for (size_t i = 0; i < BENCH_MAX_SIZE; i++)
+        bench_src[i] = (uint8_t)i;
+
+    print_clear();
+    print_str("memCpy cycles per call  (erms=");
+    print_int(cpu_features.erms);
+    print_str(" fsrm=");
+    print_int(cpu_features.fsrm);
+    print_str(" avx=");
+    print_int(cpu_features.avx);
+    print_str(")\n");
+
+    print_column_str("size");
+    for (size_t k = 0; k < kernel_count; k++)
+        print_column_str(kernels[k].name);
+    print_newline();
+
+    for (size_t size = 32; size <= BENCH_MAX_SIZE; size <<= 1)
+    {
+        print_column(size);
+        for (size_t k = 0; k < kernel_count; k++)
+        {
+            if (kernels[k].copy)
+                print_column(bench_cycles(kernels[k].copy, size));
+            else
+                print_column_str("-");
+        }
+        print_newline();
+    }
+}
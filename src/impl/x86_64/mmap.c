@@ -0,0 +1,334 @@
+#include "mmap.h"
+#include "fat_vfs.h"
+#include "constants.h"
+#include "cpu.h"
+#include "idt.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "tlb.h"
+#include "vga.h"
+#include "vmm.h"
+
+extern void isr_page_fault(void);
+
+MmapStats mmap_stats;
+
+static Mapping mappings[MMAP_MAX];
+static uint32_t pinned;             // pages all mappings hold in the page cache
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static Mapping* find(uint64_t address) {
+    for (uint32_t i = 0; i < MMAP_MAX; i++) {
+        if (mappings[i].start != 0 && address >= mappings[i].start && address - mappings[i].start < mappings[i].length) {
+            return &mappings[i];
+        }
+    }
+    return NULL;
+}
+
+// Where file page 'index' sits in the mapping, 0 when the mapping does not cover it
+static uint64_t page_address(Mapping* m, uint32_t index) {
+    if (index < m->first_page || index - m->first_page >= m->length >> PAGE_SHIFT) {
+        return 0;
+    }
+    return m->start + ((uint64_t)(index - m->first_page) << PAGE_SHIFT);
+}
+
+// Mapped address of the page in 'm' when its page table entry points at the page's frame
+static uint64_t mapped_at(Mapping* m, CachedPage* page) {
+    uint64_t phys;
+    if (m->start == 0 || m->file != page->file) {
+        return 0;
+    }
+    uint64_t virt = page_address(m, page->index);
+    if (virt == 0 || !vmm_translate(kernel_pml4, virt, &phys) || phys != page->phys) {
+        return 0;
+    }
+    return virt;
+}
+
+void mmap_unmap_page(CachedPage* page) {
+    for (uint32_t i = 0; i < MMAP_MAX && page->mapcount > 0; i++) {
+        uint64_t virt = mapped_at(&mappings[i], page);
+        if (virt != 0) {
+            vmm_unmap_noflush(kernel_pml4, virt, PAGE_SIZE);
+            tlb_flush_range(&kernel_space, virt, virt + PAGE_SIZE);
+            page->mapcount--;
+        }
+    }
+}
+
+void mmap_protect_page(CachedPage* page) {
+    for (uint32_t i = 0; i < MMAP_MAX; i++) {
+        uint64_t virt = mapped_at(&mappings[i], page);
+        if (virt != 0) {
+            vmm_protect(kernel_pml4, virt, PAGE_SIZE, PTE_NO_EXECUTE);
+            tlb_flush_range(&kernel_space, virt, virt + PAGE_SIZE);
+        }
+    }
+}
+
+void mmap_init(void) {
+    idt_set_gate(PAGE_FAULT_VECTOR, isr_page_fault);
+}
+
+void* sys_mmap(void* addr, uint64_t length, uint32_t prot, uint32_t flags, int32_t fd, uint64_t offset) {
+    (void)addr;
+    if (length == 0 || (offset & (PAGE_SIZE - 1)) != 0 || !(flags & MAP_SHARED)) {
+        return MAP_FAILED;
+    }
+    length = align_up(length, PAGE_SIZE);
+    // FAT files end below 4 GiB
+    if (offset + length > 0x100000000ULL) {
+        return MAP_FAILED;
+    }
+
+    Mapping* m = NULL;
+    for (uint32_t i = 0; i < MMAP_MAX && m == NULL; i++) {
+        if (mappings[i].start == 0) {
+            m = &mappings[i];
+        }
+    }
+    uint32_t fd_flags;
+    Inode* inode = m != NULL ? fd_inode_get(fd, &fd_flags) : NULL;
+    if (inode == NULL) {
+        return MAP_FAILED;
+    }
+    // Only FAT32 files have their pages in the page cache
+    FatFile* file = fat_vfs_file(inode);
+    uint32_t mode = fd_flags & O_ACCMODE;
+    if (file == NULL || mode == O_WRONLY || ((prot & PROT_WRITE) && mode != O_RDWR)) {
+        vfs_iput(inode);
+        return MAP_FAILED;
+    }
+
+    // The pages the file has there are read in now, the fault handler never waits for the device
+    uint32_t count = length >> PAGE_SHIFT;
+    uint32_t first = offset >> PAGE_SHIFT;
+    uint32_t file_pages = (uint32_t)(((uint64_t)file->size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    uint32_t wanted = first >= file_pages ? 0 : (file_pages - first < count ? file_pages - first : count);
+    CachedPage** pages = pinned + count <= MMAP_PINNED_MAX ? kzalloc(count * sizeof(CachedPage*)) : NULL;
+    uint32_t got = pages != NULL ? pcache_get_range(file, first, wanted, pages) : 0;
+    void* start = got == wanted ? vmm_reserve(length) : NULL;
+    if (start == NULL) {
+        for (uint32_t i = 0; i < got; i++) {
+            pcache_put(pages[i]);
+        }
+        kfree(pages);
+        vfs_iput(inode);
+        return MAP_FAILED;
+    }
+    pinned += count;
+    m->start = (uint64_t)start;
+    m->length = length;
+    m->inode = inode;
+    m->file = file;
+    m->first_page = first;
+    m->pages = pages;
+    m->prot = prot;
+    mmap_stats.maps++;
+    return start;
+}
+
+int32_t sys_msync(void* addr, uint64_t length, uint32_t flags) {
+    uint64_t start = (uint64_t)addr;
+    Mapping* m = find(start);
+    if (m == NULL || (start & (PAGE_SIZE - 1)) != 0 || length > m->start + m->length - start) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    uint32_t first = m->first_page + ((start - m->start) >> PAGE_SHIFT);
+    uint32_t count = align_up(length, PAGE_SIZE) >> PAGE_SHIFT;
+    if (!pcache_writeback(m->file, first, count)) {
+        return -1;
+    }
+    if ((flags & MS_SYNC) && !fat_sync()) {
+        return -1;
+    }
+    return 0;
+}
+
+int32_t sys_munmap(void* addr, uint64_t length) {
+    Mapping* m = find((uint64_t)addr);
+    if (m == NULL || m->start != (uint64_t)addr || align_up(length, PAGE_SIZE) != m->length) {
+        return -1;
+    }
+
+    // The frames belong to the page cache, only the entries go, then the pins
+    uint32_t count = m->length >> PAGE_SHIFT;
+    MmuGather gather;
+    mmu_gather_init(&gather, &kernel_space);
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t virt = m->start + ((uint64_t)i << PAGE_SHIFT);
+        uint64_t phys;
+        if (!vmm_translate(kernel_pml4, virt, &phys)) {
+            continue;
+        }
+        if (m->pages[i] != NULL && m->pages[i]->phys == phys) {
+            m->pages[i]->mapcount--;
+        }
+        mmu_gather_unmap(&gather, virt, PAGE_SIZE);
+    }
+    mmu_gather_finish(&gather);
+    for (uint32_t i = 0; i < count; i++) {
+        pcache_put(m->pages[i]);
+    }
+    kfree(m->pages);
+    pinned -= count;
+
+    // The address range is not handed out again, see vmm_reserve
+    Inode* inode = m->inode;
+    m->start = 0;
+    m->inode = NULL;
+    m->file = NULL;
+    m->pages = NULL;
+    vfs_iput(inode);
+    return 0;
+}
+
+// Pinned page of the mapping for file page 'index'. A page past the end of
+// the file when it was mapped is pinned once write() put it in the cache, one
+// that truncate took out is let go. Never does I/O, NULL when it is not cached.
+static CachedPage* mapped_page(Mapping* m, uint32_t index) {
+    CachedPage** slot = &m->pages[index - m->first_page];
+    if (*slot != NULL && ((*slot)->file != m->file || (*slot)->index != index)) {
+        pcache_put(*slot);
+        *slot = NULL;
+    }
+    if (*slot == NULL) {
+        *slot = pcache_peek(m->file, index);
+    }
+    return *slot;
+}
+
+// Map the page at 'address' of 'm' for the access that faulted, 0 when the access is not allowed
+static uint8_t fault_in(Mapping* m, uint64_t address, uint64_t error_code) {
+    uint8_t write = (error_code & PF_WRITE) != 0;
+    if (write && !(m->prot & PROT_WRITE)) {
+        return 0;
+    }
+    uint64_t virt = address & ~(uint64_t)(PAGE_SIZE - 1);
+    uint32_t index = m->first_page + ((virt - m->start) >> PAGE_SHIFT);
+    CachedPage* page = mapped_page(m, index);
+    if (page == NULL) {
+        return 0;
+    }
+
+    // A store to a page mapped read only: it is clean since its last writeback
+    if (error_code & PF_PRESENT) {
+        if (!write) {
+            return 0;
+        }
+        pcache_mark_dirty(page);
+        mmap_stats.write_faults++;
+        return vmm_protect(kernel_pml4, virt, PAGE_SIZE, PTE_WRITABLE | PTE_NO_EXECUTE);
+    }
+
+    mmap_stats.faults++;
+    if (write && !(page->flags & PAGE_DIRTY)) {
+        pcache_mark_dirty(page);
+        mmap_stats.write_faults++;
+    }
+    // A page that is dirty already needs no fault to notice the next store
+    uint64_t flags = PTE_NO_EXECUTE;
+    if ((m->prot & PROT_WRITE) && (page->flags & PAGE_DIRTY)) {
+        flags |= PTE_WRITABLE;
+    }
+    uint8_t ok = vmm_map(kernel_pml4, virt, page->phys, PAGE_SIZE, flags);
+    if (ok) {
+        page->mapcount++;
+    }
+    return ok;
+}
+
+void page_fault_handler(uint64_t error_code) {
+    uint64_t address = read_cr2();
+    Mapping* m = find(address);
+    if (m != NULL && fault_in(m, address, error_code)) {
+        return;
+    }
+
+    print_str("\nPage fault at ");
+    print_uint(address);
+    print_str(" error ");
+    print_uint(error_code);
+    print_str(", halting\n");
+    while (1) {
+        asm volatile("cli\n\thlt");
+    }
+}
+
+static uint8_t test_byte(uint32_t offset) {
+    return (uint8_t)(offset * 7 + (offset >> 12) + 1);
+}
+
+// Read the test file through a new descriptor, 1 when every byte is the pattern
+static uint8_t test_read_back(uint32_t flags, uint8_t* buffer) {
+    int32_t fd = sys_open(MMAP_TEST_FILE, O_RDONLY | flags);
+    if (fd < 0) {
+        return 0;
+    }
+    uint8_t ok = sys_read(fd, buffer, MMAP_TEST_SIZE) == MMAP_TEST_SIZE;
+    for (uint32_t i = 0; ok && i < MMAP_TEST_SIZE; i++) {
+        ok = buffer[i] == test_byte(i);
+    }
+    sys_close(fd);
+    return ok;
+}
+
+void mmap_selftest(void) {
+    uint8_t* buffer = kzalloc(MMAP_TEST_SIZE);
+    int32_t fd = sys_open(MMAP_TEST_FILE, O_RDWR | O_CREAT | O_TRUNC);
+    if (buffer == NULL || fd < 0) {
+        print_str("\nmmap test: cannot create " MMAP_TEST_FILE "\n");
+        kfree(buffer);
+        return;
+    }
+
+    uint64_t length = align_up(MMAP_TEST_SIZE, PAGE_SIZE);
+    uint8_t ok = sys_write(fd, buffer, MMAP_TEST_SIZE) == MMAP_TEST_SIZE;
+    uint8_t* map = ok ? sys_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    sys_close(fd);
+    if (map == MAP_FAILED) {
+        print_str("\nmmap test: FAILED to map the file\n");
+        sys_unlink(MMAP_TEST_FILE);
+        kfree(buffer);
+        return;
+    }
+
+    // Read faults first, then the stores that make the pages dirty
+    for (uint32_t i = 0; ok && i < MMAP_TEST_SIZE; i++) {
+        ok = map[i] == 0;
+    }
+    for (uint32_t i = 0; i < MMAP_TEST_SIZE; i++) {
+        map[i] = test_byte(i);
+    }
+    ok &= sys_msync(map, length, MS_SYNC) == 0;
+    ok &= sys_munmap(map, length) == 0;
+
+    print_str("\nmmap test: cached ");
+    print_str(ok && test_read_back(0, buffer) ? "ok" : "FAILED");
+    print_str(", device ");
+    print_str(ok && test_read_back(O_DIRECT, buffer) ? "ok" : "FAILED");
+    print_str("\n");
+    mmap_print_stats();
+
+    sys_unlink(MMAP_TEST_FILE);
+    kfree(buffer);
+}
+
+void mmap_print_stats(void) {
+    print_str("Mappings: maps: ");
+    print_uint(mmap_stats.maps);
+    print_str(" faults: ");
+    print_uint(mmap_stats.faults);
+    print_str(" write faults: ");
+    print_uint(mmap_stats.write_faults);
+    print_str("\n");
+}
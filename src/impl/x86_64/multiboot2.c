@@ -0,0 +1,53 @@
+#include "multiboot2.h"
+#include <stddef.h>
+
+uint64_t multiboot_info_addr;
+
+void multiboot_init(uint32_t info_addr) {
+    multiboot_info_addr = info_addr;
+}
+
+uint32_t multiboot_info_size(void) {
+    if (multiboot_info_addr == 0) {
+        return 0;
+    }
+    return ((MultibootInfo*)multiboot_info_addr)->total_size;
+}
+
+MultibootTag* multiboot_find_tag(uint32_t type, MultibootTag* previous) {
+    if (multiboot_info_addr == 0) {
+        return NULL;
+    }
+
+    uint8_t* end = (uint8_t*)multiboot_info_addr + multiboot_info_size();
+    uint8_t* cursor;
+
+    if (previous == NULL) {
+        // The first tag follows the fixed 8-byte header
+        cursor = (uint8_t*)multiboot_info_addr + sizeof(MultibootInfo);
+    }
+    else {
+        // Tags are padded so the next one starts on an 8-byte boundary
+        cursor = (uint8_t*)previous + ((previous->size + 7) & ~7u);
+    }
+
+    while (cursor < end) {
+        MultibootTag* tag = (MultibootTag*)cursor;
+        if (tag->type == MULTIBOOT_TAG_TYPE_END) {
+            break;
+        }
+        if (tag->type == type) {
+            return tag;
+        }
+        cursor += (tag->size + 7) & ~7u;
+    }
+    return NULL;
+}
+
+uint32_t multiboot_mmap_count(MultibootTagMmap* mmap) {
+    return (mmap->size - sizeof(MultibootTagMmap)) / mmap->entry_size;
+}
+
+MultibootMmapEntry* multiboot_mmap_entry(MultibootTagMmap* mmap, uint32_t index) {
+    return (MultibootMmapEntry*)((uint8_t*)mmap->entries + index * mmap->entry_size);
+}
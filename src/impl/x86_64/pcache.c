@@ -0,0 +1,606 @@
+#include "pcache.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "mmap.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "vga.h"
+
+static CachedPage* pages;
+static CachedPage* hash_table[PCACHE_HASH_SIZE];
+static uint32_t clock_hand;
+static PcacheStats stats;
+static Spinlock pcache_lock = SPINLOCK_INIT;   // hash chains, refcounts, flags and the clock hand
+
+static uint32_t hash(FatFile* file, uint32_t index) {
+    uint64_t key = index ^ ((uint64_t)file >> 4);
+    key ^= key >> 17;
+    return (uint32_t)(key * 0x9E3779B1u) & (PCACHE_HASH_SIZE - 1);
+}
+
+static CachedPage* lookup(FatFile* file, uint32_t index) {
+    for (CachedPage* page = hash_table[hash(file, index)]; page != NULL; page = page->hash_next) {
+        if (page->file == file && page->index == index) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+static void hash_insert(CachedPage* page, FatFile* file, uint32_t index) {
+    page->file = file;
+    page->index = index;
+    uint32_t bucket = hash(file, index);
+    page->hash_next = hash_table[bucket];
+    hash_table[bucket] = page;
+    file->cached_pages++;
+}
+
+// Take the page out of the cache, and out of every mapping that still has it
+static void drop(CachedPage* page) {
+    if (page->mapcount > 0) {
+        mmap_unmap_page(page);
+    }
+    CachedPage** link = &hash_table[hash(page->file, page->index)];
+    while (*link != page) {
+        link = &(*link)->hash_next;
+    }
+    *link = page->hash_next;
+    page->hash_next = NULL;
+    page->file->cached_pages--;
+    page->file = NULL;
+    page->flags = 0;
+}
+
+static void* frame(CachedPage* page) {
+    return phys_to_virt(page->phys);
+}
+
+// Pages that hold bytes of the file, the one its end falls in included
+static uint32_t file_pages(FatFile* file) {
+    return (uint32_t)(((uint64_t)file->size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+}
+
+// Device I/O never runs under pcache_lock. Pages being filled are pinned and
+// not yet PAGE_UPTODATE, pages being written back are pinned and PAGE_BUSY.
+
+// Drop the lock until the writeback of 'page' finished. The page may have been
+// dropped or reused meanwhile, callers look it up again.
+static uint64_t wait_busy(CachedPage* page, uint64_t flags) {
+    spin_unlock_irqrestore(&pcache_lock, flags);
+    while (__atomic_load_n(&page->flags, __ATOMIC_ACQUIRE) & PAGE_BUSY) {
+        asm volatile("pause");
+    }
+    return spin_lock_irqsave(&pcache_lock);
+}
+
+// Claim a dirty page for writing: it stays pinned and busy until end_write.
+// Mappings lose write access before the frame is read, a store after that
+// faults and dirties the page again instead of slipping past the write.
+static void begin_write(CachedPage* page) {
+    if (page->mapcount > 0) {
+        mmap_protect_page(page);
+    }
+    page->flags = (page->flags & ~PAGE_DIRTY) | PAGE_BUSY;
+    page->refcount++;
+    stats.writebacks++;
+}
+
+static void end_write(CachedPage* page, uint8_t ok) {
+    page->flags &= ~PAGE_BUSY;
+    if (!ok) {
+        page->flags |= PAGE_DIRTY;
+    }
+    page->refcount--;
+}
+
+// Write consecutive pages of one file that begin_write claimed with a single
+// write. Called with the lock held, it is dropped for the write.
+static uint8_t write_run(FatFile* file, CachedPage** run, uint32_t count, uint64_t* flags) {
+    IoVec iov[PCACHE_FILL_MAX];
+    uint64_t offset = (uint64_t)run[0]->index << PAGE_SHIFT;
+    uint64_t left = offset < file->size ? file->size - offset : 0;
+    uint32_t pieces = 0;
+    for (uint32_t i = 0; i < count && left > 0; i++) {
+        iov[pieces].base = frame(run[i]);
+        iov[pieces].length = left < PAGE_SIZE ? left : PAGE_SIZE;
+        left -= iov[pieces].length;
+        pieces++;
+    }
+
+    uint8_t ok = 1;
+    if (pieces > 0) {
+        spin_unlock_irqrestore(&pcache_lock, *flags);
+        ok = fat_file_writev(file, (uint32_t)offset, iov, pieces) == iov_length(iov, pieces);
+        *flags = spin_lock_irqsave(&pcache_lock);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        end_write(run[i], ok);
+    }
+    return ok;
+}
+
+// Claim 'page' and the dirty pages after it in the file, up to PCACHE_FILL_MAX,
+// into 'run'. Returns how many.
+static uint32_t claim_run(CachedPage* page, CachedPage** run) {
+    uint32_t n = 0;
+    while (page != NULL && (page->flags & (PAGE_DIRTY | PAGE_BUSY)) == PAGE_DIRTY && n < PCACHE_FILL_MAX) {
+        begin_write(page);
+        run[n++] = page;
+        page = lookup(page->file, page->index + 1);
+    }
+    return n;
+}
+
+// CLOCK over the slots like the buffer cache. Mapped pages are pinned by their
+// mapping and never come up.
+static CachedPage* find_victim(void) {
+    for (uint32_t i = 0; i < 2 * PCACHE_PAGES; i++) {
+        CachedPage* page = &pages[clock_hand];
+        clock_hand = (clock_hand + 1) % PCACHE_PAGES;
+
+        if (page->refcount > 0) {
+            continue;
+        }
+        if (page->file == NULL) {
+            return page;
+        }
+        if (page->flags & PAGE_REFERENCED) {
+            page->flags &= ~PAGE_REFERENCED;
+            continue;
+        }
+        return page;
+    }
+    return NULL;
+}
+
+// An unused slot to reuse, NULL when every page is pinned or a write back
+// failed. A dirty candidate is written together with the dirty pages after it
+// with the lock dropped and the sweep goes on, '*unlocked' then tells the
+// caller the cache may have changed meanwhile.
+static CachedPage* take_victim(uint64_t* flags, uint8_t* unlocked) {
+    CachedPage* run[PCACHE_FILL_MAX];
+    *unlocked = 0;
+    for (uint32_t i = 0; i < PCACHE_PAGES; i++) {
+        CachedPage* page = find_victim();
+        if (page == NULL || page->file == NULL) {
+            return page;
+        }
+        if (!(page->flags & PAGE_DIRTY)) {
+            stats.evictions++;
+            drop(page);
+            return page;
+        }
+        uint32_t n = claim_run(page, run);
+        *unlocked = 1;
+        if (!write_run(page->file, run, n, flags)) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static void pin(CachedPage* page) {
+    stats.hits++;
+    page->refcount++;
+    page->flags |= PAGE_REFERENCED;
+}
+
+// Read the missing pages [first, first + count) of the file with one request,
+// stopping at the first page that is already cached. The new pages are left
+// unreferenced, pages read ahead that nobody uses are the clock's first pick.
+// Returns the pages filled.
+static uint32_t fill(FatFile* file, uint32_t first, uint32_t count) {
+    CachedPage* run[PCACHE_FILL_MAX];
+    IoVec iov[PCACHE_FILL_MAX];
+    uint32_t end = file_pages(file);
+
+    if (count > PCACHE_FILL_MAX) {
+        count = PCACHE_FILL_MAX;
+    }
+    if (first >= end) {
+        return 0;
+    }
+    if (count > end - first) {
+        count = end - first;
+    }
+
+    uint32_t n = 0;
+    uint8_t unlocked;
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    while (n < count && lookup(file, first + n) == NULL) {
+        CachedPage* page = take_victim(&flags, &unlocked);
+        // A writeback dropped the lock, somebody may have cached the page since
+        if (page == NULL || (unlocked && lookup(file, first + n) != NULL)) {
+            break;
+        }
+        if (page->phys == 0) {
+            page->phys = pmm_alloc(0);
+            if (page->phys == 0) {
+                break;
+            }
+        }
+        hash_insert(page, file, first + n);
+        page->refcount = 1;
+        run[n++] = page;
+    }
+    if (n > 0) {
+        stats.misses += n;
+        stats.fills++;
+    }
+    spin_unlock_irqrestore(&pcache_lock, flags);
+    if (n == 0) {
+        return 0;
+    }
+
+    // Only these callers hold the new pages, the read runs without the lock
+    for (uint32_t i = 0; i < n; i++) {
+        iov[i].base = frame(run[i]);
+        iov[i].length = PAGE_SIZE;
+    }
+    uint32_t offset = first << PAGE_SHIFT;
+    uint32_t expected = file->size - offset < n * PAGE_SIZE ? file->size - offset : n * PAGE_SIZE;
+    uint8_t ok = fat_file_readv_direct(file, offset, iov, n) == expected;
+    // The end of the file falls in the last page, its rest reads as zeros
+    if (ok && expected < n * PAGE_SIZE) {
+        uint32_t used = expected - (n - 1) * PAGE_SIZE;
+        memSet((char*)frame(run[n - 1]) + used, 0, PAGE_SIZE - used);
+    }
+
+    flags = spin_lock_irqsave(&pcache_lock);
+    for (uint32_t i = 0; i < n; i++) {
+        run[i]->refcount--;
+        if (ok) {
+            run[i]->flags |= PAGE_UPTODATE;
+        }
+        else {
+            drop(run[i]);
+        }
+    }
+    spin_unlock_irqrestore(&pcache_lock, flags);
+    return ok ? n : 0;
+}
+
+// Pinned slot for page 'index' whose bytes the caller is about to supply in
+// full, nothing is read. The caller sets PAGE_UPTODATE once they are in.
+static CachedPage* grab(FatFile* file, uint32_t index) {
+    CachedPage* page = NULL;
+    uint8_t unlocked;
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    if (lookup(file, index) == NULL) {
+        page = take_victim(&flags, &unlocked);
+        if (page != NULL && unlocked && lookup(file, index) != NULL) {
+            page = NULL;
+        }
+        if (page != NULL && page->phys == 0) {
+            page->phys = pmm_alloc(0);
+            if (page->phys == 0) {
+                page = NULL;
+            }
+        }
+    }
+    if (page != NULL) {
+        hash_insert(page, file, index);
+        page->refcount = 1;
+        page->flags = PAGE_REFERENCED;
+        stats.misses++;
+    }
+    spin_unlock_irqrestore(&pcache_lock, flags);
+    return page;
+}
+
+// Cached page with its bytes in, pinned
+static CachedPage* peek(FatFile* file, uint32_t index) {
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    CachedPage* page = lookup(file, index);
+    if (page != NULL && (page->flags & PAGE_UPTODATE)) {
+        pin(page);
+    }
+    else {
+        page = NULL;
+    }
+    spin_unlock_irqrestore(&pcache_lock, flags);
+    return page;
+}
+
+// Move the position in an iovec list 'length' bytes on without touching the data
+static void iov_skip(IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, size_t length) {
+    while (length > 0 && *index < iov_count) {
+        size_t piece = iov[*index].length - *offset;
+        if (piece > length) {
+            piece = length;
+        }
+        length -= piece;
+        *offset += piece;
+        if (*offset == iov[*index].length) {
+            (*index)++;
+            *offset = 0;
+        }
+    }
+}
+
+void pcache_init(void) {
+    pages = kzalloc(PCACHE_PAGES * sizeof(CachedPage));
+    if (pages == NULL) {
+        print_str("Page cache: out of memory\n");
+    }
+}
+
+uint32_t pcache_readv(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count) {
+    // Without the descriptors the file is read the way it was before the cache
+    if (pages == NULL) {
+        return fat_file_readv(file, offset, iov, iov_count);
+    }
+    if (offset >= file->size) {
+        return 0;
+    }
+    uint64_t length = iov_length(iov, iov_count);
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+
+    // A read that starts where the last one ended gets the pages after it filled too
+    uint8_t sequential = offset == file->readahead.next_offset;
+    uint32_t last = (uint32_t)((offset + length - 1) >> PAGE_SHIFT);
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    uint32_t done = 0;
+
+    while (done < length) {
+        uint32_t position = offset + done;
+        uint32_t page_index = position >> PAGE_SHIFT;
+        uint32_t in_page = position & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - in_page < length - done ? PAGE_SIZE - in_page : (uint32_t)(length - done);
+
+        CachedPage* page = peek(file, page_index);
+        if (page == NULL) {
+            uint32_t wanted = last - page_index + 1;
+            uint32_t filled = fill(file, page_index, wanted + (sequential ? PCACHE_READAHEAD : 0));
+            if (filled == 0) {
+                break;
+            }
+            if (filled > wanted) {
+                stats.readahead += filled - wanted;
+            }
+            continue;
+        }
+        iov_copy(iov, iov_count, &index, &piece_offset, (char*)frame(page) + in_page, chunk, 1);
+        pcache_put(page);
+        done += chunk;
+    }
+
+    file->readahead.next_offset = offset + done;
+    return done;
+}
+
+uint32_t pcache_writev(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count) {
+    if (pages == NULL) {
+        return fat_file_writev(file, offset, iov, iov_count);
+    }
+    uint64_t length = iov_length(iov, iov_count);
+    if (length == 0 || (uint64_t)offset + length > 0xFFFFFFFF) {
+        return 0;
+    }
+    // Clusters for the new end now, a full volume fails this write and not a later writeback
+    if (!fat_file_extend(file, offset + (uint32_t)length)) {
+        return 0;
+    }
+
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    uint32_t done = 0;
+    while (done < length) {
+        uint32_t position = offset + done;
+        uint32_t page_index = position >> PAGE_SHIFT;
+        uint32_t in_page = position & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - in_page < length - done ? PAGE_SIZE - in_page : (uint32_t)(length - done);
+
+        // A page the write covers up to its end or the file's is not read first
+        CachedPage* page = peek(file, page_index);
+        if (page == NULL && in_page == 0 && (chunk == PAGE_SIZE || position + chunk >= file->size)) {
+            page = grab(file, page_index);
+            if (page != NULL && chunk < PAGE_SIZE) {
+                memSet((char*)frame(page) + chunk, 0, PAGE_SIZE - chunk);
+            }
+        }
+        else if (page == NULL) {
+            if (fill(file, page_index, 1) == 0) {
+                break;
+            }
+            continue;
+        }
+        if (page == NULL) {
+            break;
+        }
+        iov_copy(iov, iov_count, &index, &piece_offset, (char*)frame(page) + in_page, chunk, 0);
+
+        uint64_t flags = spin_lock_irqsave(&pcache_lock);
+        page->flags |= PAGE_UPTODATE | PAGE_DIRTY;
+        page->refcount--;
+        spin_unlock_irqrestore(&pcache_lock, flags);
+        done += chunk;
+    }
+    return done;
+}
+
+void pcache_written(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count, uint32_t length) {
+    if (pages == NULL || file->cached_pages == 0) {
+        return;
+    }
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    uint32_t done = 0;
+
+    while (done < length) {
+        uint32_t position = offset + done;
+        uint32_t in_page = position & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - in_page < length - done ? PAGE_SIZE - in_page : length - done;
+
+        CachedPage* page = peek(file, position >> PAGE_SHIFT);
+        if (page != NULL) {
+            iov_copy(iov, iov_count, &index, &piece_offset, (char*)frame(page) + in_page, chunk, 0);
+            pcache_put(page);
+        }
+        else {
+            iov_skip(iov, iov_count, &index, &piece_offset, chunk);
+        }
+        done += chunk;
+    }
+}
+
+uint32_t pcache_get_range(FatFile* file, uint32_t first, uint32_t count, CachedPage** out) {
+    if (pages == NULL) {
+        return 0;
+    }
+    uint32_t got = 0;
+    while (got < count && first + got < file_pages(file)) {
+        CachedPage* page = peek(file, first + got);
+        if (page != NULL) {
+            out[got++] = page;
+        }
+        else if (fill(file, first + got, count - got) == 0) {
+            break;
+        }
+    }
+    return got;
+}
+
+CachedPage* pcache_get(FatFile* file, uint32_t index) {
+    CachedPage* page;
+    return pcache_get_range(file, index, 1, &page) == 1 ? page : NULL;
+}
+
+void pcache_put(CachedPage* page) {
+    if (page == NULL) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    page->refcount--;
+    spin_unlock_irqrestore(&pcache_lock, flags);
+}
+
+void pcache_mark_dirty(CachedPage* page) {
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    page->flags |= PAGE_DIRTY;
+    spin_unlock_irqrestore(&pcache_lock, flags);
+}
+
+CachedPage* pcache_peek(FatFile* file, uint32_t index) {
+    return pages != NULL ? peek(file, index) : NULL;
+}
+
+uint8_t pcache_writeback(FatFile* file, uint32_t first, uint32_t count) {
+    if (pages == NULL || file->cached_pages == 0) {
+        return 1;
+    }
+    uint32_t end = file_pages(file);
+    if (first >= end) {
+        return 1;
+    }
+    if (count > end - first) {
+        count = end - first;
+    }
+
+    // Walking the indices finds the dirty pages already sorted. A page another
+    // writeback has in flight is waited for, its bytes may predate the caller's.
+    CachedPage* run[PCACHE_FILL_MAX];
+    uint8_t ok = 1;
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    for (uint32_t i = 0; i < count; ) {
+        CachedPage* page = lookup(file, first + i);
+        if (page != NULL && (page->flags & PAGE_BUSY)) {
+            flags = wait_busy(page, flags);
+            continue;
+        }
+        if (page == NULL || !(page->flags & PAGE_DIRTY)) {
+            i++;
+            continue;
+        }
+        // Dirty pages right after the range go along in the same write
+        uint32_t n = claim_run(page, run);
+        ok &= write_run(file, run, n, &flags);
+        i += n;
+    }
+    spin_unlock_irqrestore(&pcache_lock, flags);
+    return ok;
+}
+
+void pcache_truncate(FatFile* file, uint32_t size) {
+    if (pages == NULL || file->cached_pages == 0) {
+        return;
+    }
+    uint32_t keep = (uint32_t)(((uint64_t)size + PAGE_SIZE - 1) >> PAGE_SHIFT);
+
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    for (uint32_t i = 0; i < PCACHE_PAGES; i++) {
+        CachedPage* page = &pages[i];
+        if (page->file != file) {
+            continue;
+        }
+        if (page->index >= keep) {
+            drop(page);
+        }
+        else if (page->index == keep - 1 && (size & (PAGE_SIZE - 1)) != 0) {
+            uint32_t used = size & (PAGE_SIZE - 1);
+            memSet((char*)frame(page) + used, 0, PAGE_SIZE - used);
+        }
+    }
+    spin_unlock_irqrestore(&pcache_lock, flags);
+}
+
+uint8_t pcache_release(FatFile* file) {
+    if (pages == NULL || file->cached_pages == 0) {
+        return 1;
+    }
+    uint8_t ok = pcache_writeback(file, 0, file_pages(file));
+
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    for (uint32_t i = 0; i < PCACHE_PAGES && file->cached_pages > 0; i++) {
+        if (pages[i].file == file) {
+            drop(&pages[i]);
+        }
+    }
+    spin_unlock_irqrestore(&pcache_lock, flags);
+    return ok;
+}
+
+uint8_t pcache_sync(void) {
+    if (pages == NULL) {
+        return 1;
+    }
+    uint8_t ok = 1;
+    for (uint32_t i = 0; i < PCACHE_PAGES; i++) {
+        uint64_t flags = spin_lock_irqsave(&pcache_lock);
+        FatFile* file = (pages[i].flags & PAGE_DIRTY) ? pages[i].file : NULL;
+        spin_unlock_irqrestore(&pcache_lock, flags);
+        if (file != NULL) {
+            ok &= pcache_writeback(file, 0, file_pages(file));
+        }
+    }
+    return ok;
+}
+
+void pcache_get_stats(PcacheStats* out) {
+    uint64_t flags = spin_lock_irqsave(&pcache_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&pcache_lock, flags);
+}
+
+void pcache_print_stats(void) {
+    PcacheStats snapshot;
+    pcache_get_stats(&snapshot);
+
+    print_str("Page cache: hits: ");
+    print_uint(snapshot.hits);
+    print_str(" misses: ");
+    print_uint(snapshot.misses);
+    print_str(" fills: ");
+    print_uint(snapshot.fills);
+    print_str(" read ahead: ");
+    print_uint(snapshot.readahead);
+    print_str(" writebacks: ");
+    print_uint(snapshot.writebacks);
+    print_str(" evictions: ");
+    print_uint(snapshot.evictions);
+    print_str("\n");
+}
@@ -0,0 +1,120 @@
+#include "pci.h"
+#include "ports.h"
+
+static uint32_t config_address(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)device << 11) | ((uint32_t)function << 8) | (offset & 0xFC);
+}
+
+static uint32_t read_config(uint8_t bus, uint8_t device, uint8_t function, uint8_t offset) {
+    outportl(PCI_CONFIG_ADDRESS, config_address(bus, device, function, offset));
+    return inportl(PCI_CONFIG_DATA);
+}
+
+uint32_t pci_read32(PciDevice* dev, uint8_t offset) {
+    return read_config(dev->bus, dev->device, dev->function, offset);
+}
+
+uint16_t pci_read16(PciDevice* dev, uint8_t offset) {
+    return pci_read32(dev, offset) >> ((offset & 2) * 8);
+}
+
+uint8_t pci_read8(PciDevice* dev, uint8_t offset) {
+    return pci_read32(dev, offset) >> ((offset & 3) * 8);
+}
+
+void pci_write32(PciDevice* dev, uint8_t offset, uint32_t value) {
+    outportl(PCI_CONFIG_ADDRESS, config_address(dev->bus, dev->device, dev->function, offset));
+    outportl(PCI_CONFIG_DATA, value);
+}
+
+// A word write on its own, a read-modify-write of the dword would also write
+// back the status register whose bits are cleared by writing ones
+void pci_write16(PciDevice* dev, uint8_t offset, uint16_t value) {
+    outportl(PCI_CONFIG_ADDRESS, config_address(dev->bus, dev->device, dev->function, offset));
+    outportw(PCI_CONFIG_DATA + (offset & 2), value);
+}
+
+uint8_t pci_find_class(uint8_t class_code, uint8_t subclass, uint32_t index, PciDevice* out) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint8_t device = 0; device < 32; device++) {
+            uint8_t functions = 1;
+            for (uint8_t function = 0; function < functions; function++) {
+                uint32_t id = read_config(bus, device, function, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    continue;
+                }
+                if (function == 0 && (read_config(bus, device, 0, PCI_HEADER_TYPE) >> 16) & PCI_HEADER_MULTIFUNCTION) {
+                    functions = 8;
+                }
+                uint32_t class_reg = read_config(bus, device, function, PCI_PROG_IF);
+                if ((class_reg >> 24) != class_code || ((class_reg >> 16) & 0xFF) != subclass) {
+                    continue;
+                }
+                if (index-- > 0) {
+                    continue;
+                }
+                out->bus = bus;
+                out->device = device;
+                out->function = function;
+                out->vendor_id = id & 0xFFFF;
+                out->device_id = id >> 16;
+                out->class_code = class_code;
+                out->subclass = subclass;
+                out->prog_if = (class_reg >> 8) & 0xFF;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+uint64_t pci_bar(PciDevice* dev, uint8_t bar) {
+    uint32_t low = pci_read32(dev, PCI_BAR0 + bar * 4);
+    if (low & PCI_BAR_IO) {
+        return low & ~0x3u;
+    }
+    uint64_t base = low & ~0xFu;
+    if ((low & 0x6) == PCI_BAR_MEM64 && bar < 5) {
+        base |= (uint64_t)pci_read32(dev, PCI_BAR0 + (bar + 1) * 4) << 32;
+    }
+    return base;
+}
+
+void pci_enable(PciDevice* dev, uint16_t bits) {
+    pci_write16(dev, PCI_COMMAND, pci_read16(dev, PCI_COMMAND) | bits);
+}
+
+uint8_t pci_find_capability(PciDevice* dev, uint8_t id) {
+    if (!(pci_read16(dev, PCI_STATUS) & PCI_STATUS_CAPABILITIES)) {
+        return 0;
+    }
+    uint8_t offset = pci_read8(dev, PCI_CAPABILITIES) & 0xFC;
+    // The list lives in the header's upper part, a bound on the walk guards against a loop
+    for (uint32_t i = 0; offset != 0 && i < 48; i++) {
+        if (pci_read8(dev, offset) == id) {
+            return offset;
+        }
+        offset = pci_read8(dev, offset + 1) & 0xFC;
+    }
+    return 0;
+}
+
+uint8_t pci_enable_msi(PciDevice* dev, uint32_t apic_id, uint8_t vector) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSI);
+    if (cap == 0) {
+        return 0;
+    }
+    uint16_t control = pci_read16(dev, cap + PCI_MSI_CONTROL);
+    pci_write32(dev, cap + PCI_MSI_ADDRESS, PCI_MSI_ADDRESS_BASE | (apic_id << 12));
+    if (control & PCI_MSI_CONTROL_64BIT) {
+        pci_write32(dev, cap + PCI_MSI_ADDRESS + 4, 0);
+        pci_write16(dev, cap + PCI_MSI_ADDRESS + 8, vector);
+    }
+    else {
+        pci_write16(dev, cap + PCI_MSI_ADDRESS + 4, vector);
+    }
+    // One message, fixed delivery, edge triggered
+    pci_write16(dev, cap + PCI_MSI_CONTROL, (control & ~0x0070) | PCI_MSI_CONTROL_ENABLE);
+    pci_enable(dev, PCI_COMMAND_INTX_DISABLE);
+    return 1;
+}
@@ -0,0 +1,479 @@
+#include "pmm.h"
+#include "multiboot2.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "vga.h"
+
+// Provided by linker.ld
+extern uint8_t kernel_start[];
+extern uint8_t kernel_end[];
+extern uint8_t IDT[];
+
+#define MAX_RESERVED_RANGES 32
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} PhysRange;
+
+uint64_t pmm_max_phys;
+uint64_t phys_map_base;
+
+static Page* pages;                 // one descriptor per frame from 0 to pmm_max_phys
+static uint64_t page_count;
+static uint32_t free_lists[PMM_MAX_ORDER + 1];
+static PhysRange reserved_ranges[MAX_RESERVED_RANGES];
+static uint32_t reserved_count;
+static uint64_t mapped_limit;
+static PmmStats stats;
+static Spinlock pmm_lock = SPINLOCK_INIT;  // free lists, descriptors and stats, pmm_alloc runs from IRQ handlers too
+
+// Pre-zeroed pages, a stack linked through the page descriptors
+static uint32_t zero_pool_head = PMM_NONE;
+static uint32_t zero_pool_low = ZERO_POOL_LOW;
+static uint32_t zero_pool_high = ZERO_POOL_HIGH;
+static uint8_t zero_pool_refilling;         // set below the low mark, cleared at the high mark
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static uint64_t align_down(uint64_t value, uint64_t align) {
+    return value & ~(align - 1);
+}
+
+// Remember a physical range the allocator must never hand out
+static void reserve_range(uint64_t start, uint64_t end) {
+    if (reserved_count == MAX_RESERVED_RANGES || end <= start) {
+        return;
+    }
+    reserved_ranges[reserved_count].start = align_down(start, PAGE_SIZE);
+    reserved_ranges[reserved_count].end = align_up(end, PAGE_SIZE);
+    reserved_count++;
+}
+
+// Returns the reserved range overlapping [start, end) or NULL
+static PhysRange* find_reserved(uint64_t start, uint64_t end) {
+    for (uint32_t i = 0; i < reserved_count; i++) {
+        if (start < reserved_ranges[i].end && reserved_ranges[i].start < end) {
+            return &reserved_ranges[i];
+        }
+    }
+    return NULL;
+}
+
+static void list_push(uint8_t order, uint32_t pfn) {
+    Page* page = &pages[pfn];
+    page->order = order;
+    page->flags = PAGE_FREE;
+    page->prev = PMM_NONE;
+    page->next = free_lists[order];
+    if (free_lists[order] != PMM_NONE) {
+        pages[free_lists[order]].prev = pfn;
+    }
+    free_lists[order] = pfn;
+}
+
+static void list_remove(uint8_t order, uint32_t pfn) {
+    Page* page = &pages[pfn];
+    if (page->prev != PMM_NONE) {
+        pages[page->prev].next = page->next;
+    }
+    else {
+        free_lists[order] = page->next;
+    }
+    if (page->next != PMM_NONE) {
+        pages[page->next].prev = page->prev;
+    }
+    page->flags &= ~PAGE_FREE;
+    page->next = PMM_NONE;
+    page->prev = PMM_NONE;
+}
+
+// 1 when 'pfn' lies in a free block. Only the head of a block carries
+// PAGE_FREE, a block that merged into its buddy lost it, so every aligned
+// head up to the largest order is looked at.
+static uint8_t page_is_free(uint32_t pfn) {
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        uint32_t head = pfn & ~((1u << order) - 1);
+        if ((pages[head].flags & PAGE_FREE) && pages[head].order >= order) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Put a block on the free lists, merging it with its buddy as long as the buddy is free too
+static void free_block(uint32_t pfn, uint8_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= page_count) {
+            break;
+        }
+        Page* buddy_page = &pages[buddy];
+        if (!(buddy_page->flags & PAGE_FREE) || buddy_page->order != order) {
+            break;
+        }
+        list_remove(order, buddy);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    list_push(order, pfn);
+}
+
+// Free the usable frames [start_pfn, end_pfn) in the largest aligned blocks possible
+static void release_range(uint64_t start_pfn, uint64_t end_pfn) {
+    uint64_t pfn = start_pfn;
+
+    while (pfn < end_pfn) {
+        uint64_t phys = pfn << PAGE_SHIFT;
+
+        if (find_reserved(phys, phys + PAGE_SIZE)) {
+            stats.reserved_pages++;
+            pfn++;
+            continue;
+        }
+        if (phys >= mapped_limit) {
+            pages[pfn].flags = PAGE_UNMAPPED;
+            stats.unmapped_pages++;
+            pfn++;
+            continue;
+        }
+
+        uint8_t order = PMM_MAX_ORDER;
+        while (order > 0) {
+            uint64_t block_pages = 1ULL << order;
+            uint64_t block_end = phys + (PAGE_SIZE << order);
+            if ((pfn & (block_pages - 1)) == 0 && pfn + block_pages <= end_pfn &&
+                block_end <= mapped_limit && !find_reserved(phys, block_end)) {
+                break;
+            }
+            order--;
+        }
+
+        for (uint64_t i = 0; i < (1ULL << order); i++) {
+            pages[pfn + i].flags = 0;
+        }
+        free_block(pfn, order);
+        stats.free_pages += 1ULL << order;
+        pfn += 1ULL << order;
+    }
+}
+
+// First page aligned hole of 'size' bytes in usable, mapped RAM that is not reserved
+static uint64_t find_free_range(MultibootTagMmap* mmap, uint64_t size) {
+    for (uint32_t i = 0; i < multiboot_mmap_count(mmap); i++) {
+        MultibootMmapEntry* entry = multiboot_mmap_entry(mmap, i);
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE) {
+            continue;
+        }
+
+        uint64_t region_end = entry->base_addr + entry->length;
+        uint64_t candidate = align_up(entry->base_addr, PAGE_SIZE);
+        while (candidate + size <= region_end && candidate + size <= mapped_limit) {
+            PhysRange* overlap = find_reserved(candidate, candidate + size);
+            if (overlap == NULL) {
+                return candidate;
+            }
+            candidate = align_up(overlap->end, PAGE_SIZE);
+        }
+    }
+    return 0;
+}
+
+void pmm_init(void) {
+    MultibootTagMmap* mmap = (MultibootTagMmap*)multiboot_find_tag(MULTIBOOT_TAG_TYPE_MMAP, NULL);
+    if (mmap == NULL) {
+        print_str("No multiboot2 memory map, page allocator disabled\n");
+        return;
+    }
+
+    // Size the descriptor array by the highest usable address
+    for (uint32_t i = 0; i < multiboot_mmap_count(mmap); i++) {
+        MultibootMmapEntry* entry = multiboot_mmap_entry(mmap, i);
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE) {
+            continue;
+        }
+        uint64_t start = align_up(entry->base_addr, PAGE_SIZE);
+        uint64_t end = align_down(entry->base_addr + entry->length, PAGE_SIZE);
+        if (end > start) {
+            stats.total_pages += (end - start) >> PAGE_SHIFT;
+        }
+        if (end > pmm_max_phys) {
+            pmm_max_phys = end;
+        }
+    }
+    page_count = pmm_max_phys >> PAGE_SHIFT;
+    mapped_limit = PMM_BOOT_MAPPED_LIMIT;
+
+    // Real mode IVT, BIOS data area, VGA memory and option ROMs
+    reserve_range(0, 0x100000);
+    reserve_range((uint64_t)kernel_start, (uint64_t)kernel_end);
+    reserve_range((uint64_t)IDT, (uint64_t)IDT + 0x1000);
+    reserve_range(multiboot_info_addr, multiboot_info_addr + multiboot_info_size());
+
+    MultibootTag* tag = NULL;
+    while ((tag = multiboot_find_tag(MULTIBOOT_TAG_TYPE_MODULE, tag)) != NULL) {
+        MultibootTagModule* module = (MultibootTagModule*)tag;
+        reserve_range(module->mod_start, module->mod_end);
+    }
+
+    // The descriptor array lives in the first hole big enough for it
+    uint64_t array_size = page_count * sizeof(Page);
+    uint64_t array_phys = find_free_range(mmap, array_size);
+    if (array_phys == 0) {
+        print_str("No room for the page descriptors, page allocator disabled\n");
+        return;
+    }
+    reserve_range(array_phys, array_phys + array_size);
+    pages = (Page*)phys_to_virt(array_phys);
+
+    for (uint64_t pfn = 0; pfn < page_count; pfn++) {
+        pages[pfn].next = PMM_NONE;
+        pages[pfn].prev = PMM_NONE;
+        pages[pfn].order = 0;
+        pages[pfn].flags = PAGE_RESERVED;
+        pages[pfn].reserved = 0;
+    }
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_lists[order] = PMM_NONE;
+    }
+
+    for (uint32_t i = 0; i < multiboot_mmap_count(mmap); i++) {
+        MultibootMmapEntry* entry = multiboot_mmap_entry(mmap, i);
+        if (entry->type != MULTIBOOT_MEMORY_AVAILABLE) {
+            continue;
+        }
+        uint64_t start_pfn = align_up(entry->base_addr, PAGE_SIZE) >> PAGE_SHIFT;
+        uint64_t end_pfn = align_down(entry->base_addr + entry->length, PAGE_SIZE) >> PAGE_SHIFT;
+        release_range(start_pfn, end_pfn);
+    }
+}
+
+static uint32_t zero_pool_pop(void) {
+    uint32_t pfn = zero_pool_head;
+    if (pfn != PMM_NONE) {
+        zero_pool_head = pages[pfn].next;
+        pages[pfn].next = PMM_NONE;
+        pages[pfn].flags = 0;
+        stats.zero_pool_pages--;
+    }
+    return pfn;
+}
+
+static void zero_pool_push(uint32_t pfn) {
+    pages[pfn].order = 0;
+    pages[pfn].flags = PAGE_ZEROED;
+    pages[pfn].next = zero_pool_head;
+    zero_pool_head = pfn;
+    stats.zero_pool_pages++;
+}
+
+static uint64_t alloc_locked(uint8_t order) {
+    // Smallest non-empty list that can satisfy the request
+    uint8_t current = order;
+    while (current <= PMM_MAX_ORDER && free_lists[current] == PMM_NONE) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) {
+        // Out of free blocks, the pool pages are still good for a single page
+        uint32_t pfn = order == 0 ? zero_pool_pop() : PMM_NONE;
+        return pfn == PMM_NONE ? 0 : (uint64_t)pfn << PAGE_SHIFT;
+    }
+
+    uint32_t pfn = free_lists[current];
+    list_remove(current, pfn);
+
+    // Split, handing the upper halves back to the lower orders
+    while (current > order) {
+        current--;
+        list_push(current, pfn + (1u << current));
+    }
+
+    pages[pfn].order = order;
+    pages[pfn].flags = 0;
+    stats.free_pages -= 1ULL << order;
+    return (uint64_t)pfn << PAGE_SHIFT;
+}
+
+uint64_t pmm_alloc(uint8_t order) {
+    if (order > PMM_MAX_ORDER || pages == NULL) {
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t phys = alloc_locked(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return phys;
+}
+
+uint64_t pmm_alloc_flags(uint8_t order, uint8_t alloc_flags) {
+    if (order > PMM_MAX_ORDER || pages == NULL) {
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if ((alloc_flags & PMM_ZERO) && order == 0) {
+        uint32_t pfn = zero_pool_pop();
+        if (pfn != PMM_NONE) {
+            stats.zero_pool_hits++;
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            return (uint64_t)pfn << PAGE_SHIFT;
+        }
+        stats.zero_pool_misses++;
+    }
+    uint64_t phys = alloc_locked(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (phys != 0 && (alloc_flags & PMM_ZERO)) {
+        memSet(phys_to_virt(phys), 0, PAGE_SIZE << order);
+    }
+    return phys;
+}
+
+void pmm_free(uint64_t phys, uint8_t order) {
+    uint32_t pfn = phys >> PAGE_SHIFT;
+    if (pages == NULL) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    // A block of 'order' starts on a multiple of its size, anything else would
+    // link a misaligned block into the lists and break every buddy computation.
+    // Past that: a double free, also of a block merged into a bigger one since,
+    // a pointer that never came from pmm_alloc or a different order than the
+    // block was allocated with.
+    if (order > PMM_MAX_ORDER || (phys & ((PAGE_SIZE << order) - 1)) != 0 || pfn >= page_count ||
+        page_count - pfn < (1u << order) || (pages[pfn].flags & (PAGE_RESERVED | PAGE_UNMAPPED | PAGE_ZEROED)) ||
+        pages[pfn].order != order || page_is_free(pfn)) {
+        stats.bad_frees++;
+    }
+    else {
+        free_block(pfn, order);
+        stats.free_pages += 1ULL << order;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_free_zeroed(uint64_t phys) {
+    uint32_t pfn = phys >> PAGE_SHIFT;
+    if (pages == NULL || pfn >= page_count) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if ((pages[pfn].flags & (PAGE_RESERVED | PAGE_UNMAPPED | PAGE_ZEROED)) || pages[pfn].order != 0 || page_is_free(pfn)) {
+        stats.bad_frees++;
+    }
+    else {
+        if (stats.zero_pool_pages < zero_pool_high) {
+            zero_pool_push(pfn);
+        }
+        else {
+            free_block(pfn, 0);
+            stats.free_pages++;
+        }
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+uint32_t pmm_zero_pool_fill(uint32_t budget) {
+    uint32_t filled = 0;
+
+    while (filled < budget && pages != NULL) {
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        if (stats.zero_pool_pages < zero_pool_low) {
+            zero_pool_refilling = 1;
+        }
+        // Stop at the high mark, and leave the last free pages to real allocations
+        if (stats.zero_pool_pages >= zero_pool_high || stats.free_pages <= zero_pool_high) {
+            zero_pool_refilling = 0;
+        }
+        uint64_t phys = zero_pool_refilling ? alloc_locked(0) : 0;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (phys == 0) {
+            break;
+        }
+
+        // Zero outside the lock, streaming stores keep the caches for the real work
+        memSetStream(phys_to_virt(phys), 0, PAGE_SIZE);
+
+        flags = spin_lock_irqsave(&pmm_lock);
+        zero_pool_push(phys >> PAGE_SHIFT);
+        stats.zero_pool_filled++;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        filled++;
+    }
+    return filled;
+}
+
+void pmm_zero_pool_set_watermarks(uint32_t low, uint32_t high) {
+    if (low > high) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    zero_pool_low = low;
+    zero_pool_high = high;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_extend_mapped(uint64_t limit) {
+    if (pages == NULL || limit <= mapped_limit) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t start_pfn = mapped_limit >> PAGE_SHIFT;
+    uint64_t end_pfn = (limit < pmm_max_phys ? limit : pmm_max_phys) >> PAGE_SHIFT;
+    mapped_limit = limit;
+
+    for (uint64_t pfn = start_pfn; pfn < end_pfn; pfn++) {
+        if (pages[pfn].flags & PAGE_UNMAPPED) {
+            pages[pfn].flags = 0;
+            free_block(pfn, 0);
+            stats.unmapped_pages--;
+            stats.free_pages++;
+        }
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+Page* pmm_page(uint64_t phys) {
+    uint64_t pfn = phys >> PAGE_SHIFT;
+    if (pages == NULL || pfn >= page_count) {
+        return NULL;
+    }
+    return &pages[pfn];
+}
+
+void pmm_get_stats(PmmStats* out) {
+    memCpy(out, &stats, sizeof(PmmStats));
+}
+
+void pmm_print_stats(void) {
+    uint64_t used = stats.total_pages - stats.free_pages - stats.unmapped_pages - stats.zero_pool_pages;
+
+    print_str("Memory: ");
+    print_uint((stats.total_pages * PAGE_SIZE) >> 20);
+    print_str(" MiB, pages free: ");
+    print_uint(stats.free_pages);
+    print_str(" used: ");
+    print_uint(used);
+    if (stats.unmapped_pages) {
+        print_str(" unmapped: ");
+        print_uint(stats.unmapped_pages);
+    }
+    print_str("\nZeroed pool: ");
+    print_uint(stats.zero_pool_pages);
+    print_str(" pages, hits: ");
+    print_uint(stats.zero_pool_hits);
+    print_str(" misses: ");
+    print_uint(stats.zero_pool_misses);
+    print_str(" zeroed in idle: ");
+    print_uint(stats.zero_pool_filled);
+    if (stats.bad_frees) {
+        print_str("\nRejected frees: ");
+        print_uint(stats.bad_frees);
+    }
+    print_str("\n");
+}
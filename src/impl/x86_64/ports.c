@@ -10,4 +10,32 @@ uint8_t inportb(uint16_t _port) {
 
 void outportb(uint16_t _port, uint8_t _data) {
     asm volatile("outb %0, %1" : : "a" (_data), "dN" (_port));
-}
\ No newline at end of file
+}
+
+uint16_t inportw(uint16_t _port) {
+    uint16_t result;
+    asm volatile("inw %1, %0" : "=a" (result) : "dN" (_port));
+    return result;
+}
+
+void outportw(uint16_t _port, uint16_t _data) {
+    asm volatile("outw %0, %1" : : "a" (_data), "dN" (_port));
+}
+
+uint32_t inportl(uint16_t _port) {
+    uint32_t result;
+    asm volatile("inl %1, %0" : "=a" (result) : "dN" (_port));
+    return result;
+}
+
+void outportl(uint16_t _port, uint32_t _data) {
+    asm volatile("outl %0, %1" : : "a" (_data), "dN" (_port));
+}
+
+void inportsw(uint16_t _port, void* buffer, uint32_t count) {
+    asm volatile("rep insw" : "+D" (buffer), "+c" (count) : "d" (_port) : "memory");
+}
+
+void outportsw(uint16_t _port, void* buffer, uint32_t count) {
+    asm volatile("rep outsw" : "+S" (buffer), "+c" (count) : "d" (_port) : "memory");
+}
@@ -0,0 +1,104 @@
+#include "ramdisk.h"
+#include "multiboot2.h"
+#include "memory.h"
+#include "pmm.h"
+#include "vga.h"
+
+typedef struct {
+    BlockDev dev;
+    uint8_t* base;      // the module image, reached through the direct map
+} RamDisk;
+
+static RamDisk ramdisks[RAMDISK_MAX];
+static uint32_t ramdisk_count;
+
+static uint8_t ramdisk_read(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    RamDisk* disk = (RamDisk*)dev->private_data;
+    memCpy(buffer, disk->base + (sector << dev->sector_shift), (size_t)count << dev->sector_shift);
+    return 1;
+}
+
+static uint8_t ramdisk_write(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer) {
+    RamDisk* disk = (RamDisk*)dev->private_data;
+    memCpy(disk->base + (sector << dev->sector_shift), buffer, (size_t)count << dev->sector_shift);
+    return 1;
+}
+
+// The image is one contiguous block, so a vector is one copy per piece
+static uint8_t ramdisk_readv(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    RamDisk* disk = (RamDisk*)dev->private_data;
+    uint8_t* position = disk->base + (sector << dev->sector_shift);
+    for (uint32_t i = 0; i < iov_count; i++) {
+        memCpy(iov[i].base, position, iov[i].length);
+        position += iov[i].length;
+    }
+    return 1;
+}
+
+static uint8_t ramdisk_writev(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count) {
+    RamDisk* disk = (RamDisk*)dev->private_data;
+    uint8_t* position = disk->base + (sector << dev->sector_shift);
+    for (uint32_t i = 0; i < iov_count; i++) {
+        memCpy(position, iov[i].base, iov[i].length);
+        position += iov[i].length;
+    }
+    return 1;
+}
+
+// Writes land in RAM right away, nothing to flush
+static uint8_t ramdisk_flush(BlockDev* dev) {
+    (void)dev;
+    return 1;
+}
+
+static void* ramdisk_direct(BlockDev* dev, uint64_t sector) {
+    RamDisk* disk = (RamDisk*)dev->private_data;
+    return disk->base + (sector << dev->sector_shift);
+}
+
+static BlockDevOps ramdisk_ops = {
+    .read = ramdisk_read,
+    .write = ramdisk_write,
+    .flush = ramdisk_flush,
+    .readv = ramdisk_readv,
+    .writev = ramdisk_writev,
+    .direct = ramdisk_direct,
+};
+
+void ramdisk_init(void) {
+    MultibootTag* tag = NULL;
+
+    while ((tag = multiboot_find_tag(MULTIBOOT_TAG_TYPE_MODULE, tag)) != NULL && ramdisk_count < RAMDISK_MAX) {
+        MultibootTagModule* module = (MultibootTagModule*)tag;
+        RamDisk* disk = &ramdisks[ramdisk_count];
+
+        // pmm_init reserved the module, the direct map covers all RAM so no extra mapping is needed
+        disk->base = (uint8_t*)phys_to_virt(module->mod_start);
+        disk->dev.sector_size = RAMDISK_SECTOR_SIZE;
+        disk->dev.sector_count = (module->mod_end - module->mod_start) / RAMDISK_SECTOR_SIZE;
+        disk->dev.ops = &ramdisk_ops;
+        disk->dev.private_data = disk;
+
+        if (module->cmdline[0] != '\0') {
+            uint32_t i = 0;
+            while (i < BLOCKDEV_NAME_LENGTH - 1 && module->cmdline[i] != '\0') {
+                disk->dev.name[i] = module->cmdline[i];
+                i++;
+            }
+            disk->dev.name[i] = '\0';
+        }
+        else {
+            memCpy(disk->dev.name, "ram0", 5);
+            disk->dev.name[3] = '0' + ramdisk_count;
+        }
+
+        blockdev_register(&disk->dev);
+        ramdisk_count++;
+
+        print_str("RAM disk ");
+        print_str(disk->dev.name);
+        print_str(": ");
+        print_uint(((uint64_t)disk->dev.sector_count * RAMDISK_SECTOR_SIZE) >> 20);
+        print_str(" MiB\n");
+    }
+}
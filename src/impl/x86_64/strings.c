@@ -101,4 +101,23 @@ void int_to_str(uint16_t num, char* buffer, size_t buffer_size) {
         start++;
         end--;
     }
+}
+
+// Same as int_to_str but wide enough for cycle counts and byte totals
+void uint_to_str(uint64_t num, char* buffer, size_t buffer_size) {
+    char digits[20];
+    size_t count = 0;
+
+    // Build the digits in reverse order
+    do {
+        digits[count++] = '0' + num % 10;
+        num /= 10;
+    } while (num > 0 && count < sizeof(digits));
+
+    // Copy them back in order, leaving room for the terminator
+    size_t i = 0;
+    while (count > 0 && i < buffer_size - 1) {
+        buffer[i++] = digits[--count];
+    }
+    buffer[i] = '\0';
 }
\ No newline at end of file
@@ -0,0 +1,406 @@
+#include "tlb.h"
+#include "vmm.h"
+#include "apic.h"
+#include "idt.h"
+#include "kmalloc.h"
+#include "vga.h"
+
+extern void irq_tlb_shootdown(void);
+
+// A flush one CPU asks another to run, one slot per target CPU
+typedef struct {
+    volatile uint32_t pending;
+    AddressSpace* space;
+    uint64_t start;
+    uint64_t end;
+} TlbRequest;
+
+AddressSpace kernel_space;
+TlbStats tlb_stats;
+
+static AddressSpace* current_space[MAX_CPUS];
+static uint8_t pcid_enabled;            // CR4.PCIDE is on and address spaces use their own PCID
+static uint8_t pcid_bitmap[PCID_COUNT / 8];
+static Spinlock pcid_lock = SPINLOCK_INIT;
+static TlbRequest requests[MAX_CPUS];
+static Spinlock shootdown_lock = SPINLOCK_INIT;
+
+static void invlpg(uint64_t virt) {
+    asm volatile("invlpg (%0)" : : "r" (virt) : "memory");
+}
+
+static uint64_t cr3_value(AddressSpace* space, uint8_t noflush) {
+    uint64_t value = space->pml4_phys;
+    if (pcid_enabled) {
+        value |= space->pcid;
+        if (noflush) {
+            value |= CR3_NOFLUSH;
+        }
+    }
+    return value;
+}
+
+// Toggling CR4.PGE drops every TLB entry, global ones and those of every PCID
+static void flush_all_local(void) {
+    uint64_t cr4 = read_cr4();
+    if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    }
+    else {
+        write_cr3(read_cr3());
+    }
+    tlb_stats.full_flushes++;
+}
+
+// Flush [start, end) on this CPU. The kernel half is global and reached from every
+// address space, user ranges only matter while their space is loaded here.
+static void flush_local(AddressSpace* space, uint64_t start, uint64_t end) {
+    uint64_t pages = (end - start) >> PAGE_SHIFT;
+
+    if (start >= DIRECT_MAP_BASE) {
+        if (pages > TLB_FLUSH_CEILING) {
+            flush_all_local();
+            return;
+        }
+    }
+    else {
+        if (current_space[cpu_id()] != space) {
+            return;
+        }
+        if (pages > TLB_FLUSH_CEILING) {
+            // Reloading CR3 without NOFLUSH drops the entries of this PCID only
+            write_cr3(cr3_value(space, 0));
+            tlb_stats.full_flushes++;
+            return;
+        }
+    }
+
+    for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
+        invlpg(virt);
+    }
+    tlb_stats.page_flushes += pages;
+}
+
+// Run the flush another CPU queued for this one, if any
+static void run_request(uint32_t cpu) {
+    TlbRequest* request = &requests[cpu];
+    if (request->pending) {
+        flush_local(request->space, request->start, request->end);
+        __atomic_store_n(&request->pending, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void shootdown(AddressSpace* space, uint64_t start, uint64_t end, uint64_t targets) {
+    uint32_t self = cpu_id();
+
+    // One shootdown at a time. A CPU waiting here has interrupts off, so it
+    // answers the requests aimed at it while it spins.
+    while (!spin_trylock(&shootdown_lock)) {
+        run_request(self);
+        asm volatile("pause");
+    }
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (targets & (1ULL << cpu)) {
+            requests[cpu].space = space;
+            requests[cpu].start = start;
+            requests[cpu].end = end;
+            __atomic_store_n(&requests[cpu].pending, 1, __ATOMIC_RELEASE);
+            lapic_send_ipi(cpu_apic_ids[cpu], TLB_SHOOTDOWN_VECTOR);
+            tlb_stats.shootdowns++;
+        }
+    }
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        while ((targets & (1ULL << cpu)) && __atomic_load_n(&requests[cpu].pending, __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+    }
+
+    spin_unlock(&shootdown_lock);
+}
+
+void tlb_shootdown_handler(void) {
+    run_request(cpu_id());
+    lapic_eoi();
+}
+
+void tlb_flush_range(AddressSpace* space, uint64_t start, uint64_t end) {
+    if (end <= start) {
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    uint64_t self = 1ULL << cpu_id();
+    uint8_t kernel = start >= DIRECT_MAP_BASE;
+    uint8_t local = kernel || (space->active_cpus & self);
+
+    // CPUs that ran this space before may still hold its PCID tagged entries,
+    // they flush it at their next switch. This is marked before the active
+    // CPUs are read, so a CPU switching in right now is caught one way or the other.
+    if (!kernel) {
+        __atomic_or_fetch(&space->stale_cpus, cpu_online_mask & ~(local ? self : 0), __ATOMIC_SEQ_CST);
+    }
+    uint64_t targets = (kernel ? cpu_online_mask : __atomic_load_n(&space->active_cpus, __ATOMIC_SEQ_CST)) & ~self;
+
+    if (local) {
+        flush_local(space, start, end);
+    }
+    if (targets) {
+        shootdown(space, start, end, targets);
+    }
+    irq_restore(flags);
+}
+
+void mmu_gather_init(MmuGather* gather, AddressSpace* space) {
+    gather->space = space;
+    gather->start = 0;
+    gather->end = 0;
+    gather->frame_count = 0;
+}
+
+void mmu_gather_unmap(MmuGather* gather, uint64_t virt, uint64_t size) {
+    vmm_unmap_noflush(gather->space->pml4, virt, size);
+
+    if (gather->start == gather->end) {
+        gather->start = virt;
+        gather->end = virt + size;
+        return;
+    }
+    if (virt < gather->start) {
+        gather->start = virt;
+    }
+    if (virt + size > gather->end) {
+        gather->end = virt + size;
+    }
+}
+
+void mmu_gather_free_page(MmuGather* gather, uint64_t phys) {
+    if (gather->frame_count == MMU_GATHER_BATCH) {
+        mmu_gather_finish(gather);
+    }
+    gather->frames[gather->frame_count++] = phys;
+}
+
+void mmu_gather_finish(MmuGather* gather) {
+    tlb_flush_range(gather->space, gather->start, gather->end);
+
+    for (uint32_t i = 0; i < gather->frame_count; i++) {
+        pmm_free(gather->frames[i], 0);
+    }
+    gather->start = 0;
+    gather->end = 0;
+    gather->frame_count = 0;
+}
+
+// A free PCID, or 0 when all are taken and the space has to flush on every switch
+static uint16_t pcid_alloc(void) {
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    uint16_t pcid = 0;
+    for (uint32_t i = 1; i < PCID_COUNT; i++) {
+        if (!(pcid_bitmap[i / 8] & (1 << (i % 8)))) {
+            pcid_bitmap[i / 8] |= 1 << (i % 8);
+            pcid = i;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    return pcid;
+}
+
+static void pcid_free(uint16_t pcid) {
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    pcid_bitmap[pcid / 8] &= ~(1 << (pcid % 8));
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+void tlb_init(void) {
+    if (kernel_pml4 == NULL) {
+        return;
+    }
+
+    kernel_space.pml4 = kernel_pml4;
+    kernel_space.pml4_phys = virt_to_phys(kernel_pml4);
+    kernel_space.pcid = 0;
+    kernel_space.active_cpus = cpu_online_mask;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        current_space[cpu] = &kernel_space;
+    }
+    pcid_bitmap[0] = 1;
+
+    // CR4.PCIDE can only be set while the current PCID is 0
+    if (cpu_features.pcid && (read_cr3() & 0xFFF) == 0) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+        pcid_enabled = 1;
+    }
+
+    idt_set_gate(TLB_SHOOTDOWN_VECTOR, irq_tlb_shootdown);
+}
+
+AddressSpace* aspace_create(void) {
+    AddressSpace* space = kzalloc(sizeof(AddressSpace));
+    if (space == NULL) {
+        return NULL;
+    }
+    space->pml4 = vmm_create_pml4();
+    if (space->pml4 == NULL) {
+        kfree(space);
+        return NULL;
+    }
+    space->pml4_phys = virt_to_phys(space->pml4);
+    space->pcid = pcid_alloc();
+    // A recycled PCID may still have entries of its previous owner cached anywhere
+    space->stale_cpus = ~0ULL;
+    return space;
+}
+
+void aspace_destroy(AddressSpace* space) {
+    if (space == &kernel_space || space->active_cpus) {
+        return;
+    }
+    if (space->pcid != 0) {
+        pcid_free(space->pcid);
+    }
+    vmm_destroy_pml4(space->pml4);
+    kfree(space);
+}
+
+void aspace_switch(AddressSpace* space) {
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_id();
+    uint64_t self = 1ULL << cpu;
+    AddressSpace* previous = current_space[cpu];
+
+    if (previous == space) {
+        irq_restore(flags);
+        return;
+    }
+
+    // Become active before looking at the stale mask, see tlb_flush_range
+    __atomic_or_fetch(&space->active_cpus, self, __ATOMIC_SEQ_CST);
+    uint8_t stale = (__atomic_fetch_and(&space->stale_cpus, ~self, __ATOMIC_SEQ_CST) & self) != 0;
+    // PCID 0 is shared by the kernel space and the spaces that found no free PCID
+    uint8_t keep = pcid_enabled && space->pcid != 0 && !stale;
+
+    write_cr3(cr3_value(space, keep));
+    __atomic_and_fetch(&previous->active_cpus, ~self, __ATOMIC_SEQ_CST);
+    current_space[cpu] = space;
+
+    tlb_stats.switches++;
+    if (keep) {
+        tlb_stats.switches_noflush++;
+    }
+    irq_restore(flags);
+}
+
+AddressSpace* aspace_current(void) {
+    return current_space[cpu_id()];
+}
+
+#define BENCH_VIRT 0x0000008000000000ULL   /* Second PML4 slot, private to each address space */
+#define BENCH_MAX_PAGES 512
+#define BENCH_ROUNDS 1000
+
+// Touch one byte of each page so every access needs a TLB entry
+static void bench_touch(uint32_t pages) {
+    for (uint32_t i = 0; i < pages; i++) {
+        (void)*(volatile uint8_t*)(BENCH_VIRT + (uint64_t)i * PAGE_SIZE);
+    }
+}
+
+// Cycles for one switch plus the refill of 'pages' entries, ping-ponging between two spaces
+static uint64_t bench_round(AddressSpace* a, AddressSpace* b, uint32_t pages) {
+    aspace_switch(a);
+    bench_touch(pages);
+    aspace_switch(b);
+    bench_touch(pages);
+
+    uint64_t start = read_tsc();
+    for (uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+        aspace_switch(a);
+        bench_touch(pages);
+        aspace_switch(b);
+        bench_touch(pages);
+    }
+    return (read_tsc() - start) / (BENCH_ROUNDS * 2);
+}
+
+// Both spaces map the same 2 MiB with 4 KiB pages, one TLB entry per page
+static uint8_t bench_map(AddressSpace* a, AddressSpace* b, uint64_t block) {
+    for (uint32_t i = 0; i < BENCH_MAX_PAGES; i++) {
+        uint64_t offset = (uint64_t)i * PAGE_SIZE;
+        if (!vmm_map(a->pml4, BENCH_VIRT + offset, block + offset, PAGE_SIZE, 0) ||
+            !vmm_map(b->pml4, BENCH_VIRT + offset, block + offset, PAGE_SIZE, 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void bench_run(AddressSpace* a, AddressSpace* b) {
+    static const uint32_t sizes[] = { 0, 8, 32, 128, 512 };
+    AddressSpace* original = aspace_current();
+    uint8_t original_pcid = pcid_enabled;
+
+    print_str("\nCycles per address space switch plus TLB refill\n");
+    print_str("pages   pcid on  pcid off\n");
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint64_t with_pcid = 0;
+        if (cpu_features.pcid) {
+            pcid_enabled = 1;
+            flush_all_local();
+            with_pcid = bench_round(a, b, sizes[i]);
+        }
+
+        // Every space on PCID 0 and a full flush per switch, like a kernel without PCIDs
+        pcid_enabled = 0;
+        flush_all_local();
+        uint64_t without_pcid = bench_round(a, b, sizes[i]);
+
+        print_uint(sizes[i]);
+        print_str("\t");
+        if (cpu_features.pcid) {
+            print_uint(with_pcid);
+        }
+        else {
+            print_str("-");
+        }
+        print_str("\t ");
+        print_uint(without_pcid);
+        print_str("\n");
+    }
+
+    pcid_enabled = original_pcid;
+    flush_all_local();
+    aspace_switch(original);
+}
+
+void tlb_benchmark(void) {
+    if (kernel_pml4 == NULL) {
+        return;
+    }
+    if (!cpu_features.pcid) {
+        print_str("\nPCID not supported, only the flushing switch is measured\n");
+    }
+
+    AddressSpace* a = aspace_create();
+    AddressSpace* b = aspace_create();
+    uint64_t block = pmm_alloc(9);
+
+    if (a != NULL && b != NULL && block != 0 && bench_map(a, b, block)) {
+        bench_run(a, b);
+    }
+    else {
+        print_str("\nNot enough memory for the TLB benchmark\n");
+    }
+
+    if (block != 0) {
+        pmm_free(block, 9);
+    }
+    if (a != NULL) {
+        aspace_destroy(a);
+    }
+    if (b != NULL) {
+        aspace_destroy(b);
+    }
+}
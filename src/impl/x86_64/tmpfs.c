@@ -0,0 +1,268 @@
+#include "tmpfs.h"
+#include "constants.h"
+#include "hdd.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "pmm.h"
+#include "strings.h"
+#include "vga.h"
+
+TmpfsStats tmpfs_stats;
+
+static InodeOps tmpfs_inode_ops;
+
+static TmpNode* node_of(Inode* inode) {
+    return inode->private_data;
+}
+
+// Make room for page 'index' in the page list
+static uint8_t grow_pages(TmpNode* node, uint32_t index) {
+    if (index < node->page_slots) {
+        return 1;
+    }
+    uint32_t slots = node->page_slots == 0 ? 16 : node->page_slots;
+    while (slots <= index) {
+        slots *= 2;
+    }
+    uint64_t* pages = kzalloc(slots * sizeof(uint64_t));
+    if (pages == NULL) {
+        return 0;
+    }
+    if (node->pages != NULL) {
+        memCpy(pages, node->pages, node->page_slots * sizeof(uint64_t));
+        kfree(node->pages);
+    }
+    node->pages = pages;
+    node->page_slots = slots;
+    return 1;
+}
+
+// Give back every frame from page 'first' on
+static void free_pages_from(TmpNode* node, uint32_t first) {
+    for (uint32_t i = first; i < node->page_slots; i++) {
+        if (node->pages[i] != 0) {
+            pmm_free(node->pages[i], 0);
+            node->pages[i] = 0;
+            tmpfs_stats.pages--;
+        }
+    }
+}
+
+// No cache sits in front of the pages, O_DIRECT reads them the same way
+static uint64_t tmpfs_readv(Inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags) {
+    (void)flags;
+    TmpNode* node = node_of(inode);
+    if (offset >= inode->size) {
+        return 0;
+    }
+    uint64_t length = iov_length(iov, iov_count);
+    if (length > inode->size - offset) {
+        length = inode->size - offset;
+    }
+
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    uint64_t done = 0;
+    while (done < length) {
+        uint64_t page = (offset + done) >> PAGE_SHIFT;
+        uint32_t in_page = (offset + done) & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - in_page;
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+        // A hole reads as zeros
+        char* source = page < node->page_slots && node->pages[page] != 0 ? (char*)phys_to_virt(node->pages[page]) + in_page : zero_page();
+        iov_copy(iov, iov_count, &index, &piece_offset, source, chunk, 1);
+        done += chunk;
+    }
+    return done;
+}
+
+// Pages are allocated as they are first written. A page only partly written
+// starts out zeroed, so the bytes past the end of a file are always zeros.
+static uint64_t tmpfs_writev(Inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags) {
+    (void)flags;
+    TmpNode* node = node_of(inode);
+    uint64_t length = iov_length(iov, iov_count);
+
+    uint32_t index = 0;
+    size_t piece_offset = 0;
+    uint64_t done = 0;
+    while (done < length) {
+        uint64_t page = (offset + done) >> PAGE_SHIFT;
+        uint32_t in_page = (offset + done) & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - in_page;
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+        if (!grow_pages(node, page)) {
+            break;
+        }
+        if (node->pages[page] == 0) {
+            if (tmpfs_stats.pages >= TMPFS_MAX_PAGES) {
+                break;
+            }
+            node->pages[page] = pmm_alloc_flags(0, chunk == PAGE_SIZE ? 0 : PMM_ZERO);
+            if (node->pages[page] == 0) {
+                break;
+            }
+            tmpfs_stats.pages++;
+        }
+        iov_copy(iov, iov_count, &index, &piece_offset, (char*)phys_to_virt(node->pages[page]) + in_page, chunk, 0);
+        done += chunk;
+    }
+
+    if (offset + done > inode->size) {
+        inode->size = offset + done;
+    }
+    tmpfs_stats.bytes_written += done;
+    return done;
+}
+
+// Growing leaves a hole, shrinking frees the pages past the end and zeros the tail of the last one
+static uint8_t tmpfs_truncate(Inode* inode, uint64_t size) {
+    TmpNode* node = node_of(inode);
+    if (size > (uint64_t)TMPFS_MAX_PAGES * PAGE_SIZE) {
+        return 0;
+    }
+    if (size < inode->size) {
+        uint64_t keep = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+        free_pages_from(node, keep);
+        uint64_t last = size >> PAGE_SHIFT;
+        uint32_t used = size & (PAGE_SIZE - 1);
+        if (used != 0 && last < node->page_slots && node->pages[last] != 0) {
+            memSet((char*)phys_to_virt(node->pages[last]) + used, 0, PAGE_SIZE - used);
+        }
+    }
+    inode->size = size;
+    return 1;
+}
+
+// There is no device behind it, the memory is the file
+static uint8_t tmpfs_sync(Inode* inode) {
+    (void)inode;
+    return 1;
+}
+
+static InodeOps tmpfs_inode_ops = {
+    .readv = tmpfs_readv,
+    .writev = tmpfs_writev,
+    .truncate = tmpfs_truncate,
+    .sync = tmpfs_sync,
+};
+
+// New file or directory named 'name' in 'dir'. The returned reference belongs to its dentry.
+static Inode* create(Inode* dir, char* name, uint8_t type) {
+    TmpNode* node = kzalloc(sizeof(TmpNode));
+    Dentry* dentry = kzalloc(sizeof(Dentry));
+    Inode* inode = node != NULL && dentry != NULL ? vfs_inode_alloc(dir->mount, type, &tmpfs_inode_ops) : NULL;
+    if (inode == NULL) {
+        kfree(node);
+        kfree(dentry);
+        return NULL;
+    }
+    inode->private_data = node;
+    tmpfs_stats.files++;
+
+    memCpy(dentry->name, name, strLength(name) + 1);
+    dentry->inode = inode;
+    if (!dentry_map_insert(&node_of(dir)->entries, dentry)) {
+        vfs_iput(inode);
+        kfree(dentry);
+        return NULL;
+    }
+    tmpfs_stats.creates++;
+    return inode;
+}
+
+static Inode* tmpfs_lookup(Inode* dir, char* name, uint8_t create_file) {
+    Dentry* dentry = dentry_map_find(&node_of(dir)->entries, name);
+    Inode* inode = dentry != NULL ? dentry->inode : NULL;
+    if (inode == NULL && create_file) {
+        inode = create(dir, name, VFS_FILE);
+    }
+    if (inode != NULL) {
+        vfs_ihold(inode);
+    }
+    return inode;
+}
+
+static uint8_t tmpfs_mkdir(Inode* dir, char* name) {
+    return create(dir, name, VFS_DIR) != NULL;
+}
+
+// The name goes at once, the pages when the last descriptor of the file is closed
+static uint8_t tmpfs_unlink(Inode* dir, char* name) {
+    TmpNode* parent = node_of(dir);
+    Dentry* dentry = dentry_map_find(&parent->entries, name);
+    if (dentry == NULL || (dentry->inode->type == VFS_DIR && node_of(dentry->inode)->entries.count > 0)) {
+        return 0;
+    }
+    dentry_map_remove(&parent->entries, name);
+    vfs_iput(dentry->inode);
+    kfree(dentry);
+    tmpfs_stats.unlinks++;
+    return 1;
+}
+
+static void tmpfs_release(Inode* inode) {
+    TmpNode* node = node_of(inode);
+    if (node == NULL) {
+        return;
+    }
+    free_pages_from(node, 0);
+    kfree(node->pages);
+    // Only a replaced mount drops a directory that still has names in it
+    for (uint32_t i = 0; i < node->entries.bucket_count; i++) {
+        Dentry* dentry = node->entries.buckets[i];
+        while (dentry != NULL) {
+            Dentry* next = dentry->next;
+            vfs_iput(dentry->inode);
+            kfree(dentry);
+            dentry = next;
+        }
+    }
+    dentry_map_free(&node->entries);
+    kfree(node);
+    tmpfs_stats.files--;
+}
+
+static FsOps tmpfs_fs_ops = {
+    .name = "tmpfs",
+    .max_file_size = (uint64_t)TMPFS_MAX_PAGES * PAGE_SIZE,
+    .lookup = tmpfs_lookup,
+    .mkdir = tmpfs_mkdir,
+    .unlink = tmpfs_unlink,
+    .release = tmpfs_release,
+};
+
+uint8_t tmpfs_mount(char* path) {
+    TmpNode* node = kzalloc(sizeof(TmpNode));
+    Inode* root = node != NULL ? vfs_inode_alloc(NULL, VFS_DIR, &tmpfs_inode_ops) : NULL;
+    if (root == NULL) {
+        kfree(node);
+        return 0;
+    }
+    root->private_data = node;
+    if (!vfs_mount(path, &tmpfs_fs_ops, root, NULL)) {
+        kfree(node);
+        kfree(root);
+        return 0;
+    }
+    tmpfs_stats.files++;
+    return 1;
+}
+
+void tmpfs_print_stats(void) {
+    print_str("tmpfs: files: ");
+    print_uint(tmpfs_stats.files);
+    print_str(" pages: ");
+    print_uint(tmpfs_stats.pages);
+    print_str(" creates: ");
+    print_uint(tmpfs_stats.creates);
+    print_str(" unlinks: ");
+    print_uint(tmpfs_stats.unlinks);
+    print_str(" bytes written: ");
+    print_uint(tmpfs_stats.bytes_written);
+    print_str("\n");
+}
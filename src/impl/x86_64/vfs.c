@@ -0,0 +1,372 @@
+#include "vfs.h"
+#include "kmalloc.h"
+#include "memory.h"
+#include "strings.h"
+#include "vga.h"
+
+VfsStats vfs_stats;
+
+static Mount mounts[VFS_MOUNT_MAX];
+static Inode* icache[VFS_ICACHE_SIZE];
+
+static uint32_t icache_hash(Mount* mount, uint64_t key) {
+    key ^= (uint64_t)mount >> 4;
+    key ^= key >> 29;
+    return (uint32_t)(key * 0x9E3779B1u) & (VFS_ICACHE_SIZE - 1);
+}
+
+// FNV-1a over the name
+static uint32_t name_hash(char* name) {
+    uint32_t h = 2166136261u;
+    while (*name != '\0') {
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    }
+    return h;
+}
+
+// Copy the next component of '*path' into 'name' and move past it. 0 at the
+// end of the path or when the component is longer than VFS_NAME_MAX.
+static uint8_t next_component(char** path, char* name) {
+    char* p = *path;
+    while (*p == '/') {
+        p++;
+    }
+    uint32_t length = 0;
+    while (p[length] != '\0' && p[length] != '/') {
+        length++;
+    }
+    if (length == 0 || length > VFS_NAME_MAX) {
+        return 0;
+    }
+    memCpy(name, p, length);
+    name[length] = '\0';
+    *path = p + length;
+    return 1;
+}
+
+// "." and ".." are not names a filesystem is asked about
+static uint8_t special(char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// 1 when 'path' starts with the 'length' bytes of 'prefix'
+static uint8_t starts_with(char* path, char* prefix, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        if (path[i] != prefix[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 1 when nothing but slashes is left
+static uint8_t path_done(char* path) {
+    while (*path == '/') {
+        path++;
+    }
+    return *path == '\0';
+}
+
+uint8_t vfs_mount(char* path, FsOps* ops, Inode* root, void* private_data) {
+    uint32_t length = strLength(path);
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    if (length == 0 || length >= VFS_PATH_MAX || path[0] != '/') {
+        return 0;
+    }
+
+    Mount* slot = NULL;
+    for (uint32_t i = 0; i < VFS_MOUNT_MAX; i++) {
+        if (mounts[i].path_length == length && starts_with(path, mounts[i].path, length)) {
+            slot = &mounts[i];
+            vfs_iput(slot->root);
+            break;
+        }
+        if (slot == NULL && mounts[i].path_length == 0) {
+            slot = &mounts[i];
+        }
+    }
+    if (slot == NULL) {
+        return 0;
+    }
+    memCpy(slot->path, path, length);
+    slot->path[length] = '\0';
+    slot->path_length = length;
+    slot->ops = ops;
+    slot->root = root;
+    slot->private_data = private_data;
+    root->mount = slot;
+    return 1;
+}
+
+Mount* vfs_find_mount(char* path, char** rest) {
+    Mount* best = NULL;
+    for (uint32_t i = 0; i < VFS_MOUNT_MAX; i++) {
+        Mount* m = &mounts[i];
+        uint32_t length = m->path_length;
+        if (length == 0 || (best != NULL && length <= best->path_length)) {
+            continue;
+        }
+        // "/" covers everything, "/tmp" covers "/tmp" and "/tmp/..." but not "/tmpx"
+        if (length == 1 || (starts_with(path, m->path, length) && (path[length] == '\0' || path[length] == '/'))) {
+            best = m;
+        }
+    }
+    if (best != NULL) {
+        *rest = best->path_length == 1 ? path : path + best->path_length;
+    }
+    return best;
+}
+
+// Walk 'path' inside its mount. Returns the directory holding the last
+// component with a reference taken and copies that component into 'name'.
+// 'name' is left empty when the path names the mount root itself.
+static Inode* walk_parent(char* path, char* name) {
+    char absolute[VFS_PATH_MAX + VFS_NAME_MAX + 2];
+    vfs_stats.walks++;
+
+    // Everything is absolute, a relative path starts at the root
+    if (path[0] != '/') {
+        uint32_t length = strLength(path);
+        if (length + 2 > sizeof(absolute)) {
+            return NULL;
+        }
+        absolute[0] = '/';
+        memCpy(absolute + 1, path, length + 1);
+        path = absolute;
+    }
+
+    char* rest;
+    Mount* mount = vfs_find_mount(path, &rest);
+    if (mount == NULL) {
+        return NULL;
+    }
+    Inode* dir = mount->root;
+    vfs_ihold(dir);
+    name[0] = '\0';
+
+    while (next_component(&rest, name)) {
+        if (path_done(rest)) {
+            return dir;
+        }
+        // "." stays where it is, ".." is not supported
+        if (name[0] == '.' && name[1] == '\0') {
+            continue;
+        }
+        Inode* child = NULL;
+        if (dir->type == VFS_DIR && !special(name)) {
+            vfs_stats.lookups++;
+            child = mount->ops->lookup(dir, name, 0);
+        }
+        vfs_iput(dir);
+        if (child == NULL) {
+            return NULL;
+        }
+        dir = child;
+    }
+    // A component that is too long, or a path with nothing in it but the mount point
+    if (!path_done(rest)) {
+        vfs_iput(dir);
+        return NULL;
+    }
+    name[0] = '\0';
+    return dir;
+}
+
+Inode* vfs_open(char* path, uint8_t create) {
+    char name[VFS_NAME_MAX + 1];
+    Inode* dir = walk_parent(path, name);
+    if (dir == NULL || name[0] == '\0' || (name[0] == '.' && name[1] == '\0')) {
+        return dir;
+    }
+    Inode* inode = NULL;
+    if (dir->type == VFS_DIR && !special(name)) {
+        vfs_stats.lookups++;
+        inode = dir->mount->ops->lookup(dir, name, create);
+    }
+    vfs_iput(dir);
+    return inode;
+}
+
+uint8_t vfs_mkdir(char* path) {
+    char name[VFS_NAME_MAX + 1];
+    Inode* dir = walk_parent(path, name);
+    if (dir == NULL) {
+        return 0;
+    }
+    uint8_t ok = name[0] != '\0' && !special(name) && dir->type == VFS_DIR && dir->mount->ops->mkdir != NULL && dir->mount->ops->mkdir(dir, name);
+    vfs_iput(dir);
+    return ok;
+}
+
+uint8_t vfs_unlink(char* path) {
+    char name[VFS_NAME_MAX + 1];
+    Inode* dir = walk_parent(path, name);
+    if (dir == NULL) {
+        return 0;
+    }
+    uint8_t ok = name[0] != '\0' && !special(name) && dir->type == VFS_DIR && dir->mount->ops->unlink != NULL && dir->mount->ops->unlink(dir, name);
+    vfs_iput(dir);
+    return ok;
+}
+
+Inode* vfs_inode_alloc(Mount* mount, uint8_t type, InodeOps* ops) {
+    Inode* inode = kzalloc(sizeof(Inode));
+    if (inode == NULL) {
+        return NULL;
+    }
+    inode->mount = mount;
+    inode->type = type;
+    inode->ops = ops;
+    inode->refcount = 1;
+    return inode;
+}
+
+Inode* vfs_ifind(Mount* mount, uint64_t key) {
+    for (Inode* inode = icache[icache_hash(mount, key)]; inode != NULL; inode = inode->hash_next) {
+        if (inode->mount == mount && inode->key == key) {
+            return inode;
+        }
+    }
+    return NULL;
+}
+
+Inode* vfs_iget(Mount* mount, uint64_t key, uint8_t* created) {
+    Inode* inode = vfs_ifind(mount, key);
+    *created = 0;
+    if (inode != NULL) {
+        vfs_stats.icache_hits++;
+        inode->refcount++;
+        return inode;
+    }
+
+    vfs_stats.icache_misses++;
+    inode = vfs_inode_alloc(mount, VFS_FILE, NULL);
+    if (inode == NULL) {
+        return NULL;
+    }
+    uint32_t bucket = icache_hash(mount, key);
+    inode->key = key;
+    inode->hashed = 1;
+    inode->hash_next = icache[bucket];
+    icache[bucket] = inode;
+    *created = 1;
+    return inode;
+}
+
+void vfs_ihold(Inode* inode) {
+    inode->refcount++;
+}
+
+void vfs_iput(Inode* inode) {
+    if (inode == NULL || --inode->refcount > 0) {
+        return;
+    }
+    if (inode->hashed) {
+        Inode** link = &icache[icache_hash(inode->mount, inode->key)];
+        while (*link != inode) {
+            link = &(*link)->hash_next;
+        }
+        *link = inode->hash_next;
+    }
+    if (inode->mount != NULL && inode->mount->ops->release != NULL) {
+        inode->mount->ops->release(inode);
+    }
+    kfree(inode);
+}
+
+Dentry* dentry_map_find(DentryMap* map, char* name) {
+    if (map->bucket_count == 0) {
+        return NULL;
+    }
+    for (Dentry* d = map->buckets[name_hash(name) & (map->bucket_count - 1)]; d != NULL; d = d->next) {
+        if (strEqual(d->name, name)) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Double the buckets once there are as many names as buckets
+static uint8_t dentry_map_grow(DentryMap* map) {
+    uint32_t count = map->bucket_count == 0 ? DENTRY_MAP_INITIAL : map->bucket_count * 2;
+    Dentry** buckets = kzalloc(count * sizeof(Dentry*));
+    if (buckets == NULL) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < map->bucket_count; i++) {
+        Dentry* d = map->buckets[i];
+        while (d != NULL) {
+            Dentry* next = d->next;
+            uint32_t bucket = name_hash(d->name) & (count - 1);
+            d->next = buckets[bucket];
+            buckets[bucket] = d;
+            d = next;
+        }
+    }
+    kfree(map->buckets);
+    map->buckets = buckets;
+    map->bucket_count = count;
+    return 1;
+}
+
+uint8_t dentry_map_insert(DentryMap* map, Dentry* dentry) {
+    if (dentry_map_find(map, dentry->name) != NULL) {
+        return 0;
+    }
+    if (map->count >= map->bucket_count && !dentry_map_grow(map) && map->bucket_count == 0) {
+        return 0;
+    }
+    uint32_t bucket = name_hash(dentry->name) & (map->bucket_count - 1);
+    dentry->next = map->buckets[bucket];
+    map->buckets[bucket] = dentry;
+    map->count++;
+    return 1;
+}
+
+Dentry* dentry_map_remove(DentryMap* map, char* name) {
+    if (map->bucket_count == 0) {
+        return NULL;
+    }
+    Dentry** link = &map->buckets[name_hash(name) & (map->bucket_count - 1)];
+    while (*link != NULL && !strEqual((*link)->name, name)) {
+        link = &(*link)->next;
+    }
+    Dentry* d = *link;
+    if (d != NULL) {
+        *link = d->next;
+        d->next = NULL;
+        map->count--;
+    }
+    return d;
+}
+
+void dentry_map_free(DentryMap* map) {
+    kfree(map->buckets);
+    map->buckets = NULL;
+    map->bucket_count = 0;
+    map->count = 0;
+}
+
+void vfs_print_stats(void) {
+    print_str("VFS: mounts:");
+    for (uint32_t i = 0; i < VFS_MOUNT_MAX; i++) {
+        if (mounts[i].path_length != 0) {
+            print_str(" ");
+            print_str(mounts[i].path);
+            print_str(" (");
+            print_str(mounts[i].ops->name);
+            print_str(")");
+        }
+    }
+    print_str(" walks: ");
+    print_uint(vfs_stats.walks);
+    print_str(" lookups: ");
+    print_uint(vfs_stats.lookups);
+    print_str(" inode cache hits: ");
+    print_uint(vfs_stats.icache_hits);
+    print_str(" misses: ");
+    print_uint(vfs_stats.icache_misses);
+    print_str("\n");
+}
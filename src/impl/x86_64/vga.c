@@ -125,6 +125,13 @@ void print_int(uint16_t num) {
     print_str(num_str);
 }
 
+// function to print a 64-bit unsigned integer
+void print_uint(uint64_t num) {
+    char num_str[21]; // 20 digits covers the largest 64-bit value
+    uint_to_str(num, num_str, sizeof(num_str));
+    print_str(num_str);
+}
+
 //  Print color for text and background
 void print_set_color(uint8_t foreground, uint8_t background) {
     color = foreground | (background << 4);
@@ -0,0 +1,393 @@
+#include "vmm.h"
+#include "cpu.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "tlb.h"
+#include "vga.h"
+
+// Provided by linker.ld
+extern uint8_t kernel_end[];
+
+uint64_t* kernel_pml4;
+uint64_t direct_map_page_size;
+
+// The vmap area is handed out bottom up and never reused, 1 TiB of address
+// space outlasts anything this kernel maps at 4 KiB granularity
+static uint64_t vmap_next = VMAP_BASE;
+static Spinlock vmap_lock = SPINLOCK_INIT;
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Bytes covered by one entry of a table at 'level' (4 = PML4, 1 = page table)
+static uint64_t level_size(uint8_t level) {
+    return (uint64_t)PAGE_SIZE << (9 * (level - 1));
+}
+
+static uint32_t level_index(uint64_t virt, uint8_t level) {
+    return (virt >> (PAGE_SHIFT + 9 * (level - 1))) & (PT_ENTRIES - 1);
+}
+
+static uint64_t* entry_table(uint64_t entry) {
+    return (uint64_t*)phys_to_virt(entry & PTE_ADDR_MASK);
+}
+
+static void invlpg(uint64_t virt) {
+    asm volatile("invlpg (%0)" : : "r" (virt) : "memory");
+}
+
+// Only the tables CR3 points at can have stale TLB entries. The kernel half is
+// shared by every address space, so it is always live.
+static uint8_t is_active(uint64_t* pml4, uint64_t virt) {
+    return virt >= DIRECT_MAP_BASE || virt_to_phys(pml4) == (read_cr3() & PTE_ADDR_MASK);
+}
+
+// Drop the bits this CPU cannot take, a reserved bit in an entry faults on every access
+static uint64_t page_flags(uint64_t flags) {
+    flags &= PTE_WRITABLE | PTE_USER | PTE_WRITE_THROUGH | PTE_CACHE_DISABLE | PTE_GLOBAL | PTE_NO_EXECUTE;
+    if (!cpu_features.nx) {
+        flags &= ~PTE_NO_EXECUTE;
+    }
+    if (!cpu_features.pge) {
+        flags &= ~PTE_GLOBAL;
+    }
+    return flags;
+}
+
+// A zeroed page for a new table, returns its physical address or 0
+static uint64_t alloc_table(void) {
+    return pmm_alloc_flags(0, PMM_ZERO);
+}
+
+// Free a table and every table below it, the pages they map are left alone
+static void free_table(uint64_t* table, uint8_t level) {
+    if (level > 1) {
+        for (uint32_t i = 0; i < PT_ENTRIES; i++) {
+            if ((table[i] & PTE_PRESENT) && !(table[i] & PTE_HUGE)) {
+                free_table(entry_table(table[i]), level - 1);
+            }
+        }
+    }
+    pmm_free(virt_to_phys(table), 0);
+}
+
+// Replace a huge page with a table of 512 smaller pages mapping the same memory
+static uint8_t split(uint64_t* entry, uint8_t level) {
+    uint64_t phys = alloc_table();
+    if (phys == 0) {
+        return 0;
+    }
+
+    uint64_t* table = (uint64_t*)phys_to_virt(phys);
+    uint64_t base = *entry & PTE_ADDR_MASK;
+    uint64_t attributes = *entry & ~PTE_ADDR_MASK;
+    uint64_t child_size = level_size(level - 1);
+    // Bit 7 is the PAT bit in a page table entry, not the huge bit
+    if (level - 1 == 1) {
+        attributes &= ~PTE_HUGE;
+    }
+    for (uint32_t i = 0; i < PT_ENTRIES; i++) {
+        table[i] = (base + i * child_size) | attributes;
+    }
+
+    // Permissions of the levels are combined, so the directory entry stays permissive
+    *entry = phys | PTE_PRESENT | PTE_WRITABLE | (attributes & PTE_USER);
+    return 1;
+}
+
+// Entry for 'virt' in the table at 'target' level. With 'create' missing tables are
+// allocated and huge pages on the way are split. Without it the walk stops at the first
+// hole or huge page and 'level' tells at which level that entry sits. NULL when out of memory.
+static uint64_t* walk(uint64_t* pml4, uint64_t virt, uint8_t target, uint8_t create, uint64_t flags, uint8_t* level) {
+    uint64_t* table = pml4;
+
+    for (uint8_t current = 4; ; current--) {
+        uint64_t* entry = &table[level_index(virt, current)];
+        *level = current;
+        if (current == target) {
+            return entry;
+        }
+
+        if (!(*entry & PTE_PRESENT)) {
+            if (!create) {
+                return entry;
+            }
+            uint64_t phys = alloc_table();
+            if (phys == 0) {
+                return NULL;
+            }
+            *entry = phys | PTE_PRESENT | PTE_WRITABLE;
+        }
+        else if (*entry & PTE_HUGE) {
+            if (!create) {
+                return entry;
+            }
+            if (!split(entry, current)) {
+                return NULL;
+            }
+        }
+        if (create) {
+            *entry |= flags & PTE_USER;
+        }
+        table = entry_table(*entry);
+    }
+}
+
+// Install one page of level_size(level) bytes
+static uint8_t map_one(uint64_t* pml4, uint64_t virt, uint64_t phys, uint8_t level, uint64_t flags, uint8_t active) {
+    uint8_t found;
+    uint64_t* entry = walk(pml4, virt, level, 1, flags, &found);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    // A huge page replaces whatever smaller pages were mapped there
+    if (level > 1 && (*entry & PTE_PRESENT) && !(*entry & PTE_HUGE)) {
+        free_table(entry_table(*entry), level - 1);
+    }
+    *entry = phys | flags | PTE_PRESENT | (level > 1 ? PTE_HUGE : 0);
+    if (active) {
+        invlpg(virt);
+    }
+    return 1;
+}
+
+uint8_t vmm_map(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
+    if ((virt | phys | size) & (PAGE_SIZE - 1)) {
+        return 0;
+    }
+
+    uint8_t active = is_active(pml4, virt);
+    flags = page_flags(flags);
+
+    while (size > 0) {
+        uint8_t level = 1;
+        if (cpu_features.pdpe1gb && ((virt | phys) & (PAGE_SIZE_1G - 1)) == 0 && size >= PAGE_SIZE_1G) {
+            level = 3;
+        }
+        else if (((virt | phys) & (PAGE_SIZE_2M - 1)) == 0 && size >= PAGE_SIZE_2M) {
+            level = 2;
+        }
+
+        if (!map_one(pml4, virt, phys, level, flags, active)) {
+            return 0;
+        }
+        virt += level_size(level);
+        phys += level_size(level);
+        size -= level_size(level);
+    }
+    return 1;
+}
+
+// Shared loop of vmm_unmap and vmm_protect. Holes are skipped a whole entry at a
+// time and huge pages are only split when the range covers part of them.
+static uint8_t update_range(uint64_t* pml4, uint64_t virt, uint64_t size, uint8_t unmap, uint64_t flags, uint8_t flush) {
+    if ((virt | size) & (PAGE_SIZE - 1)) {
+        return 0;
+    }
+
+    uint8_t active = flush && is_active(pml4, virt);
+    uint64_t remaining = size;
+
+    while (remaining > 0) {
+        uint8_t level;
+        uint64_t* entry = walk(pml4, virt, 1, 0, 0, &level);
+        uint64_t page = level_size(level);
+        uint64_t step = page - (virt & (page - 1));
+
+        if (*entry & PTE_PRESENT) {
+            if (level > 1 && (step != page || page > remaining)) {
+                if (!split(entry, level)) {
+                    return 0;
+                }
+                continue;
+            }
+
+            if (unmap) {
+                *entry = 0;
+            }
+            else {
+                *entry = (*entry & (PTE_ADDR_MASK | PTE_HUGE | PTE_ACCESSED | PTE_DIRTY)) | flags | PTE_PRESENT;
+            }
+            if (active) {
+                invlpg(virt);
+            }
+        }
+
+        if (step >= remaining) {
+            break;
+        }
+        virt += step;
+        remaining -= step;
+    }
+    return 1;
+}
+
+uint8_t vmm_unmap(uint64_t* pml4, uint64_t virt, uint64_t size) {
+    return update_range(pml4, virt, size, 1, 0, 1);
+}
+
+uint8_t vmm_unmap_noflush(uint64_t* pml4, uint64_t virt, uint64_t size) {
+    return update_range(pml4, virt, size, 1, 0, 0);
+}
+
+uint8_t vmm_protect(uint64_t* pml4, uint64_t virt, uint64_t size, uint64_t flags) {
+    return update_range(pml4, virt, size, 0, page_flags(flags), 1);
+}
+
+uint8_t vmm_translate(uint64_t* pml4, uint64_t virt, uint64_t* phys) {
+    uint8_t level;
+    uint64_t* entry = walk(pml4, virt, 1, 0, 0, &level);
+    if (!(*entry & PTE_PRESENT)) {
+        return 0;
+    }
+
+    uint64_t page = level_size(level);
+    *phys = (*entry & PTE_ADDR_MASK & ~(page - 1)) + (virt & (page - 1));
+    return 1;
+}
+
+// Reserve 'size' bytes of the vmap area plus one guard page, returns 0 when it is used up
+static uint64_t vmap_reserve(uint64_t size) {
+    uint64_t flags = spin_lock_irqsave(&vmap_lock);
+    uint64_t virt = 0;
+    if (vmap_next + size + PAGE_SIZE <= VMAP_BASE + VMAP_SIZE) {
+        virt = vmap_next;
+        vmap_next += size + PAGE_SIZE;
+    }
+    spin_unlock_irqrestore(&vmap_lock, flags);
+    return virt;
+}
+
+void* vmm_map_kernel(uint64_t phys, uint64_t size, uint64_t flags) {
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    uint64_t length = align_up(size + offset, PAGE_SIZE);
+
+    uint64_t virt = vmap_reserve(length);
+    if (virt == 0) {
+        return NULL;
+    }
+    if (!vmm_map(kernel_pml4, virt, phys - offset, length, flags | PTE_GLOBAL)) {
+        vmm_unmap(kernel_pml4, virt, length);
+        return NULL;
+    }
+    return (void*)(virt + offset);
+}
+
+void* vmm_reserve(uint64_t size) {
+    return (void*)vmap_reserve(align_up(size, PAGE_SIZE));
+}
+
+void* vmm_alloc(uint64_t size) {
+    uint64_t length = align_up(size, PAGE_SIZE);
+
+    uint64_t virt = vmap_reserve(length);
+    if (virt == 0) {
+        return NULL;
+    }
+
+    for (uint64_t done = 0; done < length; done += PAGE_SIZE) {
+        uint64_t phys = pmm_alloc(0);
+        if (phys == 0 || !vmm_map(kernel_pml4, virt + done, phys, PAGE_SIZE, PTE_WRITABLE | PTE_GLOBAL | PTE_NO_EXECUTE)) {
+            if (phys != 0) {
+                pmm_free(phys, 0);
+            }
+            vmm_free((void*)virt, done);
+            return NULL;
+        }
+    }
+    return (void*)virt;
+}
+
+void vmm_free(void* ptr, uint64_t size) {
+    uint64_t virt = (uint64_t)ptr;
+    uint64_t length = align_up(size, PAGE_SIZE);
+
+    // The frames are only reused after every CPU dropped its TLB entries for them
+    MmuGather gather;
+    mmu_gather_init(&gather, &kernel_space);
+    for (uint64_t done = 0; done < length; done += PAGE_SIZE) {
+        uint64_t phys;
+        if (vmm_translate(kernel_pml4, virt + done, &phys)) {
+            mmu_gather_unmap(&gather, virt + done, PAGE_SIZE);
+            mmu_gather_free_page(&gather, phys);
+        }
+    }
+    mmu_gather_finish(&gather);
+}
+
+uint64_t* vmm_create_pml4(void) {
+    uint64_t phys = alloc_table();
+    if (phys == 0) {
+        return NULL;
+    }
+
+    // Share the kernel half and, while the kernel runs from it, the boot identity map
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(phys);
+    pml4[0] = kernel_pml4[0];
+    for (uint32_t i = PT_ENTRIES / 2; i < PT_ENTRIES; i++) {
+        pml4[i] = kernel_pml4[i];
+    }
+    return pml4;
+}
+
+void vmm_destroy_pml4(uint64_t* pml4) {
+    for (uint32_t i = 1; i < PT_ENTRIES / 2; i++) {
+        if ((pml4[i] & PTE_PRESENT) && !(pml4[i] & PTE_HUGE)) {
+            free_table(entry_table(pml4[i]), 3);
+        }
+    }
+    pmm_free(virt_to_phys(pml4), 0);
+}
+
+void vmm_init(void) {
+    if (cpu_features.nx) {
+        write_msr(MSR_EFER, read_msr(MSR_EFER) | EFER_NXE);
+    }
+    if (cpu_features.pge) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+
+    // The tables are built through the boot identity map, the page allocator
+    // only hands out frames below 1 GiB at this point
+    uint64_t pml4_phys = alloc_table();
+    if (pml4_phys == 0) {
+        print_str("No memory for the kernel page tables\n");
+        return;
+    }
+    kernel_pml4 = (uint64_t*)phys_to_virt(pml4_phys);
+
+    direct_map_page_size = cpu_features.pdpe1gb ? PAGE_SIZE_1G : PAGE_SIZE_2M;
+    uint64_t direct_map_size = align_up(pmm_max_phys, direct_map_page_size);
+    uint64_t image_size = align_up((uint64_t)kernel_end, PAGE_SIZE_2M);
+
+    // The kernel is still linked at 1 MiB, so the identity map of the first
+    // 1 GiB stays for the image, the boot stack, the IDT and VGA memory
+    uint8_t ok = vmm_map(kernel_pml4, 0, 0, PMM_BOOT_MAPPED_LIMIT, PTE_WRITABLE);
+    ok = ok && vmm_map(kernel_pml4, DIRECT_MAP_BASE, 0, direct_map_size, PTE_WRITABLE | PTE_GLOBAL | PTE_NO_EXECUTE);
+    ok = ok && vmm_map(kernel_pml4, KERNEL_VIRT_BASE, 0, image_size, PTE_WRITABLE | PTE_GLOBAL);
+    // Address spaces copy the kernel half of the PML4 when they are created,
+    // so the top level tables of the vmap area have to exist from the start
+    for (uint64_t virt = VMAP_BASE; ok && virt < VMAP_BASE + VMAP_SIZE; virt += level_size(4)) {
+        uint8_t level;
+        ok = walk(kernel_pml4, virt, 3, 1, 0, &level) != NULL;
+    }
+    if (!ok) {
+        print_str("No memory for the kernel page tables\n");
+        return;
+    }
+
+    write_cr3(pml4_phys);
+
+    // From here on physical memory is reached through the direct map
+    phys_map_base = DIRECT_MAP_BASE;
+    kernel_pml4 = (uint64_t*)phys_to_virt(pml4_phys);
+    pmm_extend_mapped(direct_map_size);
+
+    print_str("Direct map: ");
+    print_uint(direct_map_size >> 20);
+    print_str(" MiB with ");
+    print_str(cpu_features.pdpe1gb ? "1 GiB" : "2 MiB");
+    print_str(" pages\n");
+}
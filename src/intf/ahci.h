@@ -0,0 +1,147 @@
+#ifndef AHCI_H
+#define AHCI_H
+#include <stdint.h>
+#include "blockdev.h"
+
+// Generic host control registers, offsets from ABAR (BAR5)
+#define HBA_CAP 0x00
+#define HBA_GHC 0x04
+#define HBA_IS 0x08                     /* Bit n: port n has an interrupt pending */
+#define HBA_PI 0x0C                     /* Bit n: port n is implemented */
+#define HBA_CAP2 0x24
+#define HBA_BOHC 0x28
+
+#define HBA_CAP_NP 0x1F                 /* Ports minus one */
+#define HBA_CAP_NCS_SHIFT 8             /* Bits 12:8: command slots per port minus one */
+#define HBA_CAP_SNCQ (1u << 30)         /* Native Command Queuing */
+#define HBA_CAP_S64A (1u << 31)         /* 64-bit DMA addresses */
+#define HBA_GHC_HR 0x01                 /* HBA reset */
+#define HBA_GHC_IE 0x02                 /* Interrupts enabled */
+#define HBA_GHC_AE (1u << 31)           /* AHCI mode, not legacy IDE emulation */
+#define HBA_CAP2_BOH 0x01               /* BIOS/OS handoff supported */
+#define HBA_BOHC_BOS 0x01               /* The firmware owns the HBA */
+#define HBA_BOHC_OOS 0x02               /* The OS asks for it */
+
+// Port registers, offsets from the port's block at 0x100 + port * 0x80
+#define PORT_BASE 0x100
+#define PORT_STRIDE 0x80
+#define PORT_CLB 0x00                   /* Command list, 1 KiB aligned */
+#define PORT_CLBU 0x04
+#define PORT_FB 0x08                    /* Received FIS area, 256 byte aligned */
+#define PORT_FBU 0x0C
+#define PORT_IS 0x10
+#define PORT_IE 0x14
+#define PORT_CMD 0x18
+#define PORT_TFD 0x20                   /* Low byte: the device's ATA status */
+#define PORT_SIG 0x24
+#define PORT_SSTS 0x28
+#define PORT_SERR 0x30
+#define PORT_SACT 0x34                  /* Bit n: NCQ tag n is outstanding on the device */
+#define PORT_CI 0x38                    /* Bit n: slot n is issued */
+
+#define PORT_CMD_ST 0x0001              /* Process the command list */
+#define PORT_CMD_FRE 0x0010             /* Receive FISes */
+#define PORT_CMD_FR 0x4000              /* FIS receive running */
+#define PORT_CMD_CR 0x8000              /* Command list running */
+
+#define PORT_IS_DHRS 0x00000001         /* Device to host register FIS, a non-queued command ended */
+#define PORT_IS_SDBS 0x00000008         /* Set device bits FIS, NCQ commands ended */
+#define PORT_IS_ERRORS 0x7D800010       /* Task file, host bus, interface and protocol errors */
+
+#define PORT_SSTS_DET 0x0F
+#define PORT_SSTS_DET_PRESENT 3         /* Device there and the link established */
+#define PORT_SIG_ATA 0x00000101         /* Signature of a SATA disk, ATAPI and port multipliers differ */
+
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_H2D_COMMAND 0x80            /* The FIS carries a command, not a device control update */
+#define FIS_DEVICE_LBA 0x40             /* Device register: LBA addressing, required by NCQ */
+
+#define AHCI_HEADER_WRITE 0x0040        /* Command header: the data goes to the device */
+#define AHCI_PRD_IRQ (1u << 31)         /* Interrupt once this entry's data moved */
+#define AHCI_PRD_BYTES 0x400000         /* Most one PRD entry describes */
+
+#define AHCI_ABAR_SIZE 0x1100           /* Generic registers and 32 ports */
+#define AHCI_MAX_DRIVES 4
+#define AHCI_SLOTS 32
+#define AHCI_PRD_MAX 56                 /* Entries in a 1 KiB command table */
+#define AHCI_MAX_SECTORS 256            /* Per command, 128 KiB, a larger request goes out as several queued commands */
+#define AHCI_TABLES_ORDER 3             /* 32 command tables of 1 KiB */
+#define AHCI_BOUNCE_ORDER 5             /* 128 KiB bounce buffer per port, IDENTIFY data too */
+#define AHCI_TIMEOUT 100000000          /* Register polls before a command is given up */
+#define AHCI_BENCH_IOS 4096             /* Random 4 KiB reads per queue depth in ahci_benchmark */
+#define AHCI_BENCH_SPAN (1u << 30)      /* Bytes at the start of the disk the reads land in */
+
+// Host to device register FIS
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t command;
+    uint8_t features;
+    uint8_t lba0;
+    uint8_t lba1;
+    uint8_t lba2;
+    uint8_t device;
+    uint8_t lba3;
+    uint8_t lba4;
+    uint8_t lba5;
+    uint8_t features_high;
+    uint8_t count;                      // NCQ: tag in bits 7:3, the sector count goes in the features
+    uint8_t count_high;
+    uint8_t icc;
+    uint8_t control;
+    uint8_t reserved[4];
+} __attribute__((packed)) AhciFisH2D;
+
+// Entry of a port's command list, one per slot
+typedef struct {
+    uint16_t flags;                     // bits 4:0 FIS length in dwords, AHCI_HEADER_WRITE
+    uint16_t prdt_length;
+    volatile uint32_t bytes;            // moved so far, written by the HBA
+    uint64_t table_phys;                // 128 byte aligned
+    uint32_t reserved[4];
+} __attribute__((packed)) AhciCommandHeader;
+
+typedef struct {
+    uint64_t phys;                      // word aligned
+    uint32_t reserved;
+    uint32_t bytes;                     // bits 21:0 byte count minus one, even count
+} __attribute__((packed)) AhciPrd;
+
+typedef struct {
+    uint8_t fis[64];
+    uint8_t atapi[16];
+    uint8_t reserved[48];
+    AhciPrd prdt[AHCI_PRD_MAX];
+} __attribute__((packed)) AhciCommandTable;
+
+typedef struct {
+    uint64_t commands;
+    uint64_t queued;                    // of those, NCQ commands
+    uint64_t sectors;
+    uint64_t bounced;                   // commands whose buffer the HBA could not reach directly
+    uint64_t max_depth;                 // most commands in flight on one port at once
+    uint64_t irqs;
+    uint64_t errors;
+    uint64_t cycles;                    // TSC cycles spent in requests
+} AhciStats;
+
+extern AhciStats ahci_stats;
+
+// Find the first AHCI controller on the PCI bus, bring up every port with a
+// SATA disk behind it and register the disks as "ahci0".."ahci3".
+// Completions are polled until ahci_enable_irq.
+void ahci_init(void);
+
+// Have the controller interrupt by MSI, or by its PCI interrupt line when
+// there is no MSI or local APIC. Called once idt_init loaded the IDT.
+void ahci_enable_irq(void);
+
+// C side of the interrupt stub
+void ahci_irq(void);
+
+// Random 4 KiB reads on ahci0 at queue depths 1 to 32, prints the IOPS of each
+void ahci_benchmark(void);
+
+void ahci_print_stats(void);
+
+#endif
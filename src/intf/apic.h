@@ -0,0 +1,34 @@
+#ifndef APIC_H
+#define APIC_H
+#include <stdint.h>
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+
+// Local APIC register offsets
+#define LAPIC_ID 0x020
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SPURIOUS 0x0F0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+#define LAPIC_SOFTWARE_ENABLE (1 << 8)
+#define LAPIC_ICR_PENDING (1 << 12)     /* Delivery status, the IPI has not been accepted yet */
+
+// Map the local APIC of the boot CPU and software enable it
+void lapic_init(void);
+
+// 1 once lapic_init mapped the local APIC, interrupts sent as messages need it
+uint8_t lapic_ready(void);
+
+// APIC ID of the CPU running this code
+uint32_t lapic_id(void);
+
+// Send a fixed interrupt to the CPU with the given APIC ID
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// Acknowledge the interrupt being handled
+void lapic_eoi(void);
+
+#endif
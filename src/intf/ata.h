@@ -0,0 +1,132 @@
+#ifndef ATA_H
+#define ATA_H
+#include <stdint.h>
+#include "blockdev.h"
+
+// Legacy ports of the two channels of a PIIX IDE controller
+#define ATA_PRIMARY_IO 0x1F0
+#define ATA_PRIMARY_CTRL 0x3F6
+#define ATA_PRIMARY_IRQ 14
+#define ATA_SECONDARY_IO 0x170
+#define ATA_SECONDARY_CTRL 0x376
+#define ATA_SECONDARY_IRQ 15
+
+// Task file registers, offsets from the channel's I/O base
+#define ATA_REG_DATA 0
+#define ATA_REG_ERROR 1
+#define ATA_REG_FEATURES 1
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA_LOW 3
+#define ATA_REG_LBA_MID 4
+#define ATA_REG_LBA_HIGH 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_STATUS 7
+#define ATA_REG_COMMAND 7
+
+// Status register
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DF 0x20
+#define ATA_STATUS_DRDY 0x40
+#define ATA_STATUS_BSY 0x80
+
+// Device control register
+#define ATA_CTRL_NIEN 0x02              /* The drive does not raise INTRQ */
+
+#define ATA_DRIVE_LBA 0xE0              /* Drive register: LBA addressing, bits 5 and 7 always set */
+#define ATA_DRIVE_SLAVE 0x10
+
+// Commands
+#define ATA_CMD_READ_SECTORS 0x20
+#define ATA_CMD_READ_SECTORS_EXT 0x24
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_SECTORS 0x30
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60  /* Native Command Queuing, SATA only */
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE 0xC6
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_FLUSH_CACHE 0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+
+// IDENTIFY DEVICE words
+#define ATA_ID_MODEL 27                 /* 40 characters, two per word, swapped */
+#define ATA_ID_MULTIPLE 47              /* Low byte: most sectors per READ/WRITE MULTIPLE block */
+#define ATA_ID_CAPABILITIES 49          /* Bit 8: DMA supported */
+#define ATA_ID_LBA28_SECTORS 60
+#define ATA_ID_QUEUE_DEPTH 75           /* Bits 4:0: deepest NCQ queue minus one */
+#define ATA_ID_SATA_CAPABILITIES 76     /* Bit 8: NCQ supported */
+#define ATA_ID_COMMAND_SETS 83          /* Bit 10: 48-bit addressing */
+#define ATA_ID_LBA48_SECTORS 100
+
+// PCI bus master registers, offsets from BAR4, the secondary channel is at +8
+#define BM_COMMAND 0
+#define BM_STATUS 2
+#define BM_PRDT 4
+#define BM_CHANNEL_STRIDE 8
+#define BM_CMD_START 0x01
+#define BM_CMD_READ 0x08                /* The engine writes memory, a device read */
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERROR 0x02
+#define BM_STATUS_IRQ 0x04              /* INTRQ went up, cleared by writing 1 */
+
+#define ATA_SECTOR_SIZE 512
+#define ATA_LBA28_LIMIT 0x10000000      /* Sectors LBA28 commands reach */
+#define ATA_MAX_SECTORS 256             /* Per command, 128 KiB */
+#define ATA_PRD_MAX 512                 /* Entries in a one page PRD table */
+#define ATA_PRD_EOT 0x8000              /* Flags of the table's last entry */
+#define ATA_PRD_BOUNDARY 0x10000        /* A PRD region must not cross 64 KiB */
+#define ATA_BOUNCE_ORDER 5              /* 128 KiB bounce buffer per channel */
+#define ATA_TIMEOUT 100000000           /* Status polls before a command is given up */
+#define ATA_BENCH_BYTES (8u << 20)      /* Read per request size and mode by ata_benchmark */
+
+// Physical Region Descriptor: one physically contiguous piece of a DMA transfer
+typedef struct {
+    uint32_t phys;
+    uint16_t bytes;                     // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed)) AtaPrd;
+
+typedef struct {
+    uint64_t dma_commands;
+    uint64_t pio_commands;
+    uint64_t sectors;
+    uint64_t bounced;                   // DMA commands whose buffer the engine could not reach directly
+    uint64_t irq_completions;           // DMA commands finished by IRQ14/15
+    uint64_t polled_completions;        // DMA commands finished with interrupts off, by polling bus master status
+    uint64_t errors;
+    uint64_t cycles;                    // TSC cycles spent in requests
+    uint64_t wait_cycles;               // of those, waiting for the drive, polled or halted
+    uint64_t halted_cycles;             // of those, halted from hlt to the completion interrupt, free for other work
+} AtaStats;
+
+extern AtaStats ata_stats;
+
+// Find the IDE controller on the PCI bus, identify the drives on both
+// channels and register every ATA disk as "ata0".."ata3". Without a PCI IDE
+// function the legacy ports are probed and only PIO is used. Completions are
+// polled until ata_enable_irq.
+void ata_init(void);
+
+// Route IRQ14/15 to the driver, called once idt_init loaded the IDT. DMA
+// commands issued with interrupts on then halt until the drive interrupts.
+void ata_enable_irq(void);
+
+// C side of the IRQ14/15 stubs
+void ata_primary_irq(void);
+void ata_secondary_irq(void);
+
+// Read the start of ata0 with DMA and with PIO and print cycles per MiB
+// spent in total and by the CPU itself
+void ata_benchmark(void);
+
+void ata_print_stats(void);
+
+#endif
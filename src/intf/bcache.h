@@ -0,0 +1,98 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+#include <stdint.h>
+#include <stddef.h>
+#include "blockdev.h"
+
+#define BCACHE_BUFFERS 256          /* Sectors the cache holds */
+#define BCACHE_HASH_SIZE 512        /* Hash buckets, power of two */
+#define BCACHE_READAHEAD_MAX 64     /* Sectors one readahead call may fill */
+
+// Buffer flags
+#define BUF_VALID      0x01     /* data holds the sector */
+#define BUF_DIRTY      0x02     /* data is newer than the disk */
+#define BUF_REFERENCED 0x04     /* used since the clock hand last passed */
+#define BUF_DIRECT     0x08     /* data points into the device itself (RAM disk) */
+#define BUF_READAHEAD  0x10     /* read ahead of use and not asked for yet */
+#define BUF_JOURNAL    0x20     /* dirty metadata not in the log yet, must not reach its home sector */
+#define BUF_BUSY       0x40     /* device I/O in flight, the buffer is pinned and lookups wait */
+
+// One cached sector. A buffer is pinned while refcount > 0 and is only
+// reused by the clock once it has dropped to 0.
+typedef struct buffer {
+    BlockDev* dev;              // NULL while the slot is unused
+    uint64_t sector;
+    char* data;
+    uint32_t size;              // bytes allocated for data
+    uint32_t refcount;
+    uint8_t flags;
+    struct buffer* hash_next;
+} Buffer;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;        // dirty sectors written to the device
+    uint64_t evictions;
+    uint64_t readahead;         // sectors read ahead
+    uint64_t readahead_hits;    // of those, later asked for
+    uint64_t readahead_wasted;  // of those, dropped before anyone asked
+} BcacheStats;
+
+// Allocate the buffer descriptors, sector data is allocated on first use
+void bcache_init(void);
+
+// Pin the buffer for (dev, sector) and read it in when it is not cached.
+// NULL on an I/O error or when every buffer is pinned.
+Buffer* bcache_get(BlockDev* dev, uint64_t sector);
+
+// Same as bcache_get but skips the read, for callers about to overwrite the whole sector
+Buffer* bcache_get_noread(BlockDev* dev, uint64_t sector);
+
+// Pin the buffer for (dev, sector) only when it is already cached, never does I/O
+Buffer* bcache_peek(BlockDev* dev, uint64_t sector);
+
+// Start reading the uncached sectors of [sector, sector + count) into the
+// cache, each stretch of them as one device request. The buffers are not
+// pinned and are the first ones the clock takes back if nobody uses them.
+// Returns the sectors read. Devices the cache maps directly are skipped.
+uint32_t bcache_readahead(BlockDev* dev, uint64_t sector, uint32_t count);
+
+// The buffer was modified, write it back on eviction or sync
+void bcache_mark_dirty(Buffer* buf);
+
+// Same as bcache_mark_dirty for metadata that goes through the intent log. The
+// buffer is neither written nor evicted until bcache_journal_logged releases it.
+void bcache_mark_journal(Buffer* buf);
+
+// Buffers waiting for the log
+uint32_t bcache_journal_count(void);
+
+// Pin up to 'max' buffers waiting for the log and store them in 'out'
+uint32_t bcache_journal_collect(Buffer** out, uint32_t max);
+
+// The buffers are in the log: they are plain dirty buffers again and get unpinned
+void bcache_journal_logged(Buffer** bufs, uint32_t count);
+
+// Unpin a buffer returned by bcache_get
+void bcache_put(Buffer* buf);
+
+// Write every dirty buffer of 'dev' (all devices when NULL) in sector order,
+// consecutive sectors as one request, and flush the device. Buffers waiting
+// for the log are left alone.
+uint8_t bcache_sync(BlockDev* dev);
+
+// Drop the clean, unpinned buffers of 'dev'
+void bcache_invalidate(BlockDev* dev);
+
+// I/O that bypasses the cache keeps it coherent with these. Before reading
+// [sector, sector + count) from the device the dirty buffers in it are written,
+// after writing it the cached copies are dropped or, when pinned, read again.
+uint8_t bcache_writeback_range(BlockDev* dev, uint64_t sector, uint64_t count);
+void bcache_invalidate_range(BlockDev* dev, uint64_t sector, uint64_t count);
+
+void bcache_get_stats(BcacheStats* out);
+
+void bcache_print_stats(void);
+
+#endif
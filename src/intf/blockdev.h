@@ -0,0 +1,77 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLOCKDEV_NAME_LENGTH 16
+
+struct blockdev;
+
+// One piece of a scattered buffer
+typedef struct {
+    void* base;
+    size_t length;
+} IoVec;
+
+// Operations a block device driver provides. Counts and positions are in
+// device sectors, every op returns 1 on success and 0 on an I/O error.
+typedef struct blockdev_ops {
+    uint8_t (*read)(struct blockdev* dev, uint64_t sector, uint32_t count, void* buffer);
+    uint8_t (*write)(struct blockdev* dev, uint64_t sector, uint32_t count, void* buffer);
+    uint8_t (*flush)(struct blockdev* dev);
+
+    // Optional, one request moving consecutive sectors to or from the pieces of
+    // 'iov' in order. The pieces add up to whole sectors but a single piece need not.
+    uint8_t (*readv)(struct blockdev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count);
+    uint8_t (*writev)(struct blockdev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count);
+
+    // Optional, memory backed devices return a pointer to the sector itself so
+    // readers can skip the copy. NULL when the device has no such pointer.
+    void* (*direct)(struct blockdev* dev, uint64_t sector);
+} BlockDevOps;
+
+typedef struct blockdev {
+    char name[BLOCKDEV_NAME_LENGTH];
+    uint32_t sector_size;
+    uint8_t sector_shift;       // log2(sector_size)
+    uint64_t sector_count;
+    BlockDevOps* ops;
+    void* private_data;         // driver state
+    uint8_t cache_copies;       // the buffer cache keeps its own copies even when 'direct' could map sectors
+    uint64_t requests;          // calls that reached the driver
+    uint64_t sectors_moved;
+    struct blockdev* next;
+} BlockDev;
+
+// Add a device to the list blockdev_find searches, sector_shift is derived from sector_size
+void blockdev_register(BlockDev* dev);
+
+// Registered device with this name or NULL
+BlockDev* blockdev_find(char* name);
+
+// Bounds checked wrappers around the device ops
+uint8_t blockdev_read(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer);
+uint8_t blockdev_write(BlockDev* dev, uint64_t sector, uint32_t count, void* buffer);
+uint8_t blockdev_flush(BlockDev* dev);
+
+// Move consecutive sectors to or from an iovec list whose total length is a
+// multiple of the sector size. Devices without readv/writev get one request per
+// piece, a sector split across pieces goes through a bounce buffer.
+uint8_t blockdev_readv(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count);
+uint8_t blockdev_writev(BlockDev* dev, uint64_t sector, IoVec* iov, uint32_t iov_count);
+
+// Bytes described by an iovec list
+size_t iov_length(IoVec* iov, uint32_t iov_count);
+
+// Copy 'length' bytes between 'flat' and the iovec list at position
+// (*index, *offset), into the list when 'to_iov' is set, and advance the position
+void iov_copy(IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, void* flat, size_t length, uint8_t to_iov);
+
+// Describe the next 'length' bytes of the list at (*index, *offset) as pieces
+// in 'out' (room for iov_count of them) and advance. Returns the piece count.
+uint32_t iov_slice(IoVec* iov, uint32_t iov_count, uint32_t* index, size_t* offset, size_t length, IoVec* out);
+
+// Pointer to the sector in device memory, NULL when the device cannot hand one out
+void* blockdev_direct(BlockDev* dev, uint64_t sector);
+
+#endif
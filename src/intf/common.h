@@ -11,5 +11,6 @@ extern size_t col;
 extern size_t row;
 
 extern char* key_buffer;
+extern uint8_t key_buffer_index;           // defined in vga.c
 
 #endif
\ No newline at end of file
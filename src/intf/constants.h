@@ -39,6 +39,11 @@
 #define ICW4_SFNM	0x10		/* Special fully nested (not) */
 
 #define PIC_EOI		0x20		/* End-of-interrupt command code */
+#define PIC_CASCADE_IRQ 2       /* Master line the slave PIC is wired to */
+#define PIT_CHANNEL2_DATA 0x42  /* Programmable interval timer, channel 2 gates on port 0x61 */
+#define PIT_COMMAND 0x43
+#define PIT_GATE_PORT 0x61      /* Bit 0: channel 2 gate, bit 1: speaker, bit 5: channel 2 output */
+#define PIT_FREQUENCY 1193182
 #define KEYBOARD_IRQ 1          /* Standard ISA Interupt est 1 - Keyboard Interupt*/
 
 #define FAT_EOF FAT32_EOF       /* Define a generic EOF constant */
@@ -54,6 +59,8 @@
 
 #define FAT32_CLUSTER_SIZE 4096 /* FAT32 cluster size in bytes */
 
+#define MAX_CLUSTER_SIZE 65536  /* Largest cluster FAT allows, 128 sectors of 512 bytes */
+
 #define FAT32_ROOT_DIR_CLUSTER 2    /* FAT32 root directory cluster */
 
 #define FAT32_MAX_FILE_NAME_LENGTH 255 /* FAT32 max file name length */
@@ -70,6 +77,11 @@
 
 #define MAX_CLUSTERS_FAT32 0x0FFFFFF7  // FAT32 supports up to 0xFFFFFF7 clusters (0xFFFFFF8 to 0xFFFFFFFF are reserved)
 
+#define FSINFO_LEAD_SIGNATURE   0x41615252  /* FSInfo sector signatures */
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_TRAIL_SIGNATURE  0xAA550000
+#define FSINFO_UNKNOWN          0xFFFFFFFF  /* Free count or hint not known */
+
 #define FAT32_MAX_FILES_PER_DIR 512 /* FAT32 max files per directory */
 
 #define FAT32_MAX_DIRS_PER_CLUSTER 65536 /* FAT32 max directories per cluster */
@@ -80,6 +92,8 @@
 
 #define O_RDWR      2
 
+#define O_ACCMODE   3           /* Mask of the access mode above */
+
 #define O_CREAT     64
 
 #define O_APPEND    1024
@@ -100,7 +114,25 @@
 
 #define O_TMPFILE   4259840 
 
-#define O_TRUNC     0x0400
+#define O_TRUNC     0x0200      /* 0x0400 collided with O_APPEND */
+
+#define SEEK_SET    0
+
+#define SEEK_CUR    1
+
+#define SEEK_END    2
+
+#define PROT_NONE   0           /* mmap protections */
+#define PROT_READ   1
+#define PROT_WRITE  2
+
+#define MAP_SHARED  0x01        /* Stores reach the file, the only kind supported */
+#define MAP_PRIVATE 0x02
+#define MAP_FAILED  ((void*)-1)
+
+#define MS_ASYNC      1         /* msync flags */
+#define MS_INVALIDATE 2
+#define MS_SYNC       4
 
 #define EXIT_FAILURE 1
 
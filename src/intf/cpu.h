@@ -0,0 +1,67 @@
+#ifndef CPU_H
+#define CPU_H
+#include <stdint.h>
+
+// CPU features the kernel cares about, filled in once at boot by cpu_detect_features()
+typedef struct {
+    uint8_t sse2;       // CPUID.1:EDX[26], always present in long mode
+    uint8_t xsave;      // CPUID.1:ECX[26]
+    uint8_t osxsave;    // CPUID.1:ECX[27], set once long_mode_start enabled CR4.OSXSAVE
+    uint8_t avx;        // CPUID.1:ECX[28] and XCR0 has the SSE and AVX state enabled
+    uint8_t avx2;       // CPUID.(7,0):EBX[5]
+    uint8_t erms;       // CPUID.(7,0):EBX[9] Enhanced REP MOVSB/STOSB
+    uint8_t fsrm;       // CPUID.(7,0):EDX[4] Fast Short REP MOVSB
+    uint8_t pge;        // CPUID.1:EDX[13] global pages
+    uint8_t nx;         // CPUID.80000001h:EDX[20] no-execute page bit
+    uint8_t pdpe1gb;    // CPUID.80000001h:EDX[26] 1 GiB pages
+    uint8_t pcid;       // CPUID.1:ECX[17] process-context identifiers
+} CpuFeatures;
+
+extern CpuFeatures cpu_features;
+
+// Upper bound for per-CPU data such as the slab magazines
+#define MAX_CPUS 8
+
+// Bit n is set once CPU n runs and can take IPIs
+extern uint64_t cpu_online_mask;
+
+// Local APIC ID of each CPU index
+extern uint32_t cpu_apic_ids[MAX_CPUS];
+
+// Index of the CPU running this code. Only the boot CPU runs until the
+// application processors are brought up, so this is always 0 for now.
+static inline uint32_t cpu_id(void) {
+    return 0;
+}
+
+// 1 when RFLAGS.IF is set. Interrupt handlers run with it clear, shell commands with it set.
+static inline uint8_t interrupts_enabled(void) {
+    uint64_t flags;
+    asm volatile("pushfq\n\tpop %0" : "=r" (flags));
+    return (flags >> 9) & 1;
+}
+
+// Execute CPUID for the given leaf and subleaf
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx);
+
+// Query CPUID once and fill in cpu_features
+void cpu_detect_features(void);
+
+// Serialized time stamp counter read for cycle counting
+uint64_t read_tsc(void);
+
+#define MSR_EFER 0xC0000080
+#define EFER_NXE (1 << 11)      /* Enables the no-execute page bit */
+#define CR4_PGE (1 << 7)        /* Enables global pages */
+#define CR4_PCIDE (1 << 17)     /* Enables process-context identifiers in CR3[11:0] */
+
+uint64_t read_msr(uint32_t msr);
+void write_msr(uint32_t msr, uint64_t value);
+
+uint64_t read_cr2(void);
+uint64_t read_cr3(void);
+void write_cr3(uint64_t value);
+uint64_t read_cr4(void);
+void write_cr4(uint64_t value);
+
+#endif
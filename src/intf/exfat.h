@@ -0,0 +1,186 @@
+#ifndef EXFAT_H
+#define EXFAT_H
+#include <stdint.h>
+#include "blockdev.h"
+#include "fat_extent.h"
+
+#define EXFAT_SIGNATURE "EXFAT   "     /* FileSystemName of the boot sector */
+#define EXFAT_ENTRY_SIZE 32
+#define EXFAT_NAME_MAX 255              /* UTF-16 code units */
+#define EXFAT_NAME_PER_ENTRY 15         /* Code units in one File Name entry */
+#define EXFAT_UPCASE_ENTRIES 65536
+
+// Directory entry types, bit 7 is InUse
+#define EXFAT_TYPE_END 0x00
+#define EXFAT_TYPE_BITMAP 0x81
+#define EXFAT_TYPE_UPCASE 0x82
+#define EXFAT_TYPE_LABEL 0x83
+#define EXFAT_TYPE_FILE 0x85
+#define EXFAT_TYPE_STREAM 0xC0
+#define EXFAT_TYPE_NAME 0xC1
+#define EXFAT_IN_USE 0x80
+
+// Stream extension GeneralSecondaryFlags
+#define EXFAT_ALLOCATION_POSSIBLE 0x01
+#define EXFAT_NO_FAT_CHAIN 0x02         /* The clusters are contiguous, the FAT says nothing about them */
+
+#define EXFAT_ACTIVE_FAT 0x0001         /* VolumeFlags: the second FAT and bitmap are the current ones */
+#define EXFAT_VOLUME_DIRTY 0x0002       /* VolumeFlags: changes may not be complete on the disk */
+#define EXFAT_FAT_EOC 0xFFFFFFFF
+#define EXFAT_FIRST_CLUSTER 2
+
+#define EXFAT_ATTR_READ_ONLY 0x01
+#define EXFAT_ATTR_DIRECTORY 0x10
+#define EXFAT_ATTR_ARCHIVE 0x20
+
+typedef struct {
+    uint8_t jump[3];
+    char file_system_name[8];
+    uint8_t must_be_zero[53];
+    uint64_t partition_offset;
+    uint64_t volume_length;             // sectors
+    uint32_t fat_offset;                // sectors
+    uint32_t fat_length;
+    uint32_t cluster_heap_offset;
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+    uint32_t volume_serial;
+    uint16_t revision;
+    uint16_t volume_flags;
+    uint8_t bytes_per_sector_shift;
+    uint8_t sectors_per_cluster_shift;
+    uint8_t fat_count;
+    uint8_t drive_select;
+    uint8_t percent_in_use;
+    uint8_t reserved[7];
+} __attribute__((packed)) ExfatBootSector;
+
+// Entries are read as raw 32 byte records and viewed through these
+typedef struct {
+    uint8_t type;
+    uint8_t secondary_count;
+    uint16_t set_checksum;
+    uint16_t attributes;
+    uint16_t reserved1;
+    uint32_t create_time;
+    uint32_t modify_time;
+    uint32_t access_time;
+    uint8_t create_10ms;
+    uint8_t modify_10ms;
+    uint8_t create_utc;
+    uint8_t modify_utc;
+    uint8_t access_utc;
+    uint8_t reserved2[7];
+} __attribute__((packed)) ExfatFileEntry;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved1;
+    uint8_t name_length;
+    uint16_t name_hash;
+    uint16_t reserved2;
+    uint64_t valid_length;
+    uint32_t reserved3;
+    uint32_t first_cluster;
+    uint64_t data_length;
+} __attribute__((packed)) ExfatStreamEntry;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t name[EXFAT_NAME_PER_ENTRY];
+} __attribute__((packed)) ExfatNameEntry;
+
+// Allocation bitmap and up-case table entries
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t reserved[2];
+    uint32_t table_checksum;            // up-case table only
+    uint8_t reserved2[12];
+    uint32_t first_cluster;
+    uint64_t data_length;
+} __attribute__((packed)) ExfatTableEntry;
+
+// Where a file's clusters are. A NoFatChain file is one extent and a
+// fragmented one gets its whole chain mapped when it is opened, so reads
+// and writes inside the file never look at the FAT.
+typedef struct {
+    uint32_t first_cluster;             // 0 while nothing is allocated
+    uint32_t clusters;
+    uint8_t no_fat_chain;
+    Extent* extents;
+    uint32_t count;
+    uint32_t capacity;
+} ExfatChain;
+
+// An open file or directory
+typedef struct {
+    uint32_t dir_cluster;               // first cluster of the directory holding its entry set
+    uint32_t entry_index;               // File entry of its set, in entries from the directory start
+    uint8_t secondary_count;
+    uint16_t attributes;
+    uint64_t size;                      // DataLength
+    uint64_t valid_length;              // bytes past it read as zeros
+    ExfatChain chain;
+    uint8_t dirty;                      // the entry set is behind
+} ExfatFile;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hash_rejects;              // name hash matches whose names differed
+    uint64_t bitmap_writes;             // bitmap sectors written on sync
+    uint64_t contiguous_extends;        // files that grew and kept NoFatChain
+    uint64_t chain_conversions;         // NoFatChain files that had to get a FAT chain
+} ExfatStats;
+
+extern ExfatStats exfat_stats;
+
+// 1 when the sector is an exFAT boot sector
+uint8_t exfat_detect(void* sector);
+
+// Mount the exFAT volume on 'dev': loads the allocation bitmap and the up-case
+// table and indexes the root directory by name hash. A subdirectory is indexed
+// the first time it is opened into.
+uint8_t exfat_mount(BlockDev* dev);
+
+uint8_t exfat_mounted(void);
+
+// Open a file of the directory 'dir', the root when it is NULL. Names are
+// matched case-insensitively through the volume's up-case table. 'create'
+// makes a missing one as a regular file.
+uint8_t exfat_open(ExfatFile* dir, ExfatFile* file, char* name, uint8_t create);
+
+// Make an empty directory of one cluster in 'dir', 0 when the name exists
+uint8_t exfat_mkdir(ExfatFile* dir, char* name);
+
+// Read or write at 'offset', returns the bytes moved. Writes past the end
+// allocate clusters, contiguous ones while the file can stay NoFatChain.
+uint64_t exfat_readv(ExfatFile* file, uint64_t offset, IoVec* iov, uint32_t iov_count);
+uint64_t exfat_writev(ExfatFile* file, uint64_t offset, IoVec* iov, uint32_t iov_count);
+
+// Cut the file to 'size' bytes and free the clusters past it
+uint8_t exfat_truncate(ExfatFile* file, uint64_t size);
+
+// Write the entry set when it changed
+uint8_t exfat_file_sync(ExfatFile* file);
+
+void exfat_close(ExfatFile* file);
+
+// Delete a file or an empty directory of 'dir'
+uint8_t exfat_remove(ExfatFile* dir, char* name);
+
+// Free clusters, kept up to date with every allocation
+uint32_t exfat_free_clusters(void);
+
+// Bytes per sector of the mounted volume
+uint32_t exfat_sector_size(void);
+
+// Write the dirty bitmap sectors and cached sectors, then mark the volume
+// clean. It stays dirty while an open file has changes exfat_file_sync did not write.
+uint8_t exfat_sync(void);
+
+void exfat_print_stats(void);
+
+#endif
@@ -6,6 +6,8 @@
 #include "memory.h"
 #include "strings.h"
 #include "hdd.h"
+#include "kmalloc.h"
+#include "blockdev.h"
 
 typedef struct {
     // BPB (BIOS Parameter Block)
@@ -53,11 +55,24 @@ typedef struct {
     uint32_t total_clusters;
 } __attribute__((packed)) BootSector;
 
+// FSInfo sector (BootSector.fs_info_sector), keeps the free cluster count and a
+// hint where to look for the next free cluster
+typedef struct {
+    uint32_t lead_signature;
+    uint8_t reserved1[480];
+    uint32_t struct_signature;
+    uint32_t free_cluster_count;
+    uint32_t next_free_cluster;
+    uint8_t reserved2[12];
+    uint32_t trail_signature;
+} __attribute__((packed)) FsInfo;
+
 typedef struct {
     uint8_t filename[8];
     uint8_t ext[3];
     uint8_t attributes;
     uint8_t reserved;
+    uint8_t create_time_tenth;
     uint16_t create_time;
     uint16_t create_date;
     uint16_t last_access_date;
@@ -68,8 +83,33 @@ typedef struct {
     uint32_t file_size;
 } __attribute__((packed)) DirectoryEntry;
 
+// Outcome of one file of a batch
+#define FAT_BATCH_OK 0
+#define FAT_BATCH_INVALID 1         /* not an 8.3 name */
+#define FAT_BATCH_EXISTS 2          /* the name is taken, on the volume or earlier in the batch */
+#define FAT_BATCH_MISSING 3
+#define FAT_BATCH_NO_SPACE 4
+#define FAT_BATCH_FAILED 5          /* the device failed the write */
+#define FAT_BATCH_UNSUPPORTED 6     /* not a FAT volume, exFAT files go through the VFS */
+#define FAT_BATCH_IOV 64            /* Pieces gathered into one data write of create_files_batch */
+#define FAT_BATCH_ENTRY_SECTORS 2   /* Directory sectors adding one entry may change */
+
+typedef struct {
+    char* name;
+    void* data;                     // 'size' bytes of contents, unused when size is 0
+    uint32_t size;
+    uint8_t status;                 // FAT_BATCH_*, set by create_files_batch
+} FatBatchCreate;
+
+typedef struct {
+    char* name;
+    DirectoryEntry entry;           // filled when the file exists
+    uint8_t status;                 // FAT_BATCH_*, set by stat_dir_batch
+} FatBatchStat;
+
 typedef struct {
     char* file;
+    BlockDev* device;       // NULL when no device is named 'file'
     BootSector boot_sector;
     uint32_t fat_offset;
     uint32_t data_offset;
@@ -85,12 +125,20 @@ typedef enum {
 
 extern BootSector boot_sector;
 extern fat_type fatType;
+extern SlabCache* sector_cache;      // one object per sector of the mounted volume
+extern SlabCache* dir_entry_cache;   // DirectoryEntry copies
 typedef uint8_t bool;
 
+// Mount the volume on the block device named 'file' (the multiboot2 module name)
 void initialize_fat_file_system(FatFileSystem* fs, char* file);
 
+// Write the FAT cache to every FAT copy and the buffer cache to the disk
+uint8_t fat_sync(void);
+
 void read_boot_sector(BootSector* bs);
 
+// The root directory and batch helpers serve FAT volumes only, on exFAT they
+// fail and files are reached through sys_open and the VFS
 uint32_t find_directory_entry(DirectoryEntry* entry, char* filename);
 
 void update_directory_entry(DirectoryEntry* entry, char* filename, char* extension, uint8_t attributes, uint32_t first_cluster, uint32_t file_size);
@@ -105,4 +153,14 @@ void parse_filename(char* filename, char* name, char* ext);
 
 void create_file(char *filename, FatFileSystem* fs);
 
+// Create many files of the root directory at once. Room for every entry is
+// made up front and all their clusters come from one allocation, laid out
+// back to back so the contents go out in one request per run. Invalid and
+// taken names are skipped, any other failure takes back the whole batch.
+// Returns the files created, each one's status says what happened to it.
+uint32_t create_files_batch(FatBatchCreate* files, uint32_t count);
+
+// Look up many names of the root directory, returns how many exist
+uint32_t stat_dir_batch(FatBatchStat* files, uint32_t count);
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,58 @@
+#ifndef FAT_ALLOC_H
+#define FAT_ALLOC_H
+#include <stdint.h>
+#include "blockdev.h"
+#include "fat_32.h"
+
+// Requests of fewer clusters take the first run that fits after the cursor
+// (next-fit), bigger ones the smallest run that fits anywhere (best-fit)
+#define FAT_BEST_FIT_MIN 8
+#define FAT_RUN_GROUP_SHIFT 12          /* Clusters per group of the free run summary, as a power of two */
+#define FAT_RUN_GROUP_CLUSTERS (1u << FAT_RUN_GROUP_SHIFT)
+
+typedef struct {
+    uint64_t extents;           // runs handed out
+    uint64_t clusters;          // clusters handed out
+    uint64_t freed;             // clusters given back
+} FatAllocStats;
+
+// Build the free cluster bitmap from the FAT cache and read the FSInfo sector.
+// A free count in FSInfo that disagrees with the FAT is corrected on the next sync.
+uint8_t fat_alloc_init(BlockDev* dev, BootSector* bs);
+
+// Allocate a run of up to 'want' contiguous clusters, linked and terminated in
+// the FAT. Returns the first cluster and the run length in *length, or 0 when
+// the volume is full. The run is shorter than 'want' only when no free run is that long.
+uint32_t fat_alloc_extent(uint32_t want, uint32_t* length);
+
+// Allocate 'count' clusters in as few runs as possible as one chain, appended
+// to 'previous' unless it is 0. Returns the first new cluster, 0 when there is
+// not enough space (nothing is allocated then).
+uint32_t fat_alloc_chain(uint32_t count, uint32_t previous);
+
+// Free every cluster of the chain starting at 'first'
+void fat_free_chain(uint32_t first);
+
+// Clusters handed out by the allocator start unwritten: their sectors still
+// hold whatever was there before and a file reads them as zeros until it
+// writes them. The state lives in memory only, so a file has to write or
+// zero its unwritten clusters before a size covering them reaches the disk.
+//
+// Length of the run of clusters from 'cluster', at most 'max', that share its
+// state. *unwritten gets that state.
+uint32_t fat_unwritten_run(uint32_t cluster, uint32_t max, uint8_t* unwritten);
+
+// The clusters now hold real data (or zeros) on the device
+void fat_mark_written(uint32_t first, uint32_t count);
+
+uint32_t fat_free_clusters(void);
+
+// Number of clusters the volume has, valid cluster numbers are 2 .. count + 1
+uint32_t fat_cluster_count(void);
+
+// Put the free count and next free hint into the FSInfo sector (through the buffer cache)
+uint8_t fat_alloc_sync(void);
+
+void fat_alloc_print_stats(void);
+
+#endif
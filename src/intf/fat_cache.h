@@ -0,0 +1,75 @@
+#ifndef FAT_CACHE_H
+#define FAT_CACHE_H
+#include <stdint.h>
+#include "blockdev.h"
+#include "fat_32.h"
+
+#define FAT_CHUNK_SIZE 4096                             /* Bytes of FAT faulted in at once */
+#define FAT_CHUNK_ENTRIES (FAT_CHUNK_SIZE / 4)
+#define FAT_RESIDENT_MAX (8 * 1024 * 1024)              /* FATs up to this size are read whole at mount */
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF       /* The top 4 bits of a FAT32 entry are reserved */
+#define FAT_FLAGS_NO_MIRROR 0x80        /* BootSector.flags: only the active FAT is used */
+#define FAT_FLAGS_ACTIVE_MASK 0x0F
+
+typedef struct {
+    uint64_t chunk_faults;      // chunks read from the disk
+    uint64_t sectors_written;   // per FAT copy
+    uint64_t runs_written;      // coalesced writes, per FAT copy
+} FatCacheStats;
+
+// In memory copy of the FAT of the mounted volume. Small FATs are one directly
+// indexed array, big ones are faulted in FAT_CHUNK_SIZE bytes at a time.
+// Changed sectors are marked in 'dirty' and written to every FAT copy on sync.
+typedef struct {
+    BlockDev* dev;
+    uint32_t first_sector;      // first sector of FAT 0
+    uint32_t sectors_per_fat;
+    uint8_t fat_count;
+    uint8_t active_fat;         // FAT the entries are read from
+    uint8_t mirror;             // write every copy, not just the active one
+    uint8_t sector_shift;
+    uint32_t entry_count;
+    uint32_t* table;            // whole FAT when resident, NULL otherwise
+    uint32_t chunk_count;
+    uint32_t** chunks;          // NULL until faulted in
+    uint64_t* dirty;            // one bit per FAT sector
+    uint64_t* unlogged;         // dirty sectors not in the intent log yet, NULL without a log
+    uint32_t unlogged_count;
+    FatCacheStats stats;
+} FatCache;
+
+extern FatCache fat_cache;
+
+// Set up the cache for a volume, 1 on success and 0 when out of memory
+uint8_t fat_cache_init(BlockDev* dev, BootSector* bs);
+
+// Entry of 'cluster' with the reserved bits masked off, FAT32_EOF for clusters past the end
+uint32_t fat_cache_get(uint32_t cluster);
+
+// Change an entry, the reserved top bits on disk are kept
+void fat_cache_set(uint32_t cluster, uint32_t value);
+
+// FAT_CHUNK_ENTRIES entries starting at chunk * FAT_CHUNK_ENTRIES, faulted in
+// when needed. The last chunk may be shorter, entry_count bounds it.
+uint32_t* fat_cache_chunk(uint32_t chunk);
+
+// Write the dirty FAT sectors to every FAT copy, one write per run of adjacent
+// sectors. With an intent log, sectors that are not logged yet are kept back.
+uint8_t fat_cache_sync(void);
+
+// Route FAT changes through the intent log from now on
+uint8_t fat_cache_enable_log(void);
+
+// Up to 'max' FAT sectors (counted from the start of a FAT) changed since they were last logged
+uint32_t fat_cache_collect_unlogged(uint32_t* sectors, uint32_t max);
+
+// The sectors are in the log now
+void fat_cache_logged(uint32_t* sectors, uint32_t count);
+
+// Cached contents of a FAT sector
+void* fat_cache_sector(uint32_t sector);
+
+void fat_cache_print_stats(void);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef FAT_DIR_H
+#define FAT_DIR_H
+#include <stdint.h>
+#include "fat_32.h"
+#include "fat_extent.h"
+
+#define DIR_NAME_LENGTH 11          /* 8.3 name as stored on disk, space padded */
+#define DIR_ENTRY_SIZE 32
+#define DIR_ENTRY_SHIFT 5           /* log2(DIR_ENTRY_SIZE) */
+#define DIR_INDEX_MAX 8             /* Directories whose index is kept */
+#define DIR_HASH_INITIAL 64         /* Buckets of a new index, doubled as it fills */
+#define DIR_NEGATIVE_MAX 32         /* Recent failed lookups remembered */
+#define DIR_NO_SLOT 0xFFFFFFFF
+
+// Directory entry attributes
+#define ATTR_READ_ONLY 0x01
+#define ATTR_HIDDEN    0x02
+#define ATTR_SYSTEM    0x04
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE   0x20
+#define ATTR_LONG_NAME 0x0F
+
+#define DIR_ENTRY_END     0x00      /* filename[0]: this and every later slot is unused */
+#define DIR_ENTRY_DELETED 0xE5      /* filename[0]: unused slot */
+#define DIR_ENTRY_KANJI   0x05      /* filename[0]: stands for a name starting with 0xE5 */
+
+typedef struct {
+    uint8_t name[DIR_NAME_LENGTH];
+    uint32_t slot;                  // 32 byte slot of the entry in the directory
+    int32_t next;                   // next entry in the same bucket, -1 ends the chain
+} DirIndexEntry;
+
+// In memory index of one directory, built on first use by walking its whole
+// cluster chain. Names hash to their slots, free slots are kept on a stack.
+typedef struct {
+    uint32_t first_cluster;
+    ExtentMap extents;              // the directory's cluster chain
+    uint32_t slot_count;            // slots in the chain
+    uint32_t end_slot;              // first slot of the unused tail (DIR_ENTRY_END)
+    DirIndexEntry* entries;
+    uint32_t entry_count;           // used, including ones on the free list
+    uint32_t entry_capacity;
+    int32_t free_entry;             // removed entries chained through next
+    int32_t* buckets;
+    uint32_t bucket_count;          // power of two
+    uint32_t live;                  // names in the index
+    uint32_t* free_slots;           // deleted slots before end_slot
+    uint32_t free_slot_count;
+    uint32_t free_slot_capacity;
+    uint64_t last_used;
+} DirIndex;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t negative_hits;         // misses answered by the negative cache
+    uint64_t builds;                // directories walked to build an index
+    uint64_t slots_scanned;
+} DirStats;
+
+extern DirStats dir_stats;
+
+// Turn "test.txt" into "TEST    TXT", 0 when it is not a valid 8.3 name
+uint8_t fat_name_normalize(char* filename, uint8_t* name);
+
+// Cluster of the root directory of the mounted volume
+uint32_t root_directory_cluster(void);
+
+// Index of the directory starting at 'cluster', built when it is not cached. NULL when out of memory.
+DirIndex* dir_index_get(uint32_t cluster);
+
+// Find 'filename' in a directory. Copies the entry and its slot when the
+// pointers are not NULL, returns 0 when there is no such file.
+uint8_t dir_lookup(uint32_t dir_cluster, char* filename, DirectoryEntry* entry, uint32_t* slot);
+
+// Same as dir_lookup for a name that is already normalized
+uint8_t dir_find(uint32_t dir_cluster, uint8_t* name, DirectoryEntry* entry, uint32_t* slot);
+
+// Store a new entry (its name normalized) in a free slot, the directory grows
+// by a cluster when it is full. 0 when the volume is full.
+uint8_t dir_add_entry(uint32_t dir_cluster, DirectoryEntry* entry, uint32_t* slot);
+
+// Make sure 'count' more entries fit without growing the directory one
+// cluster at a time, for callers about to add many. 0 when the volume is full.
+uint8_t dir_reserve(uint32_t dir_cluster, uint32_t count);
+
+// Rewrite the entry in 'slot', a changed name is re-indexed
+uint8_t dir_write_entry(uint32_t dir_cluster, uint32_t slot, DirectoryEntry* entry);
+
+// Mark the entry in 'slot' deleted and hand the slot to the free list
+uint8_t dir_remove_entry(uint32_t dir_cluster, uint32_t slot);
+
+// Sector and byte offset of a slot, 0 past the end of the directory
+uint8_t dir_slot_location(DirIndex* index, uint32_t slot, uint32_t* sector, uint32_t* offset);
+
+// Forget every index and negative entry, for a volume that is unmounted or changed behind our back
+void dir_index_drop_all(void);
+
+void dir_print_stats(void);
+
+#endif
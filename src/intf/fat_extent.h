@@ -0,0 +1,50 @@
+#ifndef FAT_EXTENT_H
+#define FAT_EXTENT_H
+#include <stdint.h>
+
+#define EXTENT_MAP_INITIAL 8    /* Extents allocated with the first one */
+
+// A run of clusters that are contiguous both in the file and on disk
+typedef struct {
+    uint32_t file_cluster;      // index of the run's first cluster within the file
+    uint32_t disk_cluster;
+    uint32_t length;
+} Extent;
+
+// Extents of one cluster chain sorted by file_cluster. The map is built lazily:
+// a lookup past the mapped part walks the FAT from the last mapped cluster.
+typedef struct {
+    uint32_t first_cluster;     // 0 for an empty file
+    Extent* extents;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t mapped;            // file clusters covered by the extents
+    uint8_t complete;           // the end of the chain has been seen
+} ExtentMap;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t links_walked;      // FAT entries read to grow maps
+} ExtentStats;
+
+extern ExtentStats extent_stats;
+
+void extent_map_init(ExtentMap* map, uint32_t first_cluster);
+
+// Disk cluster holding file cluster 'index' or 0 past the end of the chain.
+// *run gets the number of clusters from there that follow on disk (at least 1).
+uint32_t extent_map_lookup(ExtentMap* map, uint32_t index, uint32_t* run);
+
+// Clusters in the chain, walks the rest of it when the end has not been seen
+uint32_t extent_map_length(ExtentMap* map);
+
+// The chain grew at its end (or got its first cluster), the next lookup past
+// the mapped part walks on from the last mapped cluster
+void extent_map_extended(ExtentMap* map, uint32_t first_cluster);
+
+// The chain was cut to 'clusters' clusters, extents past that are dropped
+void extent_map_truncate(ExtentMap* map, uint32_t clusters);
+
+void extent_map_free(ExtentMap* map);
+
+#endif
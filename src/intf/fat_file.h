@@ -0,0 +1,91 @@
+#ifndef FAT_FILE_H
+#define FAT_FILE_H
+#include <stdint.h>
+#include "fat_32.h"
+#include "fat_extent.h"
+
+#define READAHEAD_MIN 8             /* Sectors of the first window and after a random read */
+#define READAHEAD_MAX 64            /* Largest window in sectors, a quarter of the buffer cache */
+
+// Sequential access detection of one open file. Each read that starts where
+// the last one ended doubles the window, any other read shrinks it back.
+typedef struct {
+    uint32_t next_offset;       // where a sequential read would start
+    uint32_t window;            // sectors to keep read ahead of the reader
+    uint32_t ahead_end;         // file offset the readahead has reached
+} Readahead;
+
+// The hit and wasted counts are kept by the buffer cache, see BcacheStats
+typedef struct {
+    uint64_t sequential;        // reads that continued the previous one
+    uint64_t random;            // reads that reset the window
+    uint64_t misses;            // sectors reads had to wait for the device
+} ReadaheadStats;
+
+extern ReadaheadStats readahead_stats;
+
+typedef struct {
+    uint64_t zero_reads;        // bytes of unwritten clusters read without the device
+    uint64_t zeroed;            // bytes of unwritten clusters written as zeros
+    uint64_t skipped;           // bytes of gaps left to unwritten clusters instead of zeroed
+} ZeroStats;
+
+extern ZeroStats zero_stats;
+
+// An open file of the mounted volume
+typedef struct {
+    DirectoryEntry entry;       // copy of the directory entry it was opened from
+    uint32_t size;
+    uint32_t cluster_size;      // bytes
+    ExtentMap extents;          // where each cluster of the file is on disk
+    Readahead readahead;
+    uint32_t cached_pages;      // pages of it in the page cache
+} FatFile;
+
+// Open the file named 'filename', 1 on success and 0 when it does not exist
+uint8_t fat_file_open(FatFile* file, char* filename);
+
+// Set up 'file' from a directory entry that was already looked up
+void fat_file_init(FatFile* file, DirectoryEntry* entry);
+
+// Scatter-gather I/O at 'offset', returns the bytes moved. The range is cut
+// into runs of clusters that are contiguous on disk, found with one extent
+// lookup each. A run is one device request for its whole sectors, only a head
+// or tail that does not fill a sector goes through the buffer cache. Sectors
+// already in the cache, read ahead or not, are copied from there. Sequential
+// reads then prefetch the next window of the file into the cache.
+uint32_t fat_file_readv(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count);
+
+// fat_file_readv without the buffer cache for O_DIRECT: whole sectors always
+// come from the device and nothing is read ahead. A head or tail that does not
+// fill a sector, only possible at the end of the file, still goes through the cache.
+uint32_t fat_file_readv_direct(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count);
+
+// Writes past the end of the chain allocate clusters, a gap after the old end is zeroed.
+// New clusters are left unwritten (see fat_alloc.h), a write zeros only the parts
+// of one that it does not cover and that are inside the file.
+// The new size is kept in 'file', writing the directory entry is up to the caller.
+uint32_t fat_file_writev(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count);
+
+// Grow the file to 'size' bytes that read as zeros past the old end, the
+// clusters are allocated now so a full volume shows here. Smaller sizes do nothing.
+uint8_t fat_file_extend(FatFile* file, uint32_t size);
+
+// Zero the unwritten clusters below the end of the file on the device. Has to
+// run before a directory entry with the file's size is written.
+void fat_file_settle(FatFile* file);
+
+// Cut the file to 'size' bytes and free the clusters past it, the caller writes the directory entry
+uint8_t fat_file_truncate(FatFile* file, uint32_t size);
+
+// Single buffer versions of the above
+uint32_t fat_file_read(FatFile* file, uint32_t offset, char* buffer, uint32_t count);
+uint32_t fat_file_write(FatFile* file, uint32_t offset, char* buffer, uint32_t count);
+
+void fat_file_close(FatFile* file);
+
+// Print the readahead policy counters next to the buffer cache's hit and wasted
+// counts, and what unwritten clusters saved
+void fat_file_print_stats(void);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef FAT_GEOMETRY_H
+#define FAT_GEOMETRY_H
+#include <stdint.h>
+#include "fat_32.h"
+
+// The layout most volumes have, its address math is compiled with constant shifts
+#define FAT_COMMON_SECTOR_SHIFT 9       /* 512 byte sectors */
+#define FAT_COMMON_CLUSTER_SHIFT 12     /* 4 KiB clusters */
+#define FAT_ENTRY_SHIFT 2               /* log2(FAT_ENTRY_SIZE) */
+
+// Layout of the mounted FAT volume, worked out once from the BPB at mount and
+// left alone until the next one. Sector and cluster sizes are powers of two,
+// so every conversion between bytes, sectors, clusters and FAT entries is a
+// shift or a mask.
+typedef struct {
+    uint32_t bytes_per_sector;
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_size;              // bytes
+    uint8_t sector_shift;               // log2(bytes_per_sector)
+    uint8_t cluster_shift;              // log2(cluster_size)
+    uint8_t cluster_sector_shift;       // log2(sectors_per_cluster)
+    uint8_t common;                     // the layout is FAT_COMMON_SECTOR_SHIFT and FAT_COMMON_CLUSTER_SHIFT
+    uint8_t fat_count;
+    uint32_t fat_start;                 // first sector of FAT 0
+    uint32_t sectors_per_fat;
+    uint32_t root_dir_sectors;          // fixed root directory, 0 on FAT32
+    uint32_t data_start;                // first sector of cluster 2
+    uint32_t total_sectors;
+    uint32_t cluster_count;             // valid clusters are 2 .. cluster_count + 1
+} FatGeometry;
+
+extern FatGeometry fat_geometry;
+
+// Work out the geometry of the volume 'bs' describes. 0 when its sizes are not
+// powers of two or its regions do not fit in the volume, nothing is mounted then.
+uint8_t fat_geometry_init(BootSector* bs);
+
+static inline uint32_t fat_sector_shift(void) {
+    return __builtin_expect(fat_geometry.common, 1) ? FAT_COMMON_SECTOR_SHIFT : fat_geometry.sector_shift;
+}
+
+static inline uint32_t fat_cluster_shift(void) {
+    return __builtin_expect(fat_geometry.common, 1) ? FAT_COMMON_CLUSTER_SHIFT : fat_geometry.cluster_shift;
+}
+
+static inline uint32_t fat_sector_mask(void) {
+    return (1u << fat_sector_shift()) - 1;
+}
+
+static inline uint32_t fat_cluster_mask(void) {
+    return (1u << fat_cluster_shift()) - 1;
+}
+
+// First sector of a data cluster
+static inline uint32_t cluster_to_sector(uint32_t cluster) {
+    return fat_geometry.data_start + ((cluster - 2) << (fat_cluster_shift() - fat_sector_shift()));
+}
+
+// Sector holding the entry of 'cluster', counted from the start of a FAT, and the entry's byte offset in it
+static inline uint32_t fat_entry_sector(uint32_t cluster) {
+    return cluster >> (fat_sector_shift() - FAT_ENTRY_SHIFT);
+}
+
+static inline uint32_t fat_entry_offset(uint32_t cluster) {
+    return (cluster << FAT_ENTRY_SHIFT) & fat_sector_mask();
+}
+
+#endif
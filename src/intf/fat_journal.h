@@ -0,0 +1,105 @@
+#ifndef FAT_JOURNAL_H
+#define FAT_JOURNAL_H
+#include <stdint.h>
+#include "fat_32.h"
+#include "bcache.h"
+
+#define JOURNAL_MAGIC 0x4C4E524A        /* "JRNL" */
+#define JOURNAL_NAME "journal.sys"
+#define JOURNAL_SECTORS 2048            /* Smallest log, sector 0 of it is the log header */
+#define JOURNAL_SECTORS_MAX 131072      /* Largest log, a volume whose FAT needs more goes without one */
+#define JOURNAL_COMMIT_RECORDS 64       /* Sectors waiting for the log that force a commit */
+#define JOURNAL_BUFFER_LIMIT (BCACHE_BUFFERS / 2)   /* Cached sectors one transaction may hold */
+
+// The log holds every FAT sector plus JOURNAL_BUFFER_LIMIT cached sectors in
+// one transaction, so whatever an operation changes commits as a whole.
+
+// Where the log lives. Kept in BootSector.reserved so a mount can replay the
+// log before it reads the FAT. The log's clusters belong to a hidden system
+// file in the root directory, so other FAT drivers leave them alone.
+typedef struct {
+    uint32_t magic;
+    uint32_t first_sector;
+    uint32_t sector_count;
+} __attribute__((packed)) JournalLocation;
+
+// Sector 0 of the log. A checkpoint bumps the epoch, which retires every
+// transaction in the log at once.
+typedef struct {
+    uint32_t magic;
+    uint32_t epoch;
+} __attribute__((packed)) JournalHeader;
+
+// Home of one logged sector. FAT sectors are written to every mirrored copy.
+typedef struct {
+    uint32_t sector;
+    uint16_t copies;
+    uint16_t reserved;
+    uint32_t stride;                    // sectors between copies
+} __attribute__((packed)) JournalRecord;
+
+// Start of a transaction: its records fill as many sectors as they need and
+// the logged sector images follow, all written with one request. The checksum
+// covers the descriptor (with checksum 0) and the images, a torn write fails it.
+typedef struct {
+    uint32_t magic;
+    uint32_t epoch;
+    uint32_t sequence;                  // 0, 1, 2 ... since the last checkpoint
+    uint32_t record_count;
+    uint32_t checksum;
+    JournalRecord records[];
+} __attribute__((packed)) JournalDescriptor;
+
+typedef struct {
+    uint64_t commits;
+    uint64_t sectors_logged;
+    uint64_t checkpoints;
+    uint64_t home_writes;               // sectors written home by checkpoints
+    uint64_t replayed;                  // transactions replayed at mount
+} JournalStats;
+
+extern JournalStats journal_stats;
+
+// Replay the committed transactions of the volume's log, if it has one. Runs
+// before anything reads the FAT or directories of the volume.
+uint8_t journal_replay(BlockDev* dev, BootSector* bs);
+
+// Start logging metadata. Creates the log file on a volume that has none or
+// whose log is too small for its FAT. Needs the FAT cache, the allocator and
+// the global boot_sector.
+uint8_t journal_open(BlockDev* dev);
+
+// Stop logging, called when another volume is mounted. Nothing is written,
+// the old volume has to be synced before.
+void journal_close(void);
+
+// 1 while metadata goes through the log
+uint8_t journal_active(void);
+
+// Mark a metadata buffer dirty, through the log when there is one. Called
+// before the buffer is changed: buffers waiting for the log cannot be evicted,
+// so 0 when the transaction already holds JOURNAL_BUFFER_LIMIT of them and
+// the operation has to fail.
+uint8_t journal_mark_dirty(Buffer* buf);
+
+// Cached sectors the transaction can still take, no limit without a log
+uint32_t journal_room(void);
+
+// Commit first when fewer than 'buffers' cached sectors fit the transaction,
+// called between operations. 0 when they do not fit even then.
+uint8_t journal_reserve(uint32_t buffers);
+
+// Write every metadata change made since the last commit to the log as one
+// transaction. The changes are durable when it returns 1, on 0 they stay
+// waiting and nothing of them reached the disk.
+uint8_t journal_commit(void);
+
+// Commit when enough metadata is waiting, called at the end of operations
+void journal_maybe_commit(void);
+
+// Commit, write every logged sector home and empty the log
+uint8_t journal_checkpoint(void);
+
+void journal_print_stats(void);
+
+#endif
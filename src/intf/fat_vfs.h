@@ -0,0 +1,30 @@
+#ifndef FAT_VFS_H
+#define FAT_VFS_H
+#include <stdint.h>
+#include "vfs.h"
+#include "fat_file.h"
+#include "exfat.h"
+
+// The mounted FAT32 or exFAT volume as a VFS backend. An inode is keyed by
+// where its directory entry is, so every descriptor and mapping of a file
+// shares one node and sees the same size, cluster chain and cached pages.
+// The extent map caches where each cluster of the file lives, the name is
+// never resolved again.
+typedef struct {
+    uint32_t dir_cluster;           // first cluster of the directory holding its entry
+    uint32_t slot;                  // the entry's slot in that directory, on exFAT its entry index
+    uint8_t entry_dirty;            // size or first cluster changed since the entry was written
+    FatFile file;
+    ExfatFile exfat;
+} FatNode;
+
+extern FsOps fat_fs_ops;
+extern FsOps exfat_fs_ops;
+
+// Mount the volume initialize_fat_file_system just set up at "/"
+uint8_t fat_vfs_mount(void);
+
+// The FAT32 file behind an inode, NULL for directories and other filesystems
+FatFile* fat_vfs_file(Inode* inode);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef FD_H
+#define FD_H
+#include <stdint.h>
+#include "vfs.h"
+
+#define FD_MAX 32                   /* Open descriptors */
+
+typedef struct {
+    Inode* inode;                   // NULL when the descriptor is free, holds a reference
+    uint32_t flags;                 // O_* flags it was opened with
+    uint64_t position;              // past 4 GiB only where the filesystem allows it
+} FileDescriptor;
+
+typedef struct {
+    uint64_t opens;
+    uint64_t direct_reads;          // reads that bypassed the buffer cache
+    uint64_t direct_writes;         // writes that bypassed the page cache
+    uint64_t sync_writes;           // writes made durable before returning
+} FdStats;
+
+extern FdStats fd_stats;
+
+// Open a file through the VFS and return its descriptor, -1 on failure.
+// O_CREAT creates a missing file, O_TRUNC empties it when opened for writing.
+// Directories cannot be opened.
+int32_t sys_open(char* path, uint32_t flags);
+
+// Read or write at the descriptor's position and move it, -1 on failure.
+// FAT32 reads go through the page cache and writes update the pages it holds,
+// tmpfs files are their pages.
+// O_APPEND writes go to the end of the file. O_DIRECT transfers whose position
+// and length are whole sectors skip the buffer and page caches. O_SYNC writes return once
+// the data, the FAT and the directory entry are on the device.
+int64_t sys_read(int32_t fd, void* buffer, uint32_t count);
+int64_t sys_write(int32_t fd, void* buffer, uint32_t count);
+
+// Move the position, whence is SEEK_SET, SEEK_CUR or SEEK_END. Returns the new
+// position or -1. Writing past the end fills the gap with zeros.
+int64_t sys_lseek(int32_t fd, int64_t offset, uint32_t whence);
+
+// Write the dirty cached pages, the directory entry and every dirty FAT and data sector to the device, 0 or -1.
+// A tmpfs file has nowhere to go and is always in sync.
+int32_t sys_fsync(int32_t fd);
+
+// Shrink the file to 'size' bytes and free what lies past it, a size at or
+// past the end leaves the file as it is. 0 or -1
+int32_t sys_ftruncate(int32_t fd, uint64_t size);
+
+// Release the descriptor, the inode is released when the last reference goes. 0 or -1
+int32_t sys_close(int32_t fd);
+
+// Create a directory or remove a file or an empty directory, 0 or -1
+int32_t sys_mkdir(char* path);
+int32_t sys_unlink(char* path);
+
+// Inode behind an open descriptor with one more reference on it, for mappings
+// that outlive the descriptor. 'flags' gets the O_* flags. NULL when fd is not open.
+Inode* fd_inode_get(int32_t fd, uint32_t* flags);
+
+void fd_print_stats(void);
+
+#endif
@@ -2,12 +2,35 @@
 #define HDD_H
 #include <stdint.h>
 #include "fat_32.h"
+#include "blockdev.h"
 
-void write_sector(uint32_t sector_number, char* buffer, uint32_t sector_size);
+// Device the mounted volume lives on
+extern BlockDev* disk_device;
+
+// Write 'size' bytes starting at 'sector_number' into the buffer cache,
+// a partial last sector keeps the rest of its bytes. 0 when the cache could
+// not take a sector, the sectors before it are written.
+uint8_t write_sector(uint32_t sector_number, char* buffer, uint32_t size);
+
+// Same as write_sector but starting 'offset' bytes into the sector, the offset may span sectors
+uint8_t write_at(uint32_t sector_number, uint32_t offset, char* buffer, uint32_t size);
+
+// One request for consecutive sectors to or from the pieces of 'iov', whose
+// total is a multiple of the sector size. The buffer cache is kept coherent.
+uint8_t readv_sectors(uint32_t sector_number, IoVec* iov, uint32_t iov_count);
+uint8_t writev_sectors(uint32_t sector_number, IoVec* iov, uint32_t iov_count);
+
+// A page of zeros shared by everything that writes zeros, never written to
+char* zero_page(void);
 
 void write_cluster(uint32_t cluster, char* buffer, uint32_t buffer_size);
 
-void read_sector(uint32_t sector_number, char* buffer, uint32_t sector_size);
+// Read 'size' bytes starting at 'sector_number' through the buffer cache.
+// 0 on a read error or a full cache, the bytes not read are zeroed.
+uint8_t read_sector(uint32_t sector_number, char* buffer, uint32_t size);
+
+// Same as read_sector but starting 'offset' bytes into the sector, the offset may span sectors
+uint8_t read_at(uint32_t sector_number, uint32_t offset, char* buffer, uint32_t size);
 
 void read_cluster(uint32_t cluster, char* buffer, uint32_t buffer_size);
 
@@ -0,0 +1,11 @@
+#ifndef HOST_H
+#define HOST_H
+#include <stdint.h>
+
+// Hosted build only: the kernel services the filesystem code calls, backed by
+// libc so the code runs as a Linux program. Console output goes to stderr.
+
+// Turn the console on or off, mount prints a page of geometry otherwise
+void host_console(uint8_t enabled);
+
+#endif
@@ -12,7 +12,18 @@ struct IDT_entry {
   uint32_t zero;       // Reserved, set to zero
 };
 
+#define IRQ_BASE_VECTOR 32              /* IRQ n of the remapped PICs is vector 32 + n */
+#define PAGE_FAULT_VECTOR 14            /* #PF, the CPU pushes an error code */
+#define IRQ1_VECTOR 33                  /* Keyboard, PIC master is remapped to 0x20 */
+#define IRQ14_VECTOR 46                 /* Primary ATA channel, PIC slave is remapped to 0x28 */
+#define IRQ15_VECTOR 47                 /* Secondary ATA channel */
+#define AHCI_MSI_VECTOR 0x50            /* AHCI controller signalling by MSI */
+#define TLB_SHOOTDOWN_VECTOR 0xFD       /* Inter-processor TLB invalidation */
+
 void idt_init(void);
+
+// Point an IDT vector at an interrupt stub
+void idt_set_gate(uint8_t vector, void (*handler)(void));
 void remapPIC(void);
 
 #endif
\ No newline at end of file
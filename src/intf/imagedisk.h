@@ -0,0 +1,27 @@
+#ifndef IMAGEDISK_H
+#define IMAGEDISK_H
+#include <stdint.h>
+#include "blockdev.h"
+
+#define IMAGEDISK_SECTOR_SIZE 512
+
+// Hosted build only: disk images mapped into a Linux process, the stand-in
+// for the RAM disk the kernel gets from the multiboot2 module.
+
+// Map the image file at 'path' and register it as 'name'. With 'shared' unset
+// the mapping is private, writes never reach the file. NULL on failure.
+BlockDev* imagedisk_open(char* path, char* name, uint8_t shared);
+
+// Register a zero filled anonymous image of 'bytes' bytes, pages are only
+// backed by memory once they are written
+BlockDev* imagedisk_create(char* name, uint64_t bytes);
+
+// Start of the mapping, for tools that lay out a volume themselves
+uint8_t* imagedisk_base(BlockDev* dev);
+
+// Crash tests: once a write reaches 'sector' every later write fails, as if
+// the power went right after it. imagedisk_power_on takes writes back.
+void imagedisk_cut_after(BlockDev* dev, uint64_t sector);
+void imagedisk_power_on(BlockDev* dev);
+
+#endif
@@ -6,4 +6,7 @@
 
 void set_mask_IRQ();
 
+// Let an ISA IRQ through the PICs, a slave line also opens the cascade on IRQ2
+void clear_mask_IRQ(uint8_t irq);
+
 #endif
\ No newline at end of file
@@ -1,7 +1,17 @@
 #ifndef KEYBOARD_H
 #define KEYBOARD_H
 #pragma once
+#include <stdint.h>
+
+#define KEYBOARD_LINE_MAX 256           /* key_buffer_index is a uint8_t, a line never gets longer */
 
 void keyboard_handler(void);
 
+// 1 while a line ended by Enter waits for keyboard_run_command
+uint8_t keyboard_command_pending(void);
+
+// Run the queued line, if any, and print the next prompt. Called from the
+// idle loop so commands run with interrupts on.
+void keyboard_run_command(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+#include "spinlock.h"
+
+#define MAGAZINE_SIZE 14            /* Objects per magazine, keeps a Magazine at 128 bytes */
+#define KMALLOC_MIN_SHIFT 4         /* Smallest size class is 16 bytes */
+#define KMALLOC_MAX_SHIFT 11        /* Largest size class is 2 KiB, bigger requests take whole pages */
+#define SLAB_CACHE_NAME_LENGTH 16
+
+#define SLAB_NO_MAGAZINES 0x01      /* Every alloc/free goes straight to the slab lists */
+
+// A slab is a naturally aligned buddy block whose first bytes hold this header,
+// followed by the objects. Free objects are chained through their first word.
+typedef struct Slab {
+    struct Slab* next;
+    struct Slab* prev;
+    struct SlabCache* cache;
+    void* free_objects;
+    uint32_t in_use;
+} Slab;
+
+// A stack of free objects owned by one CPU, swapped whole with the depot
+typedef struct Magazine {
+    struct Magazine* next;
+    uint64_t count;
+    void* objects[MAGAZINE_SIZE];
+} Magazine;
+
+// Per-CPU front end: alloc/free only touch these two magazines and the
+// counters next to them, so the common case needs no lock at all
+typedef struct {
+    Magazine* loaded;
+    Magazine* previous;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t magazine_hits;     // allocs served without touching the slab lists
+} CpuCache;
+
+typedef struct {
+    uint64_t allocs;            // objects handed out
+    uint64_t frees;             // objects given back
+    uint64_t magazine_hits;     // allocs served from a per-CPU magazine
+    uint64_t depot_swaps;       // magazine exchanges with the depot
+    uint64_t slab_allocs;       // objects taken from the slab lists under the lock
+    uint64_t slabs;             // slabs currently owned by the cache
+    uint64_t objects_in_use;    // objects not sitting on a slab free list (includes magazines)
+    uint64_t objects_total;     // capacity of all slabs
+} SlabStats;
+
+typedef struct SlabCache {
+    char name[SLAB_CACHE_NAME_LENGTH];
+    size_t object_size;         // rounded up to the alignment
+    uint32_t object_offset;     // first object follows the Slab header
+    uint32_t objects_per_slab;
+    uint8_t slab_order;         // slab size is PAGE_SIZE << slab_order
+    uint8_t flags;
+
+    Spinlock lock;              // protects the slab lists, the depot and the stats below
+    Slab* partial;
+    Slab* full;
+    Slab* empty;
+    Magazine* depot_full;
+    Magazine* depot_empty;
+    uint64_t depot_swaps;
+    uint64_t slab_allocs;
+    uint64_t slabs;
+    uint64_t objects_in_use;
+
+    CpuCache cpu[MAX_CPUS];
+    struct SlabCache* next_cache;
+} SlabCache;
+
+// Set up the size classes, needs pmm_init to have run
+void kmalloc_init(void);
+
+// Create a cache of objects of a fixed size, for example sector buffers or DirectoryEntry
+SlabCache* kmem_cache_create(char* name, size_t object_size, size_t align, uint8_t flags);
+
+void* kmem_cache_alloc(SlabCache* cache);
+
+void kmem_cache_free(SlabCache* cache, void* object);
+
+// Sum the per-CPU and slab layer counters of a cache
+void kmem_cache_stats(SlabCache* cache, SlabStats* stats);
+
+// Give empty slabs and the depot's spare magazines back to the page allocator
+void kmem_cache_shrink(SlabCache* cache);
+
+// General purpose allocation, power of two classes from 16 bytes to 2 KiB, whole pages above
+void* kmalloc(size_t size);
+
+// Same as kmalloc but the memory is zeroed
+void* kzalloc(size_t size);
+
+void kfree(void* ptr);
+
+// Print every cache with its object usage and the space lost to fragmentation
+void kmalloc_print_stats(void);
+
+#endif
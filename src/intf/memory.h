@@ -1,11 +1,34 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 #include <stddef.h>
+#include <stdint.h>
 
-//
+// Copy count bytes from src to dest, the regions must not overlap
 void memCpy(void *dest, void *src, size_t count);
 
-//
+// Fill count bytes at dest with value
 void memSet(void *dest, char value, size_t count);
 
-#endif
\ No newline at end of file
+// Same as memSet but always with non-temporal stores, for memory that will
+// not be read soon such as the pre-zeroed page pool
+void memSetStream(void *dest, char value, size_t count);
+
+// Copy count bytes from src to dest, the regions may overlap
+void memMove(void *dest, void *src, size_t count);
+
+// Compare count bytes, returns <0, 0 or >0 like the C library memcmp
+int memCmp(void *ptr1, void *ptr2, size_t count);
+
+// Pick the copy and fill kernels for this CPU, called once after cpu_detect_features()
+void memory_init(void);
+
+// Print the cycles each copy kernel takes for sizes from 32 B to 1 MiB
+void memory_benchmark(void);
+
+// Copies of at least this many bytes use rep movsb when the CPU has ERMS
+extern size_t mem_rep_threshold;
+
+// Copies and fills of at least this many bytes use non-temporal stores
+extern size_t mem_nt_threshold;
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef MMAP_H
+#define MMAP_H
+#include <stdint.h>
+#include "fd.h"
+#include "pcache.h"
+
+#define MMAP_MAX 16                 /* Mappings that can exist at once */
+#define MMAP_PINNED_MAX (PCACHE_PAGES / 2)  /* Page cache pages all mappings together may pin */
+#define MMAP_TEST_FILE "mmap.tst"   /* Scratch file of mmap_selftest, removed afterwards */
+#define MMAP_TEST_SIZE (3 * PAGE_SIZE + 512)  /* Whole sectors, the last page only partly in the file */
+
+// Page fault error code bits
+#define PF_PRESENT 0x01             /* the page was mapped, the access broke its protection */
+#define PF_WRITE   0x02
+
+// A file mapped into the kernel half. sys_mmap reads the file's pages into the
+// page cache and pins them, the page fault handler only puts them in the page
+// tables and never waits for the device. The first touch of a page maps it
+// read only until the first store, which marks the cached page dirty and makes it writable.
+typedef struct {
+    uint64_t start;                 // 0 while the slot is free
+    uint64_t length;                // bytes, whole pages
+    Inode* inode;                   // the mapping holds a reference on it
+    FatFile* file;                  // the inode's file, whose cached pages are mapped
+    uint32_t first_page;            // file page mapped at 'start'
+    CachedPage** pages;             // pinned page of each page of the mapping, NULL past the end of the file
+    uint32_t prot;                  // PROT_* bits
+} Mapping;
+
+typedef struct {
+    uint64_t maps;
+    uint64_t faults;                // pages faulted in
+    uint64_t write_faults;          // stores that made a clean page dirty
+} MmapStats;
+
+extern MmapStats mmap_stats;
+
+// Hook the page fault vector
+void mmap_init(void);
+
+// Map 'length' bytes of the FAT32 file behind 'fd' from 'offset' on, which has
+// to be page aligned. Only MAP_SHARED is supported, stores reach the file, and
+// the address is always picked by the kernel, 'addr' is ignored. PROT_WRITE
+// needs a descriptor opened O_RDWR. The mapping keeps the file open after the
+// descriptor is closed. The pages of the file it covers are read in here and
+// stay pinned, at most MMAP_PINNED_MAX across all mappings. Returns MAP_FAILED on failure.
+void* sys_mmap(void* addr, uint64_t length, uint32_t prot, uint32_t flags, int32_t fd, uint64_t offset);
+
+// Write the pages of [addr, addr + length) that were stored to back to the
+// file. MS_SYNC also waits for the device, MS_ASYNC and MS_INVALIDATE have
+// nothing more to do since the mapping is the cached page itself. 0 or -1.
+int32_t sys_msync(void* addr, uint64_t length, uint32_t flags);
+
+// Remove a whole mapping returned by sys_mmap and unpin its pages, the dirty
+// ones stay in the page cache until they are written back. 0 or -1.
+int32_t sys_munmap(void* addr, uint64_t length);
+
+// Called by the page cache: take the page out of every mapping, or only take
+// away write access so the next store faults
+void mmap_unmap_page(CachedPage* page);
+void mmap_protect_page(CachedPage* page);
+
+// C side of the #PF stub. A fault outside a mapping, or on a page of it that
+// is not in the page cache, halts the machine.
+void page_fault_handler(uint64_t error_code);
+
+// Map a scratch file, store a pattern through the mapping, msync and unmap it,
+// then read the file back with read() and with O_DIRECT from the device and
+// print whether both match
+void mmap_selftest(void);
+
+void mmap_print_stats(void);
+
+#endif
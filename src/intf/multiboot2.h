@@ -0,0 +1,69 @@
+#ifndef MULTIBOOT2_H
+#define MULTIBOOT2_H
+#include <stdint.h>
+
+#define MULTIBOOT_TAG_TYPE_END      0
+#define MULTIBOOT_TAG_TYPE_CMDLINE  1
+#define MULTIBOOT_TAG_TYPE_MODULE   3
+#define MULTIBOOT_TAG_TYPE_MMAP     6
+
+#define MULTIBOOT_MEMORY_AVAILABLE          1
+#define MULTIBOOT_MEMORY_RESERVED           2
+#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE   3
+#define MULTIBOOT_MEMORY_NVS                4
+#define MULTIBOOT_MEMORY_BADRAM             5
+
+// Fixed header of the boot information GRUB passes in EBX
+typedef struct {
+    uint32_t total_size;
+    uint32_t reserved;
+} __attribute__((packed)) MultibootInfo;
+
+// Every tag starts with this header, tags are padded to 8 bytes
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+} __attribute__((packed)) MultibootTag;
+
+typedef struct {
+    uint64_t base_addr;
+    uint64_t length;
+    uint32_t type;
+    uint32_t reserved;
+} __attribute__((packed)) MultibootMmapEntry;
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    MultibootMmapEntry entries[];
+} __attribute__((packed)) MultibootTagMmap;
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char cmdline[];     // zero terminated string given after the module path in grub.cfg
+} __attribute__((packed)) MultibootTagModule;
+
+// Physical address of the boot information, 0 when not booted by multiboot2
+extern uint64_t multiboot_info_addr;
+
+// Remember where GRUB put the boot information
+void multiboot_init(uint32_t info_addr);
+
+// Size in bytes of the boot information, so it can be reserved
+uint32_t multiboot_info_size(void);
+
+// Next tag of the given type after 'previous', pass NULL to start from the beginning
+MultibootTag* multiboot_find_tag(uint32_t type, MultibootTag* previous);
+
+// Number of entries in a memory map tag
+uint32_t multiboot_mmap_count(MultibootTagMmap* mmap);
+
+// The i-th entry of a memory map tag, entry_size may be larger than the struct
+MultibootMmapEntry* multiboot_mmap_entry(MultibootTagMmap* mmap, uint32_t index);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef PCACHE_H
+#define PCACHE_H
+#include <stdint.h>
+#include "fat_file.h"
+
+#define PCACHE_PAGES 1024           /* Pages the cache holds, 4 MiB */
+#define PCACHE_HASH_SIZE 2048       /* Hash buckets, power of two */
+#define PCACHE_FILL_MAX 32          /* Pages one device request may fill */
+#define PCACHE_READAHEAD 16         /* Pages filled past a sequential read */
+
+// Page flags
+#define PAGE_UPTODATE   0x01    /* the frame holds the file's bytes */
+#define PAGE_DIRTY      0x02    /* the frame is newer than the file on disk */
+#define PAGE_REFERENCED 0x04    /* used since the clock hand last passed */
+#define PAGE_BUSY       0x08    /* being written back, the frame is read without the cache lock */
+
+// One page of an open file. The frame is what read() copies from, what write()
+// stores into and what mmap() puts in the page tables, so a file page is in
+// memory once however it is reached. A page is pinned while refcount > 0,
+// mapped while mapcount > 0, and every mapped page is pinned.
+typedef struct cached_page {
+    FatFile* file;              // NULL while the slot is unused
+    uint32_t index;             // file offset >> PAGE_SHIFT
+    uint64_t phys;              // frame, kept by the slot once allocated
+    uint32_t refcount;
+    uint32_t mapcount;          // page table entries pointing at the frame
+    uint8_t flags;
+    struct cached_page* hash_next;
+} CachedPage;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fills;             // device requests that filled pages
+    uint64_t readahead;         // pages filled ahead of a sequential reader
+    uint64_t writebacks;        // dirty pages written to the file
+    uint64_t evictions;
+} PcacheStats;
+
+// Allocate the page descriptors, frames are allocated on first use
+void pcache_init(void);
+
+// Read through the cache: pages already cached are copied, each stretch of
+// missing ones is filled with one device request straight into the frames.
+// Returns the bytes moved, never past the end of the file. Before pcache_init
+// ran, or when it ran out of memory, this is fat_file_readv.
+uint32_t pcache_readv(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count);
+
+// Write into the pages of the file, which are written back to it later.
+// Clusters for a new end of file are allocated here. A page the write covers
+// only in part is read first, unless the rest of it is past the end of the file.
+// Returns the bytes moved. Without pcache_init this is fat_file_writev.
+uint32_t pcache_writev(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count);
+
+// 'length' bytes at 'offset' were just written to the file from the iovec
+// list without the cache (O_DIRECT), copy them into the pages of that range that are cached
+void pcache_written(FatFile* file, uint32_t offset, IoVec* iov, uint32_t iov_count, uint32_t length);
+
+// Pin page 'index' of the file, filled from its cluster chain when it is not
+// cached. NULL past the end of the file, on an I/O error or when every page is pinned.
+CachedPage* pcache_get(FatFile* file, uint32_t index);
+
+// pcache_get for the pages [first, first + count) into 'out', missing ones are
+// filled a run per request. Returns how many from 'first' on were pinned.
+uint32_t pcache_get_range(FatFile* file, uint32_t first, uint32_t count, CachedPage** out);
+
+// Unpin a page returned by pcache_get
+void pcache_put(CachedPage* page);
+
+void pcache_mark_dirty(CachedPage* page);
+
+// Cached page 'index' of the file with its bytes in, pinned, or NULL. Never does I/O.
+CachedPage* pcache_peek(FatFile* file, uint32_t index);
+
+// Write the dirty pages among [first, first + count) back to the file in
+// index order, consecutive ones as one write. Their mappings are write
+// protected first, so the next store dirties the page again. The write runs
+// without the cache lock, the pages stay pinned and PAGE_BUSY meanwhile.
+uint8_t pcache_writeback(FatFile* file, uint32_t first, uint32_t count);
+
+// The file is being cut to 'size' bytes: drop the pages past it without
+// writing them and zero the tail of the page the new end falls in
+void pcache_truncate(FatFile* file, uint32_t size);
+
+// Write back and drop every page of a file that is being closed
+uint8_t pcache_release(FatFile* file);
+
+// Write back the dirty pages of every file, for fat_sync
+uint8_t pcache_sync(void);
+
+void pcache_get_stats(PcacheStats* out);
+
+void pcache_print_stats(void);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef PCI_H
+#define PCI_H
+#include <stdint.h>
+
+// Configuration mechanism #1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID 0x00
+#define PCI_DEVICE_ID 0x02
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_PROG_IF 0x09
+#define PCI_SUBCLASS 0x0A
+#define PCI_CLASS 0x0B
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_CAPABILITIES 0x34           /* Offset of the first capability */
+#define PCI_INTERRUPT_LINE 0x3C
+
+// Command register bits
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+
+#define PCI_STATUS_CAPABILITIES 0x0010  /* The function has a capability list */
+
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_BAR_IO 0x01                 /* Bit 0 of a BAR, set for I/O space */
+#define PCI_BAR_MEM64 0x04              /* Memory BAR type field, 64-bit base */
+
+// Class codes of the storage controllers the kernel drives
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define PCI_PROG_IF_AHCI 0x01
+
+// Message Signaled Interrupts capability
+#define PCI_CAP_MSI 0x05
+#define PCI_MSI_CONTROL 2               /* Offsets from the capability */
+#define PCI_MSI_ADDRESS 4
+#define PCI_MSI_CONTROL_ENABLE 0x0001
+#define PCI_MSI_CONTROL_64BIT 0x0080    /* The upper address dword sits before the data */
+#define PCI_MSI_ADDRESS_BASE 0xFEE00000 /* Local APIC message window, destination ID in bits 19:12 */
+
+typedef struct {
+    uint8_t bus;
+    uint8_t device;
+    uint8_t function;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+} PciDevice;
+
+uint32_t pci_read32(PciDevice* dev, uint8_t offset);
+uint16_t pci_read16(PciDevice* dev, uint8_t offset);
+uint8_t pci_read8(PciDevice* dev, uint8_t offset);
+void pci_write32(PciDevice* dev, uint8_t offset, uint32_t value);
+void pci_write16(PciDevice* dev, uint8_t offset, uint16_t value);
+
+// The 'index'th function on any bus with this class and subclass, 1 when found
+uint8_t pci_find_class(uint8_t class_code, uint8_t subclass, uint32_t index, PciDevice* out);
+
+// Base address in BAR 'bar' without the type bits, a 64-bit memory BAR takes the next one too
+uint64_t pci_bar(PciDevice* dev, uint8_t bar);
+
+// Set bits in the command register, e.g. to let the function master the bus
+void pci_enable(PciDevice* dev, uint16_t bits);
+
+// Offset of the capability with this ID, 0 when the function does not have it
+uint8_t pci_find_capability(PciDevice* dev, uint8_t id);
+
+// Have the function signal its interrupt as a message with 'vector' to the
+// local APIC 'apic_id' instead of its INTx line. 0 when it has no MSI capability.
+uint8_t pci_enable_msi(PciDevice* dev, uint32_t apic_id, uint8_t vector);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef PMM_H
+#define PMM_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+
+#define PMM_MAX_ORDER 9         /* Largest block is 4 KiB << 9 = 2 MiB */
+#define PMM_NONE 0xFFFFFFFF     /* End of a free list */
+
+#define PAGE_RESERVED 0x01      /* Firmware, kernel image, modules or not RAM at all */
+#define PAGE_FREE 0x02          /* Head of a free block of 'order' */
+#define PAGE_UNMAPPED 0x04      /* Usable RAM the kernel cannot address yet */
+#define PAGE_SLAB 0x08          /* Part of a slab, 'order' holds the slab order */
+#define PAGE_ZEROED 0x10        /* Sitting in the pre-zeroed pool */
+
+#define PMM_ZERO 0x01           /* pmm_alloc_flags: hand out zero filled memory */
+
+// Default watermarks of the pre-zeroed pool, in pages. The idle loop starts
+// refilling when the pool drops below the low mark and stops at the high one.
+#define ZERO_POOL_LOW 64
+#define ZERO_POOL_HIGH 512
+
+/* The boot page tables identity map the first 1 GiB */
+#define PMM_BOOT_MAPPED_LIMIT 0x40000000ULL
+
+// One descriptor per physical page frame. The free lists link descriptors
+// instead of the pages themselves, so free memory never has to be mapped.
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t order;
+    uint8_t flags;
+    uint16_t reserved;
+} Page;
+
+typedef struct {
+    uint64_t total_pages;       // usable RAM reported by the memory map
+    uint64_t free_pages;        // pages sitting in the free lists
+    uint64_t reserved_pages;    // usable RAM taken by the kernel, modules and boot data
+    uint64_t unmapped_pages;    // usable RAM above the mapped limit, not handed out yet
+    uint64_t zero_pool_pages;   // pre-zeroed pages waiting in the pool
+    uint64_t zero_pool_hits;    // PMM_ZERO allocations served from the pool
+    uint64_t zero_pool_misses;  // PMM_ZERO allocations zeroed on the spot
+    uint64_t zero_pool_filled;  // pages zeroed in the background
+    uint64_t bad_frees;         // pmm_free calls rejected: bad order, misaligned, double free
+} PmmStats;
+
+// Parse the multiboot2 memory map and build the buddy free lists
+void pmm_init(void);
+
+// Allocate 2^order contiguous, naturally aligned pages, returns the physical address or 0
+uint64_t pmm_alloc(uint8_t order);
+
+// pmm_alloc with flags, PMM_ZERO takes single pages from the pre-zeroed pool
+// and zeroes anything else (or everything when the pool is empty) right away
+uint64_t pmm_alloc_flags(uint8_t order, uint8_t flags);
+
+// Give back a block returned by pmm_alloc with the same order. A free with an
+// order above PMM_MAX_ORDER, a misaligned address, a mismatched order or of a
+// block whose first page is already free, alone or merged into a bigger free
+// block, is rejected and counted instead.
+void pmm_free(uint64_t phys, uint8_t order);
+
+// Give back a single page the caller knows is still all zeros, it goes to the pool when there is room
+void pmm_free_zeroed(uint64_t phys);
+
+// Zero up to 'budget' pages into the pool with non-temporal stores. Returns the
+// number of pages added, 0 when the pool needs no work. Run from the idle loop.
+uint32_t pmm_zero_pool_fill(uint32_t budget);
+
+void pmm_zero_pool_set_watermarks(uint32_t low, uint32_t high);
+
+// Hand out the usable RAM below 'limit' once the page tables cover it
+void pmm_extend_mapped(uint64_t limit);
+
+// Descriptor of the page frame containing 'phys'
+Page* pmm_page(uint64_t phys);
+
+// Snapshot of the page counters
+void pmm_get_stats(PmmStats* stats);
+
+// Print total, free and used pages to the screen
+void pmm_print_stats(void);
+
+// Highest physical address of usable RAM
+extern uint64_t pmm_max_phys;
+
+// Base of the direct map of all RAM. It stays 0 while the boot tables
+// identity map the first 1 GiB and vmm_init() moves it to DIRECT_MAP_BASE.
+extern uint64_t phys_map_base;
+
+// Kernel pointer for a physical address
+static inline void* phys_to_virt(uint64_t phys) {
+    return (void*)(phys + phys_map_base);
+}
+
+// Physical address behind a kernel pointer. Direct map pointers are translated,
+// anything else is the kernel image or boot data reached through the identity map.
+static inline uint64_t virt_to_phys(void* virt) {
+    uint64_t addr = (uint64_t)virt;
+    if (addr >= phys_map_base && addr - phys_map_base < pmm_max_phys) {
+        return addr - phys_map_base;
+    }
+    return addr;
+}
+
+#endif
@@ -9,4 +9,14 @@ uint8_t inportb(uint16_t _port);
 // 
 void outportb(uint16_t _port, uint8_t _data);
 
+// 16 and 32 bit ports, PCI configuration space and ATA data registers
+uint16_t inportw(uint16_t _port);
+void outportw(uint16_t _port, uint16_t _data);
+uint32_t inportl(uint16_t _port);
+void outportl(uint16_t _port, uint32_t _data);
+
+// Move 'count' words between a port and memory with rep insw/outsw
+void inportsw(uint16_t _port, void* buffer, uint32_t count);
+void outportsw(uint16_t _port, void* buffer, uint32_t count);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+#include <stdint.h>
+#include "blockdev.h"
+
+#define RAMDISK_SECTOR_SIZE 512
+#define RAMDISK_MAX 4
+
+// Register every multiboot2 module as a RAM disk, named after the module
+// command line (the "hdd.img" in "module2 /boot/hdd.img hdd.img")
+void ramdisk_init(void);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t locked;
+} Spinlock;
+
+#define SPINLOCK_INIT { 0 }
+
+#ifdef HOSTED
+// A Linux process has no interrupts to mask and may not execute cli
+static inline uint64_t irq_save(void) {
+    return 0;
+}
+
+static inline void irq_restore(uint64_t flags) {
+}
+#else
+// Disable interrupts and return the previous RFLAGS so they can be restored
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq\n\tpop %0\n\tcli" : "=r" (flags) : : "memory");
+    return flags;
+}
+
+// Re-enable interrupts only if they were enabled before irq_save
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1 << 9)) {
+        asm volatile("sti" : : : "memory");
+    }
+}
+#endif
+
+static inline void spin_lock(Spinlock* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        // Spin on a plain read so the cache line is not bounced while waiting
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+}
+
+// Returns 1 when the lock was taken, 0 when someone else holds it
+static inline uint8_t spin_trylock(Spinlock* lock) {
+    return __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_unlock(Spinlock* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+// Take the lock with interrupts off, for data also touched from interrupt handlers
+static inline uint64_t spin_lock_irqsave(Spinlock* lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock* lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
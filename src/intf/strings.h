@@ -19,4 +19,7 @@ char* strChr(char* str, char ch);
 // Converts integer to string for print
 void int_to_str(uint16_t num, char* buffer, size_t buffer_size);
 
+// Converts a 64-bit unsigned integer to string for print
+void uint_to_str(uint64_t num, char* buffer, size_t buffer_size);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,86 @@
+#ifndef TLB_H
+#define TLB_H
+#include <stdint.h>
+#include "cpu.h"
+#include "spinlock.h"
+
+#define PCID_COUNT 4096             /* CR3[11:0] */
+#define CR3_NOFLUSH (1ULL << 63)    /* Keep the TLB entries tagged with the new PCID */
+
+// Ranges of more pages than this are flushed whole instead of one invlpg per page
+#define TLB_FLUSH_CEILING 32
+
+// Frames an mmu_gather holds back before it has to flush
+#define MMU_GATHER_BATCH 64
+
+// A set of page tables with its own PCID. While PCIDs are on, switching to an
+// address space keeps the TLB entries of every other one.
+typedef struct {
+    uint64_t* pml4;
+    uint64_t pml4_phys;
+    uint16_t pcid;                  // 0 is the kernel space and the fallback without PCID
+    volatile uint64_t active_cpus;  // CPUs that have it loaded in CR3 right now
+    volatile uint64_t stale_cpus;   // CPUs that may still hold dropped translations for its PCID
+} AddressSpace;
+
+// Unmaps collected in one address space, flushed together by mmu_gather_finish.
+// Pages freed through the gather are only handed back to the page allocator
+// once no CPU can reach them through a stale TLB entry.
+typedef struct {
+    AddressSpace* space;
+    uint64_t start;                 // lowest unmapped address, start == end when nothing is pending
+    uint64_t end;
+    uint32_t frame_count;
+    uint64_t frames[MMU_GATHER_BATCH];
+} MmuGather;
+
+typedef struct {
+    uint64_t switches;          // CR3 loads
+    uint64_t switches_noflush;  // CR3 loads that kept the TLB
+    uint64_t page_flushes;      // invlpg executed
+    uint64_t full_flushes;      // whole TLB or whole PCID flushes
+    uint64_t shootdowns;        // IPIs sent
+} TlbStats;
+
+// The boot page tables, PCID 0, loaded on every CPU at start
+extern AddressSpace kernel_space;
+
+extern TlbStats tlb_stats;
+
+// Wrap kernel_pml4 in kernel_space, turn on CR4.PCIDE and hook the shootdown IPI
+void tlb_init(void);
+
+// New address space with its own PCID and the kernel half shared, NULL when out of memory
+AddressSpace* aspace_create(void);
+
+// Free an address space that no CPU has loaded anymore
+void aspace_destroy(AddressSpace* space);
+
+// Load an address space on this CPU
+void aspace_switch(AddressSpace* space);
+
+// Address space loaded on this CPU
+AddressSpace* aspace_current(void);
+
+// Drop the translations of [start, end) on every CPU that may hold them.
+// Each other CPU that has the space loaded gets one IPI for the whole range.
+void tlb_flush_range(AddressSpace* space, uint64_t start, uint64_t end);
+
+void mmu_gather_init(MmuGather* gather, AddressSpace* space);
+
+// Unmap [virt, virt + size) now, the TLB flush waits for mmu_gather_finish
+void mmu_gather_unmap(MmuGather* gather, uint64_t virt, uint64_t size);
+
+// Free a page once the pending unmaps have been flushed
+void mmu_gather_free_page(MmuGather* gather, uint64_t phys);
+
+// Flush everything collected once and free the gathered pages
+void mmu_gather_finish(MmuGather* gather);
+
+// Called from the IPI stub, runs the flush another CPU asked for
+void tlb_shootdown_handler(void);
+
+// Print the cycles of an address space switch plus TLB refill with PCID on and off
+void tlb_benchmark(void);
+
+#endif
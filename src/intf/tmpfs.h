@@ -0,0 +1,31 @@
+#ifndef TMPFS_H
+#define TMPFS_H
+#include <stdint.h>
+#include "vfs.h"
+
+#define TMPFS_MAX_PAGES 16384           /* Frames all tmpfs files may hold together, 64 MiB */
+
+// A tmpfs file or directory. Nothing of it is ever on a device: a file is the
+// list of frames holding its pages, a directory the map of its names.
+typedef struct {
+    uint64_t* pages;                    // frame of each page of a file, 0 for a hole that reads as zeros
+    uint32_t page_slots;                // entries in 'pages', grown by doubling
+    DentryMap entries;                  // a directory's names, each holding a reference on its inode
+} TmpNode;
+
+typedef struct {
+    uint64_t files;                     // files and directories that exist
+    uint64_t pages;                     // frames holding file data
+    uint64_t creates;
+    uint64_t unlinks;
+    uint64_t bytes_written;
+} TmpfsStats;
+
+extern TmpfsStats tmpfs_stats;
+
+// Mount an empty tmpfs at 'path', 1 on success
+uint8_t tmpfs_mount(char* path);
+
+void tmpfs_print_stats(void);
+
+#endif
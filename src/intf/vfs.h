@@ -0,0 +1,134 @@
+#ifndef VFS_H
+#define VFS_H
+#include <stdint.h>
+#include "blockdev.h"
+
+#define VFS_MOUNT_MAX 4
+#define VFS_PATH_MAX 128                /* Bytes of a mount point */
+#define VFS_NAME_MAX 63                 /* Bytes of one path component */
+#define VFS_ICACHE_SIZE 64              /* Inode cache buckets, power of two */
+#define DENTRY_MAP_INITIAL 16           /* Buckets of a new directory map, doubled as it fills */
+
+// Inode types
+#define VFS_FILE 0x01
+#define VFS_DIR  0x02
+
+struct inode;
+struct mount;
+
+// What a filesystem does with the data of one of its files. 'flags' are the
+// O_* flags of the descriptor. Transfers return the bytes moved, a write that
+// moved nothing failed.
+typedef struct {
+    uint64_t (*readv)(struct inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags);
+    uint64_t (*writev)(struct inode* inode, uint64_t offset, IoVec* iov, uint32_t iov_count, uint32_t flags);
+    uint8_t (*truncate)(struct inode* inode, uint64_t size);
+    // Data and the file's directory record on the device
+    uint8_t (*sync)(struct inode* inode);
+} InodeOps;
+
+// What a filesystem does with its names. A missing op is not supported.
+typedef struct {
+    char* name;
+    uint64_t max_file_size;
+    // Find 'name' in the directory 'dir' and return it with a reference taken,
+    // with 'create' a missing name becomes an empty regular file. NULL when there is no such file.
+    struct inode* (*lookup)(struct inode* dir, char* name, uint8_t create);
+    uint8_t (*mkdir)(struct inode* dir, char* name);
+    // Remove a file, or a directory that is empty
+    uint8_t (*unlink)(struct inode* dir, char* name);
+    // The last reference to the inode went, give back what it holds. The VFS frees the inode.
+    void (*release)(struct inode* inode);
+} FsOps;
+
+// An in-memory file or directory. Filesystems that read their files from a
+// device find them through the inode cache by 'key', so every opener of a
+// file shares one inode. Filesystems that live in memory keep their inodes
+// referenced by the directory entries that name them.
+typedef struct inode {
+    struct mount* mount;
+    uint64_t key;                       // the file within its mount, e.g. where its directory entry is
+    uint8_t type;
+    uint8_t read_only;
+    uint8_t hashed;                     // in the inode cache
+    uint32_t refcount;                  // descriptors, mappings, directory entries and path walks
+    uint64_t size;                      // bytes, kept up to date by the filesystem
+    InodeOps* ops;
+    void* private_data;                 // filesystem state
+    struct inode* hash_next;
+} Inode;
+
+// A name in a directory bound to an inode, holding a reference on it. Memory
+// filesystems keep their directories as DentryMaps, the dentries are the directory.
+typedef struct dentry {
+    char name[VFS_NAME_MAX + 1];
+    Inode* inode;
+    struct dentry* next;                // next one in the same bucket
+} Dentry;
+
+// Hash map of the dentries of one directory
+typedef struct {
+    Dentry** buckets;
+    uint32_t bucket_count;              // power of two, 0 until the first insert
+    uint32_t count;
+} DentryMap;
+
+typedef struct mount {
+    char path[VFS_PATH_MAX];            // "/" or a path without a trailing slash, "" while the slot is free
+    uint32_t path_length;
+    FsOps* ops;
+    Inode* root;
+    void* private_data;
+} Mount;
+
+typedef struct {
+    uint64_t walks;                     // paths resolved
+    uint64_t lookups;                   // components handed to a filesystem
+    uint64_t icache_hits;
+    uint64_t icache_misses;
+} VfsStats;
+
+extern VfsStats vfs_stats;
+
+// Attach a filesystem at 'path', replacing whatever was mounted there. The
+// root inode is taken over by the mount. 0 when every slot is used.
+uint8_t vfs_mount(char* path, FsOps* ops, Inode* root, void* private_data);
+
+// Mount that 'path' falls in: the one with the longest mount point that is a
+// whole-component prefix of it. 'rest' gets the part of the path inside the mount.
+Mount* vfs_find_mount(char* path, char** rest);
+
+// Inode of 'path' with a reference taken, paths are absolute and a relative
+// one starts at "/". With 'create' a missing last component is created as an
+// empty regular file. NULL when a component is missing or not a directory.
+Inode* vfs_open(char* path, uint8_t create);
+
+// Create a directory or remove a file or an empty directory, 1 on success
+uint8_t vfs_mkdir(char* path);
+uint8_t vfs_unlink(char* path);
+
+// A fresh inode with one reference
+Inode* vfs_inode_alloc(Mount* mount, uint8_t type, InodeOps* ops);
+
+// Cached inode of 'key' in the mount with a reference taken. On a miss a
+// fresh one is added and '*created' is set, the caller fills it in.
+Inode* vfs_iget(Mount* mount, uint64_t key, uint8_t* created);
+
+// Cached inode of 'key' when something holds it, without taking a reference
+Inode* vfs_ifind(Mount* mount, uint64_t key);
+
+void vfs_ihold(Inode* inode);
+
+// Drop a reference, the last one releases the inode
+void vfs_iput(Inode* inode);
+
+// Directory maps for memory filesystems. Insert fails on a duplicate name or
+// when out of memory, remove returns the dentry it took out or NULL.
+Dentry* dentry_map_find(DentryMap* map, char* name);
+uint8_t dentry_map_insert(DentryMap* map, Dentry* dentry);
+Dentry* dentry_map_remove(DentryMap* map, char* name);
+void dentry_map_free(DentryMap* map);
+
+void vfs_print_stats(void);
+
+#endif
@@ -32,6 +32,7 @@ void print_back_space();
 void print_tab();
 void int_to_str(uint16_t num, char* buffer, size_t buffer_size);
 void print_int(uint16_t num);
+void print_uint(uint64_t num);
 void print_char(char character);
 void print_str(char* string);
 void print_newline();
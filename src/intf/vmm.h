@@ -0,0 +1,81 @@
+#ifndef VMM_H
+#define VMM_H
+#include <stdint.h>
+#include <stddef.h>
+#include "pmm.h"
+
+// Kernel virtual address layout
+#define DIRECT_MAP_BASE 0xFFFF800000000000ULL   /* All RAM, physical address + base */
+#define VMAP_BASE       0xFFFFC90000000000ULL   /* 4 KiB mappings made by vmm_map_kernel/vmm_alloc */
+#define VMAP_SIZE       0x0000010000000000ULL   /* 1 TiB */
+#define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL  /* Higher half alias of the kernel image, top 2 GiB */
+
+// Page table entry bits
+#define PTE_PRESENT       0x001ULL
+#define PTE_WRITABLE      0x002ULL
+#define PTE_USER          0x004ULL
+#define PTE_WRITE_THROUGH 0x008ULL
+#define PTE_CACHE_DISABLE 0x010ULL
+#define PTE_ACCESSED      0x020ULL
+#define PTE_DIRTY         0x040ULL
+#define PTE_HUGE          0x080ULL      /* 2 MiB page in a PD entry, 1 GiB page in a PDPT entry */
+#define PTE_GLOBAL        0x100ULL
+#define PTE_NO_EXECUTE    (1ULL << 63)
+#define PTE_ADDR_MASK     0x000FFFFFFFFFF000ULL
+
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
+
+#define PT_ENTRIES 512
+
+// Page tables of the kernel, shared by every address space above the canonical hole
+extern uint64_t* kernel_pml4;
+
+// Largest page size the direct map was built with
+extern uint64_t direct_map_page_size;
+
+// Build the kernel page tables, switch CR3 to them and release the RAM above 1 GiB
+void vmm_init(void);
+
+// The map, unmap and protect calls invalidate the TLB of the calling CPU only,
+// tlb_flush_range and mmu_gather reach the other CPUs.
+
+// Map [virt, virt + size) to [phys, phys + size). Addresses must be page aligned.
+// The largest page that fits the alignment of both addresses is used, so a 1 GiB
+// aligned range takes 1 GiB pages when the CPU has them. Returns 1 on success
+// and 0 when a page table could not be allocated.
+uint8_t vmm_map(uint64_t* pml4, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+
+// Remove the mappings in [virt, virt + size), huge pages only partly covered are split first
+uint8_t vmm_unmap(uint64_t* pml4, uint64_t virt, uint64_t size);
+
+// Same as vmm_unmap but leaves the TLB alone, the caller flushes (see mmu_gather)
+uint8_t vmm_unmap_noflush(uint64_t* pml4, uint64_t virt, uint64_t size);
+
+// Replace the protection bits (PTE_WRITABLE, PTE_USER, PTE_NO_EXECUTE, ...) of the mapped pages in range
+uint8_t vmm_protect(uint64_t* pml4, uint64_t virt, uint64_t size, uint64_t flags);
+
+// Walk the tables for 'virt', returns 1 and the physical address when it is mapped
+uint8_t vmm_translate(uint64_t* pml4, uint64_t virt, uint64_t* phys);
+
+// Map a physical range (for example device registers) into the vmap area with
+// 4 KiB pages and an unmapped guard page behind it
+void* vmm_map_kernel(uint64_t phys, uint64_t size, uint64_t flags);
+
+// Reserve 'size' bytes of the vmap area with a guard page behind it and map
+// nothing there, for callers that fill the range in on page faults. NULL when it is used up.
+void* vmm_reserve(uint64_t size);
+
+// Allocate 'size' bytes of page backed, virtually contiguous memory with a guard page behind it
+void* vmm_alloc(uint64_t size);
+
+// Unmap and free memory returned by vmm_alloc
+void vmm_free(void* ptr, uint64_t size);
+
+// New top level table that shares the kernel half with kernel_pml4
+uint64_t* vmm_create_pml4(void);
+
+// Free a table made by vmm_create_pml4 and the private tables below it
+void vmm_destroy_pml4(uint64_t* pml4);
+
+#endif